@@ -1,2 +1,2 @@
-from .catalog import Catalog,ShearCatalog,FlexionCatalog
+from .catalog import Catalog,CatalogAccumulator,ShearCatalog,FlexionCatalog
 from .generateCatalog import MockCatalog
@@ -10,10 +10,13 @@
 
 """
 
+from multiprocessing.pool import ThreadPool
+
 import numpy as np
 from scipy.ndimage.filters import gaussian_filter
 import astropy.table as tbl
 import astropy.units as u
+from astropy.io import fits
 
 try:
 	import fitsio
@@ -32,6 +35,44 @@ from ..image.shear import ShearMap
 from ..image.flexion import FlexionMap
 from ..utils.algorithms import step
 
+##########################################################
+################Pixelization helpers######################
+##########################################################
+
+def _finalizePixelization(maps,hits,counts,accumulate,smooth,map_size,npixel,position_unit):
+
+	"""
+	Turn accumulated pixel sums into maps: pixels that no object falls into (according to the unweighted counts) are NaN, averages are divided by the (weighted) hit count, and the maps are optionally smoothed; the output has x along the horizontal axis
+
+	"""
+
+	if accumulate not in ["sum","average"]:
+		raise NotImplementedError("pixel collection method {0} not implemented!".format(accumulate))
+
+	scalar_map = maps.copy()
+
+	#Pixels that no object falls into are not defined, and neither are the averages of the pixels whose weights sum to zero
+	empty = (counts==0.0)
+	if accumulate=="average":
+		empty |= (hits==0.0)
+		scalar_map /= np.where(empty,1.0,hits)
+	scalar_map[:,empty] = np.nan
+
+	#Maybe smooth
+	if smooth is not None:
+		
+		#Smoothing scale in pixel
+		assert smooth.unit.physical_type==position_unit.physical_type
+		smooth_in_pixel = (smooth * npixel / map_size).decompose().value
+
+		#Replace NaN with zeros
+		scalar_map[np.isnan(scalar_map)] = 0.0
+
+		#Smooth
+		scalar_map = np.array([ gaussian_filter(layer,sigma=smooth_in_pixel) for layer in scalar_map ])
+
+	return scalar_map.transpose(0,2,1)
+
 ##########################################################
 ################Catalog class#############################
 ##########################################################
@@ -83,6 +124,54 @@ class Catalog(tbl.Table):
 
 	########################################################################################
 
+	@classmethod
+	def readChunks(cls,filename,chunk_size=1000000,columns=None):
+
+		"""
+		Iterate over a catalog stored in a FITS binary table in blocks of rows, so that catalogs that do not fit in memory can be processed one piece at a time
+
+		:param filename: name of the FITS file (the table is read from the first extension)
+		:type filename: str.
+
+		:param chunk_size: number of rows in each block
+		:type chunk_size: int.
+
+		:param columns: if not None, read only these columns
+		:type columns: list.
+
+		:returns: iterator over the row blocks
+		:rtype: :py:class:`Catalog` iterator
+
+		"""
+
+		assert filename.endswith(".fit") or filename.endswith(".fits"),"Only FITS binary tables can be read in chunks!"
+		assert chunk_size>0
+
+		#Use fitsio if available, which reads only the requested rows
+		if fitsio is not None:
+			
+			with fitsio.FITS(filename,"r") as hdulist:
+				
+				nrows = hdulist[1].get_nrows()
+				for start in range(0,nrows,chunk_size):
+					yield cls(hdulist[1].read(columns=columns,rows=np.arange(start,min(start+chunk_size,nrows))))
+
+		#Otherwise memory map the table with astropy
+		else:
+
+			with fits.open(filename,memmap=True) as hdulist:
+
+				data = hdulist[1].data
+				nrows = len(data)
+				for start in range(0,nrows,chunk_size):
+					block = data[start:start+chunk_size]
+					if columns is None:
+						yield cls(block)
+					else:
+						yield cls([ np.array(block[c]) for c in columns ],names=columns)
+
+	########################################################################################
+
 	def setSpatialInfo(self,field_x="x",field_y="y",unit=u.deg):
 
 		"""
@@ -108,10 +197,10 @@ class Catalog(tbl.Table):
 	########################################################################################
 
 	
-	def pixelize(self,map_size,npixel=256,field_quantity=None,origin=np.zeros(2)*u.deg,smooth=None,accumulate="average",callback=None,**kwargs):
+	def pixelize(self,map_size,npixel=256,field_quantity=None,origin=np.zeros(2)*u.deg,smooth=None,accumulate="average",callback=None,weights=None,assignment="ngp",threads=None,**kwargs):
 
 		"""
-		Constructs a two dimensional square pixelized map version of one of the scalar properties in the catalog by assigning its objects on a grid
+		Constructs a two dimensional square pixelized map version of one (or more) of the scalar properties in the catalog by assigning its objects on a grid; all the requested quantities and the pixel hit counts are accumulated in a single pass over the catalog
 
 		:param map_size: spatial size of the map
 		:type map_size: quantity
@@ -119,8 +208,8 @@ class Catalog(tbl.Table):
 		:param npixel: number of pixels on a side
 		:type npixel: int.
 
-		:param field_quantity: name of the catalog quantity to map; if None, 1 is assumed
-		:type field_quantity: str.
+		:param field_quantity: name of the catalog quantity to map; if None, 1 is assumed. If a list of quantities is passed, a stack of maps is returned (one for each quantity)
+		:type field_quantity: str. or list.
 
 		:param origin: two dimensional coordinates of the origin of the map
 		:type origin: array with units
@@ -134,10 +223,19 @@ class Catalog(tbl.Table):
 		:param callback: user defined function that gets called on field_quantity
 		:type callback: callable or None
 
+		:param weights: if not None, name of the catalog column (or array) with the weight of each object; sums become weighted sums and averages become weighted averages
+		:type weights: str. or array
+
+		:param assignment: pixel assignment scheme, "ngp" (nearest grid point) or "cic" (cloud in cell)
+		:type assignment: str.
+
+		:param threads: number of threads to use in the pixelization (each thread accumulates a different portion of the catalog)
+		:type threads: int.
+
 		:param kwargs: the keyword arguments are passed to callback
 		:type kwargs: dict.
 
-		:returns: two dimensional scalar array with the pixelized field (pixels with no objects are treated as NaN)
+		:returns: two dimensional scalar array with the pixelized field (pixels with no objects are treated as NaN), or a stack of them if field_quantity is a list
 		:rtype: array 
 
 		"""
@@ -148,72 +246,85 @@ class Catalog(tbl.Table):
 		assert origin.unit.physical_type==self._position_unit.physical_type
 		assert self._field_x in self.columns,"There is no {0} field in the catalog!".format(self._field_x)
 		assert self._field_y in self.columns,"There is no {0} field in the catalog!".format(self._field_y)
+		assert assignment in ["ngp","cic"],"assignment must be one of [ngp,cic]!"
+
+		if accumulate not in ["sum","average"]:
+			raise NotImplementedError("pixel collection method {0} not implemented!".format(accumulate))
 
 		#Horizontal and vertical positions
 		x = self.columns[self._field_x] - origin[0].to(self._position_unit).value
 		y = self.columns[self._field_y] - origin[1].to(self._position_unit).value
 
-		if field_quantity is not None:
-
-			if type(field_quantity)==str:
-				assert field_quantity in self.columns,"There is no {0} field in the catalog!".format(field_quantity)
-				scalar = self.columns[field_quantity].astype(np.float)
-			elif type(field_quantity)==np.ndarray:
-				assert len(field_quantity)==len(self),"You should provide a scalar property for each record!!"
-				scalar = field_quantity
-			elif type(field_quantity) in [int,float]:
-				scalar = np.empty(len(self),dtype=np.float)
-				scalar.fill(field_quantity)
+		#Quantities to map
+		multiple = isinstance(field_quantity,(list,tuple))
+		if not multiple:
+			field_quantity = [field_quantity]
+
+		scalars = list()
+		for quantity in field_quantity:
+
+			if quantity is None:
+				scalar = np.ones(len(self))
+			elif type(quantity)==str:
+				assert quantity in self.columns,"There is no {0} field in the catalog!".format(quantity)
+				scalar = np.asarray(self.columns[quantity],dtype=np.float64)
+			elif type(quantity)==np.ndarray:
+				assert len(quantity)==len(self),"You should provide a scalar property for each record!!"
+				scalar = quantity
+			elif type(quantity) in [int,float]:
+				scalar = np.empty(len(self),dtype=np.float64)
+				scalar.fill(quantity)
 			else:
 				raise TypeError("field_quantity format not recognized!")
 
+			#If user decides, call a function on scalar
+			if callback is not None:
+				scalar = callback(scalar,**kwargs)
+
+			#Make sure x,y,scalar have all the same length
+			assert len(x)==len(y) and len(y)==len(scalar)
+			scalars.append(scalar)
+
+		#Object weights
+		if weights is not None:
+			if type(weights)==str:
+				assert weights in self.columns,"There is no {0} field in the catalog!".format(weights)
+				weights = self.columns[weights]
+			weights = np.asarray(weights,dtype=np.float64)
+			assert len(weights)==len(self),"You should provide a weight for each record!!"
+
+		#Perform the pixelization: each thread accumulates a portion of the catalog in its own buffers
+		if threads is None or threads<1:
+			threads = 1
+
+		maps = np.zeros((threads,len(scalars),npixel,npixel))
+		hits = np.zeros((threads,npixel,npixel))
+		counts = np.zeros((threads,npixel,npixel))
+		edges = np.linspace(0,len(x),threads+1).astype(int)
+		x = np.asarray(x,dtype=np.float64)
+		y = np.asarray(y,dtype=np.float64)
+
+		def _grid(n):
+			ext._pixelize.grid2d_multi(x,y,scalars,weights,map_size.to(self._position_unit).value,int(assignment=="cic"),maps[n],hits[n],counts[n],edges[n],edges[n+1])
+
+		if threads==1:
+			_grid(0)
 		else:
-			scalar = np.ones(len(self))
-
-		#Make sure x,y,scalar have all the same length
-		assert len(x)==len(y) and len(y)==len(scalar)
-
-		#If user decides, call a function on scalar
-		if callback is not None:
-			scalar = callback(scalar,**kwargs)
-
-		#Perform the pixelization
-		scalar_map = np.zeros((npixel,npixel))
-		scalar_map.fill(np.nan)
-		ext._pixelize.grid2d(x,y,scalar,map_size.to(self._position_unit).value,scalar_map)
-
-		#If pixel averaging is requested we need to compute the pixel hit count too
-		if accumulate=="average":
-			
-			#Compute hits
-			hits = np.zeros((npixel,npixel))
-			hits.fill(np.nan)
-			ext._pixelize.grid2d(x,y,np.ones(len(self)),map_size.to(self._position_unit).value,hits)
-
-			#Average the scalar map
-			scalar_map /= hits
-
-		elif accumulate=="sum":
-			pass
-
-		else:
-			raise NotImplementedError("pixel collection method {0} not implemented!")
-
-		#Maybe smooth
-		if smooth is not None:
-			
-			#Smoothing scale in pixel
-			assert smooth.unit.physical_type==self._position_unit.physical_type
-			smooth_in_pixel = (smooth * npixel / map_size).decompose().value
+			pool = ThreadPool(threads)
+			try:
+				pool.map(_grid,range(threads))
+			finally:
+				pool.close()
+				pool.join()
 
-			#Replace NaN with zeros
-			scalar_map[np.isnan(scalar_map)] = 0.0
-
-			#Smooth
-			scalar_map = gaussian_filter(scalar_map,sigma=smooth_in_pixel)
+		#Normalize, smooth and orient the maps
+		scalar_map = _finalizePixelization(maps.sum(0),hits.sum(0),counts.sum(0),accumulate,smooth,map_size,npixel,self._position_unit)
 
 		#Return
-		return scalar_map.T
+		if multiple:
+			return scalar_map
+		else:
+			return scalar_map[0]
 
 
 
@@ -331,6 +442,117 @@ class Catalog(tbl.Table):
 		super(Catalog,self).write(filename,**kwargs)
 
 
+##########################################################
+################CatalogAccumulator class##################
+##########################################################
+
+class CatalogAccumulator(object):
+
+	"""
+	Accumulates the pixelization of one or more catalog quantities over an arbitrary number of catalog blocks (see :py:meth:`Catalog.readChunks`), so that maps of catalogs larger than memory can be built with bounded memory; accumulators built on different blocks can be summed with +
+
+	:param map_size: spatial size of the map
+	:type map_size: quantity
+
+	:param npixel: number of pixels on a side
+	:type npixel: int.
+
+	:param fields: names of the catalog quantities to map (None means 1, i.e. galaxy counts)
+	:type fields: list.
+
+	:param origin: two dimensional coordinates of the origin of the map
+	:type origin: array with units
+
+	:param weights: if not None, name of the catalog column with the weight of each object
+	:type weights: str.
+
+	:param assignment: pixel assignment scheme, "ngp" or "cic"
+	:type assignment: str.
+
+	"""
+
+	def __init__(self,map_size,npixel,fields,origin=np.zeros(2)*u.deg,weights=None,assignment="ngp"):
+
+		assert len(origin)==2
+		assert assignment in ["ngp","cic"],"assignment must be one of [ngp,cic]!"
+
+		self.map_size = map_size
+		self.npixel = npixel
+		self.fields = list(fields)
+		self.origin = origin
+		self.weights = weights
+		self.assignment = assignment
+
+		self._maps = np.zeros((len(self.fields),npixel,npixel))
+		self._hits = np.zeros((npixel,npixel))
+		self._counts = np.zeros((npixel,npixel))
+		self.nobjects = 0
+
+		#Unit of the catalog positions, recorded on the first accumulated block
+		self.position_unit = None
+
+	def accumulate(self,catalog):
+
+		"""
+		Add a catalog block to the pixelization
+
+		:param catalog: catalog block
+		:type catalog: :py:class:`Catalog`
+
+		"""
+
+		unit = catalog._position_unit
+		assert self.map_size.unit.physical_type==unit.physical_type
+
+		#All the blocks must measure positions in the same unit
+		if self.position_unit is None:
+			self.position_unit = unit
+		assert unit==self.position_unit,"Catalog positions are in {0}, but the previous blocks were in {1}!".format(unit,self.position_unit)
+
+		x = np.asarray(catalog.columns[catalog._field_x],dtype=np.float64) - self.origin[0].to(unit).value
+		y = np.asarray(catalog.columns[catalog._field_y],dtype=np.float64) - self.origin[1].to(unit).value
+
+		columns = [ (np.ones(len(catalog)) if f is None else np.asarray(catalog.columns[f],dtype=np.float64)) for f in self.fields ]
+		weights = None if self.weights is None else np.asarray(catalog.columns[self.weights],dtype=np.float64)
+
+		ext._pixelize.grid2d_multi(x,y,columns,weights,self.map_size.to(unit).value,int(self.assignment=="cic"),self._maps,self._hits,self._counts,0,len(x))
+		self.nobjects += len(x)
+
+	def __iadd__(self,rhs):
+
+		assert (self.fields==rhs.fields) and (self._hits.shape==rhs._hits.shape)
+		assert (self.position_unit is None) or (rhs.position_unit is None) or (self.position_unit==rhs.position_unit),"Cannot merge accumulators with positions in different units!"
+
+		if self.position_unit is None:
+			self.position_unit = rhs.position_unit
+
+		self._maps += rhs._maps
+		self._hits += rhs._hits
+		self._counts += rhs._counts
+		self.nobjects += rhs.nobjects
+
+		return self
+
+	def getMaps(self,accumulate="average",smooth=None):
+
+		"""
+		Maps of the accumulated quantities
+
+		:param accumulate: "sum" or "average" (see :py:meth:`Catalog.pixelize`)
+		:type accumulate: str.
+
+		:param smooth: if not None, the maps are smoothed with a gaussian filter of scale smooth
+		:type smooth: quantity
+
+		:returns: stack of maps, one for each field (pixels with no objects are NaN)
+		:rtype: array
+
+		"""
+
+		#If nothing was accumulated yet, the positions are assumed in the units of the map size
+		position_unit = self.map_size.unit if (self.position_unit is None) else self.position_unit
+		return _finalizePixelization(self._maps,self._hits,self._counts,accumulate,smooth,self.map_size,self.npixel,position_unit)
+
 ##########################################################
 ################ShearCatalog class########################
 ##########################################################
@@ -442,12 +664,11 @@ class ShearCatalog(Catalog):
 
 		"""
 
-		#Shear components
-		s1 = self.pixelize(map_size,npixel,field_quantity="shear1",smooth=smooth,accumulate="average",**kwargs)
-		s2 = self.pixelize(map_size,npixel,field_quantity="shear2",smooth=smooth,accumulate="average",**kwargs)
+		#Shear components, in a single pass over the catalog
+		shear = self.pixelize(map_size,npixel,field_quantity=["shear1","shear2"],smooth=smooth,accumulate="average",**kwargs)
 
 		#Convert into map
-		return ShearMap(np.array([s1,s2]),map_size)
+		return ShearMap(shear,map_size)
 
 	########################################################################################
 
@@ -484,6 +705,105 @@ class ShearCatalog(Catalog):
 
 	########################################################################################
 
+	@classmethod
+	def streamToMap(cls,shear_files,position_files,map_size,npixel,smooth=None,ellipticity_files=None,es_colnames=("e1","e2"),rs_correction=True,chunk_size=1000000,threads=None,**kwargs):
+
+		"""
+		Build a shear map out of a catalog split in several files without loading it in memory: each (position,shear) file pair is read in blocks of rows, the intrinsic source ellipticities are optionally added (see :py:meth:`addSourceEllipticity`) and each block is accumulated on the map before the next one is read. Different file pairs are processed concurrently
+
+		:param shear_files: list of files with the shear information
+		:type shear_files: list.
+
+		:param position_files: list of files with the position and redshift information (one for each of the shear files, with the same number of rows)
+		:type position_files: list.
+
+		:param map_size: spatial size of the map
+		:type map_size: quantity
+
+		:param npixel: number of pixels on a side
+		:type npixel: int.
+
+		:param smooth: if not None, the map is smoothed with a gaussian filter of scale smooth
+		:type smooth: quantity
+
+		:param ellipticity_files: if not None, list of files with the intrinsic source ellipticities (one for each of the shear files, with the same number of rows)
+		:type ellipticity_files: list.
+
+		:param es_colnames: column names with intrinsic ellipticities
+		:type es_colnames: tuple.
+
+		:param rs_correction: include denominator (1+g*es) in the shear correction
+		:type rs_correction: bool.
+
+		:param chunk_size: number of catalog rows read at a time from each file
+		:type chunk_size: int.
+
+		:param threads: number of file pairs processed concurrently (the peak memory usage is about threads x chunk_size rows)
+		:type threads: int.
+
+		:param kwargs: additional keyword arguments are passed to the :py:class:`CatalogAccumulator` constructor (origin,weights,assignment)
+		:type kwargs: dict.
+
+		:returns: shear map
+		:rtype: ShearMap
+
+		"""
+
+		#Safety check
+		if not (len(shear_files)==len(position_files)):
+			raise ValueError("There must be a position file for each shear file and vice-versa!")
+
+		if (ellipticity_files is not None) and (len(ellipticity_files)!=len(shear_files)):
+			raise ValueError("There must be an ellipticity file for each shear file!")
+
+		#Stream a single file pair through its own accumulator
+		def _stream(n):
+
+			accumulator = CatalogAccumulator(map_size,npixel,["shear1","shear2"],**kwargs)
+			blocks = [cls.readChunks(position_files[n],chunk_size),cls.readChunks(shear_files[n],chunk_size)]
+			if ellipticity_files is not None:
+				blocks.append(cls.readChunks(ellipticity_files[n],chunk_size,columns=list(es_colnames)))
+
+			while True:
+
+				#All the files are read with the same chunk size, so the chunks must match one to one
+				block = [ next(b,None) for b in blocks ]
+				if all(b is None for b in block):
+					break
+
+				if any((b is None) or (len(b)!=len(block[0])) for b in block):
+					raise ValueError("{0} and {1} must have the same number of rows!".format(position_files[n],shear_files[n]) if ellipticity_files is None else "{0}, {1} and {2} must have the same number of rows!".format(position_files[n],shear_files[n],ellipticity_files[n]))
+
+				catalog = block[0]
+				for name in ("shear1","shear2"):
+					catalog[name] = block[1][name]
+
+				if ellipticity_files is not None:
+					catalog.addSourceEllipticity(block[2],es_colnames=es_colnames,rs_correction=rs_correction,inplace=True)
+
+				accumulator.accumulate(catalog)
+
+			return accumulator
+
+		if threads is None or threads<=1:
+			accumulators = [ _stream(n) for n in range(len(shear_files)) ]
+		else:
+			pool = ThreadPool(threads)
+			try:
+				accumulators = pool.map(_stream,range(len(shear_files)))
+			finally:
+				pool.close()
+				pool.join()
+
+		#Merge the partial pixelizations
+		accumulator = accumulators[0]
+		for other in accumulators[1:]:
+			accumulator += other
+
+		return ShearMap(accumulator.getMaps(accumulate="average",smooth=smooth),map_size)
+
+	########################################################################################
+
 	def write(self,filename,**kwargs):
 
 		self.meta["NGAL"] = len(self)
@@ -528,12 +848,11 @@ class FlexionCatalog(Catalog):
 
 		"""
 
-		#Shear components
-		F1 = self.pixelize(map_size,npixel,field_quantity="F1",smooth=smooth,accumulate="average",**kwargs)
-		F2 = self.pixelize(map_size,npixel,field_quantity="F2",smooth=smooth,accumulate="average",**kwargs)
+		#Flexion components, in a single pass over the catalog
+		flexion = self.pixelize(map_size,npixel,field_quantity=["F1","F2"],smooth=smooth,accumulate="average",**kwargs)
 
 		#Convert into map
-		return FlexionMap(np.array([F1,F2]),map_size)
+		return FlexionMap(flexion,map_size)
 
 	########################################################################################
 
@@ -6,6 +6,7 @@ The module is called _gadget2 and it defines the methods below (see docstrings)
 */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <Python.h>
 #include <numpy/arrayobject.h>
@@ -23,12 +24,20 @@ static char getHeader_docstring[] = "Reads the header of a Gadget2 snapshot";
 static char getPosVel_docstring[] = "Gets the positions or velocities of the particles in a Gadget2 snapshot";
 static char getID_docstring[] = "Gets the 4 byte int particles IDs from the Gadget2 snapshot";
 static char write_docstring[] = "Writes the particles information to a Gadget snapshot, with a proper header";
+static char writeHeader_docstring[] = "Writes the header and the record markers of a Gadget2 snapshot, returning the byte offsets of the particle blocks";
+static char writeBlock_docstring[] = "Writes a contiguous numpy array at a byte offset of a Gadget2 snapshot (the GIL is released during the write)";
+static char writeID_docstring[] = "Generates and writes consecutive particle IDs (4 or 8 byte ints) at a byte offset of a Gadget2 snapshot";
+static char readBlock_docstring[] = "Reads a contiguous block of a Gadget2 snapshot directly into a pre-allocated numpy array (the GIL is released during the read)";
 
 //Method declarations
 static PyObject *_gadget2_getHeader(PyObject *self,PyObject *args);
 static PyObject *_gadget2_getPosVel(PyObject *self,PyObject *args);
 static PyObject *_gadget2_getID(PyObject *self,PyObject *args);
 static PyObject * _gadget2_write(PyObject *self,PyObject *args);
+static PyObject *_gadget2_readBlock(PyObject *self,PyObject *args);
+static PyObject *_gadget2_writeHeader(PyObject *self,PyObject *args);
+static PyObject *_gadget2_writeBlock(PyObject *self,PyObject *args);
+static PyObject *_gadget2_writeID(PyObject *self,PyObject *args);
 
 //_gadget method definitions
 static PyMethodDef module_methods[] = {
@@ -37,6 +46,10 @@ static PyMethodDef module_methods[] = {
 	{"getPosVel",_gadget2_getPosVel,METH_VARARGS,getPosVel_docstring},
 	{"getID",_gadget2_getID,METH_VARARGS,getID_docstring},
 	{"write",_gadget2_write,METH_VARARGS,write_docstring},
+	{"readBlock",_gadget2_readBlock,METH_VARARGS,readBlock_docstring},
+	{"writeHeader",_gadget2_writeHeader,METH_VARARGS,writeHeader_docstring},
+	{"writeBlock",_gadget2_writeBlock,METH_VARARGS,writeBlock_docstring},
+	{"writeID",_gadget2_writeID,METH_VARARGS,writeID_docstring},
 	{NULL,NULL,0,NULL}
 
 } ;
@@ -259,8 +272,13 @@ static PyObject *_gadget2_getPosVel(PyObject *self,PyObject *args){
 	int fd = PyObject_AsFileDescriptor(file_obj);
 	if(fd==-1) INITERROR ;
 
-	//Read in the positions of the partcles
-	if(getPosVelFD(fd,offset,particle_data,NumPart)==-1){
+	//Read in the positions of the partcles (no python objects are touched during the read)
+	int status;
+	Py_BEGIN_ALLOW_THREADS
+	status = getPosVelFD(fd,offset,particle_data,NumPart);
+	Py_END_ALLOW_THREADS
+
+	if(status==-1){
 
 		Py_DECREF(particle_data_array);
 		PyErr_SetString(PyExc_IOError,"End of file reached, the information requested is not available!");
@@ -323,8 +341,13 @@ static PyObject *_gadget2_getID(PyObject *self,PyObject *args){
 	int fd = PyObject_AsFileDescriptor(file_obj);
 	if(fd==-1) INITERROR;
 
-	//Read in the IDs of the particles
-	if(getIDFD(fd,offset,id_data,NumPart)==-1){
+	//Read in the IDs of the particles (no python objects are touched during the read)
+	int status;
+	Py_BEGIN_ALLOW_THREADS
+	status = getIDFD(fd,offset,id_data,NumPart);
+	Py_END_ALLOW_THREADS
+
+	if(status==-1){
 
 		Py_DECREF(id_data_array);
 		PyErr_SetString(PyExc_IOError,"End of file reached, the information requested is not available!");
@@ -358,26 +381,10 @@ static PyObject *_gadget2_getID(PyObject *self,PyObject *args){
 
 }
 
-//write() implementation
-static PyObject *_gadget2_write(PyObject *self,PyObject *args){
-
-	PyObject *header_obj,*positions_obj,*velocities_obj;
-	const char *filename;
-	int k,NumPart,firstID,writeVel;
+//Fill in a Gadget2 header struct from a header dictionary; returns -1 and sets the python exception on failure
+static int fillHeader(PyObject *header_obj,struct io_header_1 *header){
 
-	struct io_header_1 header;
-
-	//interpret input tuple
-	if(!PyArg_ParseTuple(args,"OOOisi",&header_obj,&positions_obj,&velocities_obj,&firstID,&filename,&writeVel)){
-		return NULL;
-	}
-
-	//open the file to which the snapshot will be written, quit if cannot open the file
-	FILE *fp = fopen(filename,"wb");
-	if(fp==NULL){
-		PyErr_SetString(PyExc_IOError,"Couldn't open snapshot file!");
-		return NULL;
-	}
+	int k;
 
 	//interpret arrays
 	PyObject *mass_array = PyArray_FROM_OTF(PyDict_GetItemString(header_obj,"masses"),NPY_DOUBLE,NPY_IN_ARRAY);
@@ -390,8 +397,7 @@ static PyObject *_gadget2_write(PyObject *self,PyObject *args){
 		Py_XDECREF(NumPart_array);
 		Py_XDECREF(NumPart_file_array);
 		Py_XDECREF(npartHighWord_array);
-		fclose(fp);
-		return NULL;
+		return -1;
 	}
 
 	//get pointers
@@ -403,42 +409,42 @@ static PyObject *_gadget2_write(PyObject *self,PyObject *args){
 	//Fill in the header values
 
 	//simple doubles
-	header.Omega0 = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"Om0"));
-	header.OmegaLambda = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"Ode0"));
-	header.w0 = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"w0"));
-	header.wa = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"wa"));
-	header.time = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"scale_factor"));
-	header.redshift = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"redshift"));
-	header.BoxSize = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"box_size"));
-	header.HubbleParam = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"h"));
-	header.comoving_distance = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"comoving_distance"));
+	header->Omega0 = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"Om0"));
+	header->OmegaLambda = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"Ode0"));
+	header->w0 = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"w0"));
+	header->wa = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"wa"));
+	header->time = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"scale_factor"));
+	header->redshift = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"redshift"));
+	header->BoxSize = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"box_size"));
+	header->HubbleParam = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"h"));
+	header->comoving_distance = PyFloat_AsDouble(PyDict_GetItemString(header_obj,"comoving_distance"));
 
 	//simple ints
 #ifdef IS_PY3K
-	header.flag_cooling = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_cooling"));
-	header.flag_sfr = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_sfr"));
-	header.flag_feedback = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_feedback"));
-	header.num_files = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"num_files"));
-	header.flag_stellarage = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_stellarage"));
-	header.flag_metals = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_metals"));
-	header.flag_entropy_instead_u = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_entropy_instead_u"));
+	header->flag_cooling = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_cooling"));
+	header->flag_sfr = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_sfr"));
+	header->flag_feedback = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_feedback"));
+	header->num_files = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"num_files"));
+	header->flag_stellarage = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_stellarage"));
+	header->flag_metals = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_metals"));
+	header->flag_entropy_instead_u = (int)PyLong_AsLong(PyDict_GetItemString(header_obj,"flag_entropy_instead_u"));
 #else
-	header.flag_cooling = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_cooling"));
-	header.flag_sfr = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_sfr"));
-	header.flag_feedback = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_feedback"));
-	header.num_files = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"num_files"));
-	header.flag_stellarage = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_stellarage"));
-	header.flag_metals = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_metals"));
-	header.flag_entropy_instead_u = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_entropy_instead_u"));
+	header->flag_cooling = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_cooling"));
+	header->flag_sfr = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_sfr"));
+	header->flag_feedback = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_feedback"));
+	header->num_files = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"num_files"));
+	header->flag_stellarage = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_stellarage"));
+	header->flag_metals = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_metals"));
+	header->flag_entropy_instead_u = (int)PyInt_AsLong(PyDict_GetItemString(header_obj,"flag_entropy_instead_u"));
 #endif
 
 
 	//double and int arrays
 	for(k=0;k<6;k++){
-		header.mass[k] = mass_data[k];
-		header.npart[k] = NumPart_file_data[k];
-		header.npartTotal[k] = NumPart_data[k];
-		header.npartTotalHighWord[k] = npartHighWord_data[k];
+		header->mass[k] = mass_data[k];
+		header->npart[k] = NumPart_file_data[k];
+		header->npartTotal[k] = NumPart_data[k];
+		header->npartTotalHighWord[k] = npartHighWord_data[k];
 	}
 
 	//release resources
@@ -447,6 +453,30 @@ static PyObject *_gadget2_write(PyObject *self,PyObject *args){
 	Py_DECREF(NumPart_file_array);
 	Py_DECREF(npartHighWord_array);
 
+	if(PyErr_Occurred()) return -1;
+
+	return 0;
+
+}
+
+//write() implementation
+static PyObject *_gadget2_write(PyObject *self,PyObject *args){
+
+	PyObject *header_obj,*positions_obj,*velocities_obj;
+	const char *filename;
+	int NumPart,writeVel,status;
+	long long firstID;
+
+	struct io_header_1 header;
+
+	//interpret input tuple
+	if(!PyArg_ParseTuple(args,"OOOLsi",&header_obj,&positions_obj,&velocities_obj,&firstID,&filename,&writeVel)){
+		return NULL;
+	}
+
+	//Fill in the header values
+	if(fillHeader(header_obj,&header)) return NULL;
+
 	//now interpret positions and velocities as numpy arrays
 	PyObject *positions_array = PyArray_FROM_OTF(positions_obj,NPY_FLOAT32,NPY_IN_ARRAY);
 	PyObject *velocities_array = PyArray_FROM_OTF(velocities_obj,NPY_FLOAT32,NPY_IN_ARRAY);
@@ -454,7 +484,15 @@ static PyObject *_gadget2_write(PyObject *self,PyObject *args){
 	if(positions_array==NULL || velocities_array==NULL){
 		Py_XDECREF(positions_array);
 		Py_XDECREF(velocities_array);
-		fclose(fp);
+		return NULL;
+	}
+
+	//open the file to which the snapshot will be written, quit if cannot open the file
+	FILE *fp = fopen(filename,"wb");
+	if(fp==NULL){
+		Py_DECREF(positions_array);
+		Py_DECREF(velocities_array);
+		PyErr_SetString(PyExc_IOError,"Couldn't open snapshot file!");
 		return NULL;
 	}
 
@@ -464,19 +502,169 @@ static PyObject *_gadget2_write(PyObject *self,PyObject *args){
 	float *positions_data = (float *)PyArray_DATA(positions_array);
 	float *velocities_data = (float *)PyArray_DATA(velocities_array);
 
-	//ready to write Gadget snapshot, do it!
-	if(writeSnapshot(fp,&header,positions_data,velocities_data,firstID,NumPart,writeVel)==-1){
-		
-		fclose(fp);
+	//ready to write Gadget snapshot, do it! (other threads can write other files in the meantime)
+	Py_BEGIN_ALLOW_THREADS
+	status = writeSnapshot(fp,&header,positions_data,velocities_data,firstID,NumPart,writeVel);
+	fclose(fp);
+	Py_END_ALLOW_THREADS
+
+	//release resources
+	Py_DECREF(positions_array);
+	Py_DECREF(velocities_array);
+
+	if(status==-1){
 		PyErr_SetString(PyExc_IOError,"Couldn't write snapshot!");
 		return NULL;
+	}
+
+	Py_RETURN_NONE;
+
+}
 
+//writeHeader() implementation
+static PyObject *_gadget2_writeHeader(PyObject *self,PyObject *args){
+
+	PyObject *file_obj,*header_obj;
+	long NumPart;
+	int writeVel;
+
+	struct io_header_1 header;
+	struct gadget_layout layout;
+
+	//interpret input tuple
+	if(!PyArg_ParseTuple(args,"OOli",&file_obj,&header_obj,&NumPart,&writeVel)){
+		return NULL;
 	}
 
-	//release resources and close the snapshot file
-	Py_DECREF(positions_array);
-	Py_DECREF(velocities_array);
-	fclose(fp);	
+	//Fill in the header values
+	memset(&header,0,sizeof(struct io_header_1));
+	if(fillHeader(header_obj,&header)) return NULL;
+
+	//Get a file descriptor out of the file object
+	int fd = PyObject_AsFileDescriptor(file_obj);
+	if(fd==-1) return NULL;
+
+	//Write header and record markers
+	if(writeHeaderFD(fd,&header,NumPart,writeVel,&layout)){
+		PyErr_SetString(PyExc_IOError,"Couldn't write snapshot header!");
+		return NULL;
+	}
+
+	//Return the offsets of the blocks, so the caller knows where to write the particles
+	return Py_BuildValue("lllli",layout.pos_offset,layout.vel_offset,layout.id_offset,layout.size,layout.id_size);
+
+}
+
+//writeBlock() implementation
+static PyObject *_gadget2_writeBlock(PyObject *self,PyObject *args){
+
+	PyObject *file_obj,*data_obj;
+	long offset;
+	int status;
+
+	//Interpret the tuple of arguments
+	if(!PyArg_ParseTuple(args,"OlO",&file_obj,&offset,&data_obj)){
+		return NULL;
+	}
+
+	//Get a file descriptor out of the file object
+	int fd = PyObject_AsFileDescriptor(file_obj);
+	if(fd==-1) return NULL;
+
+	//Make sure the data is contiguous
+	PyObject *data_array = PyArray_FROM_OF(data_obj,NPY_IN_ARRAY);
+	if(data_array==NULL) return NULL;
+
+	void *data = PyArray_DATA(data_array);
+	size_t nbytes = (size_t)PyArray_NBYTES(data_array);
+
+	//Bulk write, other threads can run in the meantime
+	Py_BEGIN_ALLOW_THREADS
+	status = writeBlockFD(fd,offset,data,nbytes);
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(data_array);
+
+	if(status==-1){
+		PyErr_SetString(PyExc_IOError,"Couldn't write snapshot block!");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+
+}
+
+//writeID() implementation
+static PyObject *_gadget2_writeID(PyObject *self,PyObject *args){
+
+	PyObject *file_obj;
+	long offset,NumPart;
+	long long firstID;
+	int idSize,status;
+
+	//Interpret the tuple of arguments
+	if(!PyArg_ParseTuple(args,"OlLli",&file_obj,&offset,&firstID,&NumPart,&idSize)){
+		return NULL;
+	}
+
+	if(idSize!=4 && idSize!=8){
+		PyErr_SetString(PyExc_ValueError,"Particle IDs must be 4 or 8 byte ints!");
+		return NULL;
+	}
+
+	//Get a file descriptor out of the file object
+	int fd = PyObject_AsFileDescriptor(file_obj);
+	if(fd==-1) return NULL;
+
+	//IDs are generated and written in large chunks, other threads can run in the meantime
+	Py_BEGIN_ALLOW_THREADS
+	status = writeIDFD(fd,offset,firstID,NumPart,idSize);
+	Py_END_ALLOW_THREADS
+
+	if(status==-1){
+		PyErr_SetString(PyExc_IOError,"Couldn't write particle IDs!");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+
+}
+
+//readBlock() implementation
+static PyObject *_gadget2_readBlock(PyObject *self,PyObject *args){
+
+	PyObject *file_obj,*data_obj;
+	long offset;
+	int status;
+
+	//Interpret the tuple of arguments
+	if(!PyArg_ParseTuple(args,"OlO",&file_obj,&offset,&data_obj)){
+		return NULL;
+	}
+
+	//The destination must be a well behaved array, we write in it directly
+	if(!PyArray_Check(data_obj) || !PyArray_ISCARRAY((PyArrayObject *)data_obj)){
+		PyErr_SetString(PyExc_ValueError,"The destination must be a C contiguous, aligned and writeable numpy array!");
+		return NULL;
+	}
+
+	//Get a file descriptor out of the file object
+	int fd = PyObject_AsFileDescriptor(file_obj);
+	if(fd==-1) return NULL;
+
+	//Get data pointer and size of the destination
+	void *data = PyArray_DATA((PyArrayObject *)data_obj);
+	size_t nbytes = (size_t)PyArray_NBYTES((PyArrayObject *)data_obj);
+
+	//Bulk read, other threads can run in the meantime
+	Py_BEGIN_ALLOW_THREADS
+	status = readBlockFD(fd,offset,data,nbytes);
+	Py_END_ALLOW_THREADS
+
+	if(status==-1){
+		PyErr_SetString(PyExc_IOError,"End of file reached, the information requested is not available!");
+		return NULL;
+	}
 
 	Py_RETURN_NONE;
 
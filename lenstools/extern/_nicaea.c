@@ -22,6 +22,28 @@ The module is called _nicaea and it defines the methods below (see docstrings)
 #include "nicaea_wrappers.h"
 
 #define SPEC_IN_TUPLE 11
+#define NCOSMO_PARAMS 10
+
+//Redshift distribution and computation settings, shared by all the cosmological models in a batch
+typedef struct {
+
+	int nzbins;
+	int *Nnz;
+	double *par_nz;
+	nofz_t *nofz;
+
+	nonlinear_t nonlinear_type;
+	transfer_t transfer_function;
+	growth_t growth;
+	de_param_t dark_energy;
+	norm_t norm_mode;
+	tomo_t tomography;
+	reduced_t sreduced;
+	double Q_MAG_SIZE;
+
+	PyObject *Nnz_array,*par_nz_array;
+
+} nicaea_settings;
 
 #ifndef IS_PY3K
 static struct module_state _state;
@@ -31,11 +53,16 @@ static struct module_state _state;
 static char module_docstring[] = "This module provides a python interface to the NICAEA computations";
 static char shearPowerSpectrum_docstring[] = "Compute the shear power spectrum";
 static char shear2pt_docstring[] = "Compute the shear correlation function";
+static char batch_docstring[] = "Compute the shear power spectrum or correlation function for a batch of cosmological models, filling a (Ncosmo,Nspec,Npairs) array in place";
 
 //Useful methods for parsing Nicaea class attributes into cosmo_lens structs
 static PyObject *extra_args(PyObject *args);
 static int translate(int Nobjects, char *string_dictionary[],char *string);
 static cosmo_lens *parse_model(PyObject *args, error **err);
+static int parse_settings(int nzbins,PyObject *Nnz_obj,PyObject *nofz_obj,PyObject *par_nz_obj,PyObject *settings_dict,nicaea_settings *s);
+static void free_settings(nicaea_settings *s);
+static cosmo_lens *init_model(const double *p,nicaea_settings *s,error **err);
+static int count_pairs(int Nbins,tomo_t tomo,int *bin_i,int *bin_j);
 
 //output memory allocator
 static PyObject *alloc_output(PyObject *spec,cosmo_lens *model);
@@ -46,12 +73,14 @@ static PyObject *_nicaea_Wrapper(PyObject *args,double (*nicaea_method)(cosmo_le
 //Method declarations
 static PyObject *_nicaea_shearPowerSpectrum(PyObject *self,PyObject *args);
 static PyObject *_nicaea_shear2pt(PyObject *self,PyObject *args);
+static PyObject *_nicaea_batch(PyObject *self,PyObject *args);
 
 //_nicaea method definitions
 static PyMethodDef module_methods[] = {
 
 	{"shearPowerSpectrum",_nicaea_shearPowerSpectrum,METH_VARARGS,shearPowerSpectrum_docstring},
 	{"shear2pt",_nicaea_shear2pt,METH_VARARGS,shear2pt_docstring},
+	{"batch",_nicaea_batch,METH_VARARGS,batch_docstring},
 	{NULL,NULL,0,NULL}
 
 } ;
@@ -146,11 +175,12 @@ static int translate(int Nobjects,char *string_dictionary[],char *string){
 
 }
 
-/////////////////////////////////
-/*Implementation of parse_model*/
-/////////////////////////////////
+//////////////////////////////////////
+/*Implementation of parse_settings*///
+//////////////////////////////////////
 
-static cosmo_lens *parse_model(PyObject *args, error **err){
+//Parse the redshift distribution and the computation settings, which do not depend on the cosmological parameters
+static int parse_settings(int nzbins,PyObject *Nnz_obj,PyObject *nofz_obj,PyObject *par_nz_obj,PyObject *settings_dict,nicaea_settings *s){
 
 	//Type translators
 	char *distribution_strings[Nnofz_t] = {"ludo", "jonben", "ymmk", "ymmk0const", "hist", "single"};
@@ -177,61 +207,48 @@ static cosmo_lens *parse_model(PyObject *args, error **err){
 	char *reduced_strings[Nreduced_t] = {"none", "reduced_K10"};
 	const reduced_t reduced_types[Nreduced_t] = {reduced_none, reduced_K10};
 
-	//Intrinsic alignment interface not implemented yet (defaults to none)
-	ia_t IA=ia_none;
-	ia_terms_t IA_TERMS=ia_undef;
-	double A_IA=0.0;
-
-	//Cosmological parameters
-	double Om,Ode,w0,w1,H100,Omegab,Omeganu,Neff,si8,ns;
-	int nzbins;
 	int i,j;
 	char *distr_type,*setting_string;
 
-	//Multipoles/angles, redshift distribution and other settings
-	PyObject *spec_obj,*Nnz_obj,*nofz_obj,*par_nz_obj,*settings_dict,*extra_obj;
-
-	//Parse the input tuple
-	if(!PyArg_ParseTuple(args,"ddddddddddiOOOOOO",&Om,&Ode,&w0,&w1,&H100,&Omegab,&Omeganu,&Neff,&si8,&ns,&nzbins,&spec_obj,&Nnz_obj,&nofz_obj,&par_nz_obj,&settings_dict,&extra_obj)){
-		fprintf(stderr,"Input tuple format doesn't match signature!");
-		return NULL;
-	}
+	s->nzbins = nzbins;
+	s->nofz = NULL;
 
 	///////////////////////////////////////////////////////////////////////
 	/////////////////////Redshift info/////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////
 
 	//Parse Nnz_obj and par_nz_obj into numpy arrays
-	PyObject *Nnz_array = PyArray_FROM_OTF(Nnz_obj,NPY_INT32,NPY_IN_ARRAY);
-	PyObject *par_nz_array = PyArray_FROM_OTF(par_nz_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	s->Nnz_array = PyArray_FROM_OTF(Nnz_obj,NPY_INT32,NPY_IN_ARRAY);
+	s->par_nz_array = PyArray_FROM_OTF(par_nz_obj,NPY_DOUBLE,NPY_IN_ARRAY);
 	
-	if(Nnz_array==NULL || par_nz_array==NULL){
-		Py_XDECREF(Nnz_array);
-		Py_XDECREF(par_nz_array);
-		return NULL;
+	if(s->Nnz_array==NULL || s->par_nz_array==NULL){
+		free_settings(s);
+		return -1;
 	} 
 
-	int *Nnz = (int *)PyArray_DATA(Nnz_array);
-	double *par_nz = (double *)PyArray_DATA(par_nz_array);
+	s->Nnz = (int *)PyArray_DATA(s->Nnz_array);
+	s->par_nz = (double *)PyArray_DATA(s->par_nz_array);
 
 	//Safety
-	assert(nzbins==(int)PyArray_DIM(Nnz_array,0));
+	assert(nzbins==(int)PyArray_DIM(s->Nnz_array,0));
 
 	//Parse redshift distribution information
-	nofz_t nofz[nzbins];
+	s->nofz = (nofz_t *)malloc(sizeof(nofz_t)*nzbins);
+	if(s->nofz==NULL){
+		free_settings(s);
+		PyErr_NoMemory();
+		return -1;
+	}
+
 	for(i=0;i<nzbins;i++){
 
 		PyArg_Parse(PyList_GetItem(nofz_obj,i),"s",&distr_type);
 		
 		if((j=translate(Nnofz_t,distribution_strings,distr_type))==-1){
-			
-			Py_DECREF(Nnz_array);
-			Py_DECREF(par_nz_array);
-			return NULL;
-		
+			free_settings(s);
+			return -1;
 		} else{
-
-			nofz[i]=distribution_types[j];
+			s->nofz[i]=distribution_types[j];
 		}
 
 	}
@@ -239,96 +256,170 @@ static cosmo_lens *parse_model(PyObject *args, error **err){
 	/*Parse these computation settings from the settings dictionary*/
 
 	//nonlinear_t
-	nonlinear_t nonlinear_type;
 	PyArg_Parse(PyDict_GetItemString(settings_dict,"snonlinear"),"s",&setting_string);
 	if((j=translate(Nnonlinear_t,nonlinear_strings,setting_string))==-1){
-		Py_DECREF(Nnz_array);
-		Py_DECREF(par_nz_array);
-		return NULL;
+		free_settings(s);
+		return -1;
 	} else{
-		nonlinear_type=nonlinear_types[j];
+		s->nonlinear_type=nonlinear_types[j];
 	}
 
 	//transfer_t
-	transfer_t transfer_function;
 	PyArg_Parse(PyDict_GetItemString(settings_dict,"stransfer"),"s",&setting_string);
 	if((j=translate(Ntransfer_t,transfer_strings,setting_string))==-1){
-		Py_DECREF(Nnz_array);
-		Py_DECREF(par_nz_array);
-		return NULL;
+		free_settings(s);
+		return -1;
 	} else{
-		transfer_function=transfer_types[j];
+		s->transfer_function=transfer_types[j];
 	}
 
 	//growth_t
-	growth_t growth;
 	PyArg_Parse(PyDict_GetItemString(settings_dict,"sgrowth"),"s",&setting_string);
 	if((j=translate(Ngrowth_t,growth_strings,setting_string))==-1){
-		Py_DECREF(Nnz_array);
-		Py_DECREF(par_nz_array);
-		return NULL;
+		free_settings(s);
+		return -1;
 	} else{
-		growth=growth_types[j];
+		s->growth=growth_types[j];
 	}
 
 
 	//de_param_t
-	de_param_t dark_energy;
 	PyArg_Parse(PyDict_GetItemString(settings_dict,"sde_param"),"s",&setting_string);
 	if((j=translate(Nde_param_t,de_param_strings,setting_string))==-1){
-		Py_DECREF(Nnz_array);
-		Py_DECREF(par_nz_array);
-		return NULL;
+		free_settings(s);
+		return -1;
 	} else{
-		dark_energy=de_param_types[j];
+		s->dark_energy=de_param_types[j];
 	}
 
 	//norm_t
-	norm_t norm_mode;
 	PyArg_Parse(PyDict_GetItemString(settings_dict,"normmode"),"s",&setting_string);
 	if((j=translate(2,norm_strings,setting_string))==-1){
-		Py_DECREF(Nnz_array);
-		Py_DECREF(par_nz_array);
-		return NULL;
+		free_settings(s);
+		return -1;
 	} else{
-		norm_mode=norm_types[j];
+		s->norm_mode=norm_types[j];
 	}
 
 	//tomo_t
-	tomo_t tomography;
 	PyArg_Parse(PyDict_GetItemString(settings_dict,"stomo"),"s",&setting_string);
 	if((j=translate(Ntomo_t,tomo_strings,setting_string))==-1){
-		Py_DECREF(Nnz_array);
-		Py_DECREF(par_nz_array);
-		return NULL;
+		free_settings(s);
+		return -1;
 	} else{
-		tomography=tomo_types[j];
+		s->tomography=tomo_types[j];
 	}
 
 	//reduced_t
-	reduced_t sreduced;
 	PyArg_Parse(PyDict_GetItemString(settings_dict,"sreduced"),"s",&setting_string);
 	if((j=translate(Nreduced_t,reduced_strings,setting_string))==-1){
-		Py_DECREF(Nnz_array);
-		Py_DECREF(par_nz_array);
-		return NULL;
+		free_settings(s);
+		return -1;
 	} else{
-		sreduced=reduced_types[j];
+		s->sreduced=reduced_types[j];
 	}
 	
-	double Q_MAG_SIZE = PyFloat_AsDouble(PyDict_GetItemString(settings_dict,"q_mag_size"));
+	s->Q_MAG_SIZE = PyFloat_AsDouble(PyDict_GetItemString(settings_dict,"q_mag_size"));
+
+	return 0;
+
+}
+
+////////////////////////////////////
+/*Implementation of free_settings*///
+////////////////////////////////////
+
+static void free_settings(nicaea_settings *s){
+
+	Py_XDECREF(s->Nnz_array);
+	Py_XDECREF(s->par_nz_array);
+	free(s->nofz);
+
+	s->Nnz_array = NULL;
+	s->par_nz_array = NULL;
+	s->nofz = NULL;
+
+}
+
+/////////////////////////////////
+/*Implementation of init_model*///
+/////////////////////////////////
+
+//Build a cosmo_lens instance out of the NCOSMO_PARAMS cosmological parameters (Om,Ode,w0,w1,h,Ob,Onu,Neff,sigma8,ns) and the parsed settings; this does not touch any python object, so it can be called without holding the GIL
+static cosmo_lens *init_model(const double *p,nicaea_settings *s,error **err){
+
+	//Intrinsic alignment interface not implemented yet (defaults to none)
+	ia_t IA=ia_none;
+	ia_terms_t IA_TERMS=ia_undef;
+	double A_IA=0.0;
+
+	return init_parameters_lens(p[0],p[1],p[2],p[3],NULL,0,p[4],p[5],p[6],p[7],p[8],p[9],s->nzbins,s->Nnz,s->nofz,s->par_nz,s->nonlinear_type,s->transfer_function,s->growth,s->dark_energy,s->norm_mode,s->tomography,s->sreduced,s->Q_MAG_SIZE,IA,IA_TERMS,A_IA,err);
+
+}
+
+/////////////////////////////////
+/*Implementation of parse_model*/
+/////////////////////////////////
+
+static cosmo_lens *parse_model(PyObject *args, error **err){
+
+	//Cosmological parameters
+	double p[NCOSMO_PARAMS];
+	int nzbins;
+
+	//Multipoles/angles, redshift distribution and other settings
+	PyObject *spec_obj,*Nnz_obj,*nofz_obj,*par_nz_obj,*settings_dict,*extra_obj;
+	nicaea_settings s;
+
+	//Parse the input tuple
+	if(!PyArg_ParseTuple(args,"ddddddddddiOOOOOO",p,p+1,p+2,p+3,p+4,p+5,p+6,p+7,p+8,p+9,&nzbins,&spec_obj,&Nnz_obj,&nofz_obj,&par_nz_obj,&settings_dict,&extra_obj)){
+		fprintf(stderr,"Input tuple format doesn't match signature!");
+		return NULL;
+	}
+
+	//Redshift distribution and settings
+	if(parse_settings(nzbins,Nnz_obj,nofz_obj,par_nz_obj,settings_dict,&s)){
+		return NULL;
+	}
 
 	//cosmo model object
-	cosmo_lens *model=init_parameters_lens(Om,Ode,w0,w1,NULL,0,H100,Omegab,Omeganu,Neff,si8,ns,nzbins,Nnz,nofz,par_nz,nonlinear_type,transfer_function,growth,dark_energy,norm_mode,tomography,sreduced,Q_MAG_SIZE,IA,IA_TERMS,A_IA,err);
+	cosmo_lens *model=init_model(p,&s,err);
 
 	//cleanup
-	Py_DECREF(Nnz_array);
-	Py_DECREF(par_nz_array);
+	free_settings(&s);
 
 	return model;
 
 }
 
+/////////////////////////////////
+/*Implementation of count_pairs*/
+/////////////////////////////////
+
+//Number of redshift bin pairs that are computed, depending on the tomography type (auto only, cross only or auto and cross); if bin_i and bin_j are not NULL, they are filled with the pairs in row major C ordering
+static int count_pairs(int Nbins,tomo_t tomo,int *bin_i,int *bin_j){
+
+	int i,j,b=0;
+
+	for(i=0;i<Nbins;i++){
+		for(j=i;j<Nbins;j++){
+
+			if((tomo==tomo_auto_only && j!=i) || (tomo==tomo_cross_only && j==i)) continue;
+
+			if(bin_i!=NULL){
+				bin_i[b]=i;
+				bin_j[b]=j;
+			}
+
+			b++;
+
+		}
+	}
+
+	return b;
+
+}
+
 ///////////////////////////////////
 /*Implementation of alloc_output*/
 //////////////////////////////////
@@ -344,23 +435,13 @@ static PyObject *alloc_output(PyObject *spec,cosmo_lens *model){
 	int Nz;
 
 	//Number of redshift entries depends on tomography type (auto only, cross only or auto anc cross)
-	if(tomo==tomo_auto_only){
-		
-		Nz=Nbins;
+	if(tomo!=tomo_auto_only && tomo!=tomo_cross_only && tomo!=tomo_all) return NULL;
 	
-	} else if(tomo==tomo_cross_only){
-		
-		Nz=Nbins*(Nbins-1)/2;
-		if(Nz==0){
-			PyErr_SetString(PyExc_ValueError,"There is nothing to compute, you selected tomo_cross_only with only one redshift bin!!");
-			return NULL;
-		}
-
-	} else if(tomo==tomo_all){
-
-		Nz=Nbins*(Nbins+1)/2;
-
-	} else return NULL;
+	Nz=count_pairs(Nbins,tomo,NULL,NULL);
+	if(Nz==0){
+		PyErr_SetString(PyExc_ValueError,"There is nothing to compute, you selected tomo_cross_only with only one redshift bin!!");
+		return NULL;
+	}
 
 	//Once we have the number of redshift components, we can allocate the array
 	npy_intp output_dims[] = {(npy_intp)Ns,(npy_intp)Nz};
@@ -486,6 +567,7 @@ static PyObject *_nicaea_Wrapper(PyObject *args,double (*nicaea_method)(cosmo_le
 	}
 	
 	//Computation succeeded, cleanup and return
+	free_parameters_lens(&model);
 	Py_DECREF(spec_array);
 	return output_array;
 
@@ -528,3 +610,173 @@ static PyObject *_nicaea_shear2pt(PyObject *self,PyObject *args){
 
 }
 
+/////////////////////////////////////
+/*Implementation of _nicaea_batch*///
+/////////////////////////////////////
+
+//Evaluate a NICAEA method for a batch of cosmological models; the work items c*Npairs+b (cosmology c, redshift bin pair b) in [start,stop) are processed with models that are private to this call, and the GIL is released during the computation, so different ranges can be processed concurrently by different threads
+static PyObject *_nicaea_batch(PyObject *self,PyObject *args){
+
+	PyObject *cosmo_obj,*spec_obj,*Nnz_obj,*nofz_obj,*par_nz_obj,*settings_dict,*output_obj;
+	int nzbins,method;
+	long start,stop;
+
+	//counters
+	long n;
+	int l,c,b,current=-1,failed=0;
+
+	//NICAEA method, models and error handlers
+	double (*nicaea_method)(cosmo_lens*,double,int,int,error**);
+	cosmo_lens *model=NULL;
+	nicaea_settings s;
+	error *myerr=NULL,**err;
+	err=&myerr;
+	char stringerr[4096];
+
+	/*Parse the input: cosmological parameters (Ncosmo,10), redshift distribution, settings, method (0=power spectrum, +1/-1=correlation function), output array (Ncosmo,Nspec,Npairs) and range of work items to process*/
+	if(!PyArg_ParseTuple(args,"OiOOOOOiOll",&cosmo_obj,&nzbins,&spec_obj,&Nnz_obj,&nofz_obj,&par_nz_obj,&settings_dict,&method,&output_obj,&start,&stop)){
+		return NULL;
+	}
+
+	//Select the method
+	if(method==0){
+		nicaea_method=Pshear;
+	} else if(method==1){
+		nicaea_method=xi_plus;
+	} else if(method==-1){
+		nicaea_method=xi_minus;
+	} else{
+		PyErr_SetString(PyExc_ValueError,"Only 0 (power spectrum), +1 and -1 (correlation functions) allowed for method!");
+		return NULL;
+	}
+
+	/*The output array is filled in place, so it must be already well behaved*/
+	if(!PyArray_Check(output_obj) || PyArray_TYPE((PyArrayObject *)output_obj)!=NPY_DOUBLE || !PyArray_ISCARRAY((PyArrayObject *)output_obj)){
+		PyErr_SetString(PyExc_TypeError,"The output must be a C contiguous, writeable array of doubles");
+		return NULL;
+	}
+
+	/*Interpret the inputs as numpy arrays*/
+	PyObject *cosmo_array = PyArray_FROM_OTF(cosmo_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *spec_array = PyArray_FROM_OTF(spec_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+
+	if(cosmo_array==NULL || spec_array==NULL){
+		Py_XDECREF(cosmo_array);
+		Py_XDECREF(spec_array);
+		return NULL;
+	}
+
+	//Redshift distribution and settings are common to all the models
+	if(parse_settings(nzbins,Nnz_obj,nofz_obj,par_nz_obj,settings_dict,&s)){
+		Py_DECREF(cosmo_array);
+		Py_DECREF(spec_array);
+		return NULL;
+	}
+
+	//Redshift bin pairs
+	int Npairs = count_pairs(nzbins,s.tomography,NULL,NULL);
+	if(Npairs==0){
+		free_settings(&s);
+		Py_DECREF(cosmo_array);
+		Py_DECREF(spec_array);
+		PyErr_SetString(PyExc_ValueError,"There is nothing to compute, you selected tomo_cross_only with only one redshift bin!!");
+		return NULL;
+	}
+
+	int *bin_i = (int *)malloc(sizeof(int)*(Npairs+1));
+	int *bin_j = (int *)malloc(sizeof(int)*(Npairs+1));
+	
+	if(bin_i==NULL || bin_j==NULL){
+		free(bin_i);
+		free(bin_j);
+		free_settings(&s);
+		Py_DECREF(cosmo_array);
+		Py_DECREF(spec_array);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	count_pairs(nzbins,s.tomography,bin_i,bin_j);
+
+	/*Get the dimensions*/
+	int Ncosmo = (int)PyArray_DIM(cosmo_array,0);
+	int Nspec = (int)PyArray_DIM(spec_array,0);
+
+	if(PyArray_NDIM(cosmo_array)!=2 || PyArray_DIM(cosmo_array,1)!=NCOSMO_PARAMS || PyArray_SIZE((PyArrayObject *)output_obj)!=(npy_intp)Ncosmo*Nspec*Npairs){
+		free(bin_i);
+		free(bin_j);
+		free_settings(&s);
+		Py_DECREF(cosmo_array);
+		Py_DECREF(spec_array);
+		PyErr_SetString(PyExc_ValueError,"Cosmological parameters and output sizes do not match");
+		return NULL;
+	}
+
+	if(start<0) start = 0;
+	if(stop>(long)Ncosmo*Npairs) stop = (long)Ncosmo*Npairs;
+
+	//Data pointers
+	double *cosmo = (double *)PyArray_DATA(cosmo_array);
+	double *spec = (double *)PyArray_DATA(spec_array);
+	double *output = (double *)PyArray_DATA((PyArrayObject *)output_obj);
+
+	/*Call NICAEA, other threads can run in the meantime*/
+	Py_BEGIN_ALLOW_THREADS
+
+	for(n=start;n<stop;n++){
+
+		c = (int)(n/Npairs);
+		b = (int)(n%Npairs);
+
+		//Build a new model only when the cosmology changes, so the NICAEA tables are reused for all the bin pairs
+		if(c!=current){
+			
+			if(model!=NULL) free_parameters_lens(&model);
+			model = init_model(cosmo+(long)c*NCOSMO_PARAMS,&s,err);
+			current = c;
+
+			if(isError(*err)) break;
+			if(model==NULL){
+				failed=1;
+				break;
+			}
+		
+		}
+
+		//cycle over specification (angles or multipoles)
+		for(l=0;l<Nspec;l++){
+			output[((long)c*Nspec+l)*Npairs+b] = nicaea_method(model,spec[l],bin_i[b],bin_j[b],err);
+			if(isError(*err)) break;
+		}
+
+		if(isError(*err)) break;
+
+	}
+
+	if(model!=NULL) free_parameters_lens(&model);
+
+	Py_END_ALLOW_THREADS
+
+	//Cleanup
+	free(bin_i);
+	free(bin_j);
+	free_settings(&s);
+	Py_DECREF(cosmo_array);
+	Py_DECREF(spec_array);
+
+	//Errors are reported only once the GIL is held again
+	if(isError(*err)){
+		stringError(stringerr,*err);
+		purgeError(err);
+		PyErr_SetString(PyExc_RuntimeError,stringerr);
+		return NULL;
+	}
+
+	if(failed){
+		PyErr_SetString(PyExc_RuntimeError,"NICAEA could not build the cosmological model");
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+
+}
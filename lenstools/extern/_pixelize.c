@@ -6,6 +6,7 @@ The module is called _pixelize and it defines the methods below (see docstrings)
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <Python.h>
 #include <numpy/arrayobject.h>
@@ -20,14 +21,17 @@ static struct module_state _state;
 //Python module docstrings
 static char module_docstring[] = "This module provides a python interface for two dimensional pixelizations of catalogs";
 static char grid2d_docstring[] = "Construct a 2D pixelization of a scalar quantity in a catalog";
+static char grid2d_multi_docstring[] = "Accumulate several catalog quantities and the weighted and unweighted pixel hit counts on a 2D grid in a single pass, with NGP or CIC assignment";
 
 //Method declarations
 static PyObject *_pixelize_grid2d(PyObject *self,PyObject *args);
+static PyObject *_pixelize_grid2d_multi(PyObject *self,PyObject *args);
 
 //_pixelize method definitions
 static PyMethodDef module_methods[] = {
 
 	{"grid2d",_pixelize_grid2d,METH_VARARGS,grid2d_docstring},
+	{"grid2d_multi",_pixelize_grid2d_multi,METH_VARARGS,grid2d_multi_docstring},
 	{NULL,NULL,0,NULL}
 
 } ;
@@ -158,4 +162,122 @@ static PyObject *_pixelize_grid2d(PyObject *self,PyObject *args){
 	Py_RETURN_NONE;
 
 
-}
\ No newline at end of file
+}
+
+
+//grid2d_multi() implementation
+static PyObject *_pixelize_grid2d_multi(PyObject *self,PyObject *args){
+
+	PyObject *x_obj,*y_obj,*columns_obj,*weights_obj,*maps_obj,*hits_obj,*counts_obj;
+	double map_size;
+	int cic,c,Ncolumns,failed=0;
+	long start,stop;
+
+	//parse input tuple: positions, sequence of columns, weights (or None), map size, assignment scheme, output buffers (maps, weighted and unweighted hits, accumulated in place) and range of objects
+	if(!PyArg_ParseTuple(args,"OOOOdiOOOll",&x_obj,&y_obj,&columns_obj,&weights_obj,&map_size,&cic,&maps_obj,&hits_obj,&counts_obj,&start,&stop)) return NULL;
+
+	if(!PySequence_Check(columns_obj)){
+		PyErr_SetString(PyExc_TypeError,"columns must be a sequence of arrays");
+		return NULL;
+	}
+
+	//the output buffers are filled in place, so they must be already well behaved
+	if(!PyArray_Check(maps_obj) || !PyArray_Check(hits_obj) || !PyArray_Check(counts_obj) || PyArray_TYPE((PyArrayObject *)maps_obj)!=NPY_DOUBLE || PyArray_TYPE((PyArrayObject *)hits_obj)!=NPY_DOUBLE || PyArray_TYPE((PyArrayObject *)counts_obj)!=NPY_DOUBLE || !PyArray_ISCARRAY((PyArrayObject *)maps_obj) || !PyArray_ISCARRAY((PyArrayObject *)hits_obj) || !PyArray_ISCARRAY((PyArrayObject *)counts_obj)){
+		PyErr_SetString(PyExc_TypeError,"maps, hits and counts must be C contiguous, writeable arrays of doubles");
+		return NULL;
+	}
+
+	//interpret arrays
+	Ncolumns = (int)PySequence_Size(columns_obj);
+	PyObject *x_array = PyArray_FROM_OTF(x_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *y_array = PyArray_FROM_OTF(y_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *weights_array = (weights_obj==Py_None) ? NULL : PyArray_FROM_OTF(weights_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject **column_arrays = (PyObject **)calloc(Ncolumns>0 ? Ncolumns : 1,sizeof(PyObject *));
+	double **columns = (double **)malloc(sizeof(double *)*(Ncolumns>0 ? Ncolumns : 1));
+
+	if(column_arrays==NULL || columns==NULL){
+		failed = 1;
+		PyErr_NoMemory();
+	} else{
+
+		for(c=0;c<Ncolumns;c++){
+
+			PyObject *item = PySequence_GetItem(columns_obj,c);
+			if(item==NULL){
+				failed = 1;
+				break;
+			}
+
+			column_arrays[c] = PyArray_FROM_OTF(item,NPY_DOUBLE,NPY_IN_ARRAY);
+			Py_DECREF(item);
+
+			if(column_arrays[c]==NULL){
+				failed = 1;
+				break;
+			}
+
+			columns[c] = (double *)PyArray_DATA(column_arrays[c]);
+
+		}
+
+	}
+
+	//check if anything failed
+	if(failed || x_array==NULL || y_array==NULL || (weights_obj!=Py_None && weights_array==NULL)){
+		failed = 1;
+	} else{
+
+		//get the number of objects in the catalog and the number of pixels
+		long Nobjects = (long)PyArray_SIZE(x_array);
+		int Npixel = (int)PyArray_DIM(hits_obj,0);
+
+		if(PyArray_SIZE(y_array)!=Nobjects || (weights_array!=NULL && PyArray_SIZE(weights_array)!=Nobjects) || PyArray_SIZE((PyArrayObject *)maps_obj)!=(npy_intp)Ncolumns*PyArray_SIZE((PyArrayObject *)hits_obj) || PyArray_SIZE((PyArrayObject *)counts_obj)!=PyArray_SIZE((PyArrayObject *)hits_obj)){
+			failed = 1;
+			PyErr_SetString(PyExc_ValueError,"Sizes of positions, weights and maps do not match");
+		}
+
+		for(c=0;c<Ncolumns && !failed;c++){
+			if(PyArray_SIZE(column_arrays[c])!=Nobjects){
+				failed = 1;
+				PyErr_SetString(PyExc_ValueError,"All the columns must have one entry per object");
+			}
+		}
+
+		if(!failed){
+
+			if(start<0) start = 0;
+			if(stop>Nobjects) stop = Nobjects;
+
+			double *x = (double *)PyArray_DATA(x_array);
+			double *y = (double *)PyArray_DATA(y_array);
+			double *weights = (weights_array==NULL) ? NULL : (double *)PyArray_DATA(weights_array);
+			double *maps = (double *)PyArray_DATA((PyArrayObject *)maps_obj);
+			double *hits = (double *)PyArray_DATA((PyArrayObject *)hits_obj);
+			double *counts = (double *)PyArray_DATA((PyArrayObject *)counts_obj);
+
+			//call the C backend for the gridding procedure, other threads can run in the meantime
+			Py_BEGIN_ALLOW_THREADS
+			grid2d_multi(x,y,columns,Ncolumns,weights,start,stop,Npixel,map_size,cic,maps,hits,counts);
+			Py_END_ALLOW_THREADS
+
+		}
+
+	}
+
+	//cleanup
+	Py_XDECREF(x_array);
+	Py_XDECREF(y_array);
+	Py_XDECREF(weights_array);
+
+	if(column_arrays!=NULL){
+		for(c=0;c<Ncolumns;c++) Py_XDECREF(column_arrays[c]);
+		free(column_arrays);
+	}
+	free(columns);
+
+	if(failed) return NULL;
+
+	//return None
+	Py_RETURN_NONE;
+
+}
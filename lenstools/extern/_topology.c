@@ -7,6 +7,7 @@ The module is called _topology and it defines the methods below (see docstrings)
 
 #include <complex.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include <Python.h>
 #include <numpy/arrayobject.h>
@@ -17,6 +18,9 @@ The module is called _topology and it defines the methods below (see docstrings)
 #include "differentials.h"
 #include "minkowski.h"
 #include "azimuth.h"
+#include "paircount.h"
+#include "accumulator.h"
+#include "sampler.h"
 
 #ifndef IS_PY3K
 static struct module_state _state;
@@ -32,8 +36,16 @@ static char hessian_docstring[] = "Compute the hessian of a 2D image";
 static char gradLaplacian_docstring[] = "Compute the gradient of the laplacian of a 2D image"; 
 static char minkowski_docstring[] = "Measure the three Minkowski functionals of a 2D image";
 static char rfft2_azimuthal_docstring[] = "Measure azimuthal average of Fourier transforms of 2D image";
+static char rfft2_azimuthal_eb_docstring[] = "Measure the binned EE,BB,EB power spectra from the Fourier transforms of the two components of a shear map";
+static char rfft2_azimuthal_multi_docstring[] = "Measure all the binned auto and cross power spectra of a stack of Fourier transformed 2D images";
 static char bispectrum_docstring[] = "Measure the bispectrum from the Fourier transform of a 2D image";
 static char rfft3_azimuthal_docstring[] = "Measure azimuthal average of Fourier transforms of 3D scalar field";
+static char pairCount_docstring[] = "Count the pairs of points in distance bins using a cell list";
+static char cellList_docstring[] = "Sort a set of points in a cell list, which can be shared by different pairCount calls";
+static char accumulate_docstring[] = "Accumulate the histogram and the moment power sums of a 2D image in a single pass";
+static char accumulateFields_docstring[] = "Accumulate the histogram and the moment power sums of a 2D image, given its gradient and hessian, in a single pass";
+static char sample_docstring[] = "Sample one or more 2D images at arbitrary positions (nearest pixel, bilinear or bicubic interpolation) with periodic boundary conditions";
+static char maskedDerivatives_docstring[] = "Compute stencil validity flags and compacted gradient and hessian of the valid pixels of a masked 2D image";
 
 //method declarations
 static PyObject *_topology_peakCount(PyObject *self,PyObject *args);
@@ -43,8 +55,16 @@ static PyObject *_topology_hessian(PyObject *self,PyObject *args);
 static PyObject *_topology_gradLaplacian(PyObject *self,PyObject *args);
 static PyObject *_topology_minkowski(PyObject *self,PyObject *args);
 static PyObject *_topology_rfft2_azimuthal(PyObject *self,PyObject *args);
+static PyObject *_topology_rfft2_azimuthal_eb(PyObject *self,PyObject *args);
+static PyObject *_topology_rfft2_azimuthal_multi(PyObject *self,PyObject *args);
 static PyObject *_topology_bispectrum(PyObject *self,PyObject *args);
 static PyObject *_topology_rfft3_azimuthal(PyObject *self,PyObject *args);
+static PyObject *_topology_pairCount(PyObject *self,PyObject *args);
+static PyObject *_topology_cellList(PyObject *self,PyObject *args);
+static PyObject *_topology_maskedDerivatives(PyObject *self,PyObject *args);
+static PyObject *_topology_accumulate(PyObject *self,PyObject *args);
+static PyObject *_topology_accumulateFields(PyObject *self,PyObject *args);
+static PyObject *_topology_sample(PyObject *self,PyObject *args);
 
 
 //_topology method definitions
@@ -57,8 +77,16 @@ static PyMethodDef module_methods[] = {
 	{"gradLaplacian",_topology_gradLaplacian,METH_VARARGS,gradLaplacian_docstring},
 	{"minkowski",_topology_minkowski,METH_VARARGS,minkowski_docstring},
 	{"rfft2_azimuthal",_topology_rfft2_azimuthal,METH_VARARGS,rfft2_azimuthal_docstring},
+	{"rfft2_azimuthal_eb",_topology_rfft2_azimuthal_eb,METH_VARARGS,rfft2_azimuthal_eb_docstring},
+	{"rfft2_azimuthal_multi",_topology_rfft2_azimuthal_multi,METH_VARARGS,rfft2_azimuthal_multi_docstring},
 	{"bispectrum",_topology_bispectrum,METH_VARARGS,bispectrum_docstring},
 	{"rfft3_azimuthal",_topology_rfft3_azimuthal,METH_VARARGS,rfft3_azimuthal_docstring},
+	{"pairCount",_topology_pairCount,METH_VARARGS,pairCount_docstring},
+	{"cellList",_topology_cellList,METH_VARARGS,cellList_docstring},
+	{"maskedDerivatives",_topology_maskedDerivatives,METH_VARARGS,maskedDerivatives_docstring},
+	{"accumulate",_topology_accumulate,METH_VARARGS,accumulate_docstring},
+	{"accumulateFields",_topology_accumulateFields,METH_VARARGS,accumulateFields_docstring},
+	{"sample",_topology_sample,METH_VARARGS,sample_docstring},
 	{NULL,NULL,0,NULL}
 
 } ;
@@ -1094,6 +1122,147 @@ static PyObject *_topology_rfft2_azimuthal(PyObject *self,PyObject *args){
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
+//rfft2_azimuthal_eb() implementation
+static PyObject *_topology_rfft2_azimuthal_eb(PyObject *self,PyObject *args){
+
+	/*These are the inputs: the Fourier transforms of the two shear components, the rotation tables, the multipole bin of each Fourier pixel, the number of bins and the (optional) scaling of the Fourier pixels*/
+	PyObject *ft_gamma1_obj,*ft_gamma2_obj,*cos_obj,*sin_obj,*bins_obj,*scale_obj;
+	int Nbins;
+
+	/*Parse input tuple*/
+	if(!PyArg_ParseTuple(args,"OOOOOiO",&ft_gamma1_obj,&ft_gamma2_obj,&cos_obj,&sin_obj,&bins_obj,&Nbins,&scale_obj)){
+		return NULL;
+	}
+
+	/*Interpret the parsed objects as numpy arrays*/
+	PyObject *ft_gamma1_array = PyArray_FROM_OTF(ft_gamma1_obj,NPY_COMPLEX128,NPY_IN_ARRAY);
+	PyObject *ft_gamma2_array = PyArray_FROM_OTF(ft_gamma2_obj,NPY_COMPLEX128,NPY_IN_ARRAY);
+	PyObject *cos_array = PyArray_FROM_OTF(cos_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *sin_array = PyArray_FROM_OTF(sin_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *bins_array = PyArray_FROM_OTF(bins_obj,NPY_INT32,NPY_IN_ARRAY);
+	PyObject *scale_array = NULL;
+
+	if(scale_obj!=Py_None) scale_array = PyArray_FROM_OTF(scale_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+
+	/*Check if anything failed*/
+	if(ft_gamma1_array==NULL || ft_gamma2_array==NULL || cos_array==NULL || sin_array==NULL || bins_array==NULL || (scale_obj!=Py_None && scale_array==NULL)){
+
+		Py_XDECREF(ft_gamma1_array);
+		Py_XDECREF(ft_gamma2_array);
+		Py_XDECREF(cos_array);
+		Py_XDECREF(sin_array);
+		Py_XDECREF(bins_array);
+		Py_XDECREF(scale_array);
+
+		return NULL;
+	}
+
+	/*Build the array that will contain the output: EE,BB,EB binned sums*/
+	npy_intp dims[] = {(npy_intp) 3,(npy_intp) Nbins};
+	PyObject *power_array = PyArray_ZEROS(2,dims,NPY_DOUBLE,0);
+
+	if(power_array==NULL){
+
+		Py_DECREF(ft_gamma1_array);
+		Py_DECREF(ft_gamma2_array);
+		Py_DECREF(cos_array);
+		Py_DECREF(sin_array);
+		Py_DECREF(bins_array);
+		Py_XDECREF(scale_array);
+
+		return NULL;
+	}
+
+	long Npixels = (long)PyArray_SIZE(ft_gamma1_array);
+	double *power = (double *)PyArray_DATA(power_array);
+
+	/*Call the C backend, other threads can run in the meantime*/
+	Py_BEGIN_ALLOW_THREADS
+	azimuthal_rfft2_eb((double _Complex *)PyArray_DATA(ft_gamma1_array),(double _Complex *)PyArray_DATA(ft_gamma2_array),(double *)PyArray_DATA(cos_array),(double *)PyArray_DATA(sin_array),(int *)PyArray_DATA(bins_array),Npixels,(scale_array==NULL) ? NULL : (double *)PyArray_DATA(scale_array),power,power+Nbins,power+2*Nbins);
+	Py_END_ALLOW_THREADS
+
+	//Cleanup
+	Py_DECREF(ft_gamma1_array);
+	Py_DECREF(ft_gamma2_array);
+	Py_DECREF(cos_array);
+	Py_DECREF(sin_array);
+	Py_DECREF(bins_array);
+	Py_XDECREF(scale_array);
+
+	return power_array;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//rfft2_azimuthal_multi() implementation
+static PyObject *_topology_rfft2_azimuthal_multi(PyObject *self,PyObject *args){
+
+	/*These are the inputs: the stacked Fourier transforms of the maps, the multipole bin of each Fourier pixel, the number of bins, the (optional) scaling of the Fourier pixels and the range of pixels to process*/
+	PyObject *ft_maps_obj,*bins_obj,*scale_obj;
+	int Nbins;
+	long start,stop;
+
+	/*Parse input tuple*/
+	if(!PyArg_ParseTuple(args,"OOiOll",&ft_maps_obj,&bins_obj,&Nbins,&scale_obj,&start,&stop)){
+		return NULL;
+	}
+
+	/*Interpret the parsed objects as numpy arrays*/
+	PyObject *ft_maps_array = PyArray_FROM_OTF(ft_maps_obj,NPY_COMPLEX128,NPY_IN_ARRAY);
+	PyObject *bins_array = PyArray_FROM_OTF(bins_obj,NPY_INT32,NPY_IN_ARRAY);
+	PyObject *scale_array = NULL;
+
+	if(scale_obj!=Py_None) scale_array = PyArray_FROM_OTF(scale_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+
+	/*Check if anything failed*/
+	if(ft_maps_array==NULL || bins_array==NULL || (scale_obj!=Py_None && scale_array==NULL)){
+
+		Py_XDECREF(ft_maps_array);
+		Py_XDECREF(bins_array);
+		Py_XDECREF(scale_array);
+
+		return NULL;
+	}
+
+	/*Number of maps and of Fourier pixels per map*/
+	int Nmaps = (int)PyArray_DIM(ft_maps_array,0);
+	long Npixels = (long)PyArray_SIZE(bins_array);
+
+	if(start<0) start = 0;
+	if(stop>Npixels) stop = Npixels;
+
+	/*Build the array that will contain the output: one row of binned sums per pair of maps*/
+	npy_intp dims[] = {(npy_intp) Nmaps*(Nmaps+1)/2,(npy_intp) Nbins};
+	PyObject *power_array = PyArray_ZEROS(2,dims,NPY_DOUBLE,0);
+
+	if(power_array==NULL){
+
+		Py_DECREF(ft_maps_array);
+		Py_DECREF(bins_array);
+		Py_XDECREF(scale_array);
+
+		return NULL;
+	}
+
+	/*Call the C backend, other threads can run in the meantime*/
+	Py_BEGIN_ALLOW_THREADS
+	azimuthal_rfft2_multi((double _Complex *)PyArray_DATA(ft_maps_array),Nmaps,Npixels,start,stop,(int *)PyArray_DATA(bins_array),Nbins,(scale_array==NULL) ? NULL : (double *)PyArray_DATA(scale_array),(double *)PyArray_DATA(power_array));
+	Py_END_ALLOW_THREADS
+
+	//Cleanup
+	Py_DECREF(ft_maps_array);
+	Py_DECREF(bins_array);
+	Py_XDECREF(scale_array);
+
+	return power_array;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 //bispectrum() implementation
 static PyObject *_topology_bispectrum(PyObject *self,PyObject *args){
 
@@ -1289,3 +1458,454 @@ static PyObject *_topology_rfft3_azimuthal(PyObject *self,PyObject *args){
 	return output;
 }
 
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+//pairCount() implementation
+static PyObject *_topology_pairCount(PyObject *self,PyObject *args){
+
+	/*These are the inputs: the two point sets (with their labels), the distance bin edges, the box size, the boundary conditions, the cell list of the second set (built with cellList) and the range of points of the first set to process*/
+	PyObject *points1_obj,*labels1_obj,*points2_obj,*labels2_obj,*edges_obj,*cell_start_obj,*sorted_obj;
+	int Nlabels1,Nlabels2,periodic,autocorr;
+	long start,stop;
+	double box;
+
+	/*Parse input tuple*/
+	if(!PyArg_ParseTuple(args,"OOiOOiOdiiOOll",&points1_obj,&labels1_obj,&Nlabels1,&points2_obj,&labels2_obj,&Nlabels2,&edges_obj,&box,&periodic,&autocorr,&cell_start_obj,&sorted_obj,&start,&stop)){
+		return NULL;
+	}
+
+	/*Interpret the parsed objects as numpy arrays*/
+	PyObject *points1_array = PyArray_FROM_OTF(points1_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *labels1_array = PyArray_FROM_OTF(labels1_obj,NPY_INT32,NPY_IN_ARRAY);
+	PyObject *points2_array = PyArray_FROM_OTF(points2_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *labels2_array = PyArray_FROM_OTF(labels2_obj,NPY_INT32,NPY_IN_ARRAY);
+	PyObject *edges_array = PyArray_FROM_OTF(edges_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *cell_start_array = PyArray_FROM_OTF(cell_start_obj,NPY_LONG,NPY_IN_ARRAY);
+	PyObject *sorted_array = PyArray_FROM_OTF(sorted_obj,NPY_LONG,NPY_IN_ARRAY);
+
+	/*Check if anything failed*/
+	if(points1_array==NULL || labels1_array==NULL || points2_array==NULL || labels2_array==NULL || edges_array==NULL || cell_start_array==NULL || sorted_array==NULL){
+
+		Py_XDECREF(points1_array);
+		Py_XDECREF(labels1_array);
+		Py_XDECREF(points2_array);
+		Py_XDECREF(labels2_array);
+		Py_XDECREF(edges_array);
+		Py_XDECREF(cell_start_array);
+		Py_XDECREF(sorted_array);
+
+		return NULL;
+	}
+
+	/*Get the number of points, cells and distance bins*/
+	long N1 = (long)PyArray_DIM(points1_array,0);
+	long N2 = (long)PyArray_DIM(points2_array,0);
+	int Nbins = (int)PyArray_DIM(edges_array,0) - 1;
+	int Ncells = (int)floor(sqrt((double)(PyArray_DIM(cell_start_array,0)-1))+0.5);
+
+	/*Build the array that will contain the output: the pair counts*/
+	npy_intp dims[] = {(npy_intp) Nlabels1,(npy_intp) Nlabels2,(npy_intp) Nbins};
+	PyObject *counts_array = PyArray_ZEROS(3,dims,NPY_DOUBLE,0);
+
+	if(counts_array==NULL || (long)Ncells*Ncells+1!=(long)PyArray_DIM(cell_start_array,0) || (long)PyArray_DIM(sorted_array,0)!=N2){
+
+		if(counts_array!=NULL){
+			Py_DECREF(counts_array);
+			PyErr_SetString(PyExc_ValueError,"The cell list does not match the second point set");
+		}
+
+		Py_DECREF(points1_array);
+		Py_DECREF(labels1_array);
+		Py_DECREF(points2_array);
+		Py_DECREF(labels2_array);
+		Py_DECREF(edges_array);
+		Py_DECREF(cell_start_array);
+		Py_DECREF(sorted_array);
+
+		return NULL;
+	}
+
+	/*Call the C backend pair counter, other threads can run in the meantime*/
+	int err;
+	Py_BEGIN_ALLOW_THREADS
+	err = pair_count((double *)PyArray_DATA(points1_array),(int *)PyArray_DATA(labels1_array),N1,Nlabels1,(double *)PyArray_DATA(points2_array),(int *)PyArray_DATA(labels2_array),N2,Nlabels2,autocorr,start,stop,box,periodic,Ncells,(long *)PyArray_DATA(cell_start_array),(long *)PyArray_DATA(sorted_array),Nbins,(double *)PyArray_DATA(edges_array),(double *)PyArray_DATA(counts_array));
+	Py_END_ALLOW_THREADS
+
+	//Cleanup
+	Py_DECREF(points1_array);
+	Py_DECREF(labels1_array);
+	Py_DECREF(points2_array);
+	Py_DECREF(labels2_array);
+	Py_DECREF(edges_array);
+	Py_DECREF(cell_start_array);
+	Py_DECREF(sorted_array);
+
+	if(err){
+		Py_DECREF(counts_array);
+		PyErr_SetString(PyExc_ValueError,"The point range must satisfy 0<=start<=stop<=N1 and the labels must be smaller than the number of labels");
+		return NULL;
+	}
+
+	return counts_array;
+}
+
+//cellList() implementation
+static PyObject *_topology_cellList(PyObject *self,PyObject *args){
+
+	PyObject *points_obj;
+	double rmax,box;
+	int periodic;
+
+	/*Parse the input: the points (N,2), the maximum pair distance, the box size and the boundary conditions*/
+	if(!PyArg_ParseTuple(args,"Oddi",&points_obj,&rmax,&box,&periodic)){
+		return NULL;
+	}
+
+	PyObject *points_array = PyArray_FROM_OTF(points_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	if(points_array==NULL){
+		return NULL;
+	}
+
+	/*Allocate the cell list: the cell boundaries and the sorted point indices*/
+	long N = (long)PyArray_DIM(points_array,0);
+	int Ncells = cell_list_size(box,rmax);
+	npy_intp cell_dims[] = {(npy_intp)Ncells*Ncells+1};
+	npy_intp sorted_dims[] = {(npy_intp)N};
+	PyObject *cell_start_array = PyArray_ZEROS(1,cell_dims,NPY_LONG,0);
+	PyObject *sorted_array = PyArray_ZEROS(1,sorted_dims,NPY_LONG,0);
+
+	if(cell_start_array==NULL || sorted_array==NULL){
+		Py_DECREF(points_array);
+		Py_XDECREF(cell_start_array);
+		Py_XDECREF(sorted_array);
+		return NULL;
+	}
+
+	/*Call the C backend*/
+	int err;
+	Py_BEGIN_ALLOW_THREADS
+	err = build_cell_list((double *)PyArray_DATA(points_array),N,box,Ncells,periodic,(long *)PyArray_DATA(cell_start_array),(long *)PyArray_DATA(sorted_array));
+	Py_END_ALLOW_THREADS
+
+	//Cleanup
+	Py_DECREF(points_array);
+
+	if(err){
+		Py_DECREF(cell_start_array);
+		Py_DECREF(sorted_array);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	return Py_BuildValue("NN",cell_start_array,sorted_array);
+
+}
+
+//maskedDerivatives() implementation
+static PyObject *_topology_maskedDerivatives(PyObject *self,PyObject *args){
+
+	PyObject *map_obj,*mask_obj;
+	int k;
+
+	/*Parse the input: the map and its mask (1 on the valid pixels, 0 on the masked ones)*/
+	if(!PyArg_ParseTuple(args,"OO",&map_obj,&mask_obj)){
+		return NULL;
+	}
+
+	/*Interpret the inputs as numpy arrays*/
+	PyObject *map_array = PyArray_FROM_OTF(map_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *mask_array = PyArray_FROM_OTF(mask_obj,NPY_UINT8,NPY_IN_ARRAY);
+
+	if(map_array==NULL || mask_array==NULL){
+		Py_XDECREF(map_array);
+		Py_XDECREF(mask_array);
+		return NULL;
+	}
+
+	/*Get the size of the map (in pixels) and the number of unmasked pixels, which bounds the size of the outputs*/
+	long Nside = (long)PyArray_DIM(map_array,0);
+	unsigned char *mask_data = (unsigned char *)PyArray_DATA(mask_array);
+	long p,Nunmasked = 0;
+
+	for(p=0;p<Nside*Nside;p++){
+		if(mask_data[p]) Nunmasked++;
+	}
+
+	/*Prepare the output arrays: the flags map and the compacted pixel indices, values and derivatives*/
+	npy_intp map_dims[] = {(npy_intp) Nside, (npy_intp) Nside};
+	npy_intp pix_dims[] = {(npy_intp) Nunmasked};
+	PyObject *outputs[8];
+
+	outputs[0] = PyArray_SimpleNew(2,map_dims,NPY_UINT8);
+	outputs[1] = PyArray_SimpleNew(1,pix_dims,NPY_LONG);
+	for(k=2;k<8;k++) outputs[k] = PyArray_SimpleNew(1,pix_dims,NPY_DOUBLE);
+
+	for(k=0;k<8;k++){
+		if(outputs[k]==NULL){
+			for(k=0;k<8;k++) Py_XDECREF(outputs[k]);
+			Py_DECREF(map_array);
+			Py_DECREF(mask_array);
+			return NULL;
+		}
+	}
+
+	/*Call the C backend, other threads can run in the meantime*/
+	long Nvalid;
+	Py_BEGIN_ALLOW_THREADS
+	Nvalid = masked_derivatives((double *)PyArray_DATA(map_array),mask_data,Nside,(unsigned char *)PyArray_DATA(outputs[0]),(long *)PyArray_DATA(outputs[1]),(double *)PyArray_DATA(outputs[2]),(double *)PyArray_DATA(outputs[3]),(double *)PyArray_DATA(outputs[4]),(double *)PyArray_DATA(outputs[5]),(double *)PyArray_DATA(outputs[6]),(double *)PyArray_DATA(outputs[7]));
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(map_array);
+	Py_DECREF(mask_array);
+
+	if(Nvalid<0){
+		for(k=0;k<8;k++) Py_DECREF(outputs[k]);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	/*Shrink the compacted outputs to the number of valid pixels*/
+	pix_dims[0] = (npy_intp) Nvalid;
+	PyArray_Dims new_shape = {pix_dims,1};
+
+	for(k=1;k<8;k++){
+
+		PyObject *resized = PyArray_Resize((PyArrayObject *)outputs[k],&new_shape,0,NPY_CORDER);
+
+		if(resized==NULL){
+			for(k=0;k<8;k++) Py_DECREF(outputs[k]);
+			return NULL;
+		}
+
+		Py_DECREF(resized);
+
+	}
+
+	/*Pack the outputs in a tuple (flags,pixels,values,gradient_x,gradient_y,hessian_xx,hessian_yy,hessian_xy)*/
+	PyObject *output = PyTuple_New(8);
+	if(output==NULL){
+		for(k=0;k<8;k++) Py_DECREF(outputs[k]);
+		return NULL;
+	}
+
+	for(k=0;k<8;k++) PyTuple_SET_ITEM(output,k,outputs[k]);
+
+	return output;
+
+}
+
+//accumulate() implementation
+static PyObject *_topology_accumulate(PyObject *self,PyObject *args){
+
+	PyObject *map_obj,*mask_obj,*edges_obj;
+	int uniform,derivatives;
+	long row_start,row_stop;
+
+	/*Parse the input: map, mask (or None), histogram edges (or None), uniform binning flag, derivatives flag and range of rows to process*/
+	if(!PyArg_ParseTuple(args,"OOOiill",&map_obj,&mask_obj,&edges_obj,&uniform,&derivatives,&row_start,&row_stop)){
+		return NULL;
+	}
+
+	/*Interpret the inputs as numpy arrays*/
+	PyObject *map_array = PyArray_FROM_OTF(map_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *mask_array = NULL;
+	PyObject *edges_array = NULL;
+
+	if(map_array==NULL) return NULL;
+
+	if(mask_obj!=Py_None){
+		mask_array = PyArray_FROM_OTF(mask_obj,NPY_UINT8,NPY_IN_ARRAY);
+		if(mask_array==NULL){
+			Py_DECREF(map_array);
+			return NULL;
+		}
+	}
+
+	if(edges_obj!=Py_None){
+		edges_array = PyArray_FROM_OTF(edges_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+		if(edges_array==NULL){
+			Py_DECREF(map_array);
+			Py_XDECREF(mask_array);
+			return NULL;
+		}
+	}
+
+	long Nside = (long)PyArray_DIM(map_array,0);
+	int Nbins = (edges_array==NULL) ? 0 : (int)PyArray_DIM(edges_array,0) - 1;
+
+	if(row_start<0) row_start = 0;
+	if(row_stop>Nside) row_stop = Nside;
+
+	/*Prepare the outputs: histogram counts and power sums*/
+	npy_intp hist_dims[] = {(npy_intp) (Nbins>0 ? Nbins : 0)};
+	npy_intp sums_dims[] = {(npy_intp) ACC_NSUMS};
+	PyObject *hist_array = PyArray_ZEROS(1,hist_dims,NPY_DOUBLE,0);
+	PyObject *sums_array = PyArray_ZEROS(1,sums_dims,NPY_DOUBLE,0);
+
+	if(hist_array==NULL || sums_array==NULL){
+		Py_DECREF(map_array);
+		Py_XDECREF(mask_array);
+		Py_XDECREF(edges_array);
+		Py_XDECREF(hist_array);
+		Py_XDECREF(sums_array);
+		return NULL;
+	}
+
+	/*Call the C backend, other threads can run in the meantime*/
+	int err;
+	Py_BEGIN_ALLOW_THREADS
+	err = accumulate_map((double *)PyArray_DATA(map_array),(mask_array==NULL) ? NULL : (unsigned char *)PyArray_DATA(mask_array),Nside,row_start,row_stop,Nbins,(edges_array==NULL) ? NULL : (double *)PyArray_DATA(edges_array),uniform,derivatives,(double *)PyArray_DATA(hist_array),(double *)PyArray_DATA(sums_array));
+	Py_END_ALLOW_THREADS
+
+	//Cleanup
+	Py_DECREF(map_array);
+	Py_XDECREF(mask_array);
+	Py_XDECREF(edges_array);
+
+	if(err){
+		Py_DECREF(hist_array);
+		Py_DECREF(sums_array);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	/*Output (histogram,sums)*/
+	PyObject *output = Py_BuildValue("NN",hist_array,sums_array);
+	return output;
+
+}
+
+//accumulateFields() implementation
+static PyObject *_topology_accumulateFields(PyObject *self,PyObject *args){
+
+	PyObject *map_obj,*gx_obj,*gy_obj,*hxx_obj,*hyy_obj,*edges_obj;
+	int uniform,k,valid=1;
+
+	/*Parse the input: map, gradient (x,y), hessian diagonal (xx,yy), histogram edges (or None) and uniform binning flag*/
+	if(!PyArg_ParseTuple(args,"OOOOOOi",&map_obj,&gx_obj,&gy_obj,&hxx_obj,&hyy_obj,&edges_obj,&uniform)){
+		return NULL;
+	}
+
+	/*Interpret the inputs as numpy arrays*/
+	PyObject *field_objs[] = {map_obj,gx_obj,gy_obj,hxx_obj,hyy_obj};
+	PyObject *field_arrays[] = {NULL,NULL,NULL,NULL,NULL};
+	PyObject *edges_array = NULL;
+
+	for(k=0;k<5 && valid;k++){
+		field_arrays[k] = PyArray_FROM_OTF(field_objs[k],NPY_DOUBLE,NPY_IN_ARRAY);
+		if(field_arrays[k]==NULL) valid = 0;
+	}
+
+	if(valid && edges_obj!=Py_None){
+		edges_array = PyArray_FROM_OTF(edges_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+		if(edges_array==NULL) valid = 0;
+	}
+
+	/*All the fields must have the same size*/
+	for(k=1;k<5 && valid;k++){
+		if(PyArray_SIZE((PyArrayObject *)field_arrays[k])!=PyArray_SIZE((PyArrayObject *)field_arrays[0])){
+			PyErr_SetString(PyExc_ValueError,"The map and its derivatives must have the same shape!");
+			valid = 0;
+		}
+	}
+
+	if(!valid){
+		for(k=0;k<5;k++) Py_XDECREF(field_arrays[k]);
+		Py_XDECREF(edges_array);
+		return NULL;
+	}
+
+	long Npixel = (long)PyArray_SIZE((PyArrayObject *)field_arrays[0]);
+	int Nbins = (edges_array==NULL) ? 0 : (int)PyArray_DIM(edges_array,0) - 1;
+
+	/*Prepare the outputs: histogram counts and power sums*/
+	npy_intp hist_dims[] = {(npy_intp) (Nbins>0 ? Nbins : 0)};
+	npy_intp sums_dims[] = {(npy_intp) ACC_NSUMS};
+	PyObject *hist_array = PyArray_ZEROS(1,hist_dims,NPY_DOUBLE,0);
+	PyObject *sums_array = PyArray_ZEROS(1,sums_dims,NPY_DOUBLE,0);
+
+	if(hist_array==NULL || sums_array==NULL){
+		for(k=0;k<5;k++) Py_DECREF(field_arrays[k]);
+		Py_XDECREF(edges_array);
+		Py_XDECREF(hist_array);
+		Py_XDECREF(sums_array);
+		return NULL;
+	}
+
+	/*Call the C backend, other threads can run in the meantime*/
+	Py_BEGIN_ALLOW_THREADS
+	accumulate_fields((double *)PyArray_DATA(field_arrays[0]),(double *)PyArray_DATA(field_arrays[1]),(double *)PyArray_DATA(field_arrays[2]),(double *)PyArray_DATA(field_arrays[3]),(double *)PyArray_DATA(field_arrays[4]),0,Npixel,Nbins,(edges_array==NULL) ? NULL : (double *)PyArray_DATA(edges_array),uniform,(double *)PyArray_DATA(hist_array),(double *)PyArray_DATA(sums_array));
+	Py_END_ALLOW_THREADS
+
+	//Cleanup
+	for(k=0;k<5;k++) Py_DECREF(field_arrays[k]);
+	Py_XDECREF(edges_array);
+
+	/*Output (histogram,sums)*/
+	PyObject *output = Py_BuildValue("NN",hist_array,sums_array);
+	return output;
+
+}
+
+//sample() implementation
+static PyObject *_topology_sample(PyObject *self,PyObject *args){
+
+	PyObject *layers_obj,*x_obj,*y_obj,*values_obj;
+	int method;
+	long start,stop;
+
+	/*Parse the input: map layers (Nlayers,Ny,Nx), coordinates in pixel units, interpolation method, output array (Nlayers,Npoints) and range of points to process*/
+	if(!PyArg_ParseTuple(args,"OOOiOll",&layers_obj,&x_obj,&y_obj,&method,&values_obj,&start,&stop)){
+		return NULL;
+	}
+
+	/*The output array is filled in place, so it must be already well behaved*/
+	if(!PyArray_Check(values_obj) || PyArray_TYPE((PyArrayObject *)values_obj)!=NPY_DOUBLE || !PyArray_ISCARRAY((PyArrayObject *)values_obj)){
+		PyErr_SetString(PyExc_TypeError,"The output must be a C contiguous, writeable array of doubles");
+		return NULL;
+	}
+
+	/*Interpret the inputs as numpy arrays*/
+	PyObject *layers_array = PyArray_FROM_OTF(layers_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *x_array = PyArray_FROM_OTF(x_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+	PyObject *y_array = PyArray_FROM_OTF(y_obj,NPY_DOUBLE,NPY_IN_ARRAY);
+
+	if(layers_array==NULL || x_array==NULL || y_array==NULL){
+		Py_XDECREF(layers_array);
+		Py_XDECREF(x_array);
+		Py_XDECREF(y_array);
+		return NULL;
+	}
+
+	/*Get the dimensions*/
+	int Nlayers = (int)PyArray_DIM(layers_array,0);
+	long size_y = (long)PyArray_DIM(layers_array,1);
+	long size_x = (long)PyArray_DIM(layers_array,2);
+	long Npoints = (long)PyArray_SIZE(x_array);
+
+	if(PyArray_SIZE(y_array)!=Npoints || PyArray_SIZE((PyArrayObject *)values_obj)!=Nlayers*Npoints){
+		Py_DECREF(layers_array);
+		Py_DECREF(x_array);
+		Py_DECREF(y_array);
+		PyErr_SetString(PyExc_ValueError,"Coordinates and output sizes do not match");
+		return NULL;
+	}
+
+	if(start<0) start = 0;
+	if(stop>Npoints) stop = Npoints;
+
+	/*Call the C backend, other threads can run in the meantime*/
+	Py_BEGIN_ALLOW_THREADS
+	sample_map((double *)PyArray_DATA(layers_array),Nlayers,size_y,size_x,(double *)PyArray_DATA(x_array),(double *)PyArray_DATA(y_array),Npoints,start,stop,method,(double *)PyArray_DATA((PyArrayObject *)values_obj));
+	Py_END_ALLOW_THREADS
+
+	//Cleanup
+	Py_DECREF(layers_array);
+	Py_DECREF(x_array);
+	Py_DECREF(y_array);
+
+	Py_RETURN_NONE;
+
+}
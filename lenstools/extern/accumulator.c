@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "accumulator.h"
+
+//Index of the pixel displaced by (dx,dy) from (i,j), with periodic boundary conditions looked up in the wrap table
+#define PIX(dx,dy) (wrap[j+(dy)+2]*map_size + wrap[i+(dx)+2])
+
+//find the bin x falls in (same convention as numpy.histogram: the last bin is closed on the right); returns -1 if x is out of range
+static int find_bin(double x,int Nbins,double *edges,int uniform){
+
+	int low=0,high=Nbins,mid;
+
+	if(!(x>=edges[0] && x<=edges[Nbins])) return -1;
+	if(x==edges[Nbins]) return Nbins-1;
+
+	//Uniform bins: direct lookup, corrected for roundoff
+	if(uniform){
+
+		low = (int)((x-edges[0])/(edges[1]-edges[0]));
+		if(low>Nbins-1) low = Nbins-1;
+		while(low>0 && x<edges[low]) low--;
+		while(low<Nbins-1 && x>=edges[low+1]) low++;
+		return low;
+
+	}
+
+	//Arbitrary bins: binary search on the edges
+	while(high-low>1){
+		mid = (low+high)/2;
+		if(x>=edges[mid]) low=mid;
+		else high=mid;
+	}
+
+	return low;
+
+}
+
+/*this routine accumulates, in a single pass over the rows [row_start,row_stop) of a (possibly masked) map, the histogram of the
+unmasked pixel values and the power sums of the pixel values, gradients and laplacians needed for the mean, variance and the
+cubic and quartic moments; the derivatives are computed on the fly with the same stencils as gradient_xy and hessian, and only the
+pixels whose stencils do not touch the masked region contribute to the moment sums. Results are added to hist and sums, so partial
+accumulations over tiles or maps can be merged by summation. Returns 0 on success, -1 if memory allocation fails*/
+int accumulate_map(double *map,unsigned char *mask,long map_size,long row_start,long row_stop,int Nbins,double *edges,int uniform,int derivatives,double *hist,double *sums){
+
+	long i,j,p;
+	int b;
+	double d,gx,gy,grad2,lap;
+
+	//Wrapped coordinates, so that no modulo operation is needed inside the loop
+	long *wrap = (long *)malloc(sizeof(long)*(map_size+4));
+	if(wrap==NULL) return -1;
+	for(i=0;i<map_size+4;i++) wrap[i] = (i-2+2*map_size) % map_size;
+
+	for(j=row_start;j<row_stop;j++){
+		for(i=0;i<map_size;i++){
+
+			p = j*map_size + i;
+			if(mask!=NULL && !mask[p]) continue;
+
+			d = map[p];
+
+			//One point statistics of the unmasked pixels
+			sums[ACC_NPIX] += 1.0;
+			sums[ACC_PIX_SUM] += d;
+			sums[ACC_PIX_SUM2] += d*d;
+
+			if(Nbins>0){
+				b = find_bin(d,Nbins,edges,uniform);
+				if(b>=0) hist[b] += 1.0;
+			}
+
+			if(!derivatives) continue;
+
+			//Skip the pixels whose gradient or hessian stencils touch the masked region
+			if(mask!=NULL){
+				if(!(mask[PIX(1,0)] && mask[PIX(-1,0)] && mask[PIX(0,1)] && mask[PIX(0,-1)])) continue;
+				if(!(mask[PIX(2,0)] && mask[PIX(-2,0)] && mask[PIX(0,2)] && mask[PIX(0,-2)])) continue;
+				if(!(mask[PIX(1,1)] && mask[PIX(-1,-1)] && mask[PIX(-1,1)] && mask[PIX(1,-1)])) continue;
+			}
+
+			//Derivatives on the fly
+			gx = (map[PIX(1,0)]-map[PIX(-1,0)])/2.0;
+			gy = (map[PIX(0,1)]-map[PIX(0,-1)])/2.0;
+			lap = (map[PIX(2,0)]+map[PIX(-2,0)]+map[PIX(0,2)]+map[PIX(0,-2)]-4*d)/4.0;
+			grad2 = gx*gx + gy*gy;
+
+			//Power sums
+			sums[ACC_NVALID] += 1.0;
+			sums[ACC_SUM] += d;
+			sums[ACC_SUM2] += d*d;
+			sums[ACC_SUM3] += d*d*d;
+			sums[ACC_SUM4] += d*d*d*d;
+			sums[ACC_GRAD2] += grad2;
+			sums[ACC_SUM2_LAP] += d*d*lap;
+			sums[ACC_GRAD2_LAP] += grad2*lap;
+			sums[ACC_SUM3_LAP] += d*d*d*lap;
+			sums[ACC_SUM_GRAD2_LAP] += d*grad2*lap;
+			sums[ACC_GRAD4] += grad2*grad2;
+
+		}
+	}
+
+	free(wrap);
+	return 0;
+
+}
+
+#undef PIX
+
+/*same as accumulate_map, but for the pixels [start,stop) of a map whose gradient and hessian have already been computed (e.g. in Fourier space);
+all the sums are accumulated in a single pass over the fields, without any temporary arrays*/
+void accumulate_fields(double *map,double *gx,double *gy,double *hxx,double *hyy,long start,long stop,int Nbins,double *edges,int uniform,double *hist,double *sums){
+
+	long p;
+	int b;
+	double d,grad2,lap;
+
+	for(p=start;p<stop;p++){
+
+		d = map[p];
+		grad2 = gx[p]*gx[p] + gy[p]*gy[p];
+		lap = hxx[p] + hyy[p];
+
+		if(Nbins>0){
+			b = find_bin(d,Nbins,edges,uniform);
+			if(b>=0) hist[b] += 1.0;
+		}
+
+		//Every pixel has valid derivatives, so the one point and the moment sums coincide
+		sums[ACC_NPIX] += 1.0;
+		sums[ACC_PIX_SUM] += d;
+		sums[ACC_PIX_SUM2] += d*d;
+		sums[ACC_NVALID] += 1.0;
+		sums[ACC_SUM] += d;
+		sums[ACC_SUM2] += d*d;
+		sums[ACC_SUM3] += d*d*d;
+		sums[ACC_SUM4] += d*d*d*d;
+		sums[ACC_GRAD2] += grad2;
+		sums[ACC_SUM2_LAP] += d*d*lap;
+		sums[ACC_GRAD2_LAP] += grad2*lap;
+		sums[ACC_SUM3_LAP] += d*d*d*lap;
+		sums[ACC_SUM_GRAD2_LAP] += d*grad2*lap;
+		sums[ACC_GRAD4] += grad2*grad2;
+
+	}
+
+}
@@ -0,0 +1,24 @@
+#ifndef __ACCUMULATOR_H
+#define __ACCUMULATOR_H
+
+//Layout of the power sums accumulated by accumulate_map
+#define ACC_NPIX 0
+#define ACC_PIX_SUM 1
+#define ACC_PIX_SUM2 2
+#define ACC_NVALID 3
+#define ACC_SUM 4
+#define ACC_SUM2 5
+#define ACC_SUM3 6
+#define ACC_SUM4 7
+#define ACC_GRAD2 8
+#define ACC_SUM2_LAP 9
+#define ACC_GRAD2_LAP 10
+#define ACC_SUM3_LAP 11
+#define ACC_SUM_GRAD2_LAP 12
+#define ACC_GRAD4 13
+#define ACC_NSUMS 14
+
+int accumulate_map(double *map,unsigned char *mask,long map_size,long row_start,long row_stop,int Nbins,double *edges,int uniform,int derivatives,double *hist,double *sums);
+void accumulate_fields(double *map,double *gx,double *gy,double *hxx,double *hyy,long start,long stop,int Nbins,double *edges,int uniform,double *hist,double *sums);
+
+#endif
@@ -125,6 +125,74 @@ int azimuthal_rfft2(double _Complex *ft_map1,double _Complex *ft_map2,long size_
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
+/*Accumulate the EE,BB,EB power spectra of a shear map in multipole bins, from the real Fourier transforms of its two components: the rotation
+to E and B modes is done on the fly, pixel by pixel. bins holds the precomputed multipole bin of each pixel (-1 if out of range); the binned
+sums are added to power_ee,power_bb,power_eb without normalization*/
+void azimuthal_rfft2_eb(double _Complex *ft_gamma1,double _Complex *ft_gamma2,double *cos_2_phi,double *sin_2_phi,int *bins,long Npixels,double *scale,double *power_ee,double *power_bb,double *power_eb){
+
+	long p;
+	int b;
+	double _Complex ft_E,ft_B;
+	double w;
+
+	for(p=0;p<Npixels;p++){
+
+		b = bins[p];
+		if(b<0) continue;
+
+		ft_E = cos_2_phi[p]*ft_gamma1[p] + sin_2_phi[p]*ft_gamma2[p];
+		ft_B = -sin_2_phi[p]*ft_gamma1[p] + cos_2_phi[p]*ft_gamma2[p];
+		w = scale ? scale[p] : 1.0;
+
+		power_ee[b] += w*(creal(ft_E)*creal(ft_E) + cimag(ft_E)*cimag(ft_E));
+		power_bb[b] += w*(creal(ft_B)*creal(ft_B) + cimag(ft_B)*cimag(ft_B));
+		power_eb[b] += w*(creal(ft_E)*creal(ft_B) + cimag(ft_E)*cimag(ft_B));
+
+	}
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/*Accumulate all the auto and cross power spectra of Nmaps maps in multipole bins, in a single pass over the pixels [start,stop) of their
+real Fourier transforms (stored contiguously, one map after the other). bins holds the precomputed multipole bin of each pixel (-1 if
+out of range); the sums for the pair (i,j), i<=j, are added without normalization to row i*Nmaps - i*(i-1)/2 + (j-i) of power*/
+void azimuthal_rfft2_multi(double _Complex *ft_maps,int Nmaps,long Npixels,long start,long stop,int *bins,int Nbins,double *scale,double *power){
+
+	long p;
+	int b,i,j,pair;
+	double w;
+	double _Complex *ft_i,*ft_j;
+
+	for(p=start;p<stop;p++){
+
+		b = bins[p];
+		if(b<0) continue;
+
+		w = scale ? scale[p] : 1.0;
+		pair = 0;
+
+		for(i=0;i<Nmaps;i++){
+
+			ft_i = ft_maps + i*Npixels + p;
+
+			for(j=i;j<Nmaps;j++){
+
+				ft_j = ft_maps + j*Npixels + p;
+				power[pair*Nbins + b] += w*(creal(*ft_i)*creal(*ft_j) + cimag(*ft_i)*cimag(*ft_j));
+				pair++;
+
+			}
+		}
+
+	}
+
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
 /*General bispectrum calculator*/
 int bispectrum(double _Complex *ft_map1,double _Complex *ft_map2,double _Complex *ft_map3,long size_x,long size_y,double map_angle_degrees,int Nvalues,double *lvalues,double *bispectrum_l,int (*k1tok2)(int,int,int*,int*,void*),void *args){
 
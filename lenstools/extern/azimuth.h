@@ -4,6 +4,8 @@
 #include <complex.h>
 
 int azimuthal_rfft2(double _Complex *ft_map1,double _Complex *ft_map2,long size_x,long size_y,double map_angle_degrees,int Nvalues,double *lvalues,double *power_l,double *scale);
+void azimuthal_rfft2_eb(double _Complex *ft_gamma1,double _Complex *ft_gamma2,double *cos_2_phi,double *sin_2_phi,int *bins,long Npixels,double *scale,double *power_ee,double *power_bb,double *power_eb);
+void azimuthal_rfft2_multi(double _Complex *ft_maps,int Nmaps,long Npixels,long start,long stop,int *bins,int Nbins,double *scale,double *power);
 int azimuthal_rfft3(double _Complex *ft_map1,double _Complex *ft_map2,long size_x,long size_y,long size_z,double kpixX,double kpixY,double kpixZ,int Nvalues,double *kvalues,double *power_k,long *hits);
 
 int bispectrum(double _Complex *ft_map1,double _Complex *ft_map2,double _Complex *ft_map3,long size_x,long size_y,double map_angle_degrees,int Nvalues,double *lvalues,double *bispectrum_l,int (*k1tok2)(int,int,int*,int*,void*),void *args);
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "coordinates.h"
+#include "differentials.h"
 
 void gradient_xy(double *map,double *grad_map_x,double *grad_map_y,long map_size,int Npoints,int *x_points,int *y_points){
 	
@@ -125,4 +126,74 @@ void gradLaplacian(double *map,double *grad_map_x,double *grad_map_y,long map_si
 
 
 	}
-}
\ No newline at end of file
+}
+
+/*this routine checks, in a single pass over a masked map, which pixels have derivative stencils (gradient, hessian, gradient
+of the laplacian) that touch masked pixels, and records the outcome in flags; the value, gradient and hessian of the pixels whose
+gradient and hessian stencils lie entirely in the unmasked region are written in compacted form (one entry per valid pixel, in
+increasing pixel index order). No NaN arithmetic is involved. Returns the number of valid pixels, or -1 if memory allocation fails*/
+
+//Index of the pixel displaced by (dx,dy) from (i,j), with periodic boundary conditions looked up in the wrap table
+#define PIX(dx,dy) (wrap[j+(dy)+3]*map_size + wrap[i+(dx)+3])
+
+long masked_derivatives(double *map,unsigned char *mask,long map_size,unsigned char *flags,long *pixels,double *values,double *grad_x,double *grad_y,double *hess_xx,double *hess_yy,double *hess_xy){
+
+	long i,j,p,n=0;
+	unsigned char f;
+
+	//Wrapped coordinates, so that no modulo operation is needed inside the loop
+	long *wrap = (long *)malloc(sizeof(long)*(map_size+6));
+	if(wrap==NULL) return -1;
+	for(i=0;i<map_size+6;i++) wrap[i] = (i-3+2*map_size) % map_size;
+
+	for(j=0;j<map_size;j++){
+		for(i=0;i<map_size;i++){
+
+			p = j*map_size + i;
+
+			if(!mask[p]){
+				flags[p] = STENCIL_MASKED;
+				continue;
+			}
+
+			f = 0;
+
+			//Gradient footprint
+			if(!(mask[PIX(1,0)] && mask[PIX(-1,0)] && mask[PIX(0,1)] && mask[PIX(0,-1)])) f |= STENCIL_GRADIENT;
+
+			//Hessian footprint
+			if(!(mask[PIX(2,0)] && mask[PIX(-2,0)] && mask[PIX(0,2)] && mask[PIX(0,-2)])) f |= STENCIL_HESSIAN;
+			if(!(mask[PIX(1,1)] && mask[PIX(-1,-1)] && mask[PIX(-1,1)] && mask[PIX(1,-1)])) f |= STENCIL_HESSIAN;
+
+			//Gradient of the laplacian footprint
+			if(!(mask[PIX(3,0)] && mask[PIX(-3,0)] && mask[PIX(0,3)] && mask[PIX(0,-3)])) f |= STENCIL_GRADLAPLACIAN;
+			if(!(mask[PIX(1,2)] && mask[PIX(1,-2)] && mask[PIX(-1,2)] && mask[PIX(-1,-2)])) f |= STENCIL_GRADLAPLACIAN;
+			if(!(mask[PIX(2,1)] && mask[PIX(-2,1)] && mask[PIX(2,-1)] && mask[PIX(-2,-1)])) f |= STENCIL_GRADLAPLACIAN;
+			if(f & STENCIL_GRADIENT) f |= STENCIL_GRADLAPLACIAN;
+
+			flags[p] = f;
+
+			//Derivatives of the valid pixels only
+			if(f & (STENCIL_GRADIENT | STENCIL_HESSIAN)) continue;
+
+			pixels[n] = p;
+			values[n] = map[p];
+
+			grad_x[n] = (map[PIX(1,0)]-map[PIX(-1,0)])/2.0;
+			grad_y[n] = (map[PIX(0,1)]-map[PIX(0,-1)])/2.0;
+
+			hess_xx[n] = (map[PIX(2,0)]+map[PIX(-2,0)]-2*map[p])/4.0;
+			hess_yy[n] = (map[PIX(0,2)]+map[PIX(0,-2)]-2*map[p])/4.0;
+			hess_xy[n] = (map[PIX(1,1)]+map[PIX(-1,-1)]-map[PIX(-1,1)]-map[PIX(1,-1)])/4.0;
+
+			n++;
+
+		}
+	}
+
+	free(wrap);
+	return n;
+
+}
+
+#undef PIX
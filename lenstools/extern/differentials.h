@@ -1,8 +1,15 @@
 #ifndef __DIFFERENTIALS_H
 #define __DIFFERENTIALS_H
 
+//Flags that mark which derivative stencils of a pixel touch the masked region
+#define STENCIL_MASKED 1
+#define STENCIL_GRADIENT 2
+#define STENCIL_HESSIAN 4
+#define STENCIL_GRADLAPLACIAN 8
+
 void gradient_xy(double *map,double *grad_map_x,double *grad_map_y,long map_size,int Npoints,int *x_points,int *y_points);
 void hessian(double *map,double *hess_xx_map,double *hess_yy_map,double *hess_xy_map,long map_size,int Npoints, int *x_points,int *y_points);
 void gradLaplacian(double *map,double *grad_map_x,double *grad_map_y,long map_size,int Npoints,int *x_points,int *y_points);
+long masked_derivatives(double *map,unsigned char *mask,long map_size,unsigned char *flags,long *pixels,double *values,double *grad_x,double *grad_y,double *hess_xx,double *hess_yy,double *hess_xy);
 
 #endif
\ No newline at end of file
@@ -31,15 +31,33 @@ struct io_header_1
 };
 
 
+//Byte layout of a snapshot file
+struct gadget_layout
+{
+  long pos_offset;
+  long vel_offset;
+  long id_offset;
+  long size;
+  int id_size;
+};
+
+
 //Methods
 int getHeader(FILE *fp,struct io_header_1 *header);
 int getPosVel(FILE *fp,long offset,float *data,int Npart);
 int getID(FILE *fp,long offset,int *data,int Npart);
-int writeSnapshot(FILE *fp,struct io_header_1 *header,float *positions,float *velocities,int firstID,int NumPart,int writeVel);
+int writeSnapshot(FILE *fp,struct io_header_1 *header,float *positions,float *velocities,long long firstID,int NumPart,int writeVel);
 
 int getHeaderFD(int fd,struct io_header_1 *header);
 int getPosVelFD(int fd,long offset,float *data,int Npart);
 int getIDFD(int fd,long offset,int *data,int Npart);
-int writeSnapshotFD(int fd,struct io_header_1 *header,float *positions,float *velocities,int firstID,int NumPart,int writeVel);
+int readBlockFD(int fd,long offset,void *data,size_t nbytes);
+int writeSnapshotFD(int fd,struct io_header_1 *header,float *positions,float *velocities,long long firstID,int NumPart,int writeVel);
+
+int snapshotIDSize(struct io_header_1 *header);
+void snapshotLayout(struct io_header_1 *header,long NumPart,int writeVel,struct gadget_layout *layout);
+int writeBlockFD(int fd,long offset,void *data,size_t nbytes);
+int writeHeaderFD(int fd,struct io_header_1 *header,long NumPart,int writeVel,struct gadget_layout *layout);
+int writeIDFD(int fd,long offset,long long firstID,long NumPart,int idSize);
 
 #endif
\ No newline at end of file
@@ -69,6 +69,79 @@ int grid2d(double *x,double *y,double *s,double *map,int Nobjects,int Npixel,dou
 }
 
 
+//Multi column two dimensional pixelization of a galaxy catalog
+/*this routine grids Ncolumns catalog quantities at once, together with the weighted and unweighted hit counts of each pixel; the objects in [start,stop)
+are assigned with nearest grid point (cic=0) or cloud in cell (cic=1) weights. Contributions are added to maps (Ncolumns x Npixel x Npixel),
+hits and counts (Npixel x Npixel), which must be initialized by the caller: this allows different threads to accumulate different
+object ranges in private buffers. weights can be NULL (all objects have unit weight); counts does not depend on the weights, and tells
+apart the pixels that no object falls into from the ones whose weights sum to zero*/
+void grid2d_multi(double *x,double *y,double **columns,int Ncolumns,double *weights,long start,long stop,int Npixel,double map_size,int cic,double *maps,double *hits,double *counts){
+
+	long n,p;
+	long map_pixels = (long)Npixel*Npixel;
+	int c,a,b,ip[2],jp[2];
+	double i,j,ti,tj,w,wp,fi[2],fj[2];
+	double inverse_resolution = Npixel/map_size;
+
+	for(n=start;n<stop;n++){
+
+		//Position on the grid: objects that do not land on the grid are skipped
+		i = x[n]*inverse_resolution;
+		j = y[n]*inverse_resolution;
+		if(!(i>=0 && i<Npixel && j>=0 && j<Npixel)) continue;
+
+		w = (weights==NULL) ? 1.0 : weights[n];
+
+		if(!cic){
+
+			p = (long)i*Npixel + (long)j;
+
+			hits[p] += w;
+			counts[p] += 1.0;
+			for(c=0;c<Ncolumns;c++) maps[c*map_pixels+p] += w*columns[c][n];
+
+			continue;
+
+		}
+
+		//Cloud in cell: share the object between the 4 pixels whose centers surround it (contributions off the grid are dropped)
+		i -= 0.5;
+		j -= 0.5;
+		ip[0] = (int)floor(i);
+		jp[0] = (int)floor(j);
+		ti = i - ip[0];
+		tj = j - jp[0];
+
+		ip[1] = ip[0] + 1;
+		jp[1] = jp[0] + 1;
+		fi[0] = 1.0 - ti;
+		fi[1] = ti;
+		fj[0] = 1.0 - tj;
+		fj[1] = tj;
+
+		for(a=0;a<2;a++){
+
+			if(ip[a]<0 || ip[a]>=Npixel) continue;
+
+			for(b=0;b<2;b++){
+
+				if(jp[b]<0 || jp[b]>=Npixel) continue;
+
+				p = (long)ip[a]*Npixel + jp[b];
+				wp = w*fi[a]*fj[b];
+
+				hits[p] += wp;
+				counts[p] += fi[a]*fj[b];
+				for(c=0;c<Ncolumns;c++) maps[c*map_pixels+p] += wp*columns[c][n];
+
+			}
+		}
+
+	}
+
+}
+
+
 //Snap particles on a 3d regularly spaced grid
 int grid3d(float *positions,float *weights,double *radius,double *concentration,int Npart,double leftX,double leftY,double leftZ,double sizeX,double sizeY,double sizeZ,int nx,int ny,int nz,float *grid,double(*kernel)(double,double,double,double)){
 
@@ -4,6 +4,7 @@
 #include <math.h>
 
 int grid2d(double *x,double *y,double *s,double *map,int Nobjects,int Npixel,double map_size);
+void grid2d_multi(double *x,double *y,double **columns,int Ncolumns,double *weights,long start,long stop,int Npixel,double map_size,int cic,double *maps,double *hits,double *counts);
 int grid3d(float *positions,float *weights,double *radius,double *concentration,int Npart,double leftX,double leftY,double leftZ,double sizeX,double sizeY,double sizeZ,int nx,int ny,int nz,float *grid,double(*kernel)(double,double,double,double));
 int adaptiveSmoothing(int NumPart,float *positions,float *weights,double *rp,double *concentration,double *binning0, double *binning1,double center,int direction0,int direction1,int normal,int size0,int size1,int projectAll,double *lensingPlane,double(*kernel)(double,double,double,double));
 
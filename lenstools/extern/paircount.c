@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "paircount.h"
+
+//Maximum number of cells per side of the cell list
+#define MAX_CELLS 1024
+
+//find the distance bin r falls in with a binary search on the bin edges; returns -1 if r is out of range. As in np.histogram, the last bin
+//is closed on the right
+static int find_bin(double r,int Nbins,double *edges){
+
+	int low=0,high=Nbins,mid;
+
+	if(r<edges[0] || r>edges[Nbins]) return -1;
+	if(r==edges[Nbins]) return Nbins-1;
+
+	while(high-low>1){
+		mid = (low+high)/2;
+		if(r>=edges[mid]) low=mid;
+		else high=mid;
+	}
+
+	return low;
+
+}
+
+//cell of a coordinate, wrapping it in the box if the boundary conditions are periodic
+static int find_cell(double x,double box,double cell_size,int Ncells,int periodic){
+
+	int c;
+
+	if(periodic){
+		x = fmod(x,box);
+		if(x<0) x+=box;
+	}
+
+	c = (int)floor(x/cell_size);
+	if(c<0) c=0;
+	if(c>=Ncells) c=Ncells-1;
+
+	return c;
+
+}
+
+//number of cells per side of the cell list for a box of size box and a maximum pair distance rmax: with periodic boundary conditions
+//at least 3 cells per side are needed to visit each neighbor once
+int cell_list_size(double box,double rmax){
+
+	int Ncells = (int)floor(box/rmax);
+	if(Ncells>MAX_CELLS) Ncells=MAX_CELLS;
+	if(Ncells<3) Ncells=1;
+
+	return Ncells;
+
+}
+
+/*this routine sorts the N2 points in a cell list of Ncells x Ncells cells with a counting sort: the indices of the points in cell c
+are sorted[cell_start[c]:cell_start[c+1]]. cell_start must have Ncells*Ncells+1 elements, sorted N2 elements. The cell list is only read
+by pair_count, so it can be shared between threads that process different ranges of the first point set*/
+int build_cell_list(double *points2,long N2,double box,int Ncells,int periodic,long *cell_start,long *sorted){
+
+	long j,cell;
+	double cell_size = box/Ncells;
+	long *cell_fill = (long *)calloc((size_t)Ncells*Ncells,sizeof(long));
+
+	if(cell_fill==NULL) return -1;
+
+	for(cell=0;cell<=(long)Ncells*Ncells;cell++) cell_start[cell]=0;
+
+	for(j=0;j<N2;j++){
+		cell = find_cell(points2[2*j],box,cell_size,Ncells,periodic)*Ncells + find_cell(points2[2*j+1],box,cell_size,Ncells,periodic);
+		cell_start[cell+1]++;
+	}
+
+	for(cell=0;cell<(long)Ncells*Ncells;cell++) cell_start[cell+1]+=cell_start[cell];
+
+	for(j=0;j<N2;j++){
+		cell = find_cell(points2[2*j],box,cell_size,Ncells,periodic)*Ncells + find_cell(points2[2*j+1],box,cell_size,Ncells,periodic);
+		sorted[cell_start[cell]+cell_fill[cell]] = j;
+		cell_fill[cell]++;
+	}
+
+	free(cell_fill);
+	return 0;
+
+}
+
+/*this routine counts the pairs between the points of the first set with index in [start,stop) and all the points of the second set,
+binning them in distance and in the labels of the two points (for example the threshold bin of a peak); points2 are sorted in a cell list
+(built with build_cell_list) of cell size at least equal to the maximum distance, so that only the neighboring cells need to be visited.
+If autocorr is set, the two sets are the same and each pair is counted once. Points with negative labels are skipped. The counts are added
+to the counts array, which has shape (Nlabels1,Nlabels2,Nbins); returns -1 without counting if the range or the labels do not fit in it*/
+int pair_count(double *points1,int *labels1,long N1,int Nlabels1,double *points2,int *labels2,long N2,int Nlabels2,int autocorr,long start,long stop,double box,int periodic,int Ncells,long *cell_start,long *sorted,int Nbins,double *edges,double *counts){
+
+	int cx,cy,dx,dy,nx,ny,ncx,ncy,b,Nneighbors;
+	long i,j,k,cell;
+	double cell_size,xi,yi,sx,sy,r;
+
+	//Check the range and the labels, which are used to index the counts
+	if(start<0 || start>stop || stop>N1) return -1;
+	
+	for(i=start;i<stop;i++){
+		if(labels1[i]>=Nlabels1) return -1;
+	}
+
+	for(j=0;j<N2;j++){
+		if(labels2[j]>=Nlabels2) return -1;
+	}
+
+	cell_size = box/Ncells;
+	Nneighbors = (Ncells==1) ? 0 : 1;
+
+	//Count the pairs
+	for(i=start;i<stop;i++){
+
+		if(labels1[i]<0) continue;
+
+		xi = points1[2*i];
+		yi = points1[2*i+1];
+		cx = find_cell(xi,box,cell_size,Ncells,periodic);
+		cy = find_cell(yi,box,cell_size,Ncells,periodic);
+
+		for(dx=-Nneighbors;dx<=Nneighbors;dx++){
+			for(dy=-Nneighbors;dy<=Nneighbors;dy++){
+
+				nx = cx+dx;
+				ny = cy+dy;
+
+				if(periodic){
+					ncx = (nx+Ncells)%Ncells;
+					ncy = (ny+Ncells)%Ncells;
+				} else{
+					if(nx<0 || nx>=Ncells || ny<0 || ny>=Ncells) continue;
+					ncx = nx;
+					ncy = ny;
+				}
+
+				cell = (long)ncx*Ncells + ncy;
+
+				for(k=cell_start[cell];k<cell_start[cell+1];k++){
+
+					j = sorted[k];
+					if((autocorr && j<=i) || labels2[j]<0) continue;
+
+					//Minimum image separation
+					sx = xi - points2[2*j];
+					sy = yi - points2[2*j+1];
+
+					if(periodic){
+						sx -= box*floor(sx/box+0.5);
+						sy -= box*floor(sy/box+0.5);
+					}
+
+					r = sqrt(sx*sx+sy*sy);
+					b = find_bin(r,Nbins,edges);
+					
+					if(b>=0){
+						counts[((long)labels1[i]*Nlabels2 + labels2[j])*Nbins + b] += 1.0;
+					}
+
+				}
+
+			}
+		}
+
+	}
+
+	return 0;
+
+}
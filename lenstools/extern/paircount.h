@@ -0,0 +1,8 @@
+#ifndef __PAIRCOUNT_H
+#define __PAIRCOUNT_H
+
+int cell_list_size(double box,double rmax);
+int build_cell_list(double *points2,long N2,double box,int Ncells,int periodic,long *cell_start,long *sorted);
+int pair_count(double *points1,int *labels1,long N1,int Nlabels1,double *points2,int *labels2,long N2,int Nlabels2,int autocorr,long start,long stop,double box,int periodic,int Ncells,long *cell_start,long *sorted,int Nbins,double *edges,double *counts);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "gadget2.h"
@@ -7,15 +8,11 @@
 binary file format*/
 int getPosVel(FILE *fp,long offset,float *data,int Npart){
 
-	int n;
-
 	/*First offset the file pointer to go to where the first particle is*/
 	if(fseek(fp,offset,SEEK_SET)) return -1;
 
-	/*Next read the particle positions or velocities in the data array*/
-	for(n=0;n<Npart;n++){
-		if(fread(&data[3*n],sizeof(float),3,fp)!=3) return -1;
-	}
+	/*Next read the particle positions or velocities in the data array, all in one go*/
+	if(fread(data,sizeof(float)*3,Npart,fp)!=(size_t)Npart) return -1;
 
 	return 0;
 
@@ -23,32 +20,19 @@ int getPosVel(FILE *fp,long offset,float *data,int Npart){
 
 int getPosVelFD(int fd,long offset,float *data,int Npart){
 
-	int n;
-
-	/*First offset the file pointer to go to where the first particle is*/
-	if(lseek(fd,offset,SEEK_SET)!=offset) return -1;
-
-	/*Read the particle positions or velocities in the data array*/
-	for(n=0;n<Npart;n++){
-		if(read(fd,&data[3*n],sizeof(float)*3)!=sizeof(float)*3) return -1;
-	}
-
-	return 0;
+	/*Read the particle positions or velocities in the data array with a bulk read*/
+	return readBlockFD(fd,offset,data,sizeof(float)*3*(size_t)Npart);
 
 }
 
 /*this routine loads in particle IDs (4 byte ints) from Gadget's default binary file format*/
 int getID(FILE *fp,long offset,int *data,int Npart){
 
-	int n;
-
 	/*First offset the file pointer to go to where the first particle is*/
 	if(fseek(fp,offset,SEEK_SET)) return -1;
 
-	/*Next read the particle positions or velocities in the data array*/
-	for(n=0;n<Npart;n++){
-		if(fread(&data[n],sizeof(int),1,fp)!=1) return -1;
-	}
+	/*Next read the particle IDs in the data array, all in one go*/
+	if(fread(data,sizeof(int),Npart,fp)!=(size_t)Npart) return -1;
 
 	return 0;
 
@@ -56,14 +40,29 @@ int getID(FILE *fp,long offset,int *data,int Npart){
 
 int getIDFD(int fd,long offset,int *data,int Npart){
 
-	int n;
+	/*Read the particle IDs in the data array with a bulk read*/
+	return readBlockFD(fd,offset,data,sizeof(int)*(size_t)Npart);
 
-	/*First offset the file pointer to go to where the first particle is*/
-	if(lseek(fd,offset,SEEK_SET)!=offset) return -1;
+}
+
+/*this routine reads nbytes contiguous bytes, starting at offset, into data; it uses pread so the file pointer
+is not moved, which makes it safe to call concurrently from different threads*/
+int readBlockFD(int fd,long offset,void *data,size_t nbytes){
+
+	char *buf = (char *)data;
+	ssize_t nread;
+
+	while(nbytes>0){
+
+		nread = pread(fd,buf,nbytes,(off_t)offset);
+		
+		if(nread<0 && errno==EINTR) continue;
+		if(nread<=0) return -1;
+
+		buf += nread;
+		offset += nread;
+		nbytes -= (size_t)nread;
 
-	/*Read the particle positions or velocities in the data array*/
-	for(n=0;n<Npart;n++){
-		if(read(fd,&data[n],sizeof(int))!=sizeof(int)) return -1;
 	}
 
 	return 0;
@@ -0,0 +1,111 @@
+#include <math.h>
+
+#include "sampler.h"
+
+//wrap a pixel index in [0,n) (periodic boundary conditions)
+static inline long wrap_index(long i,long n){
+
+	i %= n;
+	return (i<0) ? i+n : i;
+
+}
+
+//Catmull-Rom cubic convolution weights of the 4 nodes around a point at fractional position t
+static inline void cubic_weights(double t,double *w){
+
+	w[0] = ((-0.5*t + 1.0)*t - 0.5)*t;
+	w[1] = (1.5*t - 2.5)*t*t + 1.0;
+	w[2] = ((-1.5*t + 2.0)*t + 0.5)*t;
+	w[3] = (0.5*t - 0.5)*t*t;
+
+}
+
+/*this routine samples Nlayers maps (stored one after the other, each of shape size_y x size_x) at the points [start,stop), whose
+coordinates x,y are given in pixel units (pixel (i,j) covers [j,j+1)x[i,i+1)); periodic boundary conditions are enforced. method is
+one of SAMPLE_NEAREST (value of the pixel that contains the point), SAMPLE_BILINEAR, SAMPLE_BICUBIC (Catmull-Rom), the latter two
+interpolating between the pixel centers. The sampled
+values are written in values, which has shape Nlayers x Npoints*/
+void sample_map(double *layers,int Nlayers,long size_y,long size_x,double *x,double *y,long Npoints,long start,long stop,int method,double *values){
+
+	long p,i0,j0,rows[4],cols[4];
+	long layer_size = size_x*size_y;
+	int l,a,b;
+	double u,v,tx,ty,wx[4],wy[4],s,*map;
+
+	for(p=start;p<stop;p++){
+
+		u = x[p];
+		v = y[p];
+
+		//Invalid coordinates give invalid values
+		if(isnan(u) || isnan(v)){
+			for(l=0;l<Nlayers;l++) values[l*Npoints+p] = NAN;
+			continue;
+		}
+
+		//Interpolation nodes sit at the pixel centers
+		if(method!=SAMPLE_NEAREST){
+			u -= 0.5;
+			v -= 0.5;
+		}
+
+		j0 = (long)floor(u);
+		i0 = (long)floor(v);
+		tx = u - j0;
+		ty = v - i0;
+
+		switch(method){
+
+			case SAMPLE_BILINEAR:
+
+				rows[0] = wrap_index(i0,size_y)*size_x;
+				rows[1] = wrap_index(i0+1,size_y)*size_x;
+				cols[0] = wrap_index(j0,size_x);
+				cols[1] = wrap_index(j0+1,size_x);
+
+				for(l=0;l<Nlayers;l++){
+					map = layers + l*layer_size;
+					values[l*Npoints+p] = (1.0-ty)*((1.0-tx)*map[rows[0]+cols[0]] + tx*map[rows[0]+cols[1]]) + ty*((1.0-tx)*map[rows[1]+cols[0]] + tx*map[rows[1]+cols[1]]);
+				}
+
+				break;
+
+			case SAMPLE_BICUBIC:
+
+				cubic_weights(tx,wx);
+				cubic_weights(ty,wy);
+
+				for(a=0;a<4;a++){
+					rows[a] = wrap_index(i0+a-1,size_y)*size_x;
+					cols[a] = wrap_index(j0+a-1,size_x);
+				}
+
+				for(l=0;l<Nlayers;l++){
+
+					map = layers + l*layer_size;
+					s = 0.0;
+
+					for(a=0;a<4;a++){
+						for(b=0;b<4;b++){
+							s += wy[a]*wx[b]*map[rows[a]+cols[b]];
+						}
+					}
+
+					values[l*Npoints+p] = s;
+
+				}
+
+				break;
+
+			default:
+
+				rows[0] = wrap_index(i0,size_y)*size_x;
+				cols[0] = wrap_index(j0,size_x);
+
+				for(l=0;l<Nlayers;l++) values[l*Npoints+p] = layers[l*layer_size+rows[0]+cols[0]];
+
+		}
+
+	}
+
+}
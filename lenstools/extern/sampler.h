@@ -0,0 +1,11 @@
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+
+//Interpolation methods
+#define SAMPLE_NEAREST 0
+#define SAMPLE_BILINEAR 1
+#define SAMPLE_BICUBIC 2
+
+void sample_map(double *layers,int Nlayers,long size_y,long size_x,double *x,double *y,long Npoints,long start,long stop,int method,double *values);
+
+#endif
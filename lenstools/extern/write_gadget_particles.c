@@ -1,96 +1,219 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "gadget2.h"
 
+//Number of particle IDs that are generated and written in a single call
+#define ID_BUFFER_SIZE 1048576
+
+/*this routine decides the size of the particle IDs: 8 byte ints are needed if the total number of particles does not fit in 32 bits*/
+int snapshotIDSize(struct io_header_1 *header){
+
+	int k;
+
+	for(k=0;k<6;k++){
+		if(header->npartTotalHighWord[k]) return 8;
+	}
+
+	return 4;
+
+}
+
+/*this routine computes where each block of a snapshot with NumPart particles starts; every block is a proper Fortran
+record, i.e. it is enclosed by two 4 byte markers that contain the byte length of the block*/
+void snapshotLayout(struct io_header_1 *header,long NumPart,int writeVel,struct gadget_layout *layout){
+
+	layout->id_size = snapshotIDSize(header);
+
+	layout->pos_offset = 4 + sizeof(struct io_header_1) + 4 + 4;
+	layout->vel_offset = layout->pos_offset + 3*sizeof(float)*NumPart + 4 + 4;
+	layout->id_offset = layout->vel_offset + 3*sizeof(float)*NumPart + 4 + 4;
+
+	if(writeVel){
+		layout->size = layout->id_offset + layout->id_size*NumPart + 4;
+	} else{
+		layout->size = layout->pos_offset + 3*sizeof(float)*NumPart + 4;
+	}
+
+}
+
+/*this routine fills a buffer with n consecutive particle IDs (4 or 8 byte ints), starting from firstID*/
+static int fillIDs(void *buffer,int idSize,long long firstID,long n){
+
+	long k;
+
+	if(idSize==8){
+		long long *ids = (long long *)buffer;
+		for(k=0;k<n;k++) ids[k] = firstID + k;
+	} else{
+		unsigned int *ids = (unsigned int *)buffer;
+		for(k=0;k<n;k++) ids[k] = (unsigned int)(firstID + k);
+	}
+
+	return 0;
+
+}
+
 /*this routine writes particle positions and velocities to a snapshot in Gadget's default
 binary file format*/
-int writeSnapshot(FILE *fp,struct io_header_1 *header,float *positions,float *velocities,int firstID,int NumPart,int writeVel){
+int writeSnapshot(FILE *fp,struct io_header_1 *header,float *positions,float *velocities,long long firstID,int NumPart,int writeVel){
 
-	int k,id,garbage=256;
+	int headerSize=sizeof(struct io_header_1);
+	unsigned int posvelSize=(unsigned int)(3*sizeof(float)*NumPart);
+	unsigned int idSize;
+	long n,chunk;
+	void *buffer;
 
-	//the first 4 bytes are for endianness check
-	if(fwrite(&garbage,sizeof(int),1,fp)!=1) return -1;
+	struct gadget_layout layout;
+	snapshotLayout(header,NumPart,writeVel,&layout);
+	idSize = (unsigned int)(layout.id_size*NumPart);
 
-	//the header comes next
+	//the header comes first (the first marker is used for the endianness check)
+	if(fwrite(&headerSize,sizeof(int),1,fp)!=1) return -1;
 	if(fwrite(header,sizeof(struct io_header_1),1,fp)!=1) return -1;
-
-	//the next 8 bytes are garbage
-	if(fwrite(&garbage,sizeof(int),1,fp)!=1) return -1;
-	if(fwrite(&garbage,sizeof(int),1,fp)!=1) return -1;
+	if(fwrite(&headerSize,sizeof(int),1,fp)!=1) return -1;
 
 	//positions come next
+	if(fwrite(&posvelSize,sizeof(int),1,fp)!=1) return -1;
 	if(fwrite(positions,sizeof(float)*3,NumPart,fp)!=NumPart) return -1;
+	if(fwrite(&posvelSize,sizeof(int),1,fp)!=1) return -1;
 
-	//if writeVel is set, only the positions are written, and we stop here
+	//if writeVel is not set, only the positions are written, and we stop here
 	if(!writeVel) return 0;
 
-	//the next 8 bytes are garbage
-	if(fwrite(&garbage,sizeof(int),1,fp)!=1) return -1;
-	if(fwrite(&garbage,sizeof(int),1,fp)!=1) return -1;
-
 	//velocities come next
+	if(fwrite(&posvelSize,sizeof(int),1,fp)!=1) return -1;
 	if(fwrite(velocities,sizeof(float)*3,NumPart,fp)!=NumPart) return -1;
+	if(fwrite(&posvelSize,sizeof(int),1,fp)!=1) return -1;
 
-	//the next 8 bytes are garbage
-	if(fwrite(&garbage,sizeof(int),1,fp)!=1) return -1;
-	if(fwrite(&garbage,sizeof(int),1,fp)!=1) return -1;
+	//particle IDs come next, generated in chunks
+	if(fwrite(&idSize,sizeof(int),1,fp)!=1) return -1;
 
-	//particle IDs come next
-	for(k=0;k<NumPart;k++){
-		id = firstID + k;
-		if(fwrite(&id,sizeof(int),1,fp)!=1) return -1;
-	}
+	buffer = malloc((size_t)layout.id_size*ID_BUFFER_SIZE);
+	if(buffer==NULL) return -1;
+
+	for(n=0;n<NumPart;n+=ID_BUFFER_SIZE){
 
-	//the next 4 bytes are garbage
-	if(fwrite(&garbage,sizeof(int),1,fp)!=1) return -1;
+		chunk = (NumPart-n<ID_BUFFER_SIZE) ? NumPart-n : ID_BUFFER_SIZE;
+		fillIDs(buffer,layout.id_size,firstID+n,chunk);
+
+		if(fwrite(buffer,layout.id_size,chunk,fp)!=(size_t)chunk){
+			free(buffer);
+			return -1;
+		}
+	}
 
+	free(buffer);
+	if(fwrite(&idSize,sizeof(int),1,fp)!=1) return -1;
 
 	return 0;
-	
+
 }
 
+/*this routine writes nbytes contiguous bytes at offset; it uses pwrite so the file pointer is not moved, which makes it safe
+to call concurrently from different threads*/
+int writeBlockFD(int fd,long offset,void *data,size_t nbytes){
 
-int writeSnapshotFD(int fd,struct io_header_1 *header,float *positions,float *velocities,int firstID,int NumPart,int writeVel){
+	char *buf = (char *)data;
+	ssize_t nwritten;
 
-	int k,id,garbage=256;
+	while(nbytes>0){
 
-	//the first 4 bytes are for endianness check
-	if(write(fd,&garbage,sizeof(int))!=sizeof(int)) return -1;
+		nwritten = pwrite(fd,buf,nbytes,(off_t)offset);
 
-	//the header comes next
-	if(write(fd,header,sizeof(struct io_header_1))!=sizeof(struct io_header_1)) return -1;
+		if(nwritten<0 && errno==EINTR) continue;
+		if(nwritten<=0) return -1;
 
-	//the next 8 bytes are garbage
-	if(write(fd,&garbage,sizeof(int))!=sizeof(int)) return -1;
-	if(write(fd,&garbage,sizeof(int))!=sizeof(int)) return -1;
+		buf += nwritten;
+		offset += nwritten;
+		nbytes -= (size_t)nwritten;
 
-	//positions come next
-	if(write(fd,positions,sizeof(float)*3*NumPart)!=sizeof(float)*3*NumPart) return -1;
+	}
+
+	return 0;
+
+}
+
+/*this routine writes the header and all the record markers of a snapshot with NumPart particles, leaving the blocks
+to be filled in later (possibly out of order) with writeBlockFD and writeIDFD*/
+int writeHeaderFD(int fd,struct io_header_1 *header,long NumPart,int writeVel,struct gadget_layout *layout){
+
+	unsigned int headerSize=sizeof(struct io_header_1);
+	unsigned int posvelSize=(unsigned int)(3*sizeof(float)*NumPart);
+	unsigned int idSize;
+
+	snapshotLayout(header,NumPart,writeVel,layout);
+	idSize = (unsigned int)(layout->id_size*NumPart);
+
+	//header
+	if(writeBlockFD(fd,0,&headerSize,4)) return -1;
+	if(writeBlockFD(fd,4,header,sizeof(struct io_header_1))) return -1;
+	if(writeBlockFD(fd,4+sizeof(struct io_header_1),&headerSize,4)) return -1;
+
+	//positions
+	if(writeBlockFD(fd,layout->pos_offset-4,&posvelSize,4)) return -1;
+	if(writeBlockFD(fd,layout->pos_offset+3*sizeof(float)*NumPart,&posvelSize,4)) return -1;
 
-	//if writeVel is set, only the positions are written, and we stop here
 	if(!writeVel) return 0;
 
-	//the next 8 bytes are garbage
-	if(write(fd,&garbage,sizeof(int))!=sizeof(int)) return -1;
-	if(write(fd,&garbage,sizeof(int))!=sizeof(int)) return -1;
+	//velocities
+	if(writeBlockFD(fd,layout->vel_offset-4,&posvelSize,4)) return -1;
+	if(writeBlockFD(fd,layout->vel_offset+3*sizeof(float)*NumPart,&posvelSize,4)) return -1;
 
-	//velocities come next
-	if(write(fd,velocities,sizeof(float)*3*NumPart)!=sizeof(float)*3*NumPart) return -1;
+	//IDs
+	if(writeBlockFD(fd,layout->id_offset-4,&idSize,4)) return -1;
+	if(writeBlockFD(fd,layout->id_offset+layout->id_size*NumPart,&idSize,4)) return -1;
+
+	return 0;
+
+}
+
+/*this routine writes NumPart consecutive particle IDs, starting from firstID, at offset; IDs are generated in large chunks
+instead of one at a time*/
+int writeIDFD(int fd,long offset,long long firstID,long NumPart,int idSize){
+
+	long n,chunk;
+	void *buffer = malloc((size_t)idSize*ID_BUFFER_SIZE);
+
+	if(buffer==NULL) return -1;
 
-	//the next 8 bytes are garbage
-	if(write(fd,&garbage,sizeof(int))!=sizeof(int)) return -1;
-	if(write(fd,&garbage,sizeof(int))!=sizeof(int)) return -1;
+	for(n=0;n<NumPart;n+=ID_BUFFER_SIZE){
+
+		chunk = (NumPart-n<ID_BUFFER_SIZE) ? NumPart-n : ID_BUFFER_SIZE;
+		fillIDs(buffer,idSize,firstID+n,chunk);
+
+		if(writeBlockFD(fd,offset+idSize*n,buffer,(size_t)idSize*chunk)){
+			free(buffer);
+			return -1;
+		}
 
-	//particle IDs come next
-	for(k=0;k<NumPart;k++){
-		id = firstID + k;
-		if(write(fd,&id,sizeof(int))!=sizeof(int)) return -1;
 	}
 
-	//the next 4 bytes are garbage
-	if(write(fd,&garbage,sizeof(int))!=sizeof(int)) return -1;
+	free(buffer);
+	return 0;
+
+}
+
+
+int writeSnapshotFD(int fd,struct io_header_1 *header,float *positions,float *velocities,long long firstID,int NumPart,int writeVel){
+
+	struct gadget_layout layout;
+
+	//header and record markers first
+	if(writeHeaderFD(fd,header,NumPart,writeVel,&layout)) return -1;
+
+	//positions come next
+	if(writeBlockFD(fd,layout.pos_offset,positions,sizeof(float)*3*(size_t)NumPart)) return -1;
+
+	//if writeVel is not set, only the positions are written, and we stop here
+	if(!writeVel) return 0;
+
+	//velocities and particle IDs come next
+	if(writeBlockFD(fd,layout.vel_offset,velocities,sizeof(float)*3*(size_t)NumPart)) return -1;
+	if(writeIDFD(fd,layout.id_offset,firstID,NumPart,layout.id_size)) return -1;
 
 	return 0;
-	
-}
\ No newline at end of file
+
+}
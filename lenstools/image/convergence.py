@@ -14,6 +14,10 @@ from __future__ import division
 
 from operator import mul
 from functools import reduce
+from multiprocessing.pool import ThreadPool
+from collections import OrderedDict
+import threading
+import hashlib
 import numbers
 
 from ..extern import _topology
@@ -48,6 +52,624 @@ try:
 except ImportError:
 	matplotlib = False
 
+################################################
+########Pair counting###########################
+################################################
+
+def _pairCounts(points1,labels1,num_labels1,points2,labels2,num_labels2,edges,box,periodic,autocorr,threads):
+
+	"""
+	Count the pairs between two point sets in distance bins (and label bins) with the C backend; the cell list of the second point set is built once, and the first point set is split in chunks that are processed by different threads sharing it
+
+	"""
+
+	#With periodic boundary conditions the minimum image separation is only unique up to half the box size
+	if periodic and (edges[-1]>0.5*box):
+		raise ValueError("The maximum pair distance ({0}) cannot exceed half the box size ({1}) with periodic boundary conditions".format(edges[-1],0.5*box))
+
+	num_points = len(points1)
+	points2 = np.ascontiguousarray(points2,dtype=np.float64)
+	cell_start,sorted_points = _topology.cellList(points2,float(edges[-1]),float(box),int(periodic))
+
+	if (threads is None) or (threads<=1) or (num_points<2):
+		return _topology.pairCount(points1,labels1,num_labels1,points2,labels2,num_labels2,edges,float(box),int(periodic),int(autocorr),cell_start,sorted_points,0,num_points)
+
+	#With autocorrelations the first points have more partners, use more chunks than threads to balance the load
+	chunks = np.linspace(0,num_points,4*threads+1).astype(np.int64)
+	pool = ThreadPool(threads)
+	
+	try:
+		counts = pool.map(lambda c:_topology.pairCount(points1,labels1,num_labels1,points2,labels2,num_labels2,edges,float(box),int(periodic),int(autocorr),cell_start,sorted_points,int(c[0]),int(c[1])),zip(chunks[:-1],chunks[1:]))
+	finally:
+		pool.close()
+		pool.join()
+
+	return reduce(lambda a,b:a+b,counts)
+
+
+#Stencil validity flags of the masked derivatives (see extern/differentials.h)
+_STENCIL_MASKED = 1
+_STENCIL_GRADIENT = 2
+_STENCIL_HESSIAN = 4
+_STENCIL_GRADLAPLACIAN = 8
+
+################################################
+########Fourier space binning###################
+################################################
+
+#Cache of the multipole bin index of each rfft2 pixel, keyed on map shape, side angle and multipole binning; the least recently used entries are evicted
+_bins_cache = OrderedDict()
+_bins_cache_size = 16
+
+def _fourierBins(shape,side_deg,l_edges):
+
+	"""
+	Multipole bin of each pixel of the rfft2 half plane (-1 if out of range), with the same convention as rfft2_azimuthal, and number of pixels in each bin; cached on map shape, side angle and binning
+
+	"""
+
+	l_edges = np.asarray(l_edges,dtype=np.float64)
+	key = (tuple(shape),float(side_deg),tuple(l_edges))
+
+	if key in _bins_cache:
+		_bins_cache[key] = _bins_cache.pop(key)
+		return _bins_cache[key]
+
+	#Multipoles of the half plane pixels
+	lpix = 360.0/side_deg
+	lx = np.minimum(np.arange(shape[0]),shape[0]-np.arange(shape[0]))*lpix
+	ly = np.arange(shape[1]//2+1)*lpix
+	ell = np.sqrt(lx[:,None]*lx[:,None] + ly[None,:]*ly[None,:])
+
+	#Bins are open on the left and closed on the right
+	num_bins = len(l_edges) - 1
+	bins = np.searchsorted(l_edges,ell,side="left").astype(np.int32) - 1
+	bins[bins>=num_bins] = -1
+	hits = np.bincount(bins[bins>=0],minlength=num_bins)
+
+	_bins_cache[key] = (bins,hits)
+	while len(_bins_cache)>_bins_cache_size:
+		_bins_cache.popitem(last=False)
+
+	return bins,hits
+
+################################################
+########Mode coupling matrices##################
+################################################
+
+#Cache of the binned mode coupling matrices, keyed on mask hash, multipole binning and map geometry; the least recently used entries are evicted
+_coupling_cache = OrderedDict()
+_coupling_cache_size = 16
+
+def _couplingMatrix(weights,l_edges,side_deg,threads=None):
+
+	"""
+	Binned mode coupling matrix M of a mask, such that the binned pseudo power spectrum of the masked map is M times the binned power spectrum of the unmasked map. The convolution of the squared mask Fourier transform with each multipole bin is computed with FFTs, one bin per thread
+
+	"""
+
+	weights = np.ascontiguousarray(weights,dtype=np.float64)
+	l_edges = np.asarray(l_edges,dtype=np.float64)
+	key = (hashlib.sha1(weights.view(np.uint8)).hexdigest(),weights.shape,tuple(l_edges),float(side_deg))
+
+	if key in _coupling_cache:
+		_coupling_cache[key] = _coupling_cache.pop(key)
+		return _coupling_cache[key]
+
+	num_pix = weights.shape[0]
+	assert weights.shape==(num_pix,num_pix),"Only square maps are supported!"
+	assert not num_pix%2,"Only maps with an even number of pixels per side are supported!"
+
+	#Squared Fourier transform of the mask, normalized so that an unmasked map has no coupling
+	ft_weights = fftengine.fft2(weights)
+	ft_kernel = fftengine.rfft2((ft_weights.real**2 + ft_weights.imag**2)/num_pix**4)
+
+	#Multipoles on the full Fourier plane (same convention as rfft2_azimuthal)
+	lpix = 360.0/side_deg
+	lx = np.minimum(np.arange(num_pix),num_pix-np.arange(num_pix))*lpix
+	ell = np.sqrt(lx[:,None]**2 + lx[None,:]**2)
+	ell_half = ell[:,:num_pix//2+1]
+
+	num_bins = len(l_edges) - 1
+	in_bin = [ (ell_half>l_edges[b]) & (ell_half<=l_edges[b+1]) for b in range(num_bins) ]
+
+	#Bins without modes would make the coupling matrix singular
+	empty = [ b for b in range(num_bins) if not in_bin[b].any() ]
+	if len(empty):
+		raise ValueError("The multipole bins {0} contain no Fourier modes of the map, use a coarser binning!".format(", ".join("({0},{1}]".format(l_edges[b],l_edges[b+1]) for b in empty)))
+
+	#Column b: average over each bin of the mask kernel convolved with the indicator of bin b
+	def _column(b):
+		indicator = ((ell>l_edges[b]) & (ell<=l_edges[b+1])).astype(np.float64)
+		convolved = fftengine.irfft2(ft_kernel*fftengine.rfft2(indicator))[:,:num_pix//2+1]
+		return np.array([ convolved[i].mean() for i in in_bin ])
+
+	if (threads is not None) and (threads>1):
+		pool = ThreadPool(threads)
+		try:
+			columns = pool.map(_column,range(num_bins))
+		finally:
+			pool.close()
+			pool.join()
+	else:
+		columns = [ _column(b) for b in range(num_bins) ]
+
+	coupling = np.array(columns).T
+
+	#Cache the result
+	_coupling_cache[key] = coupling
+	while len(_coupling_cache)>_coupling_cache_size:
+		_coupling_cache.popitem(last=False)
+
+	return coupling
+
+################################################
+########Smoothing filters#######################
+################################################
+
+#Cache of the Fourier space smoothing windows, keyed on map shape, smoothing scale in pixels and filter kind; bounded in memory. The windows are requested concurrently by the threaded smoothing, hence the lock
+_window_cache = OrderedDict()
+_window_cache_bytes = 256*1024**2
+_window_cache_lock = threading.Lock()
+
+#Cache of the squared wavenumbers of the rfft2 half plane, keyed on map shape (shares the window cache lock)
+_lsquared_cache = OrderedDict()
+_lsquared_cache_size = 4
+
+def _fourierLSquared(shape):
+
+	"""
+	Squared wavenumbers (in cycles per pixel) of the rfft2 half plane, cached on map shape
+
+	"""
+
+	key = tuple(shape)
+	with _window_cache_lock:
+		if key in _lsquared_cache:
+			_lsquared_cache[key] = _lsquared_cache.pop(key)
+			return _lsquared_cache[key]
+
+	lx = fftengine.fftfreq(shape[0])
+	ly = fftengine.rfftfreq(shape[1])
+	l_squared = lx[:,None]**2 + ly[None,:]**2
+
+	with _window_cache_lock:
+		_lsquared_cache[key] = l_squared
+		while len(_lsquared_cache)>_lsquared_cache_size:
+			_lsquared_cache.popitem(last=False)
+
+	return l_squared
+
+
+def _fourierWindow(shape,scale_pixel,kind="gaussianFFT"):
+
+	"""
+	Fourier space window (on the rfft2 half plane) of a smoothing filter, cached on map shape, smoothing scale in pixel units and filter kind
+
+	"""
+
+	key = (tuple(shape),float(scale_pixel),kind)
+	with _window_cache_lock:
+		if key in _window_cache:
+			_window_cache[key] = _window_cache.pop(key)
+			return _window_cache[key]
+
+	if kind=="gaussianFFT":
+
+		#The squared wavenumbers only depend on the shape, and are cached separately
+		l_squared = _fourierLSquared(shape)
+
+		window = np.exp(-0.5*l_squared*(2*np.pi*scale_pixel)**2)
+
+	else:
+		raise NotImplementedError("Smoothing algorithm {0} not implemented!".format(kind))
+
+	#Cache the window, evicting the least recently used ones if the cache is too big
+	with _window_cache_lock:
+		_window_cache[key] = window
+		while (len(_window_cache)>2) and (sum(w.nbytes for w in _window_cache.values())>_window_cache_bytes):
+			_window_cache.popitem(last=False)
+
+	return window
+
+
+def _gaussianFilterThreaded(data,scale_pixel,threads,**kwargs):
+
+	"""
+	Separable real space Gaussian filter (same output as scipy.ndimage.gaussian_filter): each 1D pass is split in blocks of lines that are filtered in parallel, since the ndimage correlation releases the GIL
+
+	"""
+
+	smoothed = np.empty(data.shape,dtype=np.float64)
+	pool = ThreadPool(threads)
+
+	try:
+
+		for axis in range(data.ndim):
+
+			source = data if axis==0 else smoothed
+			other = (axis+1) % data.ndim
+
+			#Blocks of lines along the axis that is not being filtered
+			edges = np.linspace(0,data.shape[other],threads+1).astype(int)
+			def _block(n):
+				block = [slice(None)]*data.ndim
+				block[other] = slice(edges[n],edges[n+1])
+				block = tuple(block)
+				smoothed[block] = filters.gaussian_filter1d(source[block],scale_pixel,axis=axis,**kwargs)
+
+			pool.map(_block,range(threads))
+
+	finally:
+		pool.close()
+		pool.join()
+
+	return smoothed
+
+################################################
+########Periodic map sampling###################
+################################################
+
+_sample_methods = {"nearest":0,"bilinear":1,"bicubic":2}
+
+def _sampleLayers(layers,x,y,method="nearest",threads=None):
+
+	"""
+	Sample one or more map layers at arbitrary positions (in pixel units, pixel (i,j) covers [j,j+1)x[i,i+1)) with periodic boundary conditions; all the layers are interpolated in the same pass, and the points are split between threads since the C backend releases the GIL
+
+	:param layers: map layers, shape (Nlayers,Ny,Nx) or (Ny,Nx)
+	:type layers: array
+
+	:param x: x pixel coordinates
+	:type x: array
+
+	:param y: y pixel coordinates
+	:type y: array
+
+	:param method: interpolation method ("nearest" is the value of the pixel that contains the point, "bilinear" and "bicubic" interpolate between the pixel centers)
+	:type method: str.
+
+	:param threads: number of threads to use
+	:type threads: int.
+
+	:returns: array of shape (Nlayers,)+x.shape, or x.shape if a single layer is passed
+
+	"""
+
+	assert method in _sample_methods,"method must be one of {0}".format(list(_sample_methods.keys()))
+	assert x.shape==y.shape,"x and y must have the same shape!"
+
+	layers = np.ascontiguousarray(layers,dtype=np.float64)
+	single = (layers.ndim==2)
+	if single:
+		layers = layers[None]
+
+	x_flat = np.ascontiguousarray(x,dtype=np.float64).ravel()
+	y_flat = np.ascontiguousarray(y,dtype=np.float64).ravel()
+	values = np.empty((layers.shape[0],x_flat.shape[0]),dtype=np.float64)
+
+	if threads is None or threads<=1 or x_flat.shape[0]<threads:
+		_topology.sample(layers,x_flat,y_flat,_sample_methods[method],values,0,x_flat.shape[0])
+
+	else:
+
+		edges = np.linspace(0,x_flat.shape[0],threads+1).astype(int)
+		pool = ThreadPool(threads)
+
+		try:
+			pool.map(lambda n:_topology.sample(layers,x_flat,y_flat,_sample_methods[method],values,edges[n],edges[n+1]),range(threads))
+		finally:
+			pool.close()
+			pool.join()
+
+	values = values.reshape((layers.shape[0],)+x.shape)
+	if single:
+		return values[0]
+	else:
+		return values
+
+################################################
+########Single pass map accumulator#############
+################################################
+
+class MapAccumulator(object):
+
+	"""
+	Streaming accumulator of one point statistics of maps: the histogram of the pixel values (PDF), the mean, the variance and the power sums that enter the quadratic, cubic and quartic moments. Each map is scanned once by the C backend, with the gradients and laplacians computed on the fly; masked pixels are excluded, and only pixels whose derivative stencils are fully unmasked enter the moments. Partial accumulators (e.g. over tiles of a map, or over different maps) can be merged with the + operator
+
+	:param thresholds: histogram bin edges; if None the PDF is not accumulated
+	:type thresholds: array
+
+	:param derivatives: if True accumulate the moments that involve the derivatives of the maps
+	:type derivatives: bool.
+
+	>>> acc = MapAccumulator(thresholds=np.linspace(-0.1,0.1,50))
+	>>> for conv_map in maps:
+	>>>		acc.accumulate(conv_map)
+	>>> nu,p = acc.pdf()
+	>>> sigma0,sigma1,S0,S1,S2,K0,K1,K2,K3 = acc.moments(connected=True)
+
+	"""
+
+	#Names of the power sums, in the same order as the C backend (see extern/accumulator.h)
+	_sum_names = ["num_pixels","pixel_sum","pixel_sum2","num_valid","sum","sum2","sum3","sum4","grad2","sum2_lap","grad2_lap","sum3_lap","sum_grad2_lap","grad4"]
+
+	def __init__(self,thresholds=None,derivatives=True):
+
+		if thresholds is not None:
+			thresholds = np.ascontiguousarray(thresholds,dtype=np.float64)
+			assert thresholds.ndim==1 and len(thresholds)>1,"thresholds must be a 1D array of bin edges!"
+			widths = np.diff(thresholds)
+			assert (widths>0).all(),"thresholds must be increasing!"
+			self._uniform = int(np.allclose(widths,widths[0],rtol=1.0e-12,atol=0.0))
+			self.hist = np.zeros(len(thresholds)-1)
+		else:
+			self._uniform = 0
+			self.hist = None
+
+		self.thresholds = thresholds
+		self.derivatives = derivatives
+		self.sums = np.zeros(len(self._sum_names))
+
+	@classmethod
+	def fromMap(cls,image,thresholds=None,derivatives=True,threads=None):
+
+		"""
+		Build an accumulator from a single map, optionally splitting it in row tiles that are processed in parallel and merged
+
+		:param image: map to accumulate
+		:type image: :py:class:`Spin0` or square array
+
+		:param thresholds: histogram bin edges
+		:type thresholds: array
+
+		:param derivatives: if True accumulate the moments that involve the derivatives of the map
+		:type derivatives: bool.
+
+		:param threads: number of threads
+		:type threads: int.
+
+		:rtype: :py:class:`MapAccumulator`
+
+		"""
+
+		acc = cls(thresholds,derivatives)
+		data,mask = acc._unpack(image)
+
+		if (threads is None) or (threads<2):
+			acc.accumulate(data,mask=mask)
+			return acc
+
+		#One partial accumulator per tile
+		tiles = np.linspace(0,data.shape[0],threads+1).astype(int)
+		partials = [ cls(thresholds,derivatives) for t in range(threads) ]
+		pool = ThreadPool(threads)
+
+		try:
+			pool.map(lambda n:partials[n].accumulate(data,mask=mask,rows=(tiles[n],tiles[n+1])),range(threads))
+		finally:
+			pool.close()
+			pool.join()
+
+		for partial in partials:
+			acc += partial
+
+		return acc
+
+	def _unpack(self,image):
+
+		if isinstance(image,Spin0):
+			data = image.data
+			mask = image._mask if image._masked else None
+		else:
+			data,mask = image,None
+
+		data = np.ascontiguousarray(data,dtype=np.float64)
+		assert data.ndim==2 and data.shape[0]==data.shape[1],"Only square maps are supported!"
+
+		if mask is not None:
+			mask = np.ascontiguousarray(mask).astype(np.uint8,copy=False)
+
+		return data,mask
+
+	def accumulate(self,image,mask=None,rows=None):
+
+		"""
+		Accumulate the statistics of a map (or of a range of its rows: the derivative stencils still read the neighbouring rows, with periodic boundary conditions)
+
+		:param image: map to accumulate
+		:type image: :py:class:`Spin0` or square array
+
+		:param mask: optional mask (1 on the valid pixels, 0 on the masked ones), used if image is an array
+		:type mask: array
+
+		:param rows: optional (first,last) range of rows to accumulate
+		:type rows: tuple.
+
+		:returns: self
+
+		"""
+
+		data,image_mask = self._unpack(image)
+		if mask is None:
+			mask = image_mask
+		else:
+			mask = np.ascontiguousarray(mask).astype(np.uint8,copy=False)
+			assert mask.shape==data.shape,"The mask must have the same shape as the map!"
+
+		if rows is None:
+			rows = (0,data.shape[0])
+
+		hist,sums = _topology.accumulate(data,mask,self.thresholds,self._uniform,int(self.derivatives),int(rows[0]),int(rows[1]))
+
+		if self.hist is not None:
+			self.hist += hist
+		self.sums += sums
+
+		return self
+
+	def accumulateFields(self,data,gradient_x,gradient_y,hessian_xx,hessian_yy):
+
+		"""
+		Accumulate the statistics of an unmasked map whose gradient and hessian have already been computed (e.g. by :py:meth:`ConvergenceMap.scaleSpace`), in a single pass over the fields
+
+		:param data: map to accumulate
+		:type data: array
+
+		:param gradient_x: x component of the gradient
+		:type gradient_x: array
+
+		:param gradient_y: y component of the gradient
+		:type gradient_y: array
+
+		:param hessian_xx: xx component of the hessian
+		:type hessian_xx: array
+
+		:param hessian_yy: yy component of the hessian
+		:type hessian_yy: array
+
+		:returns: self
+
+		"""
+
+		assert self.derivatives,"The derivative moments are not accumulated!"
+		hist,sums = _topology.accumulateFields(data,gradient_x,gradient_y,hessian_xx,hessian_yy,self.thresholds,self._uniform)
+
+		if self.hist is not None:
+			self.hist += hist
+		self.sums += sums
+
+		return self
+
+	def __iadd__(self,other):
+
+		assert isinstance(other,MapAccumulator),"Only accumulators can be merged!"
+		assert (self.thresholds is None and other.thresholds is None) or np.array_equal(self.thresholds,other.thresholds),"Cannot merge accumulators with different thresholds!"
+		assert self.derivatives==other.derivatives
+
+		if self.hist is not None:
+			self.hist += other.hist
+		self.sums += other.sums
+
+		return self
+
+	def __add__(self,other):
+
+		merged = self.__class__(self.thresholds,self.derivatives)
+		merged += self
+		merged += other
+
+		return merged
+
+	def __getattr__(self,attr):
+
+		if attr in self._sum_names:
+			return self.sums[self._sum_names.index(attr)]
+
+		raise AttributeError(attr)
+
+	#########################################################################################
+
+	def mean(self):
+
+		"""
+		Mean of the unmasked pixels
+
+		:rtype: float.
+
+		"""
+
+		return self.pixel_sum / self.num_pixels
+
+	def std(self):
+
+		"""
+		Standard deviation of the unmasked pixels
+
+		:rtype: float.
+
+		"""
+
+		mean = self.pixel_sum / self.num_pixels
+		return np.sqrt(max(self.pixel_sum2/self.num_pixels - mean**2,0.0))
+
+	def pdf(self,sigma=1.0):
+
+		"""
+		Normalized histogram of the unmasked pixels (same normalization as numpy.histogram with density=True)
+
+		:param sigma: the thresholds are interpreted in units of sigma, and the PDF is multiplied by sigma
+		:type sigma: float.
+
+		:returns: tuple -- (threshold midpoints -- array, pdf normalized at the midpoints -- array)
+
+		"""
+
+		assert self.hist is not None,"The PDF was not accumulated!"
+
+		midpoints = 0.5 * (self.thresholds[:-1] + self.thresholds[1:]) / sigma
+		return midpoints,self.hist*sigma / (self.hist.sum()*np.diff(self.thresholds))
+
+	def moments(self,connected=False,dimensionless=False):
+
+		"""
+		Quadratic, cubic and quartic moments of the accumulated maps (see :py:meth:`Spin0.moments`)
+
+		:param connected: if set to True returns only the connected part of the moments
+		:type connected: bool.
+
+		:param dimensionless: if set to True returns the dimensionless moments, normalized by the appropriate powers of the variance
+		:type dimensionless: bool.
+
+		:returns: array -- (sigma0,sigma1,S0,S1,S2,K0,K1,K2,K3)
+
+		"""
+
+		assert self.derivatives,"The derivative moments were not accumulated!"
+		n = self.num_valid
+
+		#Quadratic moments
+		sigma0 = np.sqrt(max(self.sum2/n - (self.sum/n)**2,0.0))
+		sigma1 = np.sqrt(self.grad2/n)
+
+		#Cubic moments
+		S0 = self.sum3/n
+		S1 = self.sum2_lap/n
+		S2 = self.grad2_lap/n
+
+		#Quartic moments
+		K0 = self.sum4/n
+		K1 = self.sum3_lap/n
+		K2 = self.sum_grad2_lap/n
+		K3 = self.grad4/n
+
+		return _normalizeMoments(sigma0,sigma1,S0,S1,S2,K0,K1,K2,K3,connected,dimensionless)
+
+
+def _normalizeMoments(sigma0,sigma1,S0,S1,S2,K0,K1,K2,K3,connected=False,dimensionless=False):
+
+	#Compute connected moments (only quartic affected)
+	if connected:
+		K0 -= 3 * sigma0**4
+		K1 += 3 * sigma0**2 * sigma1**2
+		K2 += sigma1**4
+		K3 -= 2 * sigma1**4
+
+	#Normalize moments to make them dimensionless
+	if dimensionless:
+		S0 /= sigma0**3
+		S1 /= (sigma0 * sigma1**2)
+		S2 *= (sigma0 / sigma1**4)
+
+		K0 /= sigma0**4
+		K1 /= (sigma0**2 * sigma1**2)
+		K2 /= sigma1**4
+		K3 /= sigma1**4
+
+		sigma0 /= sigma0
+		sigma1 /= sigma1
+
+	return np.array([sigma0,sigma1,S0,S1,S2,K0,K1,K2,K3])
 
 ################################################
 ########Spin0 class#############################
@@ -224,10 +846,7 @@ class Spin0(object):
 		
 		else:
 			
-			if not hasattr(self,"_full_mask"):
-				self.maskBoundaries()
-			
-			return self.data[self._full_mask].mean()
+			return self._maskedDerivatives()["values"].mean()
 
 
 	def std(self):
@@ -245,16 +864,13 @@ class Spin0(object):
 
 		else:
 
-			if not hasattr(self,"_full_mask"):
-				self.maskBoundaries()
+			return self._maskedDerivatives()["values"].std()
 
-			return self.data[self._full_mask].std()
 
-
-	def getValues(self,x,y):
+	def getValues(self,x,y,method="nearest",threads=None):
 
 		"""
-		Extract the map values at the requested (x,y) positions; this is implemented using the numpy fast indexing routines, so the formats of x and y must follow the numpy advanced indexing rules. Periodic boundary conditions are enforced
+		Extract the map values at the requested (x,y) positions, interpolating between pixels if requested; the sampling is done in a single compiled pass. Periodic boundary conditions are enforced
 
 		:param x: x coordinates at which to extract the map values (if unitless these are interpreted as radians)
 		:type x: numpy array or quantity 
@@ -262,36 +878,23 @@ class Spin0(object):
 		:param y: y coordinates at which to extract the map values (if unitless these are interpreted as radians)
 		:type y: numpy array or quantity 
 
-		:returns: numpy array with the map values at the specified positions, with the same shape as x and y
+		:param method: interpolation method: "nearest" returns the value of the pixel that contains each position, "bilinear" and "bicubic" interpolate between the pixel centers
+		:type method: str.
 
-		:raises: IndexError if the formats of x and y are not the proper ones
+		:param threads: number of threads to use in the sampling
+		:type threads: int.
+
+		:returns: numpy array with the map values at the specified positions, with the same shape as x and y
 
 		"""
 
 		assert isinstance(x,np.ndarray) and isinstance(y,np.ndarray)
 
-		#x coordinates
-		if type(x)==u.quantity.Quantity:
-			
-			assert x.unit.physical_type==self.side_angle.unit.physical_type
-			j = np.mod(((x / self.resolution).decompose().value).astype(np.int32),self.data.shape[1])
-
-		else:
-
-			j = np.mod((x / self.resolution.to(u.rad).value).astype(np.int32),self.data.shape[1])	
-
-		#y coordinates
-		if type(y)==u.quantity.Quantity:
-			
-			assert y.unit.physical_type==self.side_angle.unit.physical_type
-			i = np.mod(((y / self.resolution).decompose().value).astype(np.int32),self.data.shape[0])
-
-		else:
-
-			i = np.mod((y / self.resolution.to(u.rad).value).astype(np.int32),self.data.shape[0])
+		#Coordinates in pixel units
+		x,y = self._pixelCoordinates(x,y)
 
 		#Return the map values at the specified coordinates
-		return self.data[i,j]
+		return _sampleLayers(self.data,x,y,method=method,threads=threads)
 
 
 	def cutRegion(self,extent):
@@ -420,6 +1023,11 @@ class Spin0(object):
 
 		new_map._masked = True
 		new_map._mask = ~np.isnan(new_map.data)
+
+		#Stencil validity depends on the mask, invalidate what was computed before
+		for attr in ("_stencils","_full_mask","_gradient_boundary","_hessian_boundary"):
+			if hasattr(new_map,attr):
+				delattr(new_map,attr)
 		new_map._masked_fraction = 1.0 - new_map._mask.sum() / reduce(mul,new_map.data.shape)
 
 		#Recompute gradients
@@ -448,30 +1056,39 @@ class Spin0(object):
 			print("The map is not masked!!")
 			return None
 
-		#First check that the instance has the gradient and hessian attributes; if not, compute them
-		if not (hasattr(self,"gradient_x") and hasattr(self,"gradient_y")):
-			self.gradient()
+		#Stencil validity flags, computed by the C backend directly from the mask
+		stencils = self._maskedDerivatives()
+		flags = stencils["flags"]
 
-		if not (hasattr(self,"hessian_xx") and hasattr(self,"hessian_yy") and hasattr(self,"hessian_xy")):
-			self.hessian()
+		#Boundaries: pixels that are not masked, but whose gradient (hessian) stencil touches the masked region
+		self._gradient_boundary = (flags & (_STENCIL_MASKED|_STENCIL_GRADIENT))==_STENCIL_GRADIENT
+		self._hessian_boundary = ((flags & _STENCIL_MASKED)==0) & ((flags & (_STENCIL_GRADIENT|_STENCIL_HESSIAN))>0)
 
-		#Check where gradient starts to have problems
-		nan_gradient_pixels = np.isnan(self.gradient_x) + np.isnan(self.gradient_y)
-		self._gradient_boundary = ~self._mask ^ nan_gradient_pixels
+		#Create attribute that holds the full mask (including gradients)
+		self._full_mask = (flags & (_STENCIL_MASKED|_STENCIL_GRADIENT|_STENCIL_HESSIAN))==0
+		num_valid = len(stencils["pixels"])
+		assert num_valid < self._mask.sum()
+
+		#Compute perimeter/area of the mask
+		perimeter_area = self._hessian_boundary.sum() / (flags.size - num_valid)
+
+		#Return
+		return perimeter_area
+
+	def _maskedDerivatives(self):
+
+		"""
+		Validity flags of the derivative stencils of each pixel, and value, gradient and hessian of the pixels whose stencils do not touch the masked region, in compacted form (one entry per valid pixel). Computed by the C backend in a single pass and cached
 
-		#Check where the hessian has alsp problems
-		nan_gradient_pixels = nan_gradient_pixels + np.isnan(self.hessian_xx) + np.isnan(self.hessian_yy) + np.isnan(self.hessian_xy)
-		self._hessian_boundary = ~self._mask ^ nan_gradient_pixels
+		:returns: dict with keys flags,pixels,values,gradient_x,gradient_y,hessian_xx,hessian_yy,hessian_xy
 
-		#Create attribute that holds the full mask (including gradients)
-		self._full_mask = self._mask * (~nan_gradient_pixels)
-		assert self._full_mask.sum() < self._mask.sum()
+		"""
 
-		#Compute perimeter/area of the mask
-		perimeter_area = self._hessian_boundary.sum() / (~self._full_mask).sum()
+		if not hasattr(self,"_stencils"):
+			outputs = _topology.maskedDerivatives(self.data,self._mask.view(np.uint8))
+			self._stencils = dict(zip(("flags","pixels","values","gradient_x","gradient_y","hessian_xx","hessian_yy","hessian_xy"),outputs))
 
-		#Return
-		return perimeter_area
+		return self._stencils
 
 	@property
 	def maskedFraction(self):
@@ -504,7 +1121,65 @@ class Spin0(object):
 		return self._hessian_boundary
 			
 
-	def gradient(self,x=None,y=None,save=True):
+	def _pixelCoordinates(self,x,y):
+
+		#Convert (x,y) positions into (float) pixel coordinates; unitless positions are interpreted as radians
+		if type(x)==u.quantity.Quantity:
+			assert x.unit.physical_type==self.side_angle.unit.physical_type
+			x = (x / self.resolution).decompose().value
+		else:
+			x = x / self.resolution.to(u.rad).value
+
+		if type(y)==u.quantity.Quantity:
+			assert y.unit.physical_type==self.side_angle.unit.physical_type
+			y = (y / self.resolution).decompose().value
+		else:
+			y = y / self.resolution.to(u.rad).value
+
+		return x,y
+
+	def _localStencil(self,stencil,x,y,interpolation="nearest"):
+
+		"""
+		Evaluate finite difference derivatives (stencil is one of the _topology routines that accept pixel indices) only at the requested positions, without computing them on the whole map; with bilinear interpolation the stencil is evaluated on the 4 pixels whose centers surround each position
+
+		"""
+
+		assert x.shape==y.shape,"x and y must have the same shape!"
+		assert interpolation in ["nearest","bilinear"],"interpolation must be one of [nearest,bilinear]!"
+
+		xp,yp = self._pixelCoordinates(x,y)
+		xp = np.asarray(xp,dtype=np.float64).ravel()
+		yp = np.asarray(yp,dtype=np.float64).ravel()
+
+		if interpolation=="nearest":
+			j = np.mod(xp.astype(np.int32),self.data.shape[1]).astype(np.int32)
+			i = np.mod(yp.astype(np.int32),self.data.shape[0]).astype(np.int32)
+			return tuple(d.reshape(x.shape) for d in stencil(self.data,j,i))
+
+		#Bilinear weights with respect to the surrounding pixel centers
+		j0 = np.floor(xp - 0.5)
+		i0 = np.floor(yp - 0.5)
+		tx = xp - 0.5 - j0
+		ty = yp - 0.5 - i0
+
+		derivatives = None
+		for di,wy in ((0,1.0-ty),(1,ty)):
+			for dj,wx in ((0,1.0-tx),(1,tx)):
+				
+				j = np.mod(j0+dj,self.data.shape[1]).astype(np.int32)
+				i = np.mod(i0+di,self.data.shape[0]).astype(np.int32)
+				corner = stencil(self.data,j,i)
+
+				if derivatives is None:
+					derivatives = [ wx*wy*d for d in corner ]
+				else:
+					for n,d in enumerate(corner):
+						derivatives[n] += wx*wy*d
+
+		return tuple(d.reshape(x.shape) for d in derivatives)
+
+	def gradient(self,x=None,y=None,save=True,interpolation="nearest"):
 		
 		"""
 		Computes the gradient of the map and sets the gradient_x,gradient_y attributes accordingly
@@ -518,6 +1193,9 @@ class Spin0(object):
 		:param save: if True saves the gradient as attrubutes
 		:type save: bool.
 
+		:param interpolation: if x,y are specified, "nearest" evaluates the finite difference gradient at the pixel that contains each position, "bilinear" interpolates it between the 4 closest pixel centers
+		:type interpolation: str.
+
 		:returns: tuple -- (gradient_x,gradient_y)
 
 		>>> test_map = ConvergenceMap.load("map.fit")
@@ -525,51 +1203,21 @@ class Spin0(object):
 
 		"""
 
+		#Derivatives only at the requested positions
 		if (x is not None) and (y is not None):
-
-			assert x.shape==y.shape,"x and y must have the same shape!"
-
-			#x coordinates
-			if type(x)==u.quantity.Quantity:
-			
-				assert x.unit.physical_type==self.side_angle.unit.physical_type
-				j = np.mod(((x / self.resolution).decompose().value).astype(np.int32),self.data.shape[1])
-
-			else:
-
-				j = np.mod((x / self.resolution.to(u.rad).value).astype(np.int32),self.data.shape[1])	
-
-			#y coordinates
-			if type(y)==u.quantity.Quantity:
-			
-				assert y.unit.physical_type==self.side_angle.unit.physical_type
-				i = np.mod(((y / self.resolution).decompose().value).astype(np.int32),self.data.shape[0])
-
-			else:
-
-				i = np.mod((y / self.resolution.to(u.rad).value).astype(np.int32),self.data.shape[0])
-
-		else:
-			i = None
-			j = None
+			return self._localStencil(_topology.gradient,x,y,interpolation)
 		
 		#Call the C backend
-		gradient_x,gradient_y = _topology.gradient(self.data,j,i)
+		gradient_x,gradient_y = _topology.gradient(self.data,None,None)
 
 		#Return the gradients
-		if (x is not None) and (y is not None):
-
-			return gradient_x.reshape(x.shape),gradient_y.reshape(x.shape)
-
-		else:
+		if save:
+			self.gradient_x = gradient_x
+			self.gradient_y = gradient_y
 		
-			if save:
-				self.gradient_x = gradient_x
-				self.gradient_y = gradient_y
-		
-			return gradient_x,gradient_y
+		return gradient_x,gradient_y
 
-	def hessian(self,x=None,y=None,save=True):
+	def hessian(self,x=None,y=None,save=True,interpolation="nearest"):
 		
 		"""
 		Computes the hessian of the map and sets the hessian_xx,hessian_yy,hessian_xy attributes accordingly
@@ -583,6 +1231,9 @@ class Spin0(object):
 		:param save: if True saves the gradient as attrubutes
 		:type save: bool.
 
+		:param interpolation: if x,y are specified, "nearest" evaluates the finite difference hessian at the pixel that contains each position, "bilinear" interpolates it between the 4 closest pixel centers
+		:type interpolation: str.
+
 		:returns: tuple -- (hessian_xx,hessian_yy,hessian_xy)
 
 		>>> test_map = ConvergenceMap.load("map.fit")
@@ -590,50 +1241,20 @@ class Spin0(object):
 
 		"""
 
+		#Derivatives only at the requested positions
 		if (x is not None) and (y is not None):
-
-			assert x.shape==y.shape,"x and y must have the same shape!"
-
-			#x coordinates
-			if type(x)==u.quantity.Quantity:
-			
-				assert x.unit.physical_type==self.side_angle.unit.physical_type
-				j = np.mod(((x / self.resolution).decompose().value).astype(np.int32),self.data.shape[1])
-
-			else:
-
-				j = np.mod((x / self.resolution.to(u.rad).value).astype(np.int32),self.data.shape[1])	
-
-			#y coordinates
-			if type(y)==u.quantity.Quantity:
-			
-				assert y.unit.physical_type==self.side_angle.unit.physical_type
-				i = np.mod(((y / self.resolution).decompose().value).astype(np.int32),self.data.shape[0])
-
-			else:
-
-				i = np.mod((y / self.resolution.to(u.rad).value).astype(np.int32),self.data.shape[0])
-
-		else:
-			i = None
-			j = None
+			return self._localStencil(_topology.hessian,x,y,interpolation)
 
 		#Call the C backend
-		hessian_xx,hessian_yy,hessian_xy = _topology.hessian(self.data,j,i)
+		hessian_xx,hessian_yy,hessian_xy = _topology.hessian(self.data,None,None)
 		
 		#Return the hessian
-		if (x is not None) and (y is not None):
-
-			return hessian_xx.reshape(x.shape),hessian_yy.reshape(x.shape),hessian_xy.reshape(x.shape)
+		if save:
+			self.hessian_xx = hessian_xx
+			self.hessian_yy = hessian_yy
+			self.hessian_xy = hessian_xy
 
-		else:
-
-			if save:
-				self.hessian_xx = hessian_xx
-				self.hessian_yy = hessian_yy
-				self.hessian_xy = hessian_xy
-
-			return hessian_xx,hessian_yy,hessian_xy
+		return hessian_xx,hessian_yy,hessian_xy
 
 	def gradLaplacian(self,x=None,y=None):
 
@@ -704,18 +1325,15 @@ class Spin0(object):
 		midpoints = 0.5 * (thresholds[:-1] + thresholds[1:])
 
 		if norm:
-			sigma = self.data.std()
+			sigma = MapAccumulator.fromMap(self,derivatives=False).std()
 		else:
 			sigma = 1.0
 
-		#Compute the histogram
-		if self._masked:
-			hist,bin_edges = np.histogram(self.data[self._mask],bins=thresholds*sigma,density=True)
-		else:
-			hist,bin_edges = np.histogram(self.data,bins=thresholds*sigma,density=True)
+		#Compute the histogram of the unmasked pixels in a single pass
+		acc = MapAccumulator.fromMap(self,thresholds=thresholds*sigma,derivatives=False)
 
 		#Return
-		return midpoints,hist*sigma
+		return midpoints,acc.pdf(sigma)[1]
 
 
 	def plotPDF(self,thresholds,norm=False,fig=None,ax=None,**kwargs):
@@ -803,7 +1421,7 @@ class Spin0(object):
 		if norm:
 			
 			if self._masked:
-				sigma = self.data[self._full_mask].std()
+				sigma = self._maskedDerivatives()["values"].std()
 			else:
 				sigma = self.data.std()
 
@@ -945,7 +1563,7 @@ class Spin0(object):
 		if norm:
 			
 			if self._masked:
-				sigma = self.data[self._full_mask].std()
+				sigma = self._maskedDerivatives()["values"].std()
 			else:
 				sigma = self.data.std()
 
@@ -961,7 +1579,7 @@ class Spin0(object):
 		return peak_values,(peak_locations*self.resolution).to(self.side_angle.unit)
 
 
-	def peakDistances(self,thresholds,norm=False):
+	def peakDistances(self,thresholds,norm=False,bins=None,periodic=False,threads=None):
 		
 		"""
 		Compute the pairwise distance between local maxima on the map
@@ -972,11 +1590,27 @@ class Spin0(object):
 		:param norm: normalization; if set to a True, interprets the thresholds array as units of sigma (the map standard deviation)
 		:type norm: bool.
 
-		:returns: pairwise distance
-		:rtype: quantity
+		:param bins: if not None, return the histogram of the pairwise distances in these bins instead of the distances themselves; the pairs are counted with a cell list, without building the full distance matrix
+		:type bins: quantity
+
+		:param periodic: if True, the distances in the histogram are computed with periodic boundary conditions
+		:type periodic: bool.
+
+		:param threads: number of threads used for the pair counting
+		:type threads: int.
+
+		:returns: pairwise distance (or number of peak pairs in each of the bins)
+		:rtype: quantity (or array)
 
 		"""
 
+		#Histogram of the distances
+		if bins is not None:
+			height,loc = self._peakPixels(thresholds,norm)
+			edges = (bins/self.resolution).decompose().value
+			labels = np.zeros(len(loc),dtype=np.int32)
+			return _pairCounts(loc,labels,1,loc,labels,1,edges,self.data.shape[0],periodic,True,threads)[0,0]
+
 		#Locate peaks first
 		height,loc = self.locatePeaks(thresholds,norm)
 
@@ -988,10 +1622,17 @@ class Spin0(object):
 		return distances[i>j]
 
 
-	def peakTwoPCF(self,thresholds,scales,norm=False):
+	def _peakPixels(self,thresholds,norm):
+
+		#Peak heights and locations in pixel units
+		height,loc = self.locatePeaks(thresholds,norm)
+		return height,(loc/self.resolution).decompose().value.astype(np.float64)
+
+
+	def peakTwoPCF(self,thresholds,scales,norm=False,cross=False,random_factor=10,periodic=True,seed=None,threads=None):
 
 		"""
-		Compute the two point function of the peaks on the map
+		Compute the two point function of the peaks on the map, with the Landy-Szalay estimator; the peak-peak, peak-random and random-random pairs are counted with a cell list. The random points are drawn uniformly on the unmasked pixels
 
 		:param thresholds: thresholds extremes that define the binning of the peak histogram
 		:type thresholds: array
@@ -1002,11 +1643,75 @@ class Spin0(object):
 		:param norm: normalization; if set to a True, interprets the thresholds array as units of sigma (the map standard deviation)
 		:type norm: bool.
 
-		:returns: (bin centers, peak 2pcf)
+		:param cross: if True, compute the cross correlation between the peaks in each pair of threshold bins
+		:type cross: bool.
+
+		:param random_factor: number of random points per peak
+		:type random_factor: int.
+
+		:param periodic: if True, the pair separations are computed with periodic boundary conditions
+		:type periodic: bool.
+
+		:param seed: random seed for the random points
+		:type seed: int.
+
+		:param threads: number of threads used for the pair counting
+		:type threads: int.
+
+		:returns: (bin centers, peak 2pcf); if cross is True the 2pcf has shape (thresholds-1,thresholds-1,scales-1)
 		:rtype: tuple
 
 		"""
-		raise NotImplementedError
+
+		#Peaks, labeled with their threshold bin
+		height,loc = self._peakPixels(thresholds,norm)
+		edges = (scales/self.resolution).decompose().value
+		
+		if cross:
+			num_labels = len(thresholds) - 1
+			labels = np.clip(np.searchsorted(thresholds,height,side="right")-1,0,num_labels-1).astype(np.int32)
+		else:
+			num_labels = 1
+			labels = np.zeros(len(loc),dtype=np.int32)
+
+		#Random points on the valid pixels, drawn with a private generator so the global random state is left untouched
+		generator = np.random.RandomState(seed)
+
+		if self._masked:
+			valid = self._maskedDerivatives()["pixels"]
+		else:
+			valid = np.arange(self.data.size)
+
+		row,col = np.unravel_index(generator.choice(valid,size=random_factor*len(loc)),self.data.shape)
+		randoms = np.array([col,row],dtype=np.float64).T
+		random_labels = np.zeros(len(randoms),dtype=np.int32)
+
+		#Pair counts
+		box = self.data.shape[0]
+		DD = _pairCounts(loc,labels,num_labels,loc,labels,num_labels,edges,box,periodic,True,threads)
+		DR = _pairCounts(loc,labels,num_labels,randoms,random_labels,1,edges,box,periodic,False,threads)[:,0]
+		RR = _pairCounts(randoms,random_labels,1,randoms,random_labels,1,edges,box,periodic,True,threads)[0,0]
+
+		#Unordered pairs between each pair of bins
+		DD = DD + DD.transpose(1,0,2) - np.eye(num_labels)[...,None]*DD
+
+		#Normalize the counts
+		num_peaks = np.bincount(labels,minlength=num_labels).astype(np.float64)
+		num_randoms = len(randoms)
+		num_DD = np.outer(num_peaks,num_peaks) - np.diag(num_peaks*(num_peaks+1)/2)
+		
+		with np.errstate(divide="ignore",invalid="ignore"):
+			
+			dd = DD/num_DD[...,None]
+			dr = DR/(num_peaks[:,None]*num_randoms)
+			rr = RR/(num_randoms*(num_randoms-1)/2)
+			xi = (dd - dr[:,None] - dr[None] + rr)/rr
+
+		#Return
+		if not cross:
+			xi = xi[0,0]
+
+		return 0.5*(scales[1:]+scales[:-1]),xi
 
 
 	################################################################################################################################################
@@ -1052,7 +1757,7 @@ class Spin0(object):
 		if norm:
 
 			if self._masked:
-				sigma = self.data[self._full_mask].std()
+				sigma = self._maskedDerivatives()["values"].std()
 			else:
 				sigma = self.data.std()
 		
@@ -1071,7 +1776,7 @@ class Spin0(object):
 
 		return midpoints,v0,v1,v2
 
-	def moments(self,connected=False,dimensionless=False):
+	def moments(self,connected=False,dimensionless=False,threads=None):
 
 		"""
 		Measures the first nine moments of the convergence map (two quadratic, three cubic and four quartic)
@@ -1082,6 +1787,9 @@ class Spin0(object):
 		:param dimensionless: if set to True returns the dimensionless moments, normalized by the appropriate powers of the variance
 		:type dimensionless: bool. 
 
+		:param threads: number of threads; the map is split in row tiles that are accumulated in parallel
+		:type threads: int.
+
 		:returns: array -- (sigma0,sigma1,S0,S1,S2,K0,K1,K2,K3)
 
 		>>> test_map = ConvergenceMap.load("map.fit")
@@ -1091,82 +1799,39 @@ class Spin0(object):
 
 		"""
 
-		#First check that the instance has the gradient and hessian attributes; if not, compute them
-		if not (hasattr(self,"gradient_x") and hasattr(self,"gradient_y")):
-			self.gradient()
-
-		if not (hasattr(self,"hessian_xx") and hasattr(self,"hessian_yy") and hasattr(self,"hessian_xy")):
-			self.hessian()
-
-		#Decide if using the full map or only the unmasked region
-		if self._masked:
-
-			if not hasattr(self,"_full_mask"):
-				self.maskBoundaries()
-			
-			data = self.data[self._full_mask]
-			gradient_x = self.gradient_x[self._full_mask]
-			gradient_y = self.gradient_y[self._full_mask]
-			hessian_xx = self.hessian_xx[self._full_mask]
-			hessian_yy = self.hessian_yy[self._full_mask]
-			hessian_xy = self.hessian_xy[self._full_mask]
+		#Accumulate the power sums in a single pass, with the derivatives computed on the fly (only pixels whose derivative stencils are unmasked contribute)
+		return MapAccumulator.fromMap(self,derivatives=True,threads=threads).moments(connected=connected,dimensionless=dimensionless)
 
-		else:
+	################################################################################################################################################
 
-			data = self.data
-			gradient_x = self.gradient_x
-			gradient_y = self.gradient_y
-			hessian_xx = self.hessian_xx
-			hessian_yy = self.hessian_yy
-			hessian_xy = self.hessian_xy
+	def couplingMatrix(self,l_edges,threads=None):
 
-		
-		#Quadratic moments
-		sigma0 = data.std()
-		sigma1 = np.sqrt((gradient_x**2 + gradient_y**2).mean())
+		"""
+		Binned mode coupling matrix of the map mask: the expected binned pseudo power spectrum of the masked map is this matrix times the binned power spectrum of the unmasked map (the power outside of the multipole range is neglected). The matrices are cached, so the cost is paid once per mask, binning and map geometry
 
-		#Cubic moments
-		S0 = (data**3).mean()
-		S1 = ((data**2)*(hessian_xx + hessian_yy)).mean()
-		S2 = ((gradient_x**2 + gradient_y**2)*(hessian_xx + hessian_yy)).mean()
+		:param l_edges: Multipole bin edges
+		:type l_edges: array
 
-		#Quartic moments
-		K0 = (data**4).mean()
-		K1 = ((data**3) * (hessian_xx + hessian_yy)).mean()
-		K2 = ((data) * (gradient_x**2 + gradient_y**2) * (hessian_xx + hessian_yy)).mean()
-		K3 = ((gradient_x**2 + gradient_y**2)**2).mean()
-
-		#Compute connected moments (only quartic affected)
-		if connected:
-			K0 -= 3 * sigma0**4
-			K1 += 3 * sigma0**2 * sigma1**2
-			K2 += sigma1**4
-			K3 -= 2 * sigma1**4
+		:param threads: number of threads used in the computation
+		:type threads: int.
 
-		
-		#Normalize moments to make them dimensionless
-		if dimensionless:
-			S0 /= sigma0**3
-			S1 /= (sigma0 * sigma1**2)
-			S2 *= (sigma0 / sigma1**4)
+		:returns: coupling matrix
+		:rtype: (len(l_edges)-1,len(l_edges)-1) array
 
-			K0 /= sigma0**4
-			K1 /= (sigma0**2 * sigma1**2)
-			K2 /= sigma1**4
-			K3 /= sigma1**4
+		"""
 
-			sigma0 /= sigma0
-			sigma1 /= sigma1
+		if self._masked:
+			weights = self._mask.astype(np.float64)
+		else:
+			weights = np.ones(self.data.shape)
 
-		#Return the array
-		return np.array([sigma0,sigma1,S0,S1,S2,K0,K1,K2,K3])
+		return _couplingMatrix(weights,l_edges,self.side_angle.to(u.deg).value,threads=threads)
 
-	################################################################################################################################################
 
-	def powerSpectrum(self,l_edges,scale=None):
+	def powerSpectrum(self,l_edges,scale=None,threads=None):
 
 		"""
-		Measures the power spectrum of the convergence map at the multipole moments specified in the input
+		Measures the power spectrum of the convergence map at the multipole moments specified in the input. If the map is masked, the pseudo power spectrum of the masked map is deconvolved with the mode coupling matrix of the mask (see :py:meth:`couplingMatrix`)
 
 		:param l_edges: Multipole bin edges
 		:type l_edges: array
@@ -1174,6 +1839,9 @@ class Spin0(object):
 		:param scale: scaling to apply to the square of the Fourier pixels before harmonic azimuthal averaging. Must be a function that takes the array of multipole magnitudes as an input and returns an array of real numbers 
 		:type scale: callable.
 
+		:param threads: number of threads used to compute the mode coupling matrix of masked maps
+		:type threads: int.
+
 		:returns: (l -- array,Pl -- array) = (binned multipole moments, power spectrum at multipole moments)
 		:rtype: tuple.
 
@@ -1183,9 +1851,11 @@ class Spin0(object):
 
 		"""
 
-		assert not self._masked,"Power spectrum calculation for masked maps is not allowed yet!"
 		assert l_edges is not None
 
+		if self._masked:
+			return self._maskedPowerSpectrum(l_edges,scale,threads)
+
 		if self.side_angle.unit.physical_type=="length":
 			raise NotImplementedError("Power spectrum measurement not implemented yet if side physical unit is length!")
 
@@ -1206,6 +1876,24 @@ class Spin0(object):
 		#Output the power spectrum
 		return l,power_spectrum
 
+
+	def _maskedPowerSpectrum(self,l_edges,scale,threads):
+
+		if scale is not None:
+			raise NotImplementedError("Scaling is not supported for masked maps!")
+
+		if self.side_angle.unit.physical_type=="length":
+			raise NotImplementedError("Power spectrum measurement not implemented yet if side physical unit is length!")
+
+		l = 0.5*(l_edges[:-1] + l_edges[1:])
+
+		#Pseudo power spectrum: masked pixels are set to 0
+		ft_map = fftengine.rfft2(np.where(self._mask,self.data,0.))
+		pseudo_power_spectrum = _topology.rfft2_azimuthal(ft_map,ft_map,self.side_angle.to(u.deg).value,l_edges,None)
+
+		#Deconvolve the mode coupling
+		return l,np.linalg.solve(self.couplingMatrix(l_edges,threads=threads),pseudo_power_spectrum)
+
 	################################################################################################################################################
 
 	def cross(self,other,statistic="power_spectrum",**kwargs):
@@ -1273,6 +1961,92 @@ class Spin0(object):
 			return statistic(self,other,**kwargs) 
 
 
+	@classmethod
+	def powerSpectrumMatrix(cls,maps,l_edges,scale=None,threads=None):
+
+		"""
+		Measures all the auto and cross power spectra of a list of maps (e.g. tomographic redshift bins). Each map is Fourier transformed once, and the N(N+1)/2 binned spectra are accumulated by the C backend in a single pass over the Fourier pixels, with the multipole bin of each pixel computed once per geometry
+
+		:param maps: maps of which to measure the power spectra; they must have the same shape and side angle
+		:type maps: list of :py:class:`Spin0`
+
+		:param l_edges: Multipole bin edges
+		:type l_edges: array
+
+		:param scale: scaling to apply to the Fourier pixels before harmonic azimuthal averaging. Must be a function that takes the array of multipole magnitudes as an input and returns an array of real numbers 
+		:type scale: callable.
+
+		:param threads: number of threads used for the FFTs and for the binning (split in ranges of Fourier pixels)
+		:type threads: int.
+
+		:returns: (l -- array,Pl -- array of shape (N,N,len(l_edges)-1)) = (binned multipole moments, auto and cross power spectra)
+		:rtype: tuple.
+
+		>>> maps = [ ConvergenceMap.load("map{0}.fit".format(n)) for n in range(5) ]
+		>>> l_edges = np.arange(200.0,5000.0,200.0)
+		>>> l,Pl = ConvergenceMap.powerSpectrumMatrix(maps,l_edges)
+
+		"""
+
+		assert len(maps)>0
+		for m in maps:
+			assert not m._masked,"Power spectrum calculation for masked maps is not allowed yet!"
+			assert m.side_angle==maps[0].side_angle
+			assert m.data.shape==maps[0].data.shape
+
+		if maps[0].side_angle.unit.physical_type=="length":
+			raise NotImplementedError("Power spectrum measurement not implemented yet if side physical unit is length!")
+
+		l_edges = np.asarray(l_edges,dtype=np.float64)
+		num_maps = len(maps)
+		num_bins = len(l_edges) - 1
+		side_deg = maps[0].side_angle.to(u.deg).value
+
+		#Multipole bins of the Fourier pixels (cached)
+		bins,hits = _fourierBins(maps[0].data.shape,side_deg,l_edges)
+
+		#Check if we should scale
+		if scale is not None:
+			sc = np.ascontiguousarray(scale(maps[0].getEll()),dtype=np.float64)
+		else:
+			sc = None
+
+		#Forward FFT of each map, once
+		ft_maps = np.empty((num_maps,)+bins.shape,dtype=np.complex128)
+		def _transform(n):
+			ft_maps[n] = fftengine.rfft2(maps[n].data)
+
+		#Binned sums, possibly split in ranges of Fourier pixels
+		pixel_ranges = np.linspace(0,bins.size,(threads or 1)+1).astype(int)
+		def _bin(n):
+			return _topology.rfft2_azimuthal_multi(ft_maps,bins,num_bins,sc,int(pixel_ranges[n]),int(pixel_ranges[n+1]))
+
+		if (threads is not None) and (threads>1):
+			pool = ThreadPool(threads)
+			try:
+				pool.map(_transform,range(num_maps))
+				power = np.sum(pool.map(_bin,range(threads)),axis=0)
+			finally:
+				pool.close()
+				pool.join()
+		else:
+			for n in range(num_maps):
+				_transform(n)
+			power = _bin(0)
+
+		#Take care of Fourier transforms normalization and compute averages
+		power *= ((side_deg*np.pi/180.0)/maps[0].data.shape[0]**2)**2 / np.where(hits>0,hits,1)
+
+		#Fill the symmetric matrix
+		power_matrix = np.empty((num_maps,num_maps,num_bins))
+		i,j = np.triu_indices(num_maps)
+		power_matrix[i,j] = power
+		power_matrix[j,i] = power
+
+		l = 0.5*(l_edges[:-1] + l_edges[1:])
+		return l,power_matrix
+
+
 	################################################################################################################################################
 
 
@@ -1462,12 +2236,12 @@ class Spin0(object):
 
 	################################################################################################################################################
 
-	def smooth(self,scale_angle,kind="gaussian",inplace=False,**kwargs):
+	def smooth(self,scale_angle,kind="gaussian",inplace=False,threads=None,**kwargs):
 
 		"""
-		Performs a smoothing operation on the convergence map
+		Performs a smoothing operation on the convergence map. The Fourier windows of the "gaussianFFT" filter are cached, and if multiple smoothing scales are specified the map is Fourier transformed only once
 
-		:param scale_angle: size of the smoothing kernel (must have units)
+		:param scale_angle: size of the smoothing kernel (must have units); if an array of scales is passed, the map is smoothed at each of them
 		:type scale_angle: float.
 
 		:param kind: type of smoothing to be performed. Select "gaussian" for regular Gaussian smoothing in real space or "gaussianFFT" if you want the smoothing to be performed via FFTs (advised for large scale_angle)
@@ -1476,15 +2250,26 @@ class Spin0(object):
 		:param inplace: if set to True performs the smoothing in place overwriting the old convergence map
 		:type inplace: bool.
 
+		:param threads: number of threads; real space smoothing is split in blocks of lines, FFT smoothing at multiple scales is split over scales
+		:type threads: int.
+
 		:param kwargs: the keyword arguments are passed to the filter function
 		:type kwargs: dict.
 
-		:returns: ConvergenceMap instance (or None if inplace is True)
+		:returns: ConvergenceMap instance (or None if inplace is True); list of ConvergenceMap instances if multiple scales are specified
+
+		>>> test_map = ConvergenceMap.load("map.fit")
+		>>> smoothed = test_map.smooth([0.5,1.0,2.0]*u.arcmin,kind="gaussianFFT")
 
 		"""
 
 		assert not self._masked,"You cannot smooth a masked convergence map!!"
 
+		#Multiple smoothing scales
+		if (kind!="kernelFFT") and (not np.isscalar(scale_angle.value)):
+			assert not inplace,"Cannot smooth in place at multiple scales!"
+			return self._smoothMultiple(scale_angle,kind,threads,**kwargs)
+
 		if kind=="kernelFFT":
 			smoothed_data = fftengine.irfft2(scale_angle*fftengine.rfft2(self.data)) 
 		else:
@@ -1496,14 +2281,14 @@ class Spin0(object):
 
 			#Perform the smoothing
 			if kind=="gaussian":
-				smoothed_data = filters.gaussian_filter(self.data,smoothing_scale_pixel,**kwargs)
+
+				if (threads is not None) and (threads>1):
+					smoothed_data = _gaussianFilterThreaded(self.data,smoothing_scale_pixel,threads,**kwargs)
+				else:
+					smoothed_data = filters.gaussian_filter(self.data,smoothing_scale_pixel,**kwargs)
 		
 			elif kind=="gaussianFFT":
-
-				lx = fftengine.fftfreq(self.data.shape[0])
-				ly = fftengine.rfftfreq(self.data.shape[1])
-				l_squared = lx[:,None]**2 + ly[None,:]**2
-				smoothed_data = fftengine.irfft2(np.exp(-0.5*l_squared*(2*np.pi*smoothing_scale_pixel)**2)*fftengine.rfft2(self.data))
+				smoothed_data = fftengine.irfft2(_fourierWindow(self.data.shape,smoothing_scale_pixel,kind)*fftengine.rfft2(self.data))
 		
 			else:
 				raise NotImplementedError("Smoothing algorithm {0} not implemented!".format(kind))
@@ -1532,6 +2317,153 @@ class Spin0(object):
 			return self.__class__(smoothed_data,self.side_angle,masked=self._masked,**kwargs)
 
 
+	def scaleSpace(self,scale_angles,derivatives="analytic"):
+
+		"""
+		Iterates over the map smoothed with a Gaussian filter at each of the specified scales, together with its gradient and hessian. The map is Fourier transformed only once; smoothing and differentiation are applied in Fourier space, and the smoothed fields are written in a fixed set of buffers that are reused at each scale (copy them if they need to be kept)
+
+		:param scale_angles: smoothing scales (must have units)
+		:type scale_angles: quantity array
+
+		:param derivatives: "analytic" for exact Fourier space derivatives, "stencil" for the Fourier transfer functions of the finite difference stencils used by gradient and hessian (reproduces smooth followed by gradient and hessian)
+		:type derivatives: str.
+
+		:returns: generator of tuples (scale_angle,smoothed map,gradient_x,gradient_y,hessian_xx,hessian_yy,hessian_xy), derivatives in pixel units
+
+		>>> test_map = ConvergenceMap.load("map.fit")
+		>>> for scale,kappa,gx,gy,hxx,hyy,hxy in test_map.scaleSpace([1.0,2.0,5.0]*u.arcmin):
+		>>>		print(scale,kappa.std())
+
+		"""
+
+		assert not self._masked,"You cannot smooth a masked convergence map!!"
+		assert scale_angles.unit.physical_type==self.side_angle.unit.physical_type
+		scales_pixel = np.atleast_1d((scale_angles * self.data.shape[0] / (self.side_angle)).decompose().value)
+
+		#Wavenumbers in cycles per pixel: x runs along the second axis of the map, y along the first one
+		ky = 2*np.pi*fftengine.fftfreq(self.data.shape[0])[:,None]
+		kx = 2*np.pi*fftengine.rfftfreq(self.data.shape[1])[None,:]
+
+		if derivatives=="analytic":
+			dx,dy = 1j*kx,1j*ky
+			dxx,dyy,dxy = -kx**2,-ky**2,-kx*ky
+		elif derivatives=="stencil":
+			dx,dy = 1j*np.sin(kx),1j*np.sin(ky)
+			dxx,dyy,dxy = -np.sin(kx)**2,-np.sin(ky)**2,-np.sin(kx)*np.sin(ky)
+		else:
+			raise ValueError("derivatives must be one of analytic,stencil")
+
+		#One forward FFT, and the buffers that are reused at each scale
+		ft_map = fftengine.rfft2(self.data)
+		ft_smoothed = np.empty_like(ft_map)
+		ft_buffer = np.empty_like(ft_map)
+		fields = np.empty((6,)+self.data.shape)
+
+		for n,scale in enumerate(scales_pixel):
+
+			np.multiply(ft_map,_fourierWindow(self.data.shape,scale,"gaussianFFT"),out=ft_smoothed)
+			fftengine.irfft2(ft_smoothed,out=fields[0])
+
+			for f,kernel in enumerate((dx,dy,dxx,dyy,dxy)):
+				np.multiply(ft_smoothed,kernel,out=ft_buffer)
+				fftengine.irfft2(ft_buffer,out=fields[f+1])
+
+			yield (np.atleast_1d(scale_angles)[n],) + tuple(fields)
+
+
+	def multiScaleStatistics(self,scale_angles,peaks=None,minkowski=None,moments=False,norm=False,derivatives="analytic"):
+
+		"""
+		Measures peak counts, Minkowski functionals and moments of the map smoothed at multiple scales, from a single forward FFT (see :py:meth:`scaleSpace`); the smoothed fields and their Fourier space derivatives are fed directly to the C backend, which also accumulates the moments in a single pass (see :py:meth:`MapAccumulator.accumulateFields`)
+
+		:param scale_angles: smoothing scales (must have units)
+		:type scale_angles: quantity array
+
+		:param peaks: thresholds of the peak histogram; if None peaks are not counted
+		:type peaks: array
+
+		:param minkowski: thresholds of the Minkowski functionals; if None they are not measured
+		:type minkowski: array
+
+		:param moments: if True measure the moments (sigma0,sigma1,S0,S1,S2,K0,K1,K2,K3); pass a dict to specify the connected,dimensionless options of :py:meth:`moments`
+		:type moments: bool. or dict.
+
+		:param norm: if True interpret the thresholds in units of the standard deviation of the smoothed map at each scale
+		:type norm: bool.
+
+		:param derivatives: "analytic" or "stencil" derivatives (see :py:meth:`scaleSpace`)
+		:type derivatives: str.
+
+		:returns: dict with keys peaks (num_scales,num_bins), minkowski (num_scales,3,num_bins), moments (num_scales,9), as requested
+		:rtype: dict.
+
+		>>> test_map = ConvergenceMap.load("map.fit")
+		>>> stats = test_map.multiScaleStatistics([1.0,2.0,5.0]*u.arcmin,peaks=np.linspace(-2,5,30),minkowski=np.linspace(-2,2,20),norm=True)
+
+		"""
+
+		results = dict()
+		if peaks is not None:
+			results["peaks"] = list()
+		if minkowski is not None:
+			results["minkowski"] = list()
+		if moments:
+			results["moments"] = list()
+			moment_options = moments if isinstance(moments,dict) else dict()
+
+		for scale,data,gradient_x,gradient_y,hessian_xx,hessian_yy,hessian_xy in self.scaleSpace(scale_angles,derivatives=derivatives):
+
+			#Single pass over the fields for the variance and the moments
+			if moments or norm:
+				acc = MapAccumulator(derivatives=True).accumulateFields(data,gradient_x,gradient_y,hessian_xx,hessian_yy)
+
+			sigma = acc.std() if norm else 1.0
+
+			if peaks is not None:
+				results["peaks"].append(_topology.peakCount(data,None,peaks,sigma))
+
+			if minkowski is not None:
+				results["minkowski"].append(np.array(_topology.minkowski(data,None,gradient_x,gradient_y,hessian_xx,hessian_yy,hessian_xy,minkowski,sigma)))
+
+			if moments:
+				results["moments"].append(acc.moments(**moment_options))
+
+		return dict((key,np.array(value)) for key,value in results.items())
+
+
+	def _smoothMultiple(self,scale_angles,kind,threads,**kwargs):
+
+		#Forward transform only once for the FFT filters
+		if kind=="gaussianFFT":
+			ft_map = fftengine.rfft2(self.data)
+			smooth_one = lambda scale:fftengine.irfft2(_fourierWindow(self.data.shape,scale,kind)*ft_map)
+		elif kind=="gaussian":
+			smooth_one = lambda scale:filters.gaussian_filter(self.data,scale,**kwargs)
+		else:
+			raise NotImplementedError("Smoothing algorithm {0} not implemented!".format(kind))
+
+		assert scale_angles.unit.physical_type==self.side_angle.unit.physical_type
+		scales_pixel = (scale_angles * self.data.shape[0] / (self.side_angle)).decompose().value
+
+		#Smooth at each scale
+		if (threads is not None) and (threads>1):
+			pool = ThreadPool(threads)
+			try:
+				smoothed_data = pool.map(smooth_one,scales_pixel)
+			finally:
+				pool.close()
+				pool.join()
+		else:
+			smoothed_data = [ smooth_one(scale) for scale in scales_pixel ]
+
+		#Copy the extra attributes as well
+		extra = dict()
+		for attribute in self._extra_attributes:
+			extra[attribute] = getattr(self,attribute)
+
+		return [ self.__class__(data,self.side_angle,masked=self._masked,**extra) for data in smoothed_data ]
+
+
 	def __add__(self,rhs):
 
 		"""
@@ -13,7 +13,7 @@
 from __future__ import division
 
 from ..extern import _topology
-from .convergence import ConvergenceMap
+from .convergence import ConvergenceMap,_sampleLayers
 
 import numpy as np
 
@@ -235,10 +235,10 @@ class Spin1(object):
 			return np.array([grad1x,grad1y,grad2x,grad2y])
 
 
-	def getValues(self,x,y):
+	def getValues(self,x,y,method="nearest",threads=None):
 
 		"""
-		Extract the map values at the requested (x,y) positions; this is implemented using the numpy fast indexing routines, so the formats of x and y must follow the numpy advanced indexing rules. Periodic boundary conditions are enforced
+		Extract the map values at the requested (x,y) positions, interpolating between pixels if requested; all the components are sampled in a single compiled pass. Periodic boundary conditions are enforced
 
 		:param x: x coordinates at which to extract the map values (if unitless these are interpreted as radians)
 		:type x: numpy array or quantity 
@@ -246,36 +246,34 @@ class Spin1(object):
 		:param y: y coordinates at which to extract the map values (if unitless these are interpreted as radians)
 		:type y: numpy array or quantity 
 
-		:returns: numpy array with the map values at the specified positions, with shape (N,shape x) where N is the number of components of the map field
+		:param method: interpolation method ("nearest", "bilinear" or "bicubic")
+		:type method: str.
+
+		:param threads: number of threads to use in the sampling
+		:type threads: int.
 
-		:raises: IndexError if the formats of x and y are not the proper ones
+		:returns: numpy array with the map values at the specified positions, with shape (N,shape x) where N is the number of components of the map field
 
 		"""
 
 		assert isinstance(x,np.ndarray) and isinstance(y,np.ndarray)
 
-		#x coordinates
+		#x coordinates in pixel units
 		if type(x)==quantity.Quantity:
-			
 			assert x.unit.physical_type=="angle"
-			j = np.mod(((x / self.resolution).decompose().value).astype(np.int32),self.data.shape[2])
-
+			x = (x / self.resolution).decompose().value
 		else:
+			x = x / self.resolution.to(rad).value
 
-			j = np.mod((x / self.resolution.to(rad).value).astype(np.int32),self.data.shape[2])	
-
-		#y coordinates
+		#y coordinates in pixel units
 		if type(y)==quantity.Quantity:
-			
 			assert y.unit.physical_type=="angle"
-			i = np.mod(((y / self.resolution).decompose().value).astype(np.int32),self.data.shape[1])
-
+			y = (y / self.resolution).decompose().value
 		else:
-
-			i = np.mod((y / self.resolution.to(rad).value).astype(np.int32),self.data.shape[1])
+			y = y / self.resolution.to(rad).value
 
 		#Return the map values at the specified coordinates
-		return self.data[:,i,j]
+		return _sampleLayers(self.data,x,y,method=method,threads=threads)
 
 
 	
@@ -15,6 +15,11 @@ from __future__ import division
 from .convergence import ConvergenceMap,CMBTemperatureMap
 from .cmblens import Lens
 
+from multiprocessing.pool import ThreadPool
+from collections import OrderedDict
+import hashlib
+import numbers
+
 import numpy as np
 
 #FFT engine
@@ -26,6 +31,17 @@ from scipy import interpolate
 #Units 
 import astropy.units as u
 
+def _cacheKey(value):
+
+	#Hashable key for the amplitude cache
+	if isinstance(value,np.ndarray):
+		data = np.ascontiguousarray(np.asarray(value))
+		return (data.shape,data.dtype.str,str(getattr(value,"unit","")),hashlib.sha1(data.view(np.uint8)).hexdigest())
+	elif callable(value):
+		return value
+	else:
+		return repr(value)
+
 ########################################################
 ########GaussianNoiseGenerator class####################
 ########################################################
@@ -45,6 +61,10 @@ class GaussianNoiseGenerator(object):
 		self.shape = shape
 		self.side_angle = side_angle
 
+		#Cache of the Fourier amplitudes sqrt(P(l)) evaluated on the grid of this geometry
+		self._amplitude_cache = OrderedDict()
+		self._amplitude_cache_size = 8
+
 	@classmethod
 	def forMap(cls,image):
 
@@ -101,7 +121,23 @@ class GaussianNoiseGenerator(object):
 		return ConvergenceMap(noise_map,self.side_angle)
 
 
-	def _fourierMap(self,power_func,**kwargs):
+	def _fourierAmplitude(self,power_func,**kwargs):
+
+		"""
+		Fourier space amplitude of a random realization with power spectrum power_func (same normalization as the one used in _fourierMap), on the rfft2 half plane; results are cached for each power spectrum and set of keyword arguments
+
+		"""
+
+		#Cache key: power spectrum function (or tabulated values) and keyword arguments; arrays are keyed on their contents, since their repr may be abbreviated
+		try:
+			key = (tuple(self.shape),self.side_angle.to(u.deg).value,_cacheKey(power_func),tuple((k,_cacheKey(v)) for k,v in sorted(kwargs.items())))
+			hash(key)
+		except TypeError:
+			key = None
+
+		if (key is not None) and (key in self._amplitude_cache):
+			self._amplitude_cache[key] = self._amplitude_cache.pop(key)
+			return self._amplitude_cache[key]
 
 		#Assert the shape of the blueprint, to tune the right size for the fourier transform
 		lpix = 360.0/self.side_angle.to(u.deg).value
@@ -129,15 +165,28 @@ class GaussianNoiseGenerator(object):
 
 		assert Pl[Pl>=0.0].size == Pl.size
 
-		#Generate real and imaginary parts
-		real_part = np.sqrt(0.5*Pl) * np.random.normal(loc=0.0,scale=1.0,size=l.shape) * lpix/(2.0*np.pi)
-		imaginary_part = np.sqrt(0.5*Pl) * np.random.normal(loc=0.0,scale=1.0,size=l.shape) * lpix/(2.0*np.pi)
+		#Amplitude of real and imaginary parts, the zero mode is not generated
+		amplitude = np.sqrt(0.5*Pl) * (lpix/(2.0*np.pi)) * l.shape[0]**2
+		amplitude[0,0] = 0.0
+		amplitude.setflags(write=False)
+
+		if key is not None:
+			self._amplitude_cache[key] = amplitude
+			while len(self._amplitude_cache)>self._amplitude_cache_size:
+				self._amplitude_cache.popitem(last=False)
+
+		return amplitude
+
 
-		#Get map in real space and return
-		ft_map = (real_part + imaginary_part*1.0j) * l.shape[0]**2
-		ft_map[0,0] = 0.0
+	def _fourierMap(self,power_func,**kwargs):
+
+		amplitude = self._fourierAmplitude(power_func,**kwargs)
 
-		return ft_map
+		#Generate real and imaginary parts
+		real_part = amplitude * np.random.normal(loc=0.0,scale=1.0,size=amplitude.shape)
+		imaginary_part = amplitude * np.random.normal(loc=0.0,scale=1.0,size=amplitude.shape)
+
+		return real_part + imaginary_part*1.0j
 
 
 	def fromConvPower(self,power_func,seed=0,**kwargs):
@@ -168,6 +217,60 @@ class GaussianNoiseGenerator(object):
 
 		return ConvergenceMap(noise_map,self.side_angle)
 
+	def fromConvPowerBatch(self,power_func,realizations,seed=0,threads=None,**kwargs):
+
+		"""
+		Generates a batch of Gaussian random field realizations with the supplied power spectrum; the Fourier amplitudes sqrt(P(l)) are computed only once per geometry and power spectrum, and each realization uses its own counter based (Philox) random stream, keyed on (seed,realization index), so a given realization is reproducible independently of the batch it belongs to and of the number of threads
+
+		:param power_func: function that given a numpy array of l's returns a numpy array with the according Pl's (this is the input power spectrum); alternatively you can pass an array (l,Pl) and the power spectrum will be calculated with scipy's interpolation routines
+		:type power_func: function with the above specifications, or numpy array (l,Pl) of shape (2,n) 
+
+		:param realizations: number of realizations to generate (indices 0,...,realizations-1), or explicit array of realization indices
+		:type realizations: int. or array
+
+		:param seed: seed of the random streams
+		:type seed: int.
+
+		:param threads: number of threads to use (each realization is drawn and transformed in a single thread)
+		:type threads: int.
+
+		:param kwargs: keyword arguments to be passed to power_func, or to the interpolate.interp1d routine
+
+		:returns: stack of maps with the same shape as the blueprint
+		:rtype: array of shape (Nmaps,)+shape
+
+		"""
+
+		#The Philox key is the 128 bit integer (seed,realization index), so both must fit in 64 bits
+		assert isinstance(seed,numbers.Integral) and (0<=seed<2**64),"seed must be an integer in [0,2**64)!"
+
+		if isinstance(realizations,numbers.Integral):
+			realizations = np.arange(realizations)
+		realizations = np.atleast_1d(realizations).tolist()
+		assert all(isinstance(r,numbers.Integral) and (0<=r<2**64) for r in realizations),"realization indices must be integers in [0,2**64)!"
+
+		amplitude = self._fourierAmplitude(power_func,**kwargs)
+		maps = np.empty((len(realizations),)+tuple(self.shape),dtype=np.float64)
+
+		#Draw a single realization into the stack
+		def _realization(n):
+			generator = np.random.Generator(np.random.Philox(key=(int(seed)<<64) + int(realizations[n])))
+			gaussian = generator.standard_normal(size=(2,)+amplitude.shape)
+			maps[n] = fftengine.irfft2(amplitude*(gaussian[0] + gaussian[1]*1.0j))
+
+		if threads is None or threads<=1:
+			for n in range(len(realizations)):
+				_realization(n)
+		else:
+			pool = ThreadPool(threads)
+			try:
+				pool.map(_realization,range(len(realizations)))
+			finally:
+				pool.close()
+				pool.join()
+
+		return maps
+
 	###################
 	#Noise in CMB maps#
 	###################
@@ -12,8 +12,11 @@
 
 from __future__ import division
 
+from multiprocessing.pool import ThreadPool
+from collections import OrderedDict
+
 from ..extern import _topology
-from .convergence import ConvergenceMap
+from .convergence import ConvergenceMap,_fourierBins,_sampleLayers
 
 import numpy as np
 
@@ -36,6 +39,45 @@ except ImportError:
 	matplotlib = False
 
 
+##########################################
+########E/B rotation tables###############
+##########################################
+
+#Cache of the cos(2phi),sin(2phi) tables on the rfft2 half plane, keyed on map shape; the least recently used entries are evicted
+_rotation_cache = OrderedDict()
+_rotation_cache_size = 8
+
+def _rotationTables(num_pix):
+
+	"""
+	Cosine and sine of twice the multipole angle on the rfft2 half plane of a num_pix x num_pix map (both 0 at l=0), cached on the map size
+
+	"""
+
+	if num_pix in _rotation_cache:
+		_rotation_cache[num_pix] = _rotation_cache.pop(num_pix)
+		return _rotation_cache[num_pix]
+
+	#Compute frequencies
+	lx = fftengine.rfftfreq(num_pix)
+	ly = fftengine.fftfreq(num_pix)
+
+	#Compute sines and cosines of rotation angles
+	l_squared = lx[np.newaxis,:]**2 + ly[:,np.newaxis]**2
+	l_squared[0,0] = 1.0
+
+	sin_2_phi = 2.0 * lx[np.newaxis,:] * ly[:,np.newaxis] / l_squared
+	cos_2_phi = (lx[np.newaxis,:]**2 - ly[:,np.newaxis]**2) / l_squared
+
+	sin_2_phi[0,0] = 0.0
+	cos_2_phi[0,0] = 0.0
+
+	_rotation_cache[num_pix] = (cos_2_phi,sin_2_phi)
+	while len(_rotation_cache)>_rotation_cache_size:
+		_rotation_cache.popitem(last=False)
+
+	return cos_2_phi,sin_2_phi
+
 ##########################################
 ########Spin1 class#######################
 ##########################################
@@ -87,8 +129,8 @@ class Spin1(object):
 
 		"""
 
-		ellx = fftengine.fftfreq(self.data.shape[1])*2.0*np.pi / self.resolution.to(u.rad).value
-		elly = fftengine.rfftfreq(self.data.shape[1])*2.0*np.pi / self.resolution.to(u.rad).value
+		ellx = fftengine.fftfreq(self.data.shape[1])*2.0*np.pi / self.resolution.to(rad).value
+		elly = fftengine.rfftfreq(self.data.shape[1])*2.0*np.pi / self.resolution.to(rad).value
 		return np.sqrt(ellx[:,None]**2 + elly[None,:]**2)
 
 	###############################################################################################
@@ -236,10 +278,10 @@ class Spin1(object):
 			return np.array([grad1x,grad1y,grad2x,grad2y])
 
 
-	def getValues(self,x,y):
+	def getValues(self,x,y,method="nearest",threads=None):
 
 		"""
-		Extract the map values at the requested (x,y) positions; this is implemented using the numpy fast indexing routines, so the formats of x and y must follow the numpy advanced indexing rules. Periodic boundary conditions are enforced
+		Extract the map values at the requested (x,y) positions, interpolating between pixels if requested; all the components are sampled in a single compiled pass. Periodic boundary conditions are enforced
 
 		:param x: x coordinates at which to extract the map values (if unitless these are interpreted as radians)
 		:type x: numpy array or quantity 
@@ -247,36 +289,34 @@ class Spin1(object):
 		:param y: y coordinates at which to extract the map values (if unitless these are interpreted as radians)
 		:type y: numpy array or quantity 
 
-		:returns: numpy array with the map values at the specified positions, with shape (N,shape x) where N is the number of components of the map field
+		:param method: interpolation method ("nearest", "bilinear" or "bicubic")
+		:type method: str.
+
+		:param threads: number of threads to use in the sampling
+		:type threads: int.
 
-		:raises: IndexError if the formats of x and y are not the proper ones
+		:returns: numpy array with the map values at the specified positions, with shape (N,shape x) where N is the number of components of the map field
 
 		"""
 
 		assert isinstance(x,np.ndarray) and isinstance(y,np.ndarray)
 
-		#x coordinates
+		#x coordinates in pixel units
 		if type(x)==quantity.Quantity:
-			
 			assert x.unit.physical_type=="angle"
-			j = np.mod(((x / self.resolution).decompose().value).astype(np.int32),self.data.shape[2])
-
+			x = (x / self.resolution).decompose().value
 		else:
+			x = x / self.resolution.to(rad).value
 
-			j = np.mod((x / self.resolution.to(rad).value).astype(np.int32),self.data.shape[2])	
-
-		#y coordinates
+		#y coordinates in pixel units
 		if type(y)==quantity.Quantity:
-			
 			assert y.unit.physical_type=="angle"
-			i = np.mod(((y / self.resolution).decompose().value).astype(np.int32),self.data.shape[1])
-
+			y = (y / self.resolution).decompose().value
 		else:
-
-			i = np.mod((y / self.resolution.to(rad).value).astype(np.int32),self.data.shape[1])
+			y = y / self.resolution.to(rad).value
 
 		#Return the map values at the specified coordinates
-		return self.data[:,i,j]
+		return _sampleLayers(self.data,x,y,method=method,threads=threads)
 
 
 	
@@ -373,23 +413,9 @@ class Spin2(Spin1):
 		assert fourier_B.shape[1] == fourier_B.shape[0]/2 + 1
 		assert fourier_E.shape == fourier_B.shape
 
-		#Compute frequencies
-		lx = fftengine.rfftfreq(fourier_E.shape[0])
-		ly = fftengine.fftfreq(fourier_E.shape[0])
-
-		#Safety check
-		assert len(lx)==fourier_E.shape[1]
-		assert len(ly)==fourier_E.shape[0]
-
-		#Compute sines and cosines of rotation angles
-		l_squared = lx[np.newaxis,:]**2 + ly[:,np.newaxis]**2
-		l_squared[0,0] = 1.0
-
-		sin_2_phi = 2.0 * lx[np.newaxis,:] * ly[:,np.newaxis] / l_squared
-		cos_2_phi = (lx[np.newaxis,:]**2 - ly[:,np.newaxis]**2) / l_squared
-
-		sin_2_phi[0,0] = 0.0
-		cos_2_phi[0,0] = 0.0
+		#Sines and cosines of rotation angles
+		cos_2_phi,sin_2_phi = _rotationTables(fourier_E.shape[0])
+		assert cos_2_phi.shape==fourier_E.shape
 
 		#Invert E/B modes and find the components of the shear
 		ft_data1 = cos_2_phi * fourier_E - sin_2_phi * fourier_B
@@ -476,20 +502,9 @@ class Spin2(Spin1):
 		ft_data1 = fftengine.rfft2(self.data[0])
 		ft_data2 = fftengine.rfft2(self.data[1])
 
-		#Compute frequencies
-		lx = fftengine.rfftfreq(ft_data1.shape[0])
-		ly = fftengine.fftfreq(ft_data1.shape[0])
-
-		#Safety check
-		assert len(lx)==ft_data1.shape[1]
-		assert len(ly)==ft_data1.shape[0]
-
-		#Compute sines and cosines of rotation angles
-		l_squared = lx[np.newaxis,:]**2 + ly[:,np.newaxis]**2
-		l_squared[0,0] = 1.0
-
-		sin_2_phi = 2.0 * lx[np.newaxis,:] * ly[:,np.newaxis] / l_squared
-		cos_2_phi = (lx[np.newaxis,:]**2 - ly[:,np.newaxis]**2) / l_squared
+		#Sines and cosines of rotation angles
+		cos_2_phi,sin_2_phi = _rotationTables(ft_data1.shape[0])
+		assert cos_2_phi.shape==ft_data1.shape
 
 		#Compute E and B components
 		ft_E = cos_2_phi * ft_data1 + sin_2_phi * ft_data2
@@ -525,23 +540,80 @@ class Spin2(Spin1):
 
 		"""
 
-		#Compute the E,B modes in Fourier space
-		ft_E,ft_B = self.fourierEB()
+		l,P_ee,P_bb,P_eb = self.__class__.ebPowerSpectra(self.data[None],self.side_angle,l_edges,scale=scale)
+
+		#Return to user
+		return l,P_ee[0],P_bb[0],P_eb[0]
+
+	@classmethod
+	def ebPowerSpectra(cls,data,angle,l_edges,scale=None,threads=None):
+
+		"""
+		Measures the EE,BB,EB power spectra of a stack of shear maps. The rotation tables and the multipole binning are cached per geometry, and the three spectra of each map are accumulated in a single pass over its Fourier coefficients (the E and B modes are never stored); the maps are distributed over threads
+
+		:param data: stack of shear maps
+		:type data: array of shape (Nmaps,2,N,N)
+
+		:param angle: side angle of the maps
+		:type angle: quantity
+
+		:param l_edges: Multipole bin edges
+		:type l_edges: array
+
+		:param scale: scaling to apply to the Fourier coefficients before harmonic azimuthal averaging. Must be a function that takes the array of multipole magnitudes as an input and returns a real numbers 
+		:type scale: callable
+
+		:param threads: number of threads
+		:type threads: int.
+
+		:returns: (l -- array,P_EE,P_BB,P_EB -- arrays of shape (Nmaps,Nbins)) = (multipole moments, EE,BB power spectra and EB cross power)
+		:rtype: tuple.
+
+		>>> l_edges = np.arange(300.0,5000.0,200.0)
+		>>> l,EE,BB,EB = ShearMap.ebPowerSpectra(np.array([shear1.data,shear2.data]),shear1.side_angle,l_edges,threads=2)
+
+		"""
+
+		assert data.ndim==4 and data.shape[1]==2 and data.shape[2]==data.shape[3],"data must have shape (Nmaps,2,N,N)!"
+		assert angle.unit.physical_type=="angle"
+
+		num_pix = data.shape[2]
+		side_deg = angle.to(deg).value
+		l_edges = np.asarray(l_edges,dtype=np.float64)
+		num_bins = len(l_edges) - 1
+
+		#Cached rotation tables and multipole bins
+		cos_2_phi,sin_2_phi = _rotationTables(num_pix)
+		bins,hits = _fourierBins((num_pix,num_pix),side_deg,l_edges)
 
 		#Scaling of Fourier coefficients
 		if scale is not None:
-			sc = scale(self.getEll())
+			ellx = fftengine.fftfreq(num_pix)*2.0*np.pi*num_pix / angle.to(rad).value
+			elly = fftengine.rfftfreq(num_pix)*2.0*np.pi*num_pix / angle.to(rad).value
+			sc = np.ascontiguousarray(scale(np.sqrt(ellx[:,None]**2 + elly[None,:]**2)),dtype=np.float64)
 		else:
 			sc = None
 
-		#Compute and return power spectra
-		l = 0.5*(l_edges[:-1] + l_edges[1:])
-		P_ee = _topology.rfft2_azimuthal(ft_E,ft_E,self.side_angle.to(deg).value,l_edges,sc)
-		P_bb = _topology.rfft2_azimuthal(ft_B,ft_B,self.side_angle.to(deg).value,l_edges,sc)
-		P_eb = _topology.rfft2_azimuthal(ft_E,ft_B,self.side_angle.to(deg).value,l_edges,sc)
+		#EE,BB,EB binned sums of one map
+		def _spectra(n):
+			return _topology.rfft2_azimuthal_eb(fftengine.rfft2(data[n,0]),fftengine.rfft2(data[n,1]),cos_2_phi,sin_2_phi,bins,num_bins,sc)
+
+		if (threads is not None) and (threads>1):
+			pool = ThreadPool(threads)
+			try:
+				power = np.array(pool.map(_spectra,range(data.shape[0])))
+			finally:
+				pool.close()
+				pool.join()
+		else:
+			power = np.array([ _spectra(n) for n in range(data.shape[0]) ])
 
-		#Return to user
-		return l,P_ee,P_bb,P_eb
+		#Take care of Fourier transforms normalization and compute averages
+		normalization = ((side_deg*np.pi/180.0)/num_pix**2)**2
+		power *= normalization / np.where(hits>0,hits,1)
+
+		l = 0.5*(l_edges[:-1] + l_edges[1:])
+		return l,power[:,0],power[:,1],power[:,2]
 
 	def decompose(self,l_edges,scale=None):
 		return self.eb_power_spectrum(l_edges,scale=scale)
@@ -670,16 +742,13 @@ class ShearMap(Spin2):
 		#Type check
 		assert isinstance(conv,ConvergenceMap)
 
-		#Multipoles
-		lx = fftengine.rfftfreq(conv.data.shape[0])[None]
-		ly = fftengine.fftfreq(conv.data.shape[0])[:,None]
-		lsquared = lx**2 + ly**2
-		lsquared[0,0] = 1
+		#Rotation tables
+		cos_2_phi,sin_2_phi = _rotationTables(conv.data.shape[0])
 
 		#FFT forward, rotation, FFT backwards
 		conv_fft = fftengine.rfft2(conv.data)
-		s1 = fftengine.irfft2((lx**2-ly**2)*conv_fft/lsquared)
-		s2 = fftengine.irfft2(2*lx*ly*conv_fft/lsquared)
+		s1 = fftengine.irfft2(cos_2_phi*conv_fft)
+		s2 = fftengine.irfft2(sin_2_phi*conv_fft)
 
 		#Return
 		kwargs = dict((k,getattr(conv,k)) for k in conv._extra_attributes)
@@ -765,21 +765,13 @@ def simulatedCatalog(pool,batch,settings,batch_id):
 	#Read the total number of galaxies to raytrace from the settings
 	total_num_galaxies = settings.total_num_galaxies
 
-	#Pre-allocate numpy arrays
-	initial_positions = np.zeros((2,total_num_galaxies)) * settings.catalog_angle_unit
-	galaxy_redshift = np.zeros(total_num_galaxies)
-
-	#Keep track of the number of galaxies for each catalog
+	#Keep track of the position catalogs and of the number of galaxies for each catalog
+	position_catalogs = list()
 	galaxies_in_catalog = list()
 
-	#Fill in initial positions and redshifts
+	#Read in initial positions and redshifts
 	for galaxy_position_file in settings.input_files:
 
-		try:
-			galaxies_before = reduce(add,galaxies_in_catalog)
-		except TypeError:
-			galaxies_before = 0
-	
 		#Read the galaxy positions and redshifts from the position catalog
 		if (pool is None) or (pool.is_master()):
 			logdriver.info("Reading galaxy positions and redshifts from {0}".format(galaxy_position_file))
@@ -799,10 +791,10 @@ def simulatedCatalog(pool,batch,settings,batch_id):
 			#Save a copy of the position catalog to the simulated catalogs directory
 			position_catalog.write(os.path.join(catalog_save_path,os.path.basename(galaxy_position_file)),overwrite=True)
 
-		#Fill in initial positions and redshifts
-		initial_positions[0,galaxies_before:galaxies_before+len(position_catalog)] = position_catalog["x"] * getattr(u,position_catalog.meta["AUNIT"])
-		initial_positions[1,galaxies_before:galaxies_before+len(position_catalog)] = position_catalog["y"] * getattr(u,position_catalog.meta["AUNIT"])
-		galaxy_redshift[galaxies_before:galaxies_before+len(position_catalog)] = position_catalog["z"]
+		#Keep only positions and redshifts
+		position_catalog = Catalog([position_catalog["x"],position_catalog["y"],position_catalog["z"]],names=("x","y","z"))
+		position_catalog.setSpatialInfo(unit=settings.catalog_angle_unit)
+		position_catalogs.append(position_catalog)
 
 	#Make sure that the total number of galaxies matches, and units are correct
 	assert reduce(add,galaxies_in_catalog)==total_num_galaxies,"The total number of galaxies in the catalogs, {0}, does not match the number provided in the settings, {1}".format(reduce(add,galaxies_in_catalog),total_num_galaxies)
@@ -946,43 +938,33 @@ def simulatedCatalog(pool,batch,settings,batch_id):
 		logdriver.info("Reordering completed in {0:.3f}s".format(now-last_timestamp))
 		last_timestamp = now
 
-		#Trace the ray deflections through the lenses
-		jacobian = tracer.shoot(initial_positions,z=galaxy_redshift,kind="jacobians")
+		#Trace the galaxies of all the catalogs through the lenses in a single traversal, one shear catalog for each position catalog
+		shear_catalogs = tracer.shootCatalog(position_catalogs,reduced_shear=settings.reduced_shear,interpolation="nearest")
 
 		now = time.time()
 		logdriver.info("Jacobian ray tracing for realization {0} completed in {1:.3f}s".format(r+1,now-last_timestamp))
 		last_timestamp = now
 
-		#Build the shear catalog and save it to disk
+		#Save the shear catalogs to disk
 		if settings.reduced_shear:
-			shear_catalog = ShearCatalog([(jacobian[3]-jacobian[0])/(jacobian[3]+jacobian[0]),-(jacobian[1]+jacobian[2])/(jacobian[3]+jacobian[0])],names=("shear1","shear2"))
+			shear_root = "WLredshear_"
 		else:
-			shear_catalog = ShearCatalog([0.5*(jacobian[3]-jacobian[0]),-0.5*(jacobian[1]+jacobian[2])],names=("shear1","shear2"))
+			shear_root = "WLshear_"
 
 		for n,galaxy_position_file in enumerate(settings.input_files):
 
-			try:
-				galaxies_before = reduce(add,galaxies_in_catalog[:n])
-			except TypeError:
-				galaxies_before = 0
-		
 			#Build savename
-			if settings.reduced_shear:
-				shear_root = "WLredshear_"
-			else:
-				shear_root = "WLshear_"
-
 			if len(catalog_subdirectory):
 				shear_catalog_savename = batch.syshandler.map(os.path.join(catalog_save_path,catalog_subdirectory[r//realizations_in_subdir],shear_root+os.path.basename(galaxy_position_file.split(".")[0])+"_{0:04d}r.{1}".format(r+1,settings.format)))
 			else:
 				shear_catalog_savename = batch.syshandler.map(os.path.join(catalog_save_path,shear_root+os.path.basename(galaxy_position_file.split(".")[0])+"_{0:04d}r.{1}".format(r+1,settings.format)))
-			
+
 			if settings.reduced_shear:
 				logdriver.info("Saving simulated reduced shear catalog to {0}".format(shear_catalog_savename))
 			else:
 				logdriver.info("Saving simulated shear catalog to {0}".format(shear_catalog_savename))
-			
-			shear_catalog[galaxies_before:galaxies_before+galaxies_in_catalog[n]].write(shear_catalog_savename,overwrite=True)
+
+			shear_catalogs[n].write(shear_catalog_savename,overwrite=True)
 
 		now = time.time()
 
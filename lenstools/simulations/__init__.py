@@ -16,7 +16,7 @@ from .cfhtemu1 import CFHTemu1,CFHTcov
 from .raytracing import Plane,DensityPlane,PotentialPlane,RayTracer
 from .nicaea import NicaeaSettings,Nicaea
 
-from .gadget2 import Gadget2Snapshot,Gadget2SnapshotDE,Gadget2SnapshotNu,Gadget2SnapshotPipe
+from .gadget2 import Gadget2Snapshot,Gadget2SnapshotDE,Gadget2SnapshotNu,Gadget2SnapshotPipe,Gadget2SnapshotSet
 from .fastpm import FastPMSnapshot, FastPMSnapshotStretchZ
 
 snapshot_allowed = {
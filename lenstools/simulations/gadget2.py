@@ -6,6 +6,10 @@ if sys.version_info.major>=3:
 else:
 	from StringIO import StringIO
 
+from functools import reduce
+from operator import add
+from multiprocessing.pool import ThreadPool
+
 from .nbody import NbodySnapshot
 from .. import extern as ext
 from .settings import LTSettings
@@ -236,16 +240,31 @@ class Gadget2Header(dict):
 		assert np.all(self["masses"]==rhs["masses"])
 		assert np.all(self["num_particles_total_of_type"]==rhs["num_particles_total_of_type"])
 
-		#Construct the header of the merged snapshot
-		merged_header = self.copy()
-		merged_header["files"] += rhs["files"]
-		merged_header["num_particles_file"] += rhs["num_particles_file"]
-		merged_header["num_particles_file_gas"] += rhs["num_particles_file_gas"]
-		merged_header["num_particles_file_of_type"] += rhs["num_particles_file_of_type"]
-		merged_header["num_particles_file_with_mass"] += rhs["num_particles_file_with_mass"]
+		#Construct the header of the merged snapshot (the operands must not be modified in place)
+		merged_header = Gadget2Header(self)
+		merged_header["files"] = self["files"] + rhs["files"]
+		merged_header["num_particles_file"] = self["num_particles_file"] + rhs["num_particles_file"]
+		merged_header["num_particles_file_gas"] = self["num_particles_file_gas"] + rhs["num_particles_file_gas"]
+		merged_header["num_particles_file_of_type"] = self["num_particles_file_of_type"] + rhs["num_particles_file_of_type"]
+		merged_header["num_particles_file_with_mass"] = self["num_particles_file_with_mass"] + rhs["num_particles_file_with_mass"]
 
 		return merged_header
 
+	@property
+	def num_particles_total_64(self):
+
+		"""
+		Total number of particles in the snapshot, taking the npartTotalHighWord bits into account (needed beyond 2^32 particles)
+
+		:rtype: int.
+
+		"""
+
+		low = np.asarray(self["num_particles_total_of_type"]).astype(np.uint32).astype(np.int64)
+		high = np.asarray(self["npartTotalHighWord"]).astype(np.int64)
+
+		return int((low + (high << 32)).sum())
+
 ##############################################################
 #################Gadget2Snapshot class######################
 ##############################################################
@@ -430,7 +449,7 @@ class Gadget2Snapshot(NbodySnapshot):
 	def getID(self,first=None,last=None,save=True):
 
 		"""
-		Reads in the particles IDs, 4 byte ints, (read in of a subset is allowed): when first and last are specified, the numpy array convention is followed (i.e. getID(first=a,last=b)=getID()[a:b])
+		Reads in the particles IDs, 4 or 8 byte ints depending on the snapshot, (read in of a subset is allowed): when first and last are specified, the numpy array convention is followed (i.e. getID(first=a,last=b)=getID()[a:b])
 
 		:param first: first particle in the file to be read, if None 0 is assumed
 		:type first: int. or None
@@ -464,11 +483,15 @@ class Gadget2Snapshot(NbodySnapshot):
 		#Skip other 8 void bytes
 		offset += 8
 
+		#IDs are 4 byte ints by default, unless the record marker that precedes them says otherwise
+		self.fp.seek(offset-4)
+		id_size = 8 if np.frombuffer(self.fp.read(4),dtype=np.int32)[0]==8*numPart else 4
+
 		#If first is specified, offset the file pointer by that amount
 		if first is not None:
 			
 			assert first>=0
-			offset += 4 * first
+			offset += id_size * first
 			numPart -= first
 
 		if last is not None:
@@ -485,7 +508,12 @@ class Gadget2Snapshot(NbodySnapshot):
 
 
 		#Read in the particles positions and return the corresponding array
-		ids = ext._gadget2.getID(self.fp,offset,numPart)
+		if id_size==8:
+			self.fp.seek(offset)
+			ids = np.fromfile(self.fp,dtype=np.int64,count=numPart)
+		else:
+			ids = ext._gadget2.getID(self.fp,offset,numPart)
+		
 		if save:
 			self.id = ids
 			return self.id
@@ -495,7 +523,31 @@ class Gadget2Snapshot(NbodySnapshot):
 
 	############################################################################################
 
-	def write(self,filename,files=1):
+	def _bareHeader(self):
+
+		#Build a bare header based on the available info (need to convert units back to the Gadget ones)
+		_header_bare = self._header.copy()
+		_header_bare["box_size"] = _header_bare["box_size"].to(self.kpc_over_h).value
+		_header_bare["masses"] = _header_bare["masses"].to(u.g).value * _header_bare["h"] / self._mass_unit
+		_header_bare["num_particles_file_of_type"] = _header_bare["num_particles_file_of_type"].astype(np.int32)
+		_header_bare["num_particles_total_of_type"] = _header_bare["num_particles_total_of_type"].astype(np.int32)
+		_header_bare["comoving_distance"] = _header_bare["comoving_distance"].to(self.Mpc_over_h).value * 1.0e3
+
+		return _header_bare
+
+	def _splitFiles(self,files):
+
+		#Distribute particles among files: the last file might have a different number of particles
+		numPart = Gadget2Header(self._header).num_particles_total_64
+		particles_per_file = numPart // files
+
+		first = np.arange(files,dtype=np.int64) * particles_per_file
+		last = first + particles_per_file
+		last[-1] = numPart
+
+		return first,last
+
+	def write(self,filename,files=1,threads=None):
 
 		"""
 		Writes particles information (positions, velocities, etc...) to a properly formatter Gadget snapshot
@@ -506,6 +558,9 @@ class Gadget2Snapshot(NbodySnapshot):
 		:param files: number of files on which to split the writing of the snapshot (useful if the number of particles is large); if > 1 the extension ".n" is appended to the filename
 		:type files: int.
 
+		:param threads: number of files that are written in parallel; if None all the files are written at the same time
+		:type threads: int.
+
 		"""
 
 		#Sanity checks
@@ -515,14 +570,8 @@ class Gadget2Snapshot(NbodySnapshot):
 		if not hasattr(self,"_header"):
 			self.setHeaderInfo()	
 
-		#Build a bare header based on the available info (need to convert units back to the Gadget ones)
-		_header_bare = self._header.copy()
-		_header_bare["box_size"] = _header_bare["box_size"].to(self.kpc_over_h).value
-		_header_bare["masses"] = _header_bare["masses"].to(u.g).value * _header_bare["h"] / self._mass_unit
-		_header_bare["num_particles_file_of_type"] = _header_bare["num_particles_file_of_type"].astype(np.int32)
-		_header_bare["num_particles_total_of_type"] = _header_bare["num_particles_total_of_type"].astype(np.int32)
-		_header_bare["comoving_distance"] = _header_bare["comoving_distance"].to(self.Mpc_over_h).value * 1.0e3
-
+		#Build a bare header based on the available info
+		_header_bare = self._bareHeader()
 
 		#Convert units for positions and velocities
 		_positions_converted = self.positions.to(self.kpc_over_h).value.astype(np.float32)
@@ -545,32 +594,36 @@ class Gadget2Snapshot(NbodySnapshot):
 			self.header["files"] = [ "{0}.{1}".format(filename,n) for n in range(files) ]
 
 			#Distribute particles among files
-			particles_per_file = _header_bare["num_particles_total"] // files
+			first,last = self._splitFiles(files)
+			jobs = list()
 
-			#Write each file
-			for n in range(files - 1):
+			for n in range(files):
 				
 				#Update header
-				_header_bare["num_particles_file"] = particles_per_file
+				_header_file = _header_bare.copy()
+				_header_file["num_particles_file"] = last[n] - first[n]
 				#TODO all particles are DM, fix distribution in the future
-				_header_bare["num_particles_file_of_type"] = np.array([0,particles_per_file,0,0,0,0],dtype=np.int32)
+				_header_file["num_particles_file_of_type"] = np.array([0,last[n]-first[n],0,0,0,0]).astype(np.int32)
 
-				#Write it!
-				filename_with_extension = "{0}.{1}".format(filename,n)
-				ext._gadget2.write(_header_bare,_positions_converted[n*particles_per_file:(n+1)*particles_per_file],_velocities_converted[n*particles_per_file:(n+1)*particles_per_file],n*particles_per_file+1,filename_with_extension,writeVel)
+				if writeVel:
+					_velocities_file = _velocities_converted[first[n]:last[n]]
+				else:
+					_velocities_file = _velocities_converted
 
-			
-			#The last file might have a different number of particles
-			particles_last_file = len(_positions_converted[particles_per_file*(files-1):])
+				jobs.append((_header_file,_positions_converted[first[n]:last[n]],_velocities_file,int(first[n])+1,self.header["files"][n],writeVel))
 
-			#Update header
-			_header_bare["num_particles_file"] = particles_last_file
-			#TODO all particles are DM, fix distribution in the future
-			_header_bare["num_particles_file_of_type"] = np.array([0,particles_last_file,0,0,0,0],dtype=np.int32)
+			#Write them! The extension releases the GIL, so the files are written in parallel
+			if threads is None:
+				threads = files
 
-			#Write it!
-			filename_with_extension = "{0}.{1}".format(filename,files-1)
-			ext._gadget2.write(_header_bare,_positions_converted[particles_per_file*(files-1):],_velocities_converted[particles_per_file*(files-1):],(files-1)*particles_per_file+1,filename_with_extension,writeVel)
+			if threads>1:
+				pool = ThreadPool(min(threads,files))
+				pool.map(_writeJob,jobs)
+				pool.close()
+				pool.join()
+			else:
+				for job in jobs:
+					_writeJob(job)
 
 		else:
 
@@ -584,6 +637,127 @@ class Gadget2Snapshot(NbodySnapshot):
 			#Write it!!
 			ext._gadget2.write(_header_bare,_positions_converted,_velocities_converted,1,filename,writeVel)
 
+	def writeStream(self,filename,chunks,files=1,velocities=True,threads=None,max_pending=None):
+
+		"""
+		Writes particles to a properly formatted Gadget snapshot, streaming them chunk by chunk so that the full positions and velocities never need to be held in memory (useful for large initial conditions); the header must be set beforehand with setHeaderInfo(num_particles_file_of_type=...). Particle IDs are generated on the fly (8 byte ints if the number of particles does not fit in 32 bits)
+
+		:param filename: name of the file to which to write the snapshot
+		:type filename: str.
+
+		:param chunks: iterable (typically a generator) that yields the particles in ID order: (positions,velocities) tuples if velocities is True, just positions otherwise; each is a (n,3) array with units
+		:type chunks: iterable
+
+		:param files: number of files on which to split the writing of the snapshot; if > 1 the extension ".n" is appended to the filename
+		:type files: int.
+
+		:param velocities: if False, only positions are written
+		:type velocities: bool.
+
+		:param threads: number of threads that perform the writes; if None one thread per file is used
+		:type threads: int.
+
+		:param max_pending: maximum number of block writes in flight (bounds the memory footprint); if None twice the number of threads is used
+		:type max_pending: int.
+
+		"""
+
+		assert hasattr(self,"_header"),"The header must be set with setHeaderInfo before streaming particles!"
+
+		#Build a bare header based on the available info
+		_header_bare = self._bareHeader()
+		_header_bare["num_files"] = files
+
+		#Distribute particles among files
+		first,last = self._splitFiles(files)
+
+		if files>1:
+			self.header["files"] = [ "{0}.{1}".format(filename,n) for n in range(files) ]
+		else:
+			self.header["files"] = [ filename ]
+
+		if threads is None:
+			threads = files
+
+		if max_pending is None:
+			max_pending = 2*threads
+
+		#Write headers and record markers, and remember where each block starts
+		fps = list()
+		layouts = list()
+
+		for n in range(files):
+			
+			_header_file = _header_bare.copy()
+			_header_file["num_particles_file"] = last[n] - first[n]
+			#TODO all particles are DM, fix distribution in the future
+			_header_file["num_particles_file_of_type"] = np.array([0,last[n]-first[n],0,0,0,0]).astype(np.int32)
+
+			fps.append(open(self.header["files"][n],"wb"))
+			layouts.append(ext._gadget2.writeHeader(fps[-1],_header_file,int(last[n]-first[n]),int(velocities)))
+
+		pool = ThreadPool(threads)
+		pending = list()
+
+		try:
+
+			#IDs do not depend on the particles, they can be written right away
+			if velocities:
+				for n in range(files):
+					pos_offset,vel_offset,id_offset,size,id_size = layouts[n]
+					pending.append(pool.apply_async(ext._gadget2.writeID,(fps[n],id_offset,int(first[n])+1,int(last[n]-first[n]),id_size)))
+
+			#Stream the particles, splitting the chunks across file boundaries
+			cursor = 0
+			for chunk in chunks:
+
+				if velocities:
+					pos,vel = chunk
+					assert pos.shape==vel.shape
+					vel = (vel.to(u.cm/u.s).value / self._velocity_unit).astype(np.float32)
+				else:
+					pos = chunk
+					
+				assert pos.shape[1]==3
+				pos = pos.to(self.kpc_over_h).value.astype(np.float32)
+				
+				if cursor+len(pos)>last[-1]:
+					raise ValueError("More particles have been provided than the header advertises ({0})!".format(last[-1]))
+
+				start = cursor
+				while start<cursor+len(pos):
+
+					n = np.searchsorted(last,start,side="right")
+					stop = min(cursor+len(pos),last[n])
+					offset = 4*3*(start-first[n])
+					pos_offset,vel_offset,id_offset,size,id_size = layouts[n]
+
+					pending.append(pool.apply_async(ext._gadget2.writeBlock,(fps[n],int(pos_offset+offset),pos[start-cursor:stop-cursor])))
+					if velocities:
+						pending.append(pool.apply_async(ext._gadget2.writeBlock,(fps[n],int(vel_offset+offset),vel[start-cursor:stop-cursor])))
+
+					start = stop
+
+				cursor += len(pos)
+
+				#Bound the number of chunks in flight, so that memory stays under control
+				while len(pending)>max_pending:
+					pending.pop(0).get()
+
+			#Wait for all the writes to finish
+			for job in pending:
+				job.get()
+
+		finally:
+
+			pool.close()
+			pool.join()
+			for fp in fps:
+				fp.close()
+
+		if cursor!=last[-1]:
+			raise ValueError("{0} particles have been provided, but the header advertises {1}!".format(cursor,last[-1]))
+
 	############################################################################################
 	###########################Extra methods####################################################
 	############################################################################################
@@ -598,7 +772,13 @@ class Gadget2Snapshot(NbodySnapshot):
 		if num_particles_file_of_type is None:
 			num_particles_file_of_type = np.array([0,1,0,0,0,0],dtype=np.int32) * self.positions.shape[0]
 
-		assert num_particles_file_of_type.sum()==self.positions.shape[0],"The total number of particles must match!!"
+		if hasattr(self,"positions"):
+			assert num_particles_file_of_type.sum()==self.positions.shape[0],"The total number of particles must match!!"
+
+		#Particle numbers that do not fit in 32 bits spill into the high word
+		num_particles_file_of_type = np.asarray(num_particles_file_of_type).astype(np.int64)
+		if np.any(num_particles_file_of_type>>32):
+			npartTotalHighWord = (num_particles_file_of_type>>32).astype(np.uint32)
 		assert box_size.unit.physical_type=="length"
 		assert masses.unit.physical_type=="mass"
 
@@ -786,4 +966,282 @@ class Gadget2SnapshotPipe(Gadget2SnapshotDE):
 		self.virial_radius = None
 		self.concentration = None
 
+##################################################################
+#################Gadget2SnapshotSet class#########################
+##################################################################
+
+class Gadget2SnapshotSet(object):
+
+	"""
+	A class that handles a Gadget2 snapshot split across num_files files (snapshot_XXX.0,...,snapshot_XXX.N-1): the files are read concurrently by a pool of threads with bulk reads, and the particle information is assembled in a single contiguous array (or in a partition balanced by particle count among the tasks of an MPI pool)
+
+	"""
+
+	#Byte size of the blocks that separate two consecutive Fortran records
+	_void = 8
+
+	def __init__(self,snapshots,threads=None):
+
+		assert len(snapshots)>0,"A snapshot set must contain at least one file!"
+
+		self.snapshots = snapshots
+		self.threads = threads if (threads is not None) else len(snapshots)
+
+		#Merge the headers of the single files, this checks that the files belong to the same snapshot
+		self._header = reduce(add,[ snap.header for snap in snapshots ])
+
+		#Check that the particles in the files add up to the advertised total
+		num_particles_total = self._header.num_particles_total_64
+		num_particles_read = sum([ int(snap.header["num_particles_file"]) for snap in snapshots ])
+
+		if num_particles_read!=num_particles_total:
+			raise ValueError("The files contain {0} particles, but the header advertises {1} (is the set complete?)".format(num_particles_read,num_particles_total))
+
+	@classmethod
+	def open(cls,root,snapshot_class=Gadget2Snapshot,num_files=None,threads=None,header_kwargs=dict()):
+
+		"""
+		Opens all the files that make up a snapshot
+
+		:param root: root of the file names (the extension ".n" is appended to it); a list of file names is also accepted
+		:type root: str. or list.
+
+		:param snapshot_class: class that handles the single files
+		:type snapshot_class: subclass of Gadget2Snapshot
+
+		:param num_files: number of files in the set; if None it is read from the header of the first file
+		:type num_files: int.
+
+		:param threads: number of threads used for reading the files concurrently; if None one thread per file is used
+		:type threads: int.
+
+		:param header_kwargs: keyword arguments to pass to the getHeader method
+		:type header_kwargs: dict.
+
+		:rtype: Gadget2SnapshotSet
+
+		"""
+
+		if isinstance(root,list):
+			snapshots = [ snapshot_class.open(filename,header_kwargs=header_kwargs) for filename in root ]
+			return cls(snapshots,threads=threads)
+
+		#Read the number of files from the first one, if not specified
+		first = snapshot_class.open("{0}.0".format(root),header_kwargs=header_kwargs)
+		if num_files is None:
+			num_files = first.header["num_files"]
+
+		snapshots = [first] + [ snapshot_class.open("{0}.{1}".format(root,n),header_kwargs=header_kwargs) for n in range(1,num_files) ]
+		return cls(snapshots,threads=threads)
+
+	def __enter__(self):
+		return self
+
+	def __exit__(self,type,value,tb):
+		self.close()
+
+	def close(self):
+
+		"""
+		Closes all the files in the set
+
+		"""
+
+		for snap in self.snapshots:
+			snap.close()
+
+	@property
+	def header(self):
+
+		"""
+		Merged header of the files in the set
+
+		:rtype: Gadget2Header
+
+		"""
+
+		return self._header
+
+	############################################################################################
+
+	def partition(self,size):
+
+		"""
+		Balances the particles in the set among size tasks, regardless of how they are distributed among the files
+
+		:param size: number of tasks
+		:type size: int.
+
+		:returns: for each task, list of (file index,first,last) triplets that identify the particles the task should read (last excluded)
+		:rtype: list.
+
+		"""
+
+		counts = np.array([ snap.header["num_particles_file"] for snap in self.snapshots ],dtype=np.int64)
+		file_last = np.cumsum(counts)
+		file_first = file_last - counts
+		edges = (np.arange(size+1,dtype=np.int64) * file_last[-1]) // size
+
+		partition = list()
+		for r in range(size):
+			
+			chunks = list()
+			for n in range(len(self.snapshots)):
+				first = max(edges[r],file_first[n])
+				last = min(edges[r+1],file_last[n])
+				if last>first:
+					chunks.append((n,int(first-file_first[n]),int(last-file_first[n])))
+
+			partition.append(chunks)
+
+		return partition
+
+	def _idSize(self,snap):
+
+		#IDs are 4 byte ints by default, unless the record marker that precedes them says otherwise
+		npart = snap.header["num_particles_file"]
+		snap.fp.seek(4 + 256 + self._void + 2*(4*3*npart + self._void) - 4)
+		marker = np.frombuffer(snap.fp.read(4),dtype=np.int32)[0]
+
+		if marker==8*npart:
+			return 8
+		return 4
+
+	def _readBlock(self,block,pool):
+
+		#Which particles we need to read
+		if pool is None:
+			chunks = [ (n,0,snap.header["num_particles_file"]) for n,snap in enumerate(self.snapshots) ]
+		else:
+			chunks = self.partition(pool.size)[pool.rank]
+
+		#Data type and byte offset of the block inside each file
+		if block=="id":
+			itemsize = self._idSize(self.snapshots[0])
+			dtype = { 4:np.int32, 8:np.int64 }[itemsize]
+			width = 1
+		else:
+			itemsize = 4
+			dtype = np.float32
+			width = 3
+
+		numPart = sum([ last-first for (n,first,last) in chunks ])
+		data = np.empty((numPart,width),dtype=dtype)
+
+		#Each chunk is read straight into the corresponding slice of the contiguous array
+		jobs = list()
+		position = 0
+		for n,first,last in chunks:
+
+			snap = self.snapshots[n]
+			npart_file = snap.header["num_particles_file"]
+
+			offset = 4 + 256 + self._void
+			if block in ["velocities","id"]:
+				offset += 4*3*npart_file + self._void
+			if block=="id":
+				offset += 4*3*npart_file + self._void
+
+			offset += itemsize * width * first
+			jobs.append((snap.fp,offset,data[position:position+last-first]))
+			position += last - first
+
+		#Read the chunks concurrently (the extension releases the GIL during the reads)
+		if (self.threads>1) and (len(jobs)>1):
+			threads = ThreadPool(min(self.threads,len(jobs)))
+			threads.map(_readBlockJob,jobs)
+			threads.close()
+			threads.join()
+		else:
+			for job in jobs:
+				_readBlockJob(job)
+
+		if width==1:
+			return data.reshape(numPart)
+		
+		return data
+
+	############################################################################################
+
+	def getPositions(self,pool=None,save=True):
+
+		"""
+		Reads in the particle positions from all the files in the set
+
+		:param pool: if not None, only the particles in the share of the current task are read (see the partition method)
+		:type pool: MPIWhirlPool instance
+
+		:param save: if True saves the particles positions as attribute
+		:type save: bool.
+
+		:returns: numpy array with the particle positions
+
+		"""
+
+		snap = self.snapshots[0]
+		data = self._readBlock("positions",pool)
+
+		try:
+			positions = (data * snap.kpc_over_h).to(snap.Mpc_over_h)
+		except AttributeError:
+			positions = data * u.kpc
+
+		if save:
+			self.positions = positions
+
+		return positions
+
+	def getVelocities(self,pool=None,save=True):
+
+		"""
+		Reads in the particle velocities from all the files in the set
+
+		:param pool: if not None, only the particles in the share of the current task are read (see the partition method)
+		:type pool: MPIWhirlPool instance
+
+		:param save: if True saves the particles velocities as attribute
+		:type save: bool.
+
+		:returns: numpy array with the particle velocities
+
+		"""
+
+		velocities = self._readBlock("velocities",pool)
+		
+		#Scale units
+		velocities *= self.snapshots[0]._velocity_unit
+		velocities = velocities * u.cm / u.s
+
+		if save:
+			self.velocities = velocities
+
+		return velocities
+
+	def getID(self,pool=None,save=True):
+
+		"""
+		Reads in the particle IDs from all the files in the set (4 or 8 byte ints, depending on the snapshot)
+
+		:param pool: if not None, only the particles in the share of the current task are read (see the partition method)
+		:type pool: MPIWhirlPool instance
+
+		:param save: if True saves the particles IDs as attribute
+		:type save: bool.
+
+		:returns: numpy array with the particle IDs
+
+		"""
+
+		ids = self._readBlock("id",pool)
+
+		if save:
+			self.id = ids
+
+		return ids
+
+
+def _writeJob(job):
+	ext._gadget2.write(*job)
 
+def _readBlockJob(job):
+	ext._gadget2.readBlock(*job)
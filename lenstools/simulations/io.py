@@ -1,6 +1,10 @@
 from __future__ import division
 
 import re
+import json
+import zlib
+import mmap
+from multiprocessing.pool import ThreadPool
 
 import numpy as np
 import astropy.units as u
@@ -25,22 +29,8 @@ def readFITSHeader(filename):
 	with fits.open(filename) as fp:
 		return fp[0].header
 
-#Read
-def readFITS(cls,filename,init_cosmology=True):
-
-	#Read the FITS file with the plane information (if there are two HDU's the second one is the imaginary part)
-	if fitsio is not None:
-		hdu = fitsio(filename)
-	else:
-		hdu = fits.open(filename)
-			
-	if len(hdu)>2:
-		raise ValueError("There are more than 2 HDUs, file format unknown")
-
-	if fitsio is not None:
-		header = hdu[0].read_header()
-	else:
-		header = hdu[0].header
+#Parse the plane information contained in a header (FITS header or dictionary with the same keys)
+def _parsePlaneHeader(header,init_cosmology=True):
 
 	#Retrieve the info from the header (handle old FITS header format too)
 	try:
@@ -88,12 +78,34 @@ def readFITS(cls,filename,init_cosmology=True):
 		name,exponent = re.match(r"([a-zA-Z]+)([0-9])?",unit_string).groups()
 		unit = getattr(u,name)
 		if exponent is not None:
-			unit **= exponent
+			unit **= int(exponent)
 	except AttributeError:
 		unit = u.dimensionless_unscaled
 	except (ValueError,KeyError):
 		unit = u.rad**2
 
+	return angle,redshift,comoving_distance,cosmology,num_particles,unit
+
+#Read
+def readFITS(cls,filename,init_cosmology=True):
+
+	#Read the FITS file with the plane information (if there are two HDU's the second one is the imaginary part)
+	if fitsio is not None:
+		hdu = fitsio(filename)
+	else:
+		hdu = fits.open(filename)
+			
+	if len(hdu)>2:
+		raise ValueError("There are more than 2 HDUs, file format unknown")
+
+	if fitsio is not None:
+		header = hdu[0].read_header()
+	else:
+		header = hdu[0].header
+
+	#Retrieve the info from the header
+	angle,redshift,comoving_distance,cosmology,num_particles,unit = _parsePlaneHeader(header,init_cosmology)
+
 	#Instantiate the new PotentialPlane instance
 	if fitsio is not None:
 
@@ -115,6 +127,31 @@ def readFITS(cls,filename,init_cosmology=True):
 
 
 
+#Build the header entries (key,(value,comment)) that describe a plane
+def _planeHeader(self):
+
+	header = list()
+
+	header.append(("H0",(self.cosmology.H0.to(u.km/(u.s*u.Mpc)).value,"Hubble constant in km/s*Mpc")))
+	header.append(("h",(self.cosmology.h,"Dimensionless Hubble constant")))
+	header.append(("OMEGA_M",(self.cosmology.Om0,"Dark Matter density")))
+	header.append(("OMEGA_L",(self.cosmology.Ode0,"Dark Energy density")))
+	header.append(("W0",(self.cosmology.w0,"Dark Energy equation of state")))
+	header.append(("WA",(self.cosmology.wa,"Dark Energy running equation of state")))
+
+	header.append(("Z",(self.redshift,"Redshift of the lens plane")))
+	header.append(("CHI",(self.cosmology.h * self.comoving_distance.to(u.Mpc).value,"Comoving distance in Mpc/h")))
+
+	if self.side_angle.unit.physical_type=="angle":
+		header.append(("ANGLE",(self.side_angle.to(u.deg).value,"Side angle in degrees")))
+	elif self.side_angle.unit.physical_type=="length":
+		header.append(("SIDE",(self.side_angle.to(u.Mpc).value*self.cosmology.h,"Side length in Mpc/h")))
+
+	header.append(("NPART",(float(self.num_particles),"Number of particles on the plane")))
+	header.append(("UNIT",(self.unit.to_string(),"Pixel value unit")))
+
+	return header
+
 #Write
 def saveFITS(self,filename,double_precision):
 
@@ -139,23 +176,8 @@ def saveFITS(self,filename,double_precision):
 
 
 	#Generate a header
-	hdu.header["H0"] = (self.cosmology.H0.to(u.km/(u.s*u.Mpc)).value,"Hubble constant in km/s*Mpc")
-	hdu.header["h"] = (self.cosmology.h,"Dimensionless Hubble constant")
-	hdu.header["OMEGA_M"] = (self.cosmology.Om0,"Dark Matter density")
-	hdu.header["OMEGA_L"] = (self.cosmology.Ode0,"Dark Energy density")
-	hdu.header["W0"] = (self.cosmology.w0,"Dark Energy equation of state")
-	hdu.header["WA"] = (self.cosmology.wa,"Dark Energy running equation of state")
-
-	hdu.header["Z"] = (self.redshift,"Redshift of the lens plane")
-	hdu.header["CHI"] = (hdu.header["h"] * self.comoving_distance.to(u.Mpc).value,"Comoving distance in Mpc/h")
-
-	if self.side_angle.unit.physical_type=="angle":
-		hdu.header["ANGLE"] = (self.side_angle.to(u.deg).value,"Side angle in degrees")
-	elif self.side_angle.unit.physical_type=="length":
-		hdu.header["SIDE"] = (self.side_angle.to(u.Mpc).value*self.cosmology.h,"Side length in Mpc/h")
-
-	hdu.header["NPART"] = (float(self.num_particles),"Number of particles on the plane")
-	hdu.header["UNIT"] = (self.unit.to_string(),"Pixel value unit") 
+	for key,value in _planeHeader(self):
+		hdu.header[key] = value
 
 	#Save the plane
 	if self.space=="real":
@@ -165,4 +187,182 @@ def saveFITS(self,filename,double_precision):
 
 	hdulist.writeto(filename,overwrite=True)
 
-########################################################################################################################################
\ No newline at end of file
+########################################################################################################################################
+
+####################################################################
+#######################Tiled format#################################
+####################################################################
+
+#The plane is split in square tiles that are compressed independently, so that a subset of the tiles can be read (and decompressed in parallel) without touching the rest of the file
+#Layout: magic string, 8 byte header length, JSON header, tile index, compressed tiles
+
+TILES_MAGIC = b"LTTILES1"
+TILES_INDEX = np.dtype([("offset","<i8"),("nbytes","<i8"),("vmin","<f8"),("quantized","<i4")])
+
+#Shuffle the bytes of an array so that bytes of the same significance are contiguous (compresses much better)
+def _shuffle(data):
+	return data.view(np.uint8).reshape(-1,data.dtype.itemsize).T.tobytes()
+
+def _unshuffle(buf,dtype,shape):
+	dtype = np.dtype(dtype)
+	return np.frombuffer(buf,dtype=np.uint8).reshape(dtype.itemsize,-1).T.copy().view(dtype).reshape(shape)
+
+#Compress a tile: lossless, or quantized with absolute error at most tolerance
+def _compressTile(tile,tolerance,level):
+
+	if tolerance is None:
+		return zlib.compress(_shuffle(tile),level),0.0,0
+
+	vmin = float(tile.min())
+	quantized = np.round((tile.astype(np.float64) - vmin) / (2.0*tolerance))
+	
+	#Fall back on lossless if the dynamic range is too large for the tolerance
+	if quantized.max()>=2**31:
+		return zlib.compress(_shuffle(tile),level),0.0,0
+
+	return zlib.compress(_shuffle(quantized.astype(np.int32)),level),vmin,1
+
+#Read the header of a tiled plane file, and the position of the tile index
+def _readTilesHeader(fp):
+
+	if fp.read(len(TILES_MAGIC))!=TILES_MAGIC:
+		raise IOError("{0} is not a tiled plane file!".format(fp.name))
+
+	length = int(np.frombuffer(fp.read(8),dtype="<u8")[0])
+	header = json.loads(fp.read(length).decode("utf-8"))
+
+	return header,len(TILES_MAGIC) + 8 + length
+
+def readTilesHeader(filename):
+	with open(filename,"rb") as fp:
+		return _readTilesHeader(fp)[0]
+
+#Write
+def saveTiles(self,filename,double_precision=False,tile_size=256,tolerance=None,level=6,threads=None):
+
+	"""
+	Save a real space plane in tiled format
+
+	:param tile_size: side of the square tiles in pixels
+	:param tolerance: if not None, pixel values are quantized so that the absolute error is at most tolerance (lossy, much better compression)
+	:param level: zlib compression level
+	:param threads: number of threads used for compressing the tiles
+
+	"""
+
+	assert self.cosmology is not None
+	assert self.space=="real","Only real space planes can be saved in tiled format!"
+
+	data = self.data if double_precision else self.data.astype(np.float32)
+	ntiles = [ (n + tile_size - 1)//tile_size for n in data.shape ]
+
+	#Header with the same keys as the FITS one, plus the tiling info
+	header = dict([ (key,value[0]) for key,value in _planeHeader(self) ])
+	header["NAXIS1"] = data.shape[1]
+	header["NAXIS2"] = data.shape[0]
+	header["TILE"] = tile_size
+	header["NTILES1"] = ntiles[1]
+	header["NTILES2"] = ntiles[0]
+	header["DTYPE"] = data.dtype.str
+	header["TOL"] = tolerance
+	
+	#Compress the tiles in parallel (zlib releases the GIL)
+	tiles = [ data[ty*tile_size:(ty+1)*tile_size,tx*tile_size:(tx+1)*tile_size] for ty in range(ntiles[0]) for tx in range(ntiles[1]) ]
+	pool = ThreadPool(threads)
+	compressed = pool.map(lambda tile:_compressTile(tile,tolerance,level),tiles)
+	pool.close()
+	pool.join()
+
+	header_bytes = json.dumps(header).encode("utf-8")
+	index = np.zeros(len(tiles),dtype=TILES_INDEX)
+	offset = len(TILES_MAGIC) + 8 + len(header_bytes) + index.nbytes
+
+	for n,(buf,vmin,quantized) in enumerate(compressed):
+		index[n] = (offset,len(buf),vmin,quantized)
+		offset += len(buf)
+
+	#Write everything
+	with open(filename,"wb") as fp:
+		fp.write(TILES_MAGIC)
+		fp.write(np.array([len(header_bytes)],dtype="<u8").tobytes())
+		fp.write(header_bytes)
+		fp.write(index.tobytes())
+		for buf,vmin,quantized in compressed:
+			fp.write(buf)
+
+#Which tiles contain the pixels (i,j) and their neighbors up to a distance halo < TILE (periodic boundary conditions)
+def tilesCovering(header,i,j,halo=0):
+
+	tile_size = header["TILE"]
+	covered = np.zeros((header["NTILES2"],header["NTILES1"]),dtype=np.bool_)
+
+	i = np.asarray(i).ravel()
+	j = np.asarray(j).ravel()
+
+	#A pixel close to a tile border needs the neighboring tiles too
+	for ti in [ ((i - halo) % header["NAXIS2"]) // tile_size, ((i + halo) % header["NAXIS2"]) // tile_size ]:
+		for tj in [ ((j - halo) % header["NAXIS1"]) // tile_size, ((j + halo) % header["NAXIS1"]) // tile_size ]:
+			covered[ti,tj] = True
+
+	return covered
+
+#Read
+def readTiles(cls,filename,init_cosmology=True,tiles=None,shift=(0,0),threads=None):
+
+	"""
+	Read a plane in tiled format; tiles that are not selected are left to zero
+
+	:param tiles: boolean array of shape (NTILES2,NTILES1) that selects the tiles to read; if None all the tiles are read
+	:param shift: the plane is read already rolled by (shift[0],shift[1]) pixels along its axes, with periodic boundary conditions
+	:param threads: number of threads used for decompressing the tiles
+
+	"""
+
+	with open(filename,"rb") as fp:
+		header,index_offset = _readTilesHeader(fp)
+
+	angle,redshift,comoving_distance,cosmology,num_particles,unit = _parsePlaneHeader(header,init_cosmology)
+
+	shape = (header["NAXIS2"],header["NAXIS1"])
+	tile_size = header["TILE"]
+	ntiles = (header["NTILES2"],header["NTILES1"])
+	dtype = np.dtype(header["DTYPE"])
+	tolerance = header["TOL"]
+
+	if tiles is None:
+		tiles = np.ones(ntiles,dtype=np.bool_)
+
+	#np.zeros does not touch memory until written, so unread tiles cost (almost) nothing
+	data = np.zeros(shape,dtype=np.float64)
+
+	with open(filename,"rb") as fp:
+		
+		mm = mmap.mmap(fp.fileno(),0,access=mmap.ACCESS_READ)
+		index = np.frombuffer(mm[index_offset:index_offset+TILES_INDEX.itemsize*ntiles[0]*ntiles[1]],dtype=TILES_INDEX).reshape(ntiles)
+
+		def _readTile(t):
+
+			ty,tx = t
+			entry = index[ty,tx]
+			tile_shape = (min(tile_size,shape[0]-ty*tile_size),min(tile_size,shape[1]-tx*tile_size))
+			buf = zlib.decompress(mm[entry["offset"]:entry["offset"]+entry["nbytes"]])
+
+			if entry["quantized"]:
+				tile = entry["vmin"] + _unshuffle(buf,np.int32,tile_shape) * (2.0*tolerance)
+			else:
+				tile = _unshuffle(buf,dtype,tile_shape)
+
+			#Place the tile in the (rolled) plane
+			rows = (np.arange(ty*tile_size,ty*tile_size+tile_shape[0]) + shift[0]) % shape[0]
+			cols = (np.arange(tx*tile_size,tx*tile_size+tile_shape[1]) + shift[1]) % shape[1]
+			data[np.ix_(rows,cols)] = tile
+
+		#Decompress in parallel (zlib releases the GIL)
+		pool = ThreadPool(threads)
+		pool.map(_readTile,list(zip(*np.where(tiles))))
+		pool.close()
+		pool.join()
+		mm.close()
+
+	return cls(data,angle=angle,redshift=redshift,comoving_distance=comoving_distance,cosmology=cosmology,unit=unit,num_particles=num_particles,filename=filename)
+
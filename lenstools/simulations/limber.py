@@ -10,6 +10,9 @@
 
 """
 
+from collections import OrderedDict
+import numbers
+
 import numpy as np
 from scipy import interpolate,integrate
 
@@ -40,6 +43,11 @@ class LimberIntegrator(object):
 		#Define also the Mpc/h units for convenience
 		self.Mpc_over_h = def_unit("Mpc/h",Mpc/self.cosmoModel.h)
 
+		#Integration grid and lensing kernels are cached
+		self._grid = None
+		self._kernel_cache = OrderedDict()
+		self._kernel_cache_size = 64
+
 	def load3DPowerSpectrum(self,loader,*args,**kwargs):
 
 		"""
@@ -77,9 +85,115 @@ class LimberIntegrator(object):
 		self.kappa = self.kappa * kappa_units
 		self.power = self.power * power_units
 
+		#The cached integration grid and kernels are not valid anymore
+		self._grid = None
+		self._kernel_cache = OrderedDict()
+
+	########################################################################################
+
+	def _integrationGrid(self):
+
+		"""
+		Redshift integration grid (comoving distances, Simpson weights, redshift factors) and power spectrum table in Mpc units, as plain arrays; computed once
+
+		"""
+
+		if self._grid is not None:
+			return self._grid
+
+		assert hasattr(self,"kappa") and hasattr(self,"power"),"Load the 3D power spectrum first!"
+
+		grid = dict()
+		grid["chi"] = self.cosmoModel.comoving_distance(self.z).to(Mpc).value
+		grid["kappa"] = self.kappa.to(Mpc**-1).value
+		grid["power"] = np.ascontiguousarray(self.power.to(Mpc**3).value)
+		assert (np.diff(grid["kappa"])>0).all(),"wavenumbers must be increasing!"
+
+		#Simpson's rule is linear in the integrand: integrating the identity gives the weight of each node
+		grid["weights"] = integrate.simps(np.eye(len(self.z)),grid["chi"],axis=1)
+		grid["redshift_factor"] = (1.0 + self.z)**2
+		grid["normalization"] = ((9.0/4)*(self.cosmoModel.Om0)**2*(self.cosmoModel.H0/c)**4).to(Mpc**-4).value
+
+		self._grid = grid
+		return grid
+
+	def _diagonalPower(self,l):
+
+		"""
+		Matter power spectrum evaluated at k=l/chi(z) at the same redshift z, for each l and each z on the integration grid (linear interpolation in k, zero outside the tabulated range); memory and time scale as len(l)*len(z)
+
+		"""
+
+		grid = self._integrationGrid()
+		kappa = grid["kappa"]
+
+		#Wavenumber of each (l,z) pair
+		k = np.asarray(l,dtype=np.float64)[:,None] / grid["chi"][None,:]
+
+		#Linear interpolation along k for the same redshift column
+		index = np.clip(np.searchsorted(kappa,k) - 1,0,len(kappa)-2)
+		t = (k - kappa[index]) / (kappa[index+1] - kappa[index])
+		column = np.arange(len(self.z))[None,:]
+
+		power = (1.0-t)*grid["power"][index,column] + t*grid["power"][index+1,column]
+		power[(k<kappa[0]) | (k>kappa[-1])] = 0.0
+
+		return power
+
+	def lensingKernel(self,nz):
+
+		"""
+		Lensing efficiency of a source redshift distribution on the integration grid, q(z) = int_{z'>z} n(z')(1-chi(z)/chi(z'))dz'; kernels are cached for each distribution
+
+		:param nz: source redshift: either a single redshift or a tabulated distribution (z,n(z)) (which does not need to be normalized)
+		:type nz: float. or tuple of arrays
+
+		:returns: lensing kernel at each redshift of the integration grid
+		:rtype: array
+
+		"""
+
+		#Cache key
+		if isinstance(nz,numbers.Number):
+			key = float(nz)
+		else:
+			z_n,n = nz
+			assert len(z_n)==len(n),"The redshift distribution must be tabulated as (z,n(z)) arrays of the same length!"
+			key = (tuple(np.asarray(z_n,dtype=np.float64)),tuple(np.asarray(n,dtype=np.float64)))
+
+		if key in self._kernel_cache:
+			return self._kernel_cache[key]
+
+		grid = self._integrationGrid()
+		chi = grid["chi"]
+
+		#Single source redshift
+		if isinstance(nz,numbers.Number):
+			chi_s = self.cosmoModel.comoving_distance(nz).to(Mpc).value
+			kernel = np.clip(1.0 - chi/chi_s,0.0,None) if chi_s>0 else np.zeros_like(chi)
+
+		#Redshift distribution, interpolated on the integration grid and normalized
+		else:
+			n = np.interp(self.z,z_n,n,left=0.0,right=0.0)
+			w = np.gradient(self.z) * n
+			assert w.sum()>0,"The redshift distribution does not overlap with the integration grid!"
+			w /= w.sum()
+
+			#Sources at chi=0 (if the grid starts at z=0) are not lensed
+			ratio = np.divide(chi[:,None],chi[None,:],out=np.ones((len(chi),len(chi))),where=(chi[None,:]>0))
+			kernel = np.clip(1.0 - ratio,0.0,None).dot(w)
+
+		self._kernel_cache[key] = kernel
+		while len(self._kernel_cache)>self._kernel_cache_size:
+			self._kernel_cache.popitem(last=False)
+
+		return kernel
+
+	########################################################################################
+
 	def convergencePowerSpectrum(self,l):
 		"""
-		Computes the convergence power spectrum with the Limber integral of the 3D matter power spectrum; this still assumes a single source redshift at z0 = max(z) 
+		Computes the convergence power spectrum with the Limber integral of the 3D matter power spectrum; this still assumes a single source redshift at z0 = max(z) (see :py:meth:`tomographicPowerSpectrum` for arbitrary source distributions)
 	
 		:param l: multipole moments at which to compute the convergence power spectrum
 
@@ -89,29 +203,31 @@ class LimberIntegrator(object):
 
 		"""
 
-		z = self.z
+		return self.tomographicPowerSpectrum(l,[self.z[-1]])[0,0]
 
-		#Power spectrum normalization
-		normalization = (9.0/4)*(self.cosmoModel.Om0)**2*(self.cosmoModel.H0/c)**4
+	def tomographicPowerSpectrum(self,l,nz):
 
-		#Compute comoving distances and integral kernel (modify in case there is an arbitrary galaxy distribution)
-		chi = self.cosmoModel.comoving_distance(z)
-		chi0 = chi[-1]
-		kernel = (1.0 - chi/chi0)**2
+		"""
+		Computes all the auto and cross convergence power spectra of a set of source redshift distributions (tomographic bins) with the Limber integral of the 3D matter power spectrum, in a single vectorized pass: P(k=l/chi,z) is evaluated once for all the bins, and the lensing kernels are cached for each distribution
 
-		#############################################################
-		#Compute the integral for lensing convergence power spectrum#
-		#############################################################
-		
-		power_interpolation = interpolate.interp1d(self.kappa.to(chi.unit**-1),self.power,axis=0,bounds_error=False,fill_value=0.0)
-		lchi = np.outer(l,1.0/chi).reshape(len(l)*len(z))
+		:param l: multipole moments at which to compute the convergence power spectra
+		:type l: array
 
-		power_integrand = power_interpolation(lchi).reshape(len(l),len(z),len(z)).diagonal(axis1=1,axis2=2) * self.power.unit
-		full_integrand = kernel[np.newaxis,:] * (1.0 + z[np.newaxis,:])**2 * power_integrand
-	
-		#Finally compute the integral
-		C = integrate.simps(full_integrand,chi,axis=1) * normalization * full_integrand.unit * chi.unit
-		assert C.unit.physical_type == u"dimensionless"
+		:param nz: source redshift distributions, each is either a single source redshift or a tabulated distribution (z,n(z))
+		:type nz: list.
+
+		:returns: array of shape (len(nz),len(nz),len(l)) with the power spectra
+		:rtype: array
+
+		"""
+
+		grid = self._integrationGrid()
+
+		#Kernels of all the bins, with the integration weights
+		kernels = np.array([ self.lensingKernel(n) for n in nz ])
+		integrand = self._diagonalPower(l) * (grid["redshift_factor"] * grid["weights"])[None,:]
+
+		#All the pairs at once
+		C = np.einsum("az,bz,lz->abl",kernels,kernels,integrand) * grid["normalization"]
 
-		#Return the final result
-		return C.decompose().value
\ No newline at end of file
+		return C
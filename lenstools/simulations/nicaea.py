@@ -1,6 +1,7 @@
 from __future__ import division
 
 import types
+from multiprocessing.pool import ThreadPool
 
 import numpy as np
 from scipy.integrate import odeint
@@ -111,6 +112,73 @@ def _check_redshift(z,distribution,distribution_parameters,**kwargs):
 	return nzbins,nofz,Nnz,par_nz
 
 
+#Order of the cosmological parameters in the rows of the arrays accepted by the batched NICAEA evaluation
+_batch_parameters = ("Om0","Ode0","w0","wa","h","Ob0","Onu0","Neff","sigma8","ns")
+
+def _count_pairs(nzbins,tomo):
+
+	#Number of redshift bin pairs computed by NICAEA, depending on the tomography type
+	if tomo=="tomo_auto_only":
+		return nzbins
+	elif tomo=="tomo_cross_only":
+		return nzbins*(nzbins-1)//2
+	else:
+		return nzbins*(nzbins+1)//2
+
+def _nicaea_batch(cosmologies,spec,method,z,distribution,distribution_parameters,settings,threads,**kwargs):
+
+	if _nicaea is None:
+		raise ImportError("You need to install the Nicaea bindings to use this routine! Check your GSL/FFTW3 installations!")
+
+	assert isinstance(spec,np.ndarray)
+
+	#If no settings provided, use the default ones
+	if settings is None:
+		settings=NicaeaSettings.default()
+
+	#Cosmological parameters, one row per model
+	if isinstance(cosmologies,np.ndarray):
+		parameters = np.ascontiguousarray(cosmologies,dtype=np.float64)
+	else:
+		parameters = np.array([ c._batchParameters() for c in cosmologies ],dtype=np.float64)
+
+	assert parameters.ndim==2 and parameters.shape[1]==len(_batch_parameters),"cosmologies must have shape (Ncosmo,{0}), with the parameters ordered as {1}".format(len(_batch_parameters),_batch_parameters)
+
+	#Check sanity of input
+	nzbins,nofz,Nnz,par_nz = _check_redshift(z,distribution,distribution_parameters,**kwargs)
+	Npairs = _count_pairs(nzbins,settings["stomo"])
+	if Npairs==0:
+		raise ValueError("There is nothing to compute, you selected tomo_cross_only with only one redshift bin!!")
+
+	Ncosmo = parameters.shape[0]
+	spec = np.ascontiguousarray(spec,dtype=np.float64)
+
+	#The output is filled in place
+	output = np.zeros((Ncosmo,len(spec),Npairs))
+	Nitems = Ncosmo*Npairs
+
+	if threads is None or threads<=1 or Nitems<2:
+		_nicaea.batch(parameters,nzbins,spec,Nnz,nofz,par_nz,settings,method,output,0,Nitems)
+
+	else:
+
+		#Each thread builds its own models: split along the cosmologies when possible, so the NICAEA tables of a model are computed only once
+		if Ncosmo>=threads:
+			edges = np.linspace(0,Ncosmo,threads+1).astype(int)*Npairs
+		else:
+			edges = np.linspace(0,Nitems,min(threads,Nitems)+1).astype(int)
+
+		pool = ThreadPool(len(edges)-1)
+
+		try:
+			pool.map(lambda n:_nicaea.batch(parameters,nzbins,spec,Nnz,nofz,par_nz,settings,method,output,edges[n],edges[n+1]),range(len(edges)-1))
+		finally:
+			pool.close()
+			pool.join()
+
+	return output
+
+
 ##################################################################
 ######Useful for integrating the linear growth factor ODE#########
 ##################################################################
@@ -438,5 +506,91 @@ class Nicaea(w0waCDM):
 		else:
 			return two_point_function_nicaea
 
+	################################################################################################################
+
+	def _batchParameters(self):
+		return np.array([self.Om0,self.Ode0,self.w0,self.wa,self.H0.value/100.0,self.Ob0,self.Onu0,self.Neff,self.sigma8,self.ns])
+
+	@classmethod
+	def batchPowerSpectrum(cls,cosmologies,ell,z=2.0,distribution=None,distribution_parameters=None,settings=None,threads=None,**kwargs):
+
+		"""
+		Computes the convergence power spectrum for a batch of cosmological models using NICAEA; the models and the redshift bin pairs are split between threads, each with its own NICAEA models, since the computations run without holding the GIL
+
+		:param cosmologies: cosmological models, either a list of Nicaea instances or an (Ncosmo,10) array whose columns are (Om0,Ode0,w0,wa,h,Ob0,Onu0,Neff,sigma8,ns)
+		:type cosmologies: list or array
+
+		:param ell: multipole moments at which to compute the power spectrum
+		:type ell: array.
+
+		:param z: redshift bins for the sources (same as convergencePowerSpectrum)
+		:type z: float., array or None
+
+		:param distribution: redshift distribution of the sources (same as convergencePowerSpectrum)
+		:type distribution: None,callable or list
+
+		:param distribution_parameters: redshift distribution parameters (same as convergencePowerSpectrum)
+		:type distribution_parameters: str. or list.
+
+		:param settings: NICAEA code settings
+		:type settings: NicaeaSettings instance
+
+		:param threads: number of threads to use
+		:type threads: int.
 
+		:param kwargs: the keyword arguments are passed to the distribution, if callable
+		:type kwargs: dict.
+
+		:returns: ( Ncosmo x Nl x Nz array ) computed power spectra at the selected multipoles (cross components in row major C ordering)
+
+		"""
+
+		return _nicaea_batch(cosmologies,ell,0,z,distribution,distribution_parameters,settings,threads,**kwargs)
+
+
+	@classmethod
+	def batchTwoPoint(cls,cosmologies,theta,z=2.0,distribution=None,distribution_parameters=None,settings=None,kind="+",threads=None,**kwargs):
+
+		"""
+		Computes the shear two point function for a batch of cosmological models using NICAEA, with the same parallelization as batchPowerSpectrum
+
+		:param cosmologies: cosmological models, either a list of Nicaea instances or an (Ncosmo,10) array whose columns are (Om0,Ode0,w0,wa,h,Ob0,Onu0,Neff,sigma8,ns)
+		:type cosmologies: list or array
+
+		:param theta: angles at which to compute the two point function 
+		:type theta: array. with units
+
+		:param z: redshift bins for the sources (same as shearTwoPoint)
+		:type z: float., array or None
+
+		:param distribution: redshift distribution of the sources (same as shearTwoPoint)
+		:type distribution: None,callable or list
+
+		:param distribution_parameters: redshift distribution parameters (same as shearTwoPoint)
+		:type distribution_parameters: str. or list.
+
+		:param settings: NICAEA code settings
+		:type settings: NicaeaSettings instance
+
+		:param kind: must be "+" or "-"
+		:type kind: str.
+
+		:param threads: number of threads to use
+		:type threads: int.
+
+		:param kwargs: the keyword arguments are passed to the distribution, if callable
+		:type kwargs: dict.
+
+		:returns: ( Ncosmo x Nt x Nz array ) computed two point functions at the selected angles (cross components in row major C ordering)
+
+		"""
+
+		#Plus or minus?
+		if kind=="+":
+			pm = 1
+		elif kind=="-":
+			pm = -1
+		else:
+			raise ValueError("kind must be either + or -")
 
+		return _nicaea_batch(cosmologies,theta.to(u.rad).value,pm,z,distribution,distribution_parameters,settings,threads,**kwargs)
@@ -1,5 +1,6 @@
-from ..image.convergence import Spin0,ConvergenceMap,OmegaMap
+from ..image.convergence import Spin0,ConvergenceMap,OmegaMap,_sampleLayers
 from ..image.shear import Spin1,Spin2,ShearMap
+from ..catalog import ShearCatalog
 
 import sys
 import time
@@ -25,7 +26,7 @@ fftengine = NUMPYFFTPack()
 
 from astropy.units import km,s,Mpc,rad,deg,dimensionless_unscaled,quantity
 
-from .io import readFITSHeader,readFITS,saveFITS
+from .io import readFITSHeader,readFITS,saveFITS,readTilesHeader,readTiles,saveTiles,tilesCovering
 from .camb import TransferFunction
 
 #Enable garbage collection if not active already
@@ -75,7 +76,7 @@ class Plane(Spin0):
 		:param filename: name of the file
 		:type filename: str.
 
-		:param format: format of the file, only FITS implemented so far; if None, it's detected automatically from the filename
+		:param format: format of the file (fits or tiles); if None, it's detected automatically from the filename
 		:type format: str.
 
 		:returns: header object
@@ -87,12 +88,16 @@ class Plane(Spin0):
 			extension = filename.split(".")[-1]
 			if extension in ["fit","fits"]:
 				format="fits"
+			elif extension=="tiles":
+				format="tiles"
 			else:
 				raise IOError("File format not recognized from extension '{0}', please specify it manually".format(extension))
 
 
 		if format=="fits":
 			return readFITSHeader(filename)
+		elif format=="tiles":
+			return readTilesHeader(filename)
 		else:
 			raise ValueError("Format {0} not implemented yet!!".format(format))
 
@@ -123,20 +128,23 @@ class Plane(Spin0):
 		return angle_scale.to(deg),pixel_scale
 
 
-	def save(self,filename,format=None,double_precision=False):
+	def save(self,filename,format=None,double_precision=False,**kwargs):
 
 		"""
-		Saves the Plane to an external file, of which the format can be specified (only fits implemented so far)
+		Saves the Plane to an external file, of which the format can be specified (fits, or tiles for the compressed tiled format that allows reading only part of the plane)
 
 		:param filename: name of the file on which to save the plane
 		:type filename: str.
 
-		:param format: format of the file, only FITS implemented so far; if None, it's detected automatically from the filename
+		:param format: format of the file (fits or tiles); if None, it's detected automatically from the filename
 		:type format: str.
 
 		:param double_precision: if True saves the Plane in double precision
 		:type double_precision: bool.
 
+		:param kwargs: passed to the writer of the tiled format (tile_size, tolerance, level, threads)
+		:type kwargs: dict.
+
 		"""
 
 		if format is None:
@@ -144,30 +152,37 @@ class Plane(Spin0):
 			extension = filename.split(".")[-1]
 			if extension in ["fit","fits"]:
 				format="fits"
+			elif extension=="tiles":
+				format="tiles"
 			else:
 				raise IOError("File format not recognized from extension '{0}', please specify it manually".format(extension))
 
 		if format=="fits":
 			saveFITS(self,filename=filename,double_precision=double_precision)
+		elif format=="tiles":
+			saveTiles(self,filename=filename,double_precision=double_precision,**kwargs)
 		else:
 			raise ValueError("Format {0} not implemented yet!!".format(format))
 
 
 	@classmethod
-	def load(cls,filename,format=None,init_cosmology=True):
+	def load(cls,filename,format=None,init_cosmology=True,**kwargs):
 
 		"""
-		Loads the Plane from an external file, of which the format can be specified (only fits implemented so far)
+		Loads the Plane from an external file, of which the format can be specified (fits or tiles)
 
 		:param filename: name of the file from which to load the plane
 		:type filename: str.
 
-		:param format: format of the file, only FITS implemented so far; if None, it's detected automatically from the filename
+		:param format: format of the file (fits or tiles); if None, it's detected automatically from the filename
 		:type format: str.
 
 		:param init_cosmology: if True, instantiates the cosmology attribute of the PotentialPlane
 		:type init_cosmology: bool.
 
+		:param kwargs: passed to the reader of the tiled format (tiles, shift, threads)
+		:type kwargs: dict.
+
 		:returns: PotentialPlane instance that wraps the data contained in the file
 
 		"""
@@ -177,12 +192,16 @@ class Plane(Spin0):
 			extension = filename.split(".")[-1]
 			if extension in ["fit","fits"]:
 				format="fits"
+			elif extension=="tiles":
+				format="tiles"
 			else:
 				raise IOError("File format not recognized from extension '{0}', please specify it manually".format(extension))
 
 
 		if format=="fits":
 			return readFITS(cls,filename=filename,init_cosmology=init_cosmology)
+		elif format=="tiles":
+			return readTiles(cls,filename=filename,init_cosmology=init_cosmology,**kwargs)
 		else:
 			raise ValueError("Format {0} not implemented yet!!".format(format))
 
@@ -261,10 +280,10 @@ class Plane(Spin0):
 		self.space="fourier"
 
 
-	def getValues(self,x,y):
+	def getValues(self,x,y,method="nearest",threads=None):
 
 		"""
-		Extract the map values at the requested (x,y) positions; this is implemented using the numpy fast indexing routines, so the formats of x and y must follow the numpy advanced indexing rules. Periodic boundary conditions are enforced
+		Extract the map values at the requested (x,y) positions, interpolating between pixels if requested; the sampling is done in a single compiled pass. Periodic boundary conditions are enforced
 
 		:param x: x coordinates at which to extract the map values (if unitless these are interpreted as radians)
 		:type x: numpy array or quantity 
@@ -272,15 +291,19 @@ class Plane(Spin0):
 		:param y: y coordinates at which to extract the map values (if unitless these are interpreted as radians)
 		:type y: numpy array or quantity 
 
-		:returns: numpy array with the map values at the specified positions, with the same shape as x and y
+		:param method: interpolation method ("nearest", "bilinear" or "bicubic")
+		:type method: str.
+
+		:param threads: number of threads to use in the sampling
+		:type threads: int.
 
-		:raises: IndexError if the formats of x and y are not the proper ones
+		:returns: numpy array with the map values at the specified positions, with the same shape as x and y
 
 		"""
 
 		assert isinstance(x,np.ndarray) and isinstance(y,np.ndarray)
 
-		#x coordinates
+		#x coordinates in pixel units
 		if type(x)==quantity.Quantity:
 			
 			assert x.unit.physical_type=="angle"
@@ -289,13 +312,13 @@ class Plane(Spin0):
 			if self.resolution.unit.physical_type=="length":
 				x = x.to(rad).value*self.comoving_distance 
 
-			j = np.mod(((x / self.resolution).decompose().value).astype(np.int32),self.data.shape[1])
+			x = (x / self.resolution).decompose().value
 
 		else:
 
-			j = np.mod((x / self.resolution.to(rad).value).astype(np.int32),self.data.shape[1])	
+			x = x / self.resolution.to(rad).value
 
-		#y coordinates
+		#y coordinates in pixel units
 		if type(y)==quantity.Quantity:
 			
 			assert y.unit.physical_type=="angle"
@@ -304,16 +327,16 @@ class Plane(Spin0):
 			if self.resolution.unit.physical_type=="length":
 				y = y.to(rad).value*self.comoving_distance
 
-			i = np.mod(((y / self.resolution).decompose().value).astype(np.int32),self.data.shape[0])
+			y = (y / self.resolution).decompose().value
 
 		else:
 
-			i = np.mod((y / self.resolution.to(rad).value).astype(np.int32),self.data.shape[0])
+			y = y / self.resolution.to(rad).value
 
 		#Return the map values at the specified coordinates
-		return self.data[i,j]
+		return _sampleLayers(self.data,x,y,method=method,threads=threads)
 
-	def _grad(self,x=None,y=None,lmesh=None):
+	def _grad(self,x=None,y=None,lmesh=None,interpolation="nearest"):
 
 		now = time.time()
 		last_timestamp = now
@@ -326,7 +349,7 @@ class Plane(Spin0):
 				y = y.to(rad).value * self.comoving_distance
 			
 			#Compute the gradient of the potential map
-			deflection_x,deflection_y = self.gradient(x,y)
+			deflection_x,deflection_y = self.gradient(x,y,interpolation=interpolation)
 			deflection = np.array([deflection_x,deflection_y])
 		
 		elif self.space=="fourier":
@@ -569,7 +592,7 @@ class PotentialPlane(Plane):
 	"""
 
 	
-	def deflectionAngles(self,x=None,y=None,lmesh=None):
+	def deflectionAngles(self,x=None,y=None,lmesh=None,interpolation="nearest"):
 
 		"""
 		Computes the deflection angles for the given lensing potential by taking the gradient of the potential map; it is also possible to proceed with FFTs
@@ -583,11 +606,14 @@ class PotentialPlane(Plane):
 		:param lmesh: the FFT frequency meshgrid (lx,ly) necessary for the calculations in fourier space; if None, a new one is computed from scratch (must have the appropriate dimensions)
 		:type lmesh: array
 
+		:param interpolation: if x,y are specified, "nearest" uses the deflection of the pixel each ray falls into, "bilinear" interpolates the deflections between the closest pixel centers
+		:type interpolation: str.
+
 		:returns: DeflectionPlane instance, or array with deflections of rays hitting the lens at (x,y)
 
 		"""
 
-		deflection = self._grad(x,y,lmesh)
+		deflection = self._grad(x,y,lmesh,interpolation=interpolation)
 
 		assert deflection.unit.physical_type=="angle"
 		deflection = deflection.to(rad)
@@ -604,7 +630,7 @@ class PotentialPlane(Plane):
 
 	#########################################################################################################################################
 
-	def shearMatrix(self,x=None,y=None,lmesh=None):
+	def shearMatrix(self,x=None,y=None,lmesh=None,interpolation="nearest"):
 
 		"""
 		Computes the shear matrix for the given lensing potential; it is also possible to proceed with FFTs
@@ -618,6 +644,9 @@ class PotentialPlane(Plane):
 		:param lmesh: the FFT frequency meshgrid (lx,ly) necessary for the calculations in fourier space; if None, a new one is computed from scratch (must have the appropriate dimensions)
 		:type lmesh: array
 
+		:param interpolation: if x,y are specified, "nearest" uses the shear matrix of the pixel each ray falls into, "bilinear" interpolates the shear matrices between the closest pixel centers
+		:type interpolation: str.
+
 		:returns: ShearTensorPlane instance, or array with deflections of rays hitting the lens at (x,y)
 
 		"""
@@ -633,7 +662,7 @@ class PotentialPlane(Plane):
 				y = y.to(rad).value * self.comoving_distance
 			
 			#Compute the second derivatives
-			tensor = np.array(self.hessian(x,y))
+			tensor = np.array(self.hessian(x,y,interpolation=interpolation))
 
 		elif self.space=="fourier":
 
@@ -1033,11 +1062,14 @@ class RayTracer(object):
 		logray.debug("Added lens at redshift {0:.3f}(comoving distance {1:.3f})".format(self.redshift[-1],self.distance[-1]))
 
 	#Load the lens
-	def loadLens(self,lens):
+	def loadLens(self,lens,positions=None,halo=3):
 
 		if type(lens)==self.lens_type:
 			return lens
 
+		elif (type(lens)==str) and (positions is not None) and lens.endswith(".tiles"):
+			return self._loadLensTiles(lens,positions,halo=halo)
+
 		elif type(lens)==str:
 				
 			logray.info("Reading plane from {0}...".format(lens))
@@ -1056,6 +1088,36 @@ class RayTracer(object):
 			raise TypeError("Lens format not recognized!")
 
 
+	#Load only the tiles of the lens that the light rays hit (plus the halo needed by the finite difference stencils)
+	def _loadLensTiles(self,lens,positions,halo=3):
+
+		header = readTilesHeader(lens)
+		shape = (header["NAXIS2"],header["NAXIS1"])
+
+		#Pixels hit by the rays
+		x = positions[0].to(rad).value
+		y = positions[1].to(rad).value
+
+		if "ANGLE" in header:
+			resolution = (header["ANGLE"]*deg).to(rad).value / shape[1]
+		else:
+			resolution = header["SIDE"] / (header["CHI"] * shape[1])
+
+		j = (x / resolution).astype(np.int32) % shape[1]
+		i = (y / resolution).astype(np.int32) % shape[0]
+
+		#Draw the random roll in the same way as randomRoll does, then find which tiles of the unrolled plane are needed
+		shift = (np.random.randint(0,shape[0]),np.random.randint(0,shape[1]))
+		tiles = tilesCovering(header,(i-shift[0]) % shape[0],(j-shift[1]) % shape[1],halo=halo)
+
+		logray.info("Reading {0} of {1} tiles from {2}, rolled by {3}...".format(tiles.sum(),tiles.size,lens,shift))
+		current_lens = self.lens_type.load(lens,format="tiles",tiles=tiles,shift=shift)
+		logray.info("Read tiles from {0}...".format(lens))
+		logstderr.debug("Read plane tiles: peak memory usage {0:.3f} (task)".format(peakMemory()))
+
+		return current_lens
+
+
 	def randomRoll(self,seed=None):
 
 		"""
@@ -1090,7 +1152,7 @@ class RayTracer(object):
 	#############################(backward ray tracing)###############################################################################
 	##################################################################################################################################
 
-	def shoot(self,initial_positions,z=2.0,initial_deflection=None,kind="positions",save_intermediate=False,compute_all_deflections=False,callback=None,transfer=None,**kwargs):
+	def shoot(self,initial_positions,z=2.0,initial_deflection=None,kind="positions",save_intermediate=False,compute_all_deflections=False,callback=None,transfer=None,interpolation="nearest",**kwargs):
 
 		"""
 		Shots a bucket of light rays from the observer to the sources at redshift z (backward ray tracing), through the system of gravitational lenses, and computes the deflection statistics
@@ -1119,6 +1181,9 @@ class RayTracer(object):
 		:param transfer: if not None, scales the fluctuations on each lens plane to a different redshift (before computing the ray defections) using a provided transfer function 
 		:type transfer: :py:class:`TransferSpecs`
 
+		:param interpolation: "nearest" uses the deflections and shear matrices of the lens pixel each ray falls into, "bilinear" interpolates them between the closest pixel centers
+		:type interpolation: str.
+
 		:param kwargs: the keyword arguments are passed to the callback if not None
 		:type kwargs: dict.
 
@@ -1132,6 +1197,7 @@ class RayTracer(object):
 		assert type(initial_positions)==quantity.Quantity and initial_positions.unit.physical_type=="angle"
 		assert kind in ["positions","jacobians","shear","convergence"],"kind must be one in [positions,jacobians,shear,convergence]!"
 		assert transfer is None or isinstance(transfer,TransferSpecs)
+		assert interpolation in ["nearest","bilinear"],"interpolation must be one of [nearest,bilinear]!"
 
 		#Allocate arrays for the intermediate light ray positions and deflections
 
@@ -1187,8 +1253,12 @@ class RayTracer(object):
 		#This is the main loop that goes through all the lenses
 		for k in range(last_lens+1):
 
-			#Load in the lens
-			current_lens = self.loadLens(lens[k])
+			#Load in the lens (if the deflections are computed only where the rays hit, the tiled format allows to read only part of the lens)
+			if compute_all_deflections or (transfer is not None):
+				current_lens = self.loadLens(lens[k])
+			else:
+				current_lens = self.loadLens(lens[k],positions=current_positions,halo=(3 if interpolation=="nearest" else 4))
+			
 			np.testing.assert_approx_equal(current_lens.redshift,self.redshift[k],significant=4,err_msg="Loaded lens ({0}) redshift does not match info file specifications {1} neq {2}!".format(k,current_lens.redshift,self.redshift[k]))
 
 			#If transfer function is provided, scale to target redshift
@@ -1202,9 +1272,9 @@ class RayTracer(object):
 
 			#Compute the deflection angles and log timestamp
 			if compute_all_deflections:
-				deflections = current_lens.deflectionAngles(lmesh=self.lmesh).getValues(current_positions[0],current_positions[1])
+				deflections = current_lens.deflectionAngles(lmesh=self.lmesh).getValues(current_positions[0],current_positions[1],method=interpolation)
 			else:
-				deflections = current_lens.deflectionAngles(current_positions[0],current_positions[1])
+				deflections = current_lens.deflectionAngles(current_positions[0],current_positions[1],interpolation=interpolation)
 
 			now = time.time()
 			logray.debug("Retrieval of deflection angles from potential planes completed in {0:.3f}s".format(now-last_timestamp))
@@ -1215,9 +1285,9 @@ class RayTracer(object):
 			if kind in ["jacobians","convergence","shear"]:
 
 				if compute_all_deflections:
-					shear_tensors = current_lens.shearMatrix(lmesh=self.lmesh).getValues(current_positions[0],current_positions[1])
+					shear_tensors = current_lens.shearMatrix(lmesh=self.lmesh).getValues(current_positions[0],current_positions[1],method=interpolation)
 				else:
-					shear_tensors = current_lens.shearMatrix(current_positions[0],current_positions[1])
+					shear_tensors = current_lens.shearMatrix(current_positions[0],current_positions[1],interpolation=interpolation)
 
 				now = time.time()
 				logray.debug("Shear matrices retrieved in {0:.3f}s".format(now-last_timestamp))
@@ -1325,6 +1395,94 @@ class RayTracer(object):
 			else:
 				return current_jacobian
 
+	##################################################################################
+	###########Ray tracing of galaxy catalogs#########################################
+	##################################################################################
+
+	def shootCatalog(self,catalogs,z_field="z",reduced_shear=False,interpolation="bilinear",tile_angle=0.25*deg,save=None,**kwargs):
+
+		"""
+		Traces the light rays coming from the galaxies of one or more position catalogs (e.g. one for each redshift slice) in a single pass through the lenses, each galaxy being traced up to its own redshift. The galaxies are sorted in spatial tiles before the traversal, so the rays that hit the same region of a lens are processed together (and only the lens tiles that are actually hit are read, if the lenses are stored in tiled format); deflections and shear matrices are evaluated only at the galaxy positions, with local finite differences
+
+		:param catalogs: position catalogs, with x,y positions (according to their spatial information) and redshift columns
+		:type catalogs: list of :py:class:`~lenstools.catalog.Catalog`
+
+		:param z_field: name of the redshift column of the position catalogs
+		:type z_field: str.
+
+		:param reduced_shear: if True compute the reduced shear, otherwise the shear
+		:type reduced_shear: bool.
+
+		:param interpolation: "nearest" or "bilinear" (see :py:meth:`shoot`)
+		:type interpolation: str.
+
+		:param tile_angle: angular size of the tiles the galaxies are sorted in
+		:type tile_angle: quantity
+
+		:param save: if not None, list of file names (one for each position catalog) the shear catalogs are saved to
+		:type save: list.
+
+		:param kwargs: additional keyword arguments are passed to :py:meth:`shoot`
+		:type kwargs: dict.
+
+		:returns: shear catalogs, one for each position catalog
+		:rtype: list of :py:class:`~lenstools.catalog.ShearCatalog`
+
+		"""
+
+		#Safety check
+		if not isinstance(catalogs,(list,tuple)):
+			catalogs = [catalogs]
+
+		if (save is not None) and (len(save)!=len(catalogs)):
+			raise ValueError("There must be a file name for each catalog!")
+
+		assert tile_angle.unit.physical_type=="angle"
+		for c in catalogs:
+			assert z_field in c.columns,"There is no {0} field in the catalog!".format(z_field)
+
+		#Collect all the galaxies (positions in radians) and their redshifts
+		sizes = [ len(c) for c in catalogs ]
+		x = np.concatenate([ (np.asarray(c.columns[c._field_x])*c._position_unit).to(rad).value for c in catalogs ])
+		y = np.concatenate([ (np.asarray(c.columns[c._field_y])*c._position_unit).to(rad).value for c in catalogs ])
+		z = np.concatenate([ np.asarray(c.columns[z_field],dtype=np.float64) for c in catalogs ])
+
+		#Sort the galaxies by spatial tile, and by position inside the tile
+		tile = tile_angle.to(rad).value
+		tx = np.floor(x/tile).astype(np.int64)
+		ty = np.floor(y/tile).astype(np.int64)
+		order = np.lexsort((x,y,tx - tx.min(),ty - ty.min()))
+
+		logray.info("Tracing {0} galaxies from {1} catalogs, sorted in {2} tiles".format(len(x),len(catalogs),len(np.unique(ty[order]*(tx.max()-tx.min()+1) + tx[order]))))
+
+		#Trace the jacobians in a single traversal of the lenses
+		positions = np.array([x[order],y[order]]) * rad
+		jacobian = np.empty((4,len(x)))
+		jacobian[:,order] = self.shoot(positions,z=z[order],kind="jacobians",interpolation=interpolation,**kwargs)
+
+		#Shear (or reduced shear) of each galaxy
+		if reduced_shear:
+			shear1 = (jacobian[3]-jacobian[0])/(jacobian[3]+jacobian[0])
+			shear2 = -(jacobian[1]+jacobian[2])/(jacobian[3]+jacobian[0])
+		else:
+			shear1 = 0.5*(jacobian[3]-jacobian[0])
+			shear2 = -0.5*(jacobian[1]+jacobian[2])
+
+		#Split back in the original catalogs
+		shear_catalogs = list()
+		edges = np.concatenate(([0],np.cumsum(sizes)))
+
+		for n in range(len(catalogs)):
+
+			shear_catalog = ShearCatalog([shear1[edges[n]:edges[n+1]],shear2[edges[n]:edges[n+1]]],names=("shear1","shear2"))
+			shear_catalogs.append(shear_catalog)
+
+			if save is not None:
+				logray.info("Saving shear catalog to {0}".format(save[n]))
+				shear_catalog.write(save[n],overwrite=True)
+
+		return shear_catalogs
+
 	##################################################################################
 	###########Direct calculation of the convergence with Born approximation##########
 	##################################################################################
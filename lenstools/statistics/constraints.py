@@ -13,8 +13,10 @@
 from __future__ import division,print_function,with_statement
 
 import sys
+import copy
 from operator import mul
 from functools import reduce
+from multiprocessing.pool import ThreadPool
 
 if sys.version_info.major>=3:
 	import _pickle as pickle
@@ -26,9 +28,7 @@ else:
 import numpy as np
 import pandas as pd
 
-from scipy import stats,interpolate
-
-from emcee.ensemble import _function_wrapper
+from scipy import stats,interpolate,linalg,special
 
 try:
 	from matplotlib.patches import Ellipse
@@ -65,16 +65,100 @@ def chi2(parameters,*args,**kwargs):
 	inverse_covariance_dot = np.dot(observed_feature - model_feature,inverse_covariance)
 
 	return ((observed_feature - model_feature) * inverse_covariance_dot).sum(-1)
+
+#######################################################################
+##########Streaming chi2 calculation with a Cholesky factor############
+#######################################################################
+
+class Chi2Scorer(object):
+
+	"""
+	Computes the chi2 of an observed feature with respect to the emulated features on a (possibly very large) set of parameter points. The covariance matrix is Cholesky factorized once; the points are then processed in blocks, and for each block the prediction, the residuals, the triangular solve and the squared norm are computed in sequence, so the memory usage is proportional to block_size x Nbins instead of Npoints x Nbins
+
+	:param interpolator: trained emulator interpolator
+	:type interpolator: :py:class:`RbfInterpolator`, callable or list
+
+	:param observed_feature: observed feature on which to condition the parameter likelihood
+	:type observed_feature: array
+
+	:param features_covariance: covariance matrix of the features
+	:type features_covariance: array
+
+	:param correct: if not None, correct for the bias in the inverse covariance estimator assuming the covariance was estimated by 'correct' simulations
+	:type correct: int.
+
+	:param block_size: number of parameter points processed at once; if None it is chosen so that the temporary arrays of a block occupy a few MB
+	:type block_size: int.
+
+	:param threads: number of threads that process different blocks in parallel
+	:type threads: int.
+
+	"""
+
+	#Approximate number of float64 elements in the temporaries of a single block
+	_block_elements = 262144
+
+	def __init__(self,interpolator,observed_feature,features_covariance,correct=None,block_size=None,threads=None):
+
+		self.interpolator = interpolator
+		self.observed_feature = np.asarray(observed_feature,dtype=np.float64).reshape(-1)
+		self.cholesky = linalg.cholesky(np.asarray(features_covariance,dtype=np.float64).reshape((len(self.observed_feature),)*2),lower=True)
+		self.threads = threads
+
+		#The bias correction multiplies the inverse covariance, hence the chi2
+		if correct is not None:
+			self.correction = precision_bias_correction(correct,len(self.observed_feature))
+		else:
+			self.correction = 1.0
+
+		#Cache sized blocks
+		if block_size is None:
+			num_train = len(getattr(interpolator,"points",()))
+			block_size = max(1,self._block_elements//max(len(self.observed_feature),num_train,1))
+
+		self.block_size = block_size
+
+	def _scoreBlock(self,parameters):
+
+		#Predict, then whiten the residuals with the Cholesky factor
+		residuals = self.observed_feature[None] - _predict(parameters,self.interpolator).reshape(len(parameters),-1)
+		whitened = linalg.solve_triangular(self.cholesky,residuals.T,lower=True,check_finite=False)
+
+		return self.correction*(whitened**2).sum(0)
+
+	def __call__(self,parameters):
+
+		"""
+		Compute the chi2 on a set of parameter points
+
+		:param parameters: points in parameter space
+		:type parameters: (N,p) array
+
+		:returns: chi2 values
+		:rtype: (N,) array
+
+		"""
+
+		parameters = np.atleast_2d(parameters)
+		blocks = [ parameters[n:n+self.block_size] for n in range(0,len(parameters),self.block_size) ]
+
+		if (self.threads is not None) and (self.threads>1) and (len(blocks)>1):
+			pool = ThreadPool(min(self.threads,len(blocks)))
+			try:
+				chi2_blocks = pool.map(self._scoreBlock,blocks)
+			finally:
+				pool.close()
+				pool.join()
+		else:
+			chi2_blocks = [ self._scoreBlock(b) for b in blocks ]
+
+		return np.concatenate(chi2_blocks)
 	
 
 #######################################################################
 #############Feature prediction wrapper################################
 #######################################################################
 
-#Fast interpolation method
-def _interpolate_fast(p,parameter_grid,method,weights,epsilon):
-	return method(((parameter_grid[None]-p[:,None])**2).sum(-1),epsilon).dot(weights)
-
 def _predict(parameters,interpolator):
 
 	#Cast to higher dimension
@@ -93,6 +177,254 @@ def _predict(parameters,interpolator):
 
 	return np.squeeze(interpolated_feature)
 
+#######################################################################
+#############Batched radial basis function interpolator################
+#######################################################################
+
+class RbfInterpolator(object):
+
+	"""
+	Radial basis function interpolator that treats all the feature bins at once: the kernel matrix between the training points is factorized once and the interpolation weights of all the bins are stored in a single (Ntrain,Nbins) matrix, so a prediction on N points is a (N,Ntrain) kernel matrix times the weights. The kernels and the default smoothing scale are the same as scipy.interpolate.Rbf. New training points can be added with :py:meth:`update`, which extends the existing factorization instead of recomputing it
+
+	:param points: training points in parameter space
+	:type points: (Ntrain,p) array
+
+	:param values: features at the training points
+	:type values: (Ntrain,Nbins) array
+
+	:param function: radial basis function; one of 'multiquadric','inverse','gaussian','linear','cubic','quintic','thin_plate' or callable. If callable, it must take two arguments, a square distance and a square length smoothing scale
+	:type function: str. or callable
+
+	:param epsilon: smoothing scale; if None it is set to the average distance between the training points as in scipy.interpolate.Rbf (the mean square distance between the training points if function is callable)
+	:type epsilon: float.
+
+	:param smooth: smoothing of the interpolant (0 means exact interpolation through the training points)
+	:type smooth: float.
+
+	:param block_size: number of points that are predicted in a single kernel matrix product
+	:type block_size: int.
+
+	:param threads: number of threads that predict different blocks of points in parallel
+	:type threads: int.
+
+	"""
+
+	_aliases = {"inverse_multiquadric":"inverse","inverse multiquadric":"inverse","thin-plate":"thin_plate"}
+
+	def __init__(self,points,values,function="multiquadric",epsilon=None,smooth=0.0,block_size=1024,threads=None):
+
+		if isinstance(function,str):
+			function = self._aliases.get(function.lower(),function.lower())
+			if not hasattr(self,"_h_"+function):
+				raise ValueError("Radial basis function '{0}' not implemented!".format(function))
+
+		self.function = function
+		self.fixed_epsilon = epsilon
+		self.smooth = smooth
+		self.block_size = block_size
+		self.threads = threads
+
+		#Build the interpolator
+		self.fit(points,values)
+
+	def defaultEpsilon(self,points):
+
+		"""
+		Smoothing scale that is used if none is specified by the user
+
+		:param points: training points in parameter space
+		:type points: (Ntrain,p) array
+
+		:rtype: float.
+
+		"""
+
+		if self.fixed_epsilon is not None:
+			return self.fixed_epsilon
+
+		if callable(self.function):
+			#Mean square distance between pairs of nodes: computed from the first two moments, it does not need the full distance matrix
+			num = len(points)
+			return (num*(points**2).sum() - (points.sum(0)**2).sum())/(num*(num-1)/2)
+		else:
+			#Average distance between nodes, based on a bounding hypercube
+			edges = points.max(0) - points.min(0)
+			edges = edges[edges>0]
+			return np.power(np.prod(edges)/len(points),1.0/len(edges))
+
+	##################
+	#Radial functions#
+	##################
+
+	def _h_multiquadric(self,r):
+		return np.sqrt((r/self.epsilon)**2 + 1)
+
+	def _h_inverse(self,r):
+		return 1.0/np.sqrt((r/self.epsilon)**2 + 1)
+
+	def _h_gaussian(self,r):
+		return np.exp(-(r/self.epsilon)**2)
+
+	def _h_linear(self,r):
+		return r
+
+	def _h_cubic(self,r):
+		return r**3
+
+	def _h_quintic(self,r):
+		return r**5
+
+	def _h_thin_plate(self,r):
+		return special.xlogy(r**2,r)
+
+	def kernel(self,r):
+
+		if callable(self.function):
+			return self.function(r**2,self.epsilon)
+		else:
+			return getattr(self,"_h_"+self.function)(r)
+
+	def distance(self,p,q=None):
+
+		"""
+		Euclidean distance between each of the points p and each of the training points (or each of the points q if provided)
+
+		"""
+
+		if q is None:
+			q = self.points
+
+		return np.sqrt(((p[:,None] - q[None])**2).sum(-1))
+
+	##########
+	#Training#
+	##########
+
+	def _solve(self,values):
+
+		#Solve the kernel system with the LU factors (the kernel rows are permuted by perm)
+		z = linalg.solve_triangular(self.L,values[self.perm],lower=True,unit_diagonal=True,check_finite=False)
+		return linalg.solve_triangular(self.U,z,lower=False,check_finite=False)
+
+	def fit(self,points,values):
+
+		"""
+		Train the interpolator from scratch: the kernel matrix between the training points is factorized and the weights of all the bins are solved for at once
+
+		:param points: training points in parameter space
+		:type points: (Ntrain,p) array
+
+		:param values: features at the training points
+		:type values: (Ntrain,Nbins) array
+
+		"""
+
+		#Safety checks
+		points = np.asarray(points,dtype=np.float64)
+		values = np.asarray(values,dtype=np.float64)
+		assert points.ndim==2,"Training points must be a (Ntrain,p) array!"
+		assert values.shape[0]==points.shape[0],"There must be one feature per training point!"
+
+		self.points = points
+		self.values = values.reshape(len(points),-1)
+		self.epsilon = self.defaultEpsilon(points)
+
+		#Factorize the kernel matrix once, solve for the weights of all the bins at once
+		P,self.L,self.U = linalg.lu(self.kernel(self.distance(points)) - np.eye(len(points))*self.smooth)
+		self.perm = P.argmax(0)
+		self.weights = self._solve(self.values)
+
+	def update(self,points,values,epsilon_rtol=0.05):
+
+		"""
+		Add new training points to the interpolator. The LU factors of the kernel matrix are extended with the border made of the kernel between new and old points, which for k new points costs O(N^2 k) instead of the O(N^3) of a full refit; the weights of all the bins are then refreshed. If the default smoothing scale changes by more than epsilon_rtol the interpolator is refit from scratch
+
+		:param points: new training points in parameter space
+		:type points: (k,p) array
+
+		:param values: features at the new training points
+		:type values: (k,Nbins) array
+
+		:param epsilon_rtol: maximum relative change of the smoothing scale that allows to keep the current factorization
+		:type epsilon_rtol: float.
+
+		:returns: True if the factorization was updated, False if the interpolator was refit from scratch
+		:rtype: bool.
+
+		"""
+
+		points = np.atleast_2d(np.asarray(points,dtype=np.float64))
+		values = np.asarray(values,dtype=np.float64).reshape(len(points),-1)
+		assert points.shape[1]==self.points.shape[1],"New points must have the same dimension as the training points!"
+		assert values.shape[1]==self.values.shape[1],"New features must have the same number of bins as the training features!"
+
+		all_points = np.concatenate((self.points,points),axis=0)
+		all_values = np.concatenate((self.values,values),axis=0)
+
+		#If the smoothing scale changes too much, the kernel matrix changes everywhere: refit
+		new_epsilon = self.defaultEpsilon(all_points)
+		if np.abs(new_epsilon-self.epsilon)>epsilon_rtol*np.abs(self.epsilon):
+			self.fit(all_points,all_values)
+			return False
+
+		#Kernel between old and new points, and between new points
+		B = self.kernel(self.distance(self.points,points))
+		D = self.kernel(self.distance(points,points)) - np.eye(len(points))*self.smooth
+
+		#Border of the LU factors, the Schur complement is factorized with its own pivoting
+		Y = linalg.solve_triangular(self.L,B[self.perm],lower=True,unit_diagonal=True,check_finite=False)
+		W = linalg.solve_triangular(self.U,B,trans="T",lower=False,check_finite=False).T
+		Ps,Ls,Us = linalg.lu(D - W.dot(Y))
+		ps = Ps.argmax(0)
+
+		num_old,num_new = len(self.points),len(points)
+		self.L = np.block([[self.L,np.zeros((num_old,num_new))],[W[ps],Ls]])
+		self.U = np.block([[self.U,Y],[np.zeros((num_new,num_old)),Us]])
+		self.perm = np.concatenate((self.perm,num_old+ps))
+
+		#Refresh the weights
+		self.points = all_points
+		self.values = all_values
+		self.weights = self._solve(self.values)
+
+		return True
+
+	############
+	#Prediction#
+	############
+
+	def _predictBlock(self,p):
+		return self.kernel(self.distance(p)).dot(self.weights)
+
+	def __call__(self,parameters):
+
+		"""
+		Predict the features at new points in parameter space
+
+		:param parameters: points in parameter space
+		:type parameters: (N,p) array
+
+		:returns: predicted features
+		:rtype: (N,Nbins) array
+
+		"""
+
+		parameters = np.atleast_2d(parameters)
+		blocks = [ parameters[n:n+self.block_size] for n in range(0,len(parameters),self.block_size) ]
+
+		#Numpy releases the GIL in the kernel matrix products, so blocks can be processed by different threads
+		if (self.threads is not None) and (self.threads>1) and (len(blocks)>1):
+			pool = ThreadPool(min(self.threads,len(blocks)))
+			try:
+				predicted = pool.map(self._predictBlock,blocks)
+			finally:
+				pool.close()
+				pool.join()
+		else:
+			predicted = [ self._predictBlock(b) for b in blocks ]
+
+		return np.concatenate(predicted,axis=0)
+
 
 ##############################################
 ###########Analysis base class################
@@ -984,6 +1316,55 @@ class Emulator(Analysis):
 
 	#######################################################################################################################################
 
+	def add_models(self,parameters,feature,incremental=True,epsilon_rtol=0.05):
+
+		"""
+		Add models to the training set of the current Emulator; if the Emulator is already trained, the interpolator of the new Emulator is obtained by extending the current one with the new models (see :py:meth:`RbfInterpolator.update`), which is much cheaper than training from scratch when few models are added to a large training set
+
+		:param parameters: parameter set of the new models
+		:type parameters: array
+
+		:param feature: measured feature of the new models
+		:type feature: array
+
+		:param incremental: if False, the new Emulator is not trained
+		:type incremental: bool.
+
+		:param epsilon_rtol: maximum relative change of the interpolation length scale that allows an incremental update (the new Emulator is trained from scratch otherwise)
+		:type epsilon_rtol: float.
+
+		:returns: Emulator with the new models added
+		:rtype: :py:class:`Emulator`
+
+		"""
+
+		emulator = super(Emulator,self).add_models(parameters,feature)
+
+		#Incremental training is possible only for the batched interpolators
+		if not(incremental) or not(isinstance(getattr(self,"_interpolator",None),RbfInterpolator)):
+			return emulator
+
+		#Cast dimensions
+		parameters = np.atleast_2d(parameters)
+		if getattr(self,"_use_parameters","all")!="all":
+			parameters = parameters[:,self._use_parameters]
+
+		#Update a copy of the current interpolator, the current Emulator stays unchanged
+		interpolator = copy.deepcopy(self._interpolator)
+		interpolator.update(parameters,feature.reshape(len(parameters),-1),epsilon_rtol=epsilon_rtol)
+
+		for attr in ["_num_bins","_interpolator","_use_parameters"]:
+			if attr not in emulator._metadata:
+				emulator._metadata.append(attr)
+
+		emulator._num_bins = self._num_bins
+		emulator._interpolator = interpolator
+		emulator._use_parameters = getattr(self,"_use_parameters","all")
+
+		return emulator
+
+	#######################################################################################################################################
+
 	def set_likelihood(self,function=None):
 
 		"""
@@ -1002,10 +1383,10 @@ class Emulator(Analysis):
 		:param use_parameters: which parameters actually vary in the supplied parameter set (it doesn't make sense to interpolate over the constant ones)
 		:type use_parameters: list. or "all"
 
-		:param method: interpolation method; can be 'Rbf' or callable. If callable, it must take two arguments, a square distance and a square length smoothing scale
+		:param method: interpolation method; can be 'Rbf' (all the bins are interpolated at once with :py:class:`RbfInterpolator`), 'ScipyRbf' (one scipy.interpolate.Rbf per bin) or callable. If callable, it must take two arguments, a square distance and a square length smoothing scale
 		:type method: str. or callable
 
-		:param kwargs: keyword arguments to be passed to the interpolator constructor
+		:param kwargs: keyword arguments to be passed to the interpolator constructor (function, epsilon, smooth, and for 'Rbf' also block_size and threads)
 
 		"""
 
@@ -1029,6 +1410,11 @@ class Emulator(Analysis):
 
 		if method=="Rbf":
 
+			#Batched Rbf method: one kernel factorization and one weight matrix for all the bins
+			self._interpolator = RbfInterpolator(used_parameters,flattened_feature_set,**kwargs)
+
+		elif method=="ScipyRbf":
+
 			#Scipy Rbf method
 			self._interpolator = list()
 
@@ -1037,14 +1423,13 @@ class Emulator(Analysis):
 
 		else:
 
-			#Compute pairwise square distance between points
-			distances = ((used_parameters[None] - used_parameters[:,None])**2).sum(-1)
-			epsilon = distances[np.triu_indices(len(distances),k=1)].mean()
-			kernel = method(distances,epsilon)
-			weights = np.linalg.solve(kernel,self.feature_set)
+			#Custom kernel of the square distance, the default length scale is the mean square distance between points
+			self._interpolator = RbfInterpolator(used_parameters,flattened_feature_set,function=method,**kwargs)
 
-			#Wrap interpolator
-			self._interpolator = _function_wrapper(_interpolate_fast,args=[],kwargs={"parameter_grid":used_parameters,"method":method,"weights":weights,"epsilon":epsilon})
+		#Remember which parameters were used, new models are added to the interpolator accordingly
+		if "_use_parameters" not in self._metadata:
+			self._metadata.append("_use_parameters")
+		self._use_parameters = use_parameters
 
 
 	###############################################################################################################################################################
@@ -1098,10 +1483,10 @@ class Emulator(Analysis):
 	###############################################################################################################################################################
 
 
-	def chi2(self,parameters,observed_feature,features_covariance,correct=None,split_chunks=None,pool=None):
+	def chi2(self,parameters,observed_feature,features_covariance,correct=None,split_chunks=None,pool=None,block_size=None,threads=None):
 
 		"""
-		Computes the chi2 part of the parameter likelihood with the usual sandwich product with the covariance matrix; the model features are computed with the interpolators
+		Computes the chi2 part of the parameter likelihood with the usual sandwich product with the covariance matrix; the model features are computed with the interpolators. The covariance matrix is Cholesky factorized once, and the parameter points are streamed in blocks through a :py:class:`Chi2Scorer`, so large parameter grids can be scored in bounded memory
 
 		:param parameters: new points in parameter space on which to compute the chi2 statistic
 		:type parameters: (N,p) array where N is the number of points and p the number of parameters
@@ -1118,6 +1503,15 @@ class Emulator(Analysis):
 		:param split_chunks: if set to an integer bigger than 0, splits the calculation of the chi2 into subsequent chunks, each that takes care of an equal number of points. Each chunk could be taken care of by a different processor
 		:type split_chunks: int.
 
+		:param pool: pool of processes to map the chunks on
+		:type pool: MPIPool
+
+		:param block_size: number of parameter points that are scored at once within each chunk (None for a cache sized default)
+		:type block_size: int.
+
+		:param threads: number of threads that score different blocks in parallel
+		:type threads: int.
+
 		:returns: array with the chi2 values, with the same shape of the parameters input
 
 		"""
@@ -1152,16 +1546,8 @@ class Emulator(Analysis):
 
 			raise ValueError("split_chunks must be >0!!")
 
-		#Compute the inverse of the covariance matrix once and for all
-		covinv = np.linalg.inv(features_covariance)
-		if correct is not None:
-			covinv *= precision_bias_correction(correct,len(covinv))
-
-		#Build the keyword argument dictionary to be passed to the chi2 calculator
-		kwargs = {"interpolator":self._interpolator,"inverse_covariance":covinv,"observed_feature":observed_feature}
-
-		#Hack to make the chi2 pickleable (from emcee)
-		chi2_wrapper = _function_wrapper(chi2,tuple(),kwargs)
+		#Factorize the covariance matrix once and for all
+		scorer = Chi2Scorer(self._interpolator,observed_feature,features_covariance,correct=correct,block_size=block_size,threads=threads)
 
 		#Finally map chi2 calculator on the list of chunks
 		if pool is not None:
@@ -1169,9 +1555,9 @@ class Emulator(Analysis):
 		else:
 			M = map
 		
-		chi2_list = list(M(chi2_wrapper,parameter_chunks))
+		chi2_list = list(M(scorer,parameter_chunks))
 
-		return np.array(chi2_list).reshape(num_points)
+		return np.concatenate(chi2_list).reshape(num_points)
 
 
 	def chi2Contributions(self,parameters,observed_feature,features_covariance,correct=None): 
@@ -1312,7 +1698,7 @@ class Emulator(Analysis):
 		:param observed_feature: observed feature to score
 		:type observed_feature: Series
 
-		:param sample: posterior sampling method
+		:param sample: posterior sampling method ('emcee', 'ensemble' for the built-in vectorized ensemble sampler, or callable)
 		:type sample: str. or callable
 
 		:returns: samples from the posterior distribution
@@ -1322,6 +1708,8 @@ class Emulator(Analysis):
 
 		if sample=="emcee":
 			sample = samplers.emcee_sampler
+		elif sample=="ensemble":
+			sample = samplers.ensemble_sampler
 
 		#Get the names of the features to use
 		feature_names = list(observed_feature.index.levels[0])
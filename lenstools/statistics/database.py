@@ -207,10 +207,10 @@ class ScoreDatabase(Database):
 #######Compute scores of a grid of parameter combinations##########
 ###################################################################
 
-def chi2score(emulator,parameters,data,data_covariance,nchunks,pool):
+def chi2score(emulator,parameters,data,data_covariance,nchunks,pool,block_size=None):
 
 	#Score the data on each of the parameter combinations provided
-	scores = emulator.score(parameters,data,features_covariance=data_covariance,split_chunks=nchunks,pool=pool)
+	scores = emulator.score(parameters,data,features_covariance=data_covariance,split_chunks=nchunks,pool=pool,block_size=block_size)
 
 	#Pop the parameter columns, compute the likelihoods out of the chi2
 	for p in parameters.columns:
@@ -219,7 +219,7 @@ def chi2score(emulator,parameters,data,data_covariance,nchunks,pool):
 	return scores,scores.apply(lambda c:np.exp(-0.5*c),axis=0)
 
 @Parallelize.masterworker
-def chi2database(db_name,parameters,specs,table_name="scores",pool=None,nchunks=None):
+def chi2database(db_name,parameters,specs,table_name="scores",pool=None,nchunks=None,block_size=None,insert_size=None):
 
 	"""
 	Populate an SQL database with the scores of different parameter sets with respect to the data; supports multiple features
@@ -242,10 +242,20 @@ def chi2database(db_name,parameters,specs,table_name="scores",pool=None,nchunks=
  	:param nchunks: number of chunks to split the parameter score calculations in (one chunk per processor ideally) 
  	:type nchunks: int.
 
+ 	:param block_size: number of parameter combinations that each processor scores at once (None for a cache sized default)
+ 	:type block_size: int.
+
+ 	:param insert_size: if not None, the parameter combinations are scored and inserted in the database in slices of this many rows, so the full score table is never held in memory
+ 	:type insert_size: int.
+
 	"""
 
 	#Each processor should have the same exact workload
+	if insert_size is None:
+		insert_size = len(parameters)
+
 	if nchunks is not None:
+		assert not insert_size%nchunks
 		assert not len(parameters)%nchunks
 
 	#Database context manager
@@ -258,14 +268,17 @@ def chi2database(db_name,parameters,specs,table_name="scores",pool=None,nchunks=
 			#Log
 			logdriver.info("Processing feature_type: {0} ({1} feature dimensions, {2} parameter combinations)...".format(feature_type,len(specs[feature_type]["data"]),len(parameters)))
 			
-			#Score
-			chi2,likelihood = chi2score(emulator=specs[feature_type]["emulator"],parameters=parameters,data=specs[feature_type]["data"],data_covariance=specs[feature_type]["data_covariance"],nchunks=nchunks,pool=pool)
-			assert (chi2.columns==[feature_type]).all()
+			for first in range(0,len(parameters),insert_size):
+
+				#Score
+				parameter_slice = parameters.iloc[first:first+insert_size]
+				chi2,likelihood = chi2score(emulator=specs[feature_type]["emulator"],parameters=parameter_slice,data=specs[feature_type]["data"],data_covariance=specs[feature_type]["data_covariance"],nchunks=nchunks,pool=pool,block_size=block_size)
+				assert (chi2.columns==[feature_type]).all()
 
-			#Add to the database
-			db_chunk = parameters.copy()
-			db_chunk["feature_type"] = feature_type
-			db_chunk["chi2"] = chi2
-			db_chunk["likelihood"] = likelihood
+				#Add to the database
+				db_chunk = parameter_slice.copy()
+				db_chunk["feature_type"] = feature_type
+				db_chunk["chi2"] = chi2
+				db_chunk["likelihood"] = likelihood
 
-			db.insert(db_chunk,table_name)
\ No newline at end of file
+				db.insert(db_chunk,table_name)
\ No newline at end of file
@@ -13,19 +13,28 @@
 from __future__ import division
 
 import sys
+import os
+import json
+import time
+import threading
 from operator import add
 from functools import reduce
+from multiprocessing.pool import ThreadPool
 
 if sys.version_info.major>=3:
 	import _pickle as pickle
+	import queue
 else:
 	import cPickle as pickle
+	import Queue as queue
 
 from ..utils.algorithms import pcaHandler as PCA
+from ..simulations.logs import logdriver
 
 import numpy as np
 import scipy.io as sio
 from scipy import sparse
+from scipy.linalg import blas
 
 from emcee.ensemble import _function_wrapper
 
@@ -213,6 +222,9 @@ class Ensemble(pd.DataFrame):
 
 		if callback_loader is None:
 
+			if os.path.isdir(filename):
+				return EnsembleStore(filename).toEnsemble(cls)
+
 			if filename.endswith(".pkl") or filename.endswith(".p"):
 				callback_loader = pd.read_pickle
 			elif filename.endswith(".sqlite"):
@@ -279,7 +291,7 @@ class Ensemble(pd.DataFrame):
 		return ensemble 
 
 	@classmethod
-	def compute(cls,file_list,callback_loader=None,pool=None,index=None,assemble=np.array,**kwargs):
+	def compute(cls,file_list,callback_loader=None,pool=None,index=None,assemble=np.array,store=None,chunk_size=None,pipeline=None,**kwargs):
 		
 		"""
 		Computes an ensemble, can spread the calculations on multiple processors using a MPI pool
@@ -299,6 +311,15 @@ class Ensemble(pd.DataFrame):
 		:param assemble: called on the list of features (one feature per file) to assemble them in an array (defaults to np.array)
 		:type assemble: callable
 
+		:param store: if not None, the realizations are appended to this out of core store (or to the store in this directory, created if necessary with the 'columns' keyword argument), which is returned instead of an in memory Ensemble
+		:type store: :py:class:`EnsembleStore` or str.
+
+		:param chunk_size: number of files whose features are held in memory at once before being appended to the store
+		:type chunk_size: int.
+
+		:param pipeline: if not None, the files are processed by this pipelined executor (separate reader and compute threads) instead of the pool
+		:type pipeline: :py:class:`ComputePipeline`
+
 		:param kwargs: Any additional keyword arguments to be passed to callback_loader
 		:type kwargs: dict.
 
@@ -317,6 +338,24 @@ class Ensemble(pd.DataFrame):
 		if index is not None:
 			assert len(index)==len(file_list),"The number of elements in the index hould be the same as the number of files!"
 
+		#Out of core computation
+		if store is not None:
+			columns = kwargs.pop("columns",None)
+			if not isinstance(store,EnsembleStore):
+				store = EnsembleStore.open(store,columns=columns)
+			return store.compute(file_list,callback_loader=callback_loader,pool=pool,chunk_size=chunk_size,assemble=assemble,pipeline=pipeline,**kwargs)
+
+		#Check if user provided column labels
+		if "columns" in kwargs.keys():
+			columns = kwargs["columns"]
+		else:
+			columns = None
+
+		#Pipelined computation: I/O and computations overlap, results are written in order
+		if pipeline is not None:
+			full_data = pipeline.run(file_list,callback_loader,assemble=(assemble if assemble is not np.array else None),**kwargs)
+			return cls(full_data,file_list,index=index,columns=columns)
+
 		#Build a function wrapper of the callback loader, so it becomes pickleable
 		_callback_wrapper = _function_wrapper(callback_loader,args=tuple(),kwargs=kwargs)
 
@@ -328,12 +367,6 @@ class Ensemble(pd.DataFrame):
 
 		full_data = assemble([r for r in M(_callback_wrapper,file_list) if r is not None])
 
-		#Check if user provided column labels
-		if "columns" in kwargs.keys():
-			columns = kwargs["columns"]
-		else:
-			columns = None
-
 		#Return the created ensemble from the full_data array
 		return cls(full_data,file_list,index=index,columns=columns)
 
@@ -346,7 +379,7 @@ class Ensemble(pd.DataFrame):
 		:param filename: file name of the external file
 		:type filename: str.
 
-		:format: format in which to save the ensemble; if None the format is auto detected from the filename
+		:format: format in which to save the ensemble; if None the format is auto detected from the filename. If "store", the Ensemble is appended to the out of core :py:class:`EnsembleStore` in the directory filename
 		:type format: str.or callable
 
 		:param kwargs: the keyword arguments are passed to the saver (or to format if callable)
@@ -374,6 +407,8 @@ class Ensemble(pd.DataFrame):
 		elif format=="pickle":
 			with open(filename,"wb") as fp:
 				pickle.dump(self,fp)
+		elif format=="store":
+			EnsembleStore.open(filename,columns=self.columns,dtype=self.values.dtype).append(self.values,file_list=self.file_list)
 		else:
 			format(self,filename,**kwargs)
 
@@ -647,12 +682,12 @@ class Ensemble(pd.DataFrame):
 	def cov(self,*args,**kwargs):
 		return SquareMatrix(super(Ensemble,self).cov(*args,**kwargs))
 
-	def covariance(self,bootstrap=False,bootstrap_size=10,resample=10,seed=None,pool=None):
+	def covariance(self,bootstrap=False,bootstrap_size=10,resample=10,seed=None,pool=None,threads=None,error=False):
 
 		"""
 		Computes the ensemble covariance matrix
 
-		:param bootstrap: if True the covariance matrix is computed with a bootstrap estimate
+		:param bootstrap: if True the covariance matrix is computed with a bootstrap estimate (see :py:meth:`bootstrapCovariance`)
 		:type bootstrap: bool.
 
 		:param bootstrap_size: size of the resampled ensembles used in the bootstraping; must be less than or equal to the number of realizations in the Ensemble
@@ -664,20 +699,97 @@ class Ensemble(pd.DataFrame):
 		:param resample: number of times the Ensemble is resampled
 		:type resample: int.
 
-		:param pool: MPI pool for multiprocessing (imported from emcee https://github.com/dfm/emcee)
+		:param pool: unused, kept for backwards compatibility (the bootstrap resamples are spread over threads instead)
 		:type pool: MPI pool object
 
+		:param threads: number of threads that process the bootstrap resamples
+		:type threads: int.
+
+		:param error: if True, return also the bootstrap error on each covariance matrix element
+		:type error: bool.
+
 		:returns: Covariance matrix, has shape (self.data[1],self.data[1]) 
 		:rtype: :py:class:`SquareMatrix`
 
 		""" 
 
 		if bootstrap:
-			return self.bootstrap(lambda e:e.cov(),bootstrap_size=bootstrap_size,resample=resample,seed=seed,pool=pool,assemble=lambda l:self._constructor_expanddim(dict((n,e) for n,e in enumerate(l))))
+			covariance,covariance_error = self.bootstrapCovariance(bootstrap_size=bootstrap_size,resample=resample,seed=seed,threads=threads)
+			if error:
+				return covariance,covariance_error
+			else:
+				return covariance
 		else:
 			return self.cov()
 
 
+	def bootstrapCovariance(self,bootstrap_size=None,resample=10,seed=None,threads=None,block_size=1024):
+
+		"""
+		Computes the bootstrap estimate of the ensemble covariance matrix, along with its bootstrap error. The resampled ensembles are never built: each resample is represented by the number of times each realization is drawn, and its first and second moments are accumulated in place by streaming over blocks of rows of the original data
+
+		:param bootstrap_size: size of the resampled ensembles; if None it is the number of realizations in the Ensemble
+		:type bootstrap_size: int.
+
+		:param resample: number of times the Ensemble is resampled
+		:type resample: int.
+
+		:param seed: if not None, this is the random seed of the random resamples 
+		:type seed: int.
+
+		:param threads: number of threads that process different resamples in parallel
+		:type threads: int.
+
+		:param block_size: number of rows processed at once
+		:type block_size: int.
+
+		:returns: bootstrap covariance matrix (mean over the resamples) and its bootstrap error (standard deviation over the resamples)
+		:rtype: tuple. of :py:class:`SquareMatrix`
+
+		"""
+
+		if bootstrap_size is None:
+			bootstrap_size = self.nobs
+
+		#Safety check
+		assert bootstrap_size<=self.nobs,"The size of the resampling cannot exceed the original number of realizations"
+		assert bootstrap_size>1,"The size of the resampling must be at least 2"
+
+		#Set the random seed
+		if seed is not None:
+			np.random.seed(seed)
+
+		#Construct the randomization matrix
+		randomizer = np.random.randint(self.nobs,size=(resample,bootstrap_size))
+
+		#Moments are computed with respect to the ensemble mean for numerical stability
+		data = self.values.astype(np.float64,copy=False)
+		location = data.mean(0)
+
+		#Accumulate the moments of the resampled covariances, splitting the resamples between threads
+		if (threads is not None) and (threads>1) and (resample>1):
+			pool = ThreadPool(min(threads,resample))
+			try:
+				moments = pool.map(lambda r:_bootstrapCovarianceMoments(data,location,r,block_size),np.array_split(randomizer,min(threads,resample)))
+			finally:
+				pool.close()
+				pool.join()
+		else:
+			moments = [ _bootstrapCovarianceMoments(data,location,randomizer,block_size) ]
+
+		s1 = reduce(add,[ m[0] for m in moments ])
+		s2 = reduce(add,[ m[1] for m in moments ])
+
+		#Mean and standard deviation of the resampled covariances
+		covariance = s1/resample
+		if resample>1:
+			covariance_error = np.sqrt(np.clip((s2 - resample*covariance**2)/(resample-1),0,None))
+		else:
+			covariance_error = np.zeros_like(covariance)
+
+		return SquareMatrix(covariance,index=self.columns,columns=self.columns),SquareMatrix(covariance_error,index=self.columns,columns=self.columns)
+
+
 	def bootstrap(self,callback,bootstrap_size=10,resample=10,seed=None,assemble=np.array,pool=None,**kwargs):
 
 		"""
@@ -908,6 +1020,631 @@ class Ensemble(pd.DataFrame):
 		#Return the handle
 		return self.ax
 
+##################################################################
+##########Pipelined executor for Ensemble.compute#################
+##################################################################
+
+class ComputePipeline(object):
+
+	"""
+	Executor for :py:meth:`Ensemble.compute` that overlaps I/O and computations: reader threads load the files and prefetch them into a bounded queue, compute threads apply the callback to the loaded data, and the results are written in order into a preallocated array. After each run, the throughput metrics are available in the metrics attribute (and are logged)
+
+	:param reader: function that loads a file; the callback_loader is then applied to its return value instead of the file name. If None, the file names are passed directly to the callback_loader (which then does both I/O and computations)
+	:type reader: callable
+
+	:param read_threads: number of reader threads
+	:type read_threads: int.
+
+	:param compute_threads: number of compute threads
+	:type compute_threads: int.
+
+	:param prefetch: maximum number of loaded files waiting to be processed (bounds the memory usage); defaults to twice the number of compute threads
+	:type prefetch: int.
+
+	>>> from lenstools import ConvergenceMap
+	>>> from lenstools.statistics.ensemble import Ensemble,ComputePipeline
+
+	>>> pipeline = ComputePipeline(reader=ConvergenceMap.load,read_threads=2,compute_threads=4)
+	>>> ensemble = Ensemble.compute(map_list,callback_loader=lambda m,l_edges:m.powerSpectrum(l_edges)[1],pipeline=pipeline,l_edges=l_edges)
+	>>> pipeline.metrics["maps_per_second"]
+
+	"""
+
+	def __init__(self,reader=None,read_threads=2,compute_threads=4,prefetch=None):
+
+		assert read_threads>0 and compute_threads>0,"There must be at least one reader and one compute thread!"
+
+		self.reader = reader
+		self.read_threads = read_threads
+		self.compute_threads = compute_threads
+		self.prefetch = prefetch or 2*compute_threads
+		self.metrics = dict()
+
+	def _read(self,files,loaded,timers,errors):
+
+		while True:
+
+			try:
+				n,f = files.get_nowait()
+			except queue.Empty:
+				break
+
+			try:
+				start = time.time()
+				data = self.reader(f) if (self.reader is not None) else f
+				size = os.path.getsize(f) if (isinstance(f,str) and os.path.isfile(f)) else 0
+				timers["read"].append((time.time()-start,size))
+			except Exception as e:
+				errors.append(e)
+				data = None
+				n = -1
+
+			#Blocks if the compute threads are behind
+			start = time.time()
+			loaded.put((n,data))
+			timers["read_wait"].append(time.time()-start)
+
+	def _compute(self,callback,loaded,results,timers,errors):
+
+		while True:
+
+			start = time.time()
+			item = loaded.get()
+			timers["compute_wait"].append(time.time()-start)
+
+			#Sentinel: no more files to process
+			if item is None:
+				results.put(None)
+				return
+
+			n,data = item
+			if n<0:
+				continue
+
+			try:
+				start = time.time()
+				r = callback(data)
+				timers["compute"].append(time.time()-start)
+				results.put((n,r))
+			except Exception as e:
+				errors.append(e)
+
+	def run(self,file_list,callback_loader,assemble=None,**kwargs):
+
+		"""
+		Run the pipeline on a list of files
+
+		:param file_list: files to process
+		:type file_list: list.
+
+		:param callback_loader: function called on each loaded file (with kwargs as additional keyword arguments), returns a feature
+		:type callback_loader: callable
+
+		:param assemble: if not None, called on the list of features instead of writing them in a preallocated array
+		:type assemble: callable
+
+		:returns: array with one feature per row, in the same order as file_list (files for which the callback returns None are skipped)
+		:rtype: array
+
+		"""
+
+		callback = _function_wrapper(callback_loader,args=tuple(),kwargs=kwargs)
+
+		files = queue.Queue()
+		for n,f in enumerate(file_list):
+			files.put((n,f))
+
+		loaded = queue.Queue(maxsize=self.prefetch)
+		results = queue.Queue()
+		timers = dict((k,list()) for k in ["read","read_wait","compute","compute_wait"])
+		errors = list()
+
+		#Start the stages
+		wall_start = time.time()
+		readers = [ threading.Thread(target=self._read,args=(files,loaded,timers,errors)) for t in range(self.read_threads) ]
+		workers = [ threading.Thread(target=self._compute,args=(callback,loaded,results,timers,errors)) for t in range(self.compute_threads) ]
+
+		for t in readers+workers:
+			t.daemon = True
+			t.start()
+
+		#When all the files are read, tell the compute threads to stop
+		def _close():
+			for t in readers:
+				t.join()
+			for t in workers:
+				loaded.put(None)
+
+		closer = threading.Thread(target=_close)
+		closer.daemon = True
+		closer.start()
+
+		#Ordered writer
+		write_time = 0.
+		output = None
+		written = np.zeros(len(file_list),dtype=np.bool_)
+		collected = dict()
+		finished = 0
+
+		while finished<self.compute_threads:
+
+			item = results.get()
+			if item is None:
+				finished += 1
+				continue
+
+			n,r = item
+			if r is None:
+				continue
+
+			start = time.time()
+			if assemble is not None:
+				collected[n] = r
+			else:
+				r = np.asarray(r)
+				if output is None:
+					output = np.empty((len(file_list),)+r.shape,dtype=r.dtype)
+				output[n] = r
+			written[n] = True
+			write_time += time.time()-start
+
+		closer.join()
+		wall_time = time.time()-wall_start
+
+		if len(errors):
+			raise errors[0]
+
+		#Metrics
+		read_time = sum(t for t,s in timers["read"])
+		bytes_read = sum(s for t,s in timers["read"])
+		self.metrics = {
+		"files" : len(file_list),
+		"bytes_read" : bytes_read,
+		"wall_time" : wall_time,
+		"read_time" : read_time,
+		"read_wait_time" : sum(timers["read_wait"]),
+		"compute_time" : sum(timers["compute"]),
+		"compute_wait_time" : sum(timers["compute_wait"]),
+		"write_time" : write_time,
+		"maps_per_second" : len(file_list)/wall_time if wall_time>0 else 0.,
+		"MB_per_second" : bytes_read/(1024.**2)/wall_time if wall_time>0 else 0.
+		}
+
+		logdriver.info("Pipeline processed {0} files in {1:.2f}s ({2:.2f} maps/s, {3:.2f} MB/s); read={4:.2f}s, compute={5:.2f}s, write={6:.2f}s, readers blocked={7:.2f}s, workers starved={8:.2f}s".format(len(file_list),wall_time,self.metrics["maps_per_second"],self.metrics["MB_per_second"],read_time,self.metrics["compute_time"],write_time,self.metrics["read_wait_time"],self.metrics["compute_wait_time"]))
+
+		#Return the results in order
+		if assemble is not None:
+			return assemble([ collected[n] for n in sorted(collected.keys()) ])
+		
+		if output is None:
+			return np.array([])
+		elif written.all():
+			return output
+		else:
+			return output[written]
+
+##########################################################################################################################################################################
+
+##################################################################
+##########Out of core Ensemble backed by memory maps##############
+##################################################################
+
+class EnsembleStore(object):
+
+	"""
+	An Ensemble that lives on disk: the realizations are stored in a directory, in chunks of rows that are appended one after the other (each chunk is a column-major .npy file that is memory mapped when accessed). Statistics are computed by streaming over blocks of rows, so the Ensemble never needs to fit in memory; appending new realizations does not rewrite the existing chunks
+
+	:param path: directory of the store (it must have been created with :py:meth:`create`)
+	:type path: str.
+
+	"""
+
+	_meta_file = "store.json"
+	_columns_file = "columns.pkl"
+
+	def __init__(self,path):
+
+		self.path = path
+
+		with open(os.path.join(path,self._meta_file),"r") as fp:
+			self._meta = json.load(fp)
+
+		with open(os.path.join(path,self._columns_file),"rb") as fp:
+			self.columns = pickle.load(fp)
+
+	@classmethod
+	def create(cls,path,columns,dtype=np.float64):
+
+		"""
+		Create an empty store
+
+		:param path: directory of the store (created if not existing)
+		:type path: str.
+
+		:param columns: columns of the Ensemble
+		:type columns: pandas Index
+
+		:param dtype: data type of the stored features
+		:type dtype: numpy dtype
+
+		:rtype: :py:class:`EnsembleStore`
+
+		"""
+
+		if not os.path.isdir(path):
+			os.makedirs(path)
+
+		if os.path.exists(os.path.join(path,cls._meta_file)):
+			raise IOError("An Ensemble store already exists in {0}!".format(path))
+
+		with open(os.path.join(path,cls._columns_file),"wb") as fp:
+			pickle.dump(pd.Index(columns),fp)
+
+		with open(os.path.join(path,cls._meta_file),"w") as fp:
+			json.dump({"dtype":np.dtype(dtype).str,"chunks":[],"file_list":[]},fp)
+
+		return cls(path)
+
+	@classmethod
+	def open(cls,path,columns=None,dtype=np.float64):
+
+		"""
+		Open an existing store, or create a new one if it does not exist and columns are provided
+
+		"""
+
+		if os.path.exists(os.path.join(path,cls._meta_file)) or (columns is None):
+			return cls(path)
+		else:
+			return cls.create(path,columns,dtype=dtype)
+
+	##################
+	####Properties####
+	##################
+
+	@property
+	def dtype(self):
+		return np.dtype(self._meta["dtype"])
+
+	@property
+	def nobs(self):
+		return sum(c["rows"] for c in self._meta["chunks"])
+
+	@property
+	def shape(self):
+		return (self.nobs,len(self.columns))
+
+	@property
+	def file_list(self):
+		return self._meta["file_list"]
+
+	def __len__(self):
+		return self.nobs
+
+	def __repr__(self):
+		return "<EnsembleStore at {0}: {1} realizations x {2} columns in {3} chunks>".format(self.path,self.shape[0],self.shape[1],len(self._meta["chunks"]))
+
+	####################################
+	#############I/O####################
+	####################################
+
+	def _writeMeta(self):
+
+		#Write a new meta file and move it in place, so a crash never leaves a half written one
+		tmp = os.path.join(self.path,self._meta_file+".tmp")
+		with open(tmp,"w") as fp:
+			json.dump(self._meta,fp)
+		os.rename(tmp,os.path.join(self.path,self._meta_file))
+
+	def append(self,data,file_list=None):
+
+		"""
+		Append new realizations to the store; they are written in a new chunk
+
+		:param data: new realizations
+		:type data: array or :py:class:`Ensemble`
+
+		:param file_list: files the realizations have been computed from
+		:type file_list: list.
+
+		"""
+
+		if isinstance(data,pd.DataFrame):
+			assert (data.columns==self.columns).all(),"The column names do not match!"
+			data = data.values
+
+		data = np.atleast_2d(data)
+		assert data.shape[1]==len(self.columns),"The number of columns does not match!"
+
+		if not len(data):
+			return
+
+		#Write the chunk
+		chunk_name = "chunk{0:06d}.npy".format(len(self._meta["chunks"]))
+		chunk = np.lib.format.open_memmap(os.path.join(self.path,chunk_name),mode="w+",dtype=self.dtype,shape=data.shape,fortran_order=True)
+		chunk[:] = data
+		chunk.flush()
+		del(chunk)
+
+		#Update the meta information
+		self._meta["chunks"].append({"file":chunk_name,"rows":len(data)})
+		if file_list is not None:
+			self._meta["file_list"] += list(file_list)
+		self._writeMeta()
+
+	def chunk(self,n):
+
+		"""
+		Memory map a chunk of realizations
+
+		:param n: chunk number
+		:type n: int.
+
+		:rtype: numpy memmap
+
+		"""
+
+		return np.load(os.path.join(self.path,self._meta["chunks"][n]["file"]),mmap_mode="r")
+
+	def blocks(self,block_size=65536,columns=None):
+
+		"""
+		Iterate over blocks of rows of the store
+
+		:param block_size: maximum number of rows in each block
+		:type block_size: int.
+
+		:param columns: restrict to these columns
+		:type columns: list.
+
+		:returns: iterator over (rows,columns) arrays
+
+		"""
+
+		if columns is not None:
+			column_indices = self.columns.get_indexer(columns)
+			assert (column_indices>=0).all(),"Some of the columns are not in the store!"
+
+		for n in range(len(self._meta["chunks"])):
+
+			chunk = self.chunk(n)
+			for first in range(0,len(chunk),block_size):
+
+				if columns is not None:
+					yield np.asarray(chunk[first:first+block_size,column_indices])
+				else:
+					yield np.asarray(chunk[first:first+block_size])
+
+	def toEnsemble(self,cls=None):
+
+		"""
+		Load the whole store in memory
+
+		:rtype: :py:class:`Ensemble`
+
+		"""
+
+		if cls is None:
+			cls = Ensemble
+
+		if self.nobs:
+			data = np.concatenate([ np.asarray(self.chunk(n)) for n in range(len(self._meta["chunks"])) ],axis=0)
+		else:
+			data = np.zeros((0,len(self.columns)),dtype=self.dtype)
+
+		return cls(data,file_list=self.file_list,columns=self.columns)
+
+	def compute(self,file_list,callback_loader=None,pool=None,chunk_size=None,assemble=np.array,pipeline=None,**kwargs):
+
+		"""
+		Compute new realizations and append them to the store, one chunk of files at a time (see :py:meth:`Ensemble.compute`)
+
+		:param file_list: list of files that will constitute the new realizations
+		:type file_list: list. 
+
+		:param callback_loader: This function gets executed on each of the files in the list and must return a numpy array with the feature
+		:type callback_loader: function
+
+		:param pool: MPI pool for multiprocessing
+		:type pool: MPI pool object
+
+		:param chunk_size: number of files processed (and kept in memory) at once; if None all the files are processed at once
+		:type chunk_size: int.
+
+		:param assemble: called on the list of features to assemble them in an array
+		:type assemble: callable
+
+		:param pipeline: if not None, each chunk of files is processed by this pipelined executor instead of the pool
+		:type pipeline: :py:class:`ComputePipeline`
+
+		:param kwargs: Any additional keyword arguments to be passed to callback_loader
+		:type kwargs: dict.
+
+		:returns: the store itself
+
+		"""
+
+		#Safety checks
+		assert callback_loader is not None, "You must specify a callback loader function that returns a numpy array!"
+		if chunk_size is None:
+			chunk_size = max(len(file_list),1)
+
+		#Build a function wrapper of the callback loader, so it becomes pickleable
+		_callback_wrapper = _function_wrapper(callback_loader,args=tuple(),kwargs=kwargs)
+
+		if pool is not None:
+			M = pool.map
+		else:
+			M = map
+
+		for first in range(0,len(file_list),chunk_size):
+			files = file_list[first:first+chunk_size]
+			if pipeline is not None:
+				self.append(pipeline.run(files,callback_loader,**kwargs),file_list=files)
+			else:
+				self.append(assemble([r for r in M(_callback_wrapper,files) if r is not None]),file_list=files)
+
+		return self
+
+	###################################
+	#############Statistics############
+	###################################
+
+	def _sums(self,location,block_size):
+
+		#First and second moments with respect to location, accumulated over row blocks
+		s1 = np.zeros(len(self.columns))
+		s2 = np.zeros((len(self.columns),)*2)
+
+		for block in self.blocks(block_size):
+			centered = block.astype(np.float64) - location
+			s1 += centered.sum(0)
+			s2 += centered.T.dot(centered)
+
+		return s1,s2
+
+	def mean(self,block_size=65536):
+
+		"""
+		Mean of the realizations
+
+		:rtype: :py:class:`Series`
+
+		"""
+
+		s = np.zeros(len(self.columns))
+		for block in self.blocks(block_size):
+			s += block.sum(0,dtype=np.float64)
+
+		return Series(s/self.nobs,index=self.columns)
+
+	def covariance(self,block_size=65536):
+
+		"""
+		Covariance matrix of the realizations
+
+		:rtype: :py:class:`SquareMatrix`
+
+		"""
+
+		assert self.nobs>1,"At least two realizations are needed to compute a covariance!"
+
+		#Accumulate with respect to the first realization for numerical stability
+		location = np.asarray(self.chunk(0)[0],dtype=np.float64)
+		s1,s2 = self._sums(location,block_size)
+		n = self.nobs
+
+		covariance = (s2 - np.outer(s1,s1)/n)/(n-1)
+		return SquareMatrix(covariance,index=self.columns,columns=self.columns)
+
+	def principalComponents(self,location=None,scale=None,block_size=65536):
+
+		"""
+		Computes the principal components of the realizations, see :py:meth:`Ensemble.principalComponents`
+
+		:returns: pcaHandler instance
+
+		"""
+
+		for l in [location,scale]:
+			if l is not None:
+				assert (l.index==self.columns).all(),"The column names do not match!"
+
+		#Scatter with respect to the location (the mean by default)
+		if location is None:
+			location = self.mean(block_size).values
+		else:
+			location = location.values
+		
+		s1,s2 = self._sums(location,block_size)
+		n = self.nobs
+
+		#Scale with the standard deviation by default
+		if scale is None:
+			scale = np.sqrt(np.diag(s2)/n - (s1/n)**2)
+		else:
+			scale = scale.values
+
+		pca = PCA(constructor_series=Series,constructor_ensemble=Ensemble,columns=self.columns,location=location,scale=scale)
+		pca.fit_scatter(s2,n)
+		return pca
+
+	def project(self,vectors,names=None,block_size=65536):
+
+		"""
+		Projects the realizations on the hyperplane defined by N linearly independent vectors, see :py:meth:`Ensemble.project`
+
+		:returns: projected Ensemble (in memory, it has only N columns)
+		:rtype: :py:class:`Ensemble`
+
+		"""
+
+		#Cast vector in matrix format, compute the cosines of the angles between all pairs of vector
+		vector_ensemble = Ensemble.from_records(vectors,index=names)
+		vector_values = vector_ensemble[self.columns].values
+		cosines = vector_values.dot(vector_values.T)
+
+		#Compute matrix of projectors along each of the basis vectors
+		projection_matrix = vector_values.T.dot(np.linalg.solve(cosines,np.eye(len(vector_values))))
+
+		#Project each block
+		projected = [ block.dot(projection_matrix) for block in self.blocks(block_size) ]
+		if len(projected):
+			projected = np.concatenate(projected,axis=0)
+		else:
+			projected = np.zeros((0,len(vector_values)))
+			
+		return Ensemble(projected,columns=vector_ensemble.index)
+
+##########################################################################################################################################################################
+
+##################################################################
+##########Moments of bootstrap resampled covariances##############
+##################################################################
+
+def _bootstrapCovarianceMoments(data,location,randomizer,block_size):
+
+	nobs,nfeatures = data.shape
+	s1 = np.zeros((nfeatures,nfeatures))
+	s2 = np.zeros((nfeatures,nfeatures))
+
+	#Covariance buffer in Fortran order, so that the BLAS update happens in place
+	c = np.zeros((nfeatures,nfeatures),order="F")
+	m = np.zeros(nfeatures)
+
+	for r in randomizer:
+
+		#Number of times each realization appears in the resample
+		counts = np.bincount(r,minlength=nobs).astype(np.float64)
+		n = counts.sum()
+		
+		c[:] = 0.
+		m[:] = 0.
+
+		#Stream over blocks of rows: c += (x-location)^T diag(counts) (x-location)
+		for first in range(0,nobs,block_size):
+
+			weights = counts[first:first+block_size]
+			if not weights.any():
+				continue
+
+			centered = data[first:first+block_size] - location
+			weighted = centered*weights[:,None]
+			m += weighted.sum(0)
+			c = blas.dgemm(alpha=1.0,a=weighted,b=centered,beta=1.0,c=c,trans_a=True,overwrite_c=True)
+
+		#Resampled covariance
+		m /= n
+		c -= n*np.outer(m,m)
+		c /= (n-1)
+
+		s1 += c
+		s2 += c**2
+
+	return s1,s2
+
+##########################################################################################################################################################################
+
 ##############################################
 ########SquareMatrix class####################
 ##############################################
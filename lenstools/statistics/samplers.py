@@ -12,6 +12,8 @@
 
 from __future__ import division,print_function,with_statement
 
+from multiprocessing.pool import ThreadPool
+
 import numpy as np
 import emcee
 
@@ -134,4 +136,273 @@ def emcee_sampler(emulator,observed_feature,features_covariance,correct=None,psl
 	if pslice is None:
 		return Ensemble(sampler.flatchain,columns=emulator.parameter_names)
 	else:
-		return Ensemble(sampler.flatchain,columns=filter(lambda p:p not in pslice,emulator.parameter_names))
\ No newline at end of file
+		return Ensemble(sampler.flatchain,columns=filter(lambda p:p not in pslice,emulator.parameter_names))
+
+#####################################################
+######Vectorized affine invariant ensemble sampler####
+#####################################################
+
+class EnsembleSampler(object):
+
+	"""
+	Affine invariant ensemble MCMC sampler (Goodman & Weare 2010, stretch move) in which the log probability is evaluated on the proposals of all the walkers of a half-ensemble at once; this allows the emulator predictions and chi2 to be computed as a single batched matrix operation per step. The chain is stored in a preallocated buffer, which can be a memory mapped .npy file for long chains
+
+	:param nwalkers: number of walkers (must be even)
+	:type nwalkers: int.
+
+	:param ndim: dimension of the parameter space
+	:type ndim: int.
+
+	:param lnprob: log probability; it must take a (N,ndim) array of parameters and return an array of N log probabilities
+	:type lnprob: callable
+
+	:param a: scale parameter of the stretch move
+	:type a: float.
+
+	:param threads: if bigger than 1, the proposals are split in this many batches that are evaluated by different threads
+	:type threads: int.
+
+	"""
+
+	def __init__(self,nwalkers,ndim,lnprob,a=2.0,threads=None):
+
+		assert not nwalkers%2,"The number of walkers must be even!"
+		assert nwalkers>=2*ndim,"The number of walkers must be at least twice the parameter space dimension!"
+
+		self.nwalkers = nwalkers
+		self.ndim = ndim
+		self.lnprob = lnprob
+		self.a = a
+		self.threads = threads
+
+		self.chain = None
+		self.lnprobability = None
+		self.naccepted = np.zeros(nwalkers,dtype=np.int64)
+		self.iterations = 0
+
+	@property
+	def flatchain(self):
+		return self.chain.reshape(-1,self.ndim)
+
+	@property
+	def acceptance_fraction(self):
+
+		"""
+		Fraction of accepted proposals of each walker, counting only the steps stored in the chain (burn-in runs with store=False are excluded)
+
+		"""
+
+		return self.naccepted/max(self.iterations,1)
+
+	def _lnprob(self,p,pool):
+
+		if pool is None:
+			return np.asarray(self.lnprob(p)).reshape(len(p))
+
+		batches = [ b for b in np.array_split(p,self.threads) if len(b) ]
+		return np.concatenate([ np.asarray(l).reshape(-1) for l in pool.map(self.lnprob,batches) ])
+
+	def sample(self,p0,nsteps,lnprob0=None,store=True,chain_file=None):
+
+		"""
+		Run the sampler for nsteps steps
+
+		:param p0: initial positions of the walkers
+		:type p0: (nwalkers,ndim) array
+
+		:param nsteps: number of steps
+		:type nsteps: int.
+
+		:param lnprob0: log probability at the initial positions (computed if None)
+		:type lnprob0: array
+
+		:param store: if False the positions are not stored in the chain buffer (useful for burn-in)
+		:type store: bool.
+
+		:param chain_file: if not None, the chain buffer is a .npy file with this name, memory mapped and filled while sampling
+		:type chain_file: str.
+
+		:returns: final positions and log probabilities of the walkers
+		:rtype: tuple.
+
+		"""
+
+		p = np.array(p0,dtype=np.float64).reshape(self.nwalkers,self.ndim)
+		half = self.nwalkers//2
+
+		#Preallocate the chain buffer
+		if store:
+			if chain_file is not None:
+				self.chain = np.lib.format.open_memmap(chain_file,mode="w+",dtype=np.float64,shape=(nsteps,self.nwalkers,self.ndim))
+			else:
+				self.chain = np.empty((nsteps,self.nwalkers,self.ndim))
+			self.lnprobability = np.empty((nsteps,self.nwalkers))
+			self.naccepted[:] = 0
+			self.iterations = 0
+
+		#Thread pool for the log probability evaluations
+		if (self.threads is not None) and (self.threads>1):
+			pool = ThreadPool(self.threads)
+		else:
+			pool = None
+
+		try:
+			
+			if lnprob0 is None:
+				lnp = self._lnprob(p,pool)
+			else:
+				lnp = np.array(lnprob0,dtype=np.float64)
+
+			for step in range(nsteps):
+
+				#Each half of the walkers is moved using the other half as complementary ensemble
+				for first,second in [(slice(0,half),slice(half,None)),(slice(half,None),slice(0,half))]:
+
+					moving = p[first]
+					complementary = p[second]
+
+					#Stretch move proposals
+					z = ((self.a-1.0)*np.random.uniform(size=half) + 1.0)**2/self.a
+					partners = complementary[np.random.randint(half,size=half)]
+					proposal = partners + z[:,None]*(moving - partners)
+
+					#Batched log probability, Metropolis acceptance
+					lnp_proposal = self._lnprob(proposal,pool)
+					lnq = (self.ndim-1.0)*np.log(z) + lnp_proposal - lnp[first]
+					accepted = np.log(np.random.uniform(size=half)) < lnq
+
+					moving[accepted] = proposal[accepted]
+					lnp[first][accepted] = lnp_proposal[accepted]
+					if store:
+						self.naccepted[first] += accepted
+
+				if store:
+					self.iterations += 1
+					self.chain[step] = p
+					self.lnprobability[step] = lnp
+
+		finally:
+			if pool is not None:
+				pool.close()
+				pool.join()
+
+		if store and (chain_file is not None):
+			self.chain.flush()
+
+		return p,lnp
+
+#######################################################
+######Emulator sampling with the ensemble sampler######
+#######################################################
+
+class _lnprobBatch(object):
+
+	def __init__(self,scorer,pslice_values,sample_indices):
+		self.scorer = scorer
+		self.pslice_values = pslice_values
+		self.sample_indices = sample_indices
+
+	def __call__(self,p):
+
+		if self.pslice_values is not None:
+			
+			pc = np.empty((len(p),len(self.pslice_values)+len(self.sample_indices)))
+			for i in self.pslice_values:
+				pc[:,i] = self.pslice_values[i]
+			pc[:,self.sample_indices] = p
+
+		else:
+			pc = p
+
+		return -0.5*self.scorer(pc)
+
+
+def ensemble_sampler(emulator,observed_feature,features_covariance,correct=None,pslice=None,nwalkers=16,nburn=100,nchain=1000,threads=None,chain_file=None):
+
+	"""
+	Parameter posterior sampling with the built-in :py:class:`EnsembleSampler`: at each step the emulated features and the chi2 of all the walker proposals are computed at once
+
+	:param emulator: feature emulator
+	:type emulator: :py:class:`Emulator`
+
+	:param observed_feature: observed feature to condition the parameter estimation
+	:type observed_feature: array
+
+	:param features_covariance: covariance matrix of the features
+	:type features_covariance: array
+
+	:param correct: if not None, correct for the bias in the inverse covariance estimator assuming the covariance was estimated by 'correct' simulations
+	:type correct: int.
+
+	:param pslice: specify slices of the parameter space in which some parameters are keps as constants
+	:type pslice: dict.
+
+	:param nwalkers: number of chains
+	:type nwalkers: int.
+
+	:param nburn: length of the burn-in chain
+	:type nburn: int.
+
+	:param nchain: length of the MCMC chain
+	:type nchain: int.
+
+	:param threads: number of threads that evaluate the walker proposals
+	:type threads: int.
+
+	:param chain_file: if not None, the chain is streamed to this .npy file
+	:type chain_file: str.
+
+	:returns: ensemble of samples from the posterior probability distribution
+	:rtype: :py:class:`Ensemble`
+
+	"""
+
+	from .constraints import Chi2Scorer
+
+	#Train the emulator if necessary
+	if not hasattr(emulator,"_interpolator"):
+		emulator.train()
+
+	parameters = emulator["parameters"]
+
+	#Parameter space to sample
+	if pslice is None: 
+		parameters = parameters.values
+		pslice_values = None
+		sample_indices = None
+		parameter_names = emulator.parameter_names
+	else:
+		pslice_values = dict((emulator.parameter_names.index(p),pslice[p]) for p in pslice)
+		sample_indices = [ emulator.parameter_names.index(p) for p in emulator.parameter_names if p not in pslice ]
+		assert len(pslice_values)+len(sample_indices)==len(emulator.parameter_names)
+		parameters = parameters.values[:,sample_indices]
+		parameter_names = [ p for p in emulator.parameter_names if p not in pslice ]
+
+	#Extremes of the sampling space	
+	pmin,pmax = parameters.min(0),parameters.max(0)
+
+	#Feature name
+	feature_name = emulator.feature_names[0]
+
+	#Factorize the covariance once, the log probability is evaluated on batches of points
+	scorer = Chi2Scorer(emulator._interpolator,observed_feature,features_covariance,correct=correct)
+	lnprob = _lnprobBatch(scorer,pslice_values,sample_indices)
+
+	#Initialize the walkers positions
+	ndim = len(pmin)
+	p0 = pmin + np.random.uniform(size=(nwalkers,ndim))*(pmax-pmin)
+
+	#Initialize the sampler
+	sampler = EnsembleSampler(nwalkers,ndim,lnprob,threads=threads)
+
+	#Burn-in
+	logdriver.info("Running ensemble sampler burn-in: feature name={0}, feature dimension={1}, parameter dimension={2}, steps={3}".format(feature_name,len(observed_feature),ndim,nburn))
+	pos,lnp = sampler.sample(p0,nburn,store=False)
+
+	#Sampling
+	logdriver.info("Running ensemble sampler MCMC chain: feature name={0}, feature dimension={1}, parameter dimension={2}, steps={3}".format(feature_name,len(observed_feature),ndim,nchain))
+	sampler.sample(pos,nchain,lnprob0=lnp,chain_file=chain_file)
+	logdriver.info("Mean acceptance fraction: {0:.3f}".format(sampler.acceptance_fraction.mean()))
+
+	#Return sampled parameters
+	return Ensemble(sampler.flatchain,columns=parameter_names)
@@ -1,10 +1,13 @@
 import sys,os
 
+import numpy as np
+
 from .. import dataExtern
-from ..catalog import ShearCatalog
+from ..catalog import ShearCatalog,CatalogAccumulator
 
 import matplotlib.pyplot as plt
 import astropy.units as u
+import astropy.table as tbl
 
 #Reconstruct shear map from catalogs
 def test_reconstruct():
@@ -45,3 +48,97 @@ def test_reconstruct():
 
 
 
+
+#Single pass, multi quantity pixelization
+def test_pixelize_multi():
+
+	rs = np.random.RandomState(11)
+	x,y = rs.uniform(0.0,2.0,size=(2,100000))
+	catalog = ShearCatalog([x,y,rs.normal(size=len(x)),rs.normal(size=len(x)),rs.uniform(0.5,1.5,size=len(x))],names=["x","y","shear1","shear2","w"])
+	npixel = 64
+
+	#Nearest grid point assignment matches a direct histogram, both for sums and weighted averages
+	edges = np.linspace(0.0,2.0,npixel+1)
+	hits = np.histogram2d(y,x,bins=(edges,edges))[0]
+	wsum = np.histogram2d(y,x,bins=(edges,edges),weights=catalog["w"])[0]
+	s1 = np.histogram2d(y,x,bins=(edges,edges),weights=catalog["w"]*catalog["shear1"])[0]
+	s2 = np.histogram2d(y,x,bins=(edges,edges),weights=catalog["shear2"])[0]
+
+	assert np.allclose(catalog.pixelize(2.0*u.deg,npixel,field_quantity=None,accumulate="sum"),hits)
+	assert np.allclose(catalog.pixelize(2.0*u.deg,npixel,field_quantity="shear2",accumulate="sum",threads=3),s2)
+	assert np.allclose(catalog.pixelize(2.0*u.deg,npixel,field_quantity=["shear1"],weights="w",threads=2)[0],s1/wsum)
+
+	#Shear maps are built in one pass
+	shear = catalog.toMap(2.0*u.deg,npixel,None,threads=4)
+	assert np.allclose(shear.data[1],s2/hits)
+
+	#Cloud in cell assignment conserves the total weight of the objects away from the edges
+	inner = catalog[(x>0.1) & (x<1.9) & (y>0.1) & (y<1.9)]
+	cic = inner.pixelize(2.0*u.deg,npixel,field_quantity=[None,"shear1"],accumulate="sum",assignment="cic",threads=2)
+	assert np.isclose(np.nansum(cic[0]),len(inner))
+	assert np.isclose(np.nansum(cic[1]),inner["shear1"].sum())
+
+	#Pixels with objects of zero total weight are not empty: their sums are defined, their weighted averages are not
+	zero = catalog[(x<0.5) & (y<0.5)]
+	zero["w"] = 0.0
+	zero_sum = zero.pixelize(2.0*u.deg,npixel,field_quantity="shear1",weights="w",accumulate="sum")
+	zero_hits = np.histogram2d(zero["y"],zero["x"],bins=(edges,edges))[0]
+	assert (zero_sum[zero_hits>0]==0.0).all() and np.isnan(zero_sum[zero_hits==0]).all()
+	assert np.isnan(zero.pixelize(2.0*u.deg,npixel,field_quantity="shear1",weights="w")).all()
+
+#Streaming map construction from catalogs split in several files
+def test_stream_to_map():
+
+	rs = np.random.RandomState(5)
+	npixel = 32
+	catalogs = list()
+
+	for n in range(2):
+
+		x,y = rs.uniform(0.0,1.0,size=(2,5000))
+		position = ShearCatalog([x,y,rs.uniform(0.5,2.0,size=len(x))],names=["x","y","z"])
+		shear = ShearCatalog([rs.normal(scale=0.01,size=len(x)),rs.normal(scale=0.01,size=len(x))],names=["shear1","shear2"])
+		es = ShearCatalog([rs.normal(scale=0.2,size=len(x)),rs.normal(scale=0.2,size=len(x))],names=["e1","e2"])
+
+		position.write("stream_positions{0}.fits".format(n),overwrite=True)
+		shear.write("stream_shear{0}.fits".format(n),overwrite=True)
+		es.write("stream_es{0}.fits".format(n),overwrite=True)
+
+		catalog = tbl.hstack((position,shear))
+		catalog = ShearCatalog(catalog)
+		catalog.addSourceEllipticity(es,inplace=True)
+		catalogs.append(catalog)
+
+	#Chunked reading gives back the whole file
+	chunks = list(ShearCatalog.readChunks("stream_positions0.fits",chunk_size=1234))
+	assert len(chunks)==5 and np.allclose(np.concatenate([c["x"] for c in chunks]),catalogs[0]["x"])
+
+	#Streaming, with the intrinsic ellipticities added block by block, matches the pixelization of the full catalog
+	full = ShearCatalog(tbl.vstack(catalogs)).toMap(1.0*u.deg,npixel,None)
+	streamed = ShearCatalog.streamToMap(["stream_shear0.fits","stream_shear1.fits"],["stream_positions0.fits","stream_positions1.fits"],1.0*u.deg,npixel,ellipticity_files=["stream_es0.fits","stream_es1.fits"],chunk_size=700,threads=2)
+	assert np.allclose(streamed.data,full.data,equal_nan=True)
+
+	#Files with different numbers of rows are refused
+	ShearCatalog.read("stream_shear0.fits")[:4000].write("stream_shear_short.fits",overwrite=True)
+	try:
+		ShearCatalog.streamToMap(["stream_shear_short.fits"],["stream_positions0.fits"],1.0*u.deg,npixel,chunk_size=700)
+	except ValueError:
+		pass
+	else:
+		raise AssertionError("Mismatched files should raise a ValueError")
+
+	#Blocks with positions in different units are refused, the unit is recorded for the smoothing
+	accumulator = CatalogAccumulator(1.0*u.deg,npixel,["shear1"])
+	accumulator.accumulate(catalogs[0])
+	assert accumulator.position_unit==u.deg
+	accumulator.getMaps(smooth=1.0*u.arcmin)
+
+	catalogs[1]["x"] *= 60.0
+	catalogs[1]["y"] *= 60.0
+	catalogs[1].setSpatialInfo(unit=u.arcmin)
+	try:
+		accumulator.accumulate(catalogs[1])
+	except AssertionError:
+		pass
+	else:
+		raise AssertionError("Blocks with different position units should be refused")
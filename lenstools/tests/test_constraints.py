@@ -11,7 +11,9 @@ import matplotlib.pyplot as plt
 from .. import Ensemble
 from ..statistics.constraints import FisherAnalysis,FisherSeries,Emulator,EmulatorSeries
 from ..statistics.contours import ContourPlot
+from ..statistics import samplers
 from ..simulations import CFHTemu1
+from ..utils.algorithms import precision_bias_correction
 
 
 #Test Fisher analysis with power spectrum
@@ -265,6 +267,110 @@ def test_reparametrize():
 	assert (emulator[("parameters","Si8")]==(si8*(Om**0.5))).all()
 
 
+#Test the batched Rbf interpolator against one scipy Rbf per bin
+def test_rbf_batched():
+
+	np.random.seed(0)
+	points = np.random.uniform(size=(50,3))
+	features = np.random.normal(size=(50,20))
+	new_points = np.random.uniform(size=(300,3))
+
+	for function in ["multiquadric","inverse","gaussian","linear","cubic","quintic","thin_plate"]:
+		
+		batched = Emulator.from_features(features,parameters=points)
+		batched.train(function=function,block_size=64,threads=4)
+		scipy_rbf = Emulator.from_features(features,parameters=points)
+		scipy_rbf.train(method="ScipyRbf",function=function)
+
+		assert np.allclose(batched.predict(new_points,raw=True),scipy_rbf.predict(new_points,raw=True))
+
+	#The interpolation is exact at the training points
+	assert np.allclose(batched.predict(points,raw=True),features)
+
+#Test the streaming chi2 against the direct sandwich product with the inverse covariance
+def test_chi2_streaming():
+
+	np.random.seed(0)
+	points = np.random.uniform(size=(50,3))
+	features = np.random.normal(size=(50,20))
+	new_points = np.random.uniform(size=(1000,3))
+
+	emulator = Emulator.from_features(features,parameters=points)
+	emulator.train()
+
+	A = np.random.normal(size=(20,20))
+	covariance = A.dot(A.T) + np.eye(20)
+	observation = np.random.normal(size=20)
+
+	residuals = observation[None] - emulator.predict(new_points,raw=True)
+	chi2_direct = (residuals.dot(np.linalg.inv(covariance))*residuals).sum(-1)*precision_bias_correction(100,20)
+
+	chi2_streaming = emulator.chi2(new_points,observation,covariance,correct=100,block_size=64,threads=4)
+	assert np.allclose(chi2_streaming,chi2_direct)
+
+	chi2_chunks = emulator.chi2(new_points,observation,covariance,correct=100,split_chunks=4)
+	assert np.allclose(chi2_chunks,chi2_direct)
+
+#Test the incremental training when new models are added to the Emulator
+def test_emulator_incremental():
+
+	np.random.seed(0)
+	points = np.random.uniform(size=(200,3))
+	features = np.random.normal(size=(200,20))
+	new_points = np.random.uniform(size=(100,3))
+
+	for method in ["Rbf",samplers.multiquadric]:
+
+		emulator = Emulator.from_features(features[:195],parameters=points[:195])
+		emulator.train(method=method)
+
+		#Adding few models keeps the length scale: the updated factorization must match a fresh one with the same length scale (up to the conditioning of the kernel matrix)
+		updated = emulator.add_models(points[195:],features[195:])
+		assert len(updated)==200
+		assert updated._interpolator.epsilon==emulator._interpolator.epsilon
+
+		fresh = Emulator.from_features(features,parameters=points)
+		fresh.train(method=method,epsilon=emulator._interpolator.epsilon)
+		assert np.allclose(updated.predict(new_points,raw=True),fresh.predict(new_points,raw=True),atol=1.0e-4)
+		assert np.allclose(updated.predict(points,raw=True),features,atol=1.0e-4)
+
+	#Adding many models changes the length scale: refit from scratch
+	emulator = Emulator.from_features(features[:100],parameters=points[:100])
+	emulator.train()
+	updated = emulator.add_models(points[100:],features[100:])
+	
+	fresh = Emulator.from_features(features,parameters=points)
+	fresh.train()
+	assert updated._interpolator.epsilon==fresh._interpolator.epsilon
+	assert np.allclose(updated.predict(new_points,raw=True),fresh.predict(new_points,raw=True))
+
+#Test the vectorized ensemble sampler on a gaussian posterior
+def test_ensemble_sampler():
+
+	np.random.seed(0)
+	sigma = np.array([1.,2.,0.5])
+	lnprob = lambda p:-0.5*((p/sigma)**2).sum(-1)
+
+	sampler = samplers.EnsembleSampler(16,3,lnprob,threads=4)
+	pos,lnp = sampler.sample(np.random.normal(size=(16,3)),200,store=False)
+	sampler.sample(pos,2000,lnprob0=lnp,chain_file="ensemble_chain.npy")
+
+	assert sampler.flatchain.shape==(32000,3)
+	assert (sampler.acceptance_fraction>0.2).all()
+	assert np.allclose(sampler.flatchain.mean(0),0.,atol=0.2)
+	assert np.allclose(sampler.flatchain.std(0),sigma,rtol=0.15)
+	assert (np.load("ensemble_chain.npy")==sampler.chain).all()
+
+	#Emulator posterior: the chi2 of all the walkers is computed at once
+	points = np.random.uniform(size=(50,2))
+	features = points.dot(np.random.normal(size=(2,10)))
+	emulator = Emulator.from_features(features,parameters=points,parameter_index=["a","b"])
+	emulator.train()
+
+	samples = samplers.ensemble_sampler(emulator,features[0],np.eye(10)*1.0e-4,nwalkers=8,nburn=100,nchain=200,threads=2)
+	assert samples.shape==(1600,2)
+	assert np.allclose(samples.mean(0).values,points[0],atol=0.05)
+
 #Test various methods of parameter sampling: Fisher Matrix, grid emulator, MCMC chain
 def test_sampling(p_value=0.684):
 
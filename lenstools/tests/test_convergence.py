@@ -1,11 +1,13 @@
 import os
 
 from .. import ConvergenceMap
+from ..image.convergence import MapAccumulator
+from ..image.noise import GaussianNoiseGenerator
 
 from .. import dataExtern
 
 import numpy as np
-from astropy.units import deg,rad
+from astropy.units import deg,rad,arcmin
 
 import matplotlib.pyplot as plt
 
@@ -67,6 +69,20 @@ def test_cross():
 	plt.savefig("cross_spectrum.png")
 	plt.clf()
 
+def test_power_matrix():
+
+	#All the auto and cross spectra in one call
+	conv1 = ConvergenceMap.load(os.path.join(dataExtern(),"conv1.fit"))
+	conv2 = ConvergenceMap.load(os.path.join(dataExtern(),"conv2.fit"))
+	maps = [conv1,conv2,conv1+conv2]
+
+	l,Pl = ConvergenceMap.powerSpectrumMatrix(maps,l_edges,threads=2)
+	assert Pl.shape==(3,3,len(l_edges)-1)
+
+	for i in range(3):
+		for j in range(3):
+			assert np.allclose(Pl[i,j],maps[i].cross(maps[j],l_edges=l_edges)[1])
+
 def test_bispectrum():
 
 	#Measure bispectrum
@@ -174,6 +190,82 @@ def test_peak_locations():
 	fig.savefig("peak_locations.png")
 
 
+def test_peak_pairs():
+
+	#Histogram of the peak distances with the pair counter, compared with the full distance matrix
+	thresholds = np.arange(0.05,0.5,0.05)
+	bins = np.linspace(0.01,1.0,20)*deg
+	distances = test_map.peakDistances(thresholds)
+	counts = test_map.peakDistances(thresholds,bins=bins,threads=4)
+	assert (np.histogram(distances.to(deg).value,bins=bins.value)[0]==counts).all()
+
+	#Peak two point function, also between threshold bins
+	scales,xi = test_map.peakTwoPCF(thresholds,bins,threads=4,seed=0)
+	assert xi.shape==(len(bins)-1,)
+	scales,xi_cross = test_map.peakTwoPCF(thresholds,bins,cross=True,threads=4,seed=0)
+	assert xi_cross.shape==(len(thresholds)-1,len(thresholds)-1,len(bins)-1)
+
+
+def test_accumulator():
+
+	#Single pass moments and PDF must agree with the full derivative maps and numpy histograms
+	gradient_x,gradient_y = test_map.gradient()
+	hessian_xx,hessian_yy,hessian_xy = test_map.hessian()
+	laplacian = hessian_xx + hessian_yy
+	gradient2 = gradient_x**2 + gradient_y**2
+
+	moments = test_map.moments(threads=4)
+	assert np.isclose(moments[0],test_map.data.std())
+	assert np.isclose(moments[1],np.sqrt(gradient2.mean()))
+	assert np.isclose(moments[4],(gradient2*laplacian).mean())
+	assert np.isclose(moments[7],(test_map.data*gradient2*laplacian).mean())
+
+	edges = np.sort(np.random.uniform(-0.1,0.1,size=20))
+	assert np.allclose(test_map.pdf(edges)[1],np.histogram(test_map.data,bins=edges,density=True)[0])
+
+	#Merging partial accumulators
+	acc = MapAccumulator(thresholds_mf*test_map.data.std())
+	acc.accumulate(test_map.data,rows=(0,100))
+	acc += MapAccumulator(thresholds_mf*test_map.data.std()).accumulate(test_map.data,rows=(100,test_map.data.shape[0]))
+	assert np.allclose(acc.pdf()[1],test_map.pdf(thresholds_mf,norm=True)[1]/test_map.data.std())
+
+
+def test_scale_space():
+
+	#Multi scale statistics with stencil derivatives must match smoothing followed by the single scale statistics
+	scales = [0.5,1.0,2.0]*arcmin
+	stats = test_map.multiScaleStatistics(scales,peaks=thresholds_pk,minkowski=thresholds_mf,moments=True,norm=True,derivatives="stencil")
+	assert stats["peaks"].shape==(len(scales),len(thresholds_pk)-1)
+	assert stats["minkowski"].shape==(len(scales),3,len(thresholds_mf)-1)
+
+	for n,scale in enumerate(scales):
+		smoothed = test_map.smooth(scale,kind="gaussianFFT")
+		assert np.allclose(stats["peaks"][n],smoothed.peakCount(thresholds_pk,norm=True)[1])
+		assert np.allclose(stats["minkowski"][n],np.array(smoothed.minkowskiFunctionals(thresholds_mf,norm=True)[1:]))
+		assert np.allclose(stats["moments"][n],smoothed.moments())
+
+
+def test_masked_power():
+
+	#Gaussian random fields with a known spectrum: the deconvolved pseudo spectrum of the masked maps must match the unmasked one
+	generator = GaussianNoiseGenerator(shape=(256,256),side_angle=3.5*deg)
+	ell = np.linspace(10.0,50000.0,1000)
+	power = np.array([ell,1.0e-9*1000.0/ell])
+	edges = np.arange(200.0,8000.0,400.0)
+
+	mask = np.ones((256,256),dtype=np.int8)
+	mask[100:130,40:70] = 0
+	mask[:,:20] = 0
+
+	full,masked = list(),list()
+	for seed in range(20):
+		gaussian_map = generator.fromConvPower(power,seed=seed,kind="linear",bounds_error=False,fill_value=0.0)
+		full.append(gaussian_map.powerSpectrum(edges)[1])
+		masked.append(gaussian_map.mask(mask).powerSpectrum(edges,threads=4)[1])
+
+	assert np.allclose(np.mean(masked,axis=0),np.mean(full,axis=0),rtol=0.05)
+
+
 def test_getValues():
 
 	b = np.linspace(0.0,test_map.side_angle.value,test_map.data.shape[0])
@@ -182,6 +274,21 @@ def test_getValues():
 	new_values = test_map.getValues(xx,yy)
 	assert (new_values==test_map.data)[:-1,:-1].all()
 
+def test_getValues_interpolation():
+
+	#Interpolation schemes go through the values at the pixel centers
+	n = test_map.data.shape[0]
+	xx,yy = np.meshgrid(np.arange(n)+0.5,np.arange(n)+0.5) * test_map.resolution.to(deg)
+	for method in ["nearest","bilinear","bicubic"]:
+		assert np.allclose(test_map.getValues(xx,yy,method=method,threads=4),test_map.data)
+
+	#Both bilinear and bicubic interpolation are exact on linear fields away from the periodic boundary
+	ramp = ConvergenceMap(data=np.add.outer(0.5*np.arange(64),-0.25*np.arange(64)),angle=1.0*deg)
+	x,y = np.random.RandomState(7).uniform(2.0,60.0,size=(2,1000))
+	for method in ["bilinear","bicubic"]:
+		values = ramp.getValues(x*ramp.resolution.to(deg),y*ramp.resolution.to(deg),method=method)
+		assert np.allclose(values,0.5*(y-0.5)-0.25*(x-0.5))
+
 def test_gradient_partial():
 
 	b = np.linspace(0.0,test_map.side_angle.value,test_map.data.shape[0])
@@ -1,6 +1,7 @@
 import sys,os
 	
 from .. import Ensemble
+from ..statistics.ensemble import EnsembleStore,ComputePipeline
 from ..utils.defaults import measure_power_spectrum,peaks_loader
 
 try:
@@ -241,5 +242,72 @@ def test_selfChi2():
 	#Save figure
 	fig.savefig("self_chi2.png")
 
+def test_bootstrap_covariance():
 
+	np.random.seed(0)
+	ens = Ensemble(np.random.normal(size=(500,20))*np.arange(1,21))
 
+	#Compare with the covariance of explicitly resampled ensembles
+	covariance,error = ens.covariance(bootstrap=True,bootstrap_size=300,resample=20,seed=1,threads=4,error=True)
+
+	np.random.seed(1)
+	randomizer = np.random.randint(ens.nobs,size=(20,300))
+	resampled = np.array([ np.cov(ens.values[r],rowvar=False) for r in randomizer ])
+
+	assert np.allclose(covariance.values,resampled.mean(0))
+	assert np.allclose(error.values,resampled.std(0,ddof=1))
+	assert (covariance.columns==ens.columns).all()
+
+def test_store():
+
+	np.random.seed(0)
+	ens = Ensemble(np.random.normal(size=(1000,10))*np.arange(1,11)+np.arange(10),columns=pd.Index(range(10),name="bin"))
+	
+	#Build the store in three pieces: the existing chunks are never rewritten
+	if os.path.isdir("ensemble_store"):
+		import shutil
+		shutil.rmtree("ensemble_store")
+	
+	ens.iloc[:400].save("ensemble_store",format="store")
+	ens.iloc[400:700].save("ensemble_store",format="store")
+
+	file_list = list()
+	for n in range(700,1000):
+		file_list.append("ensemble_store_row{0}.npy".format(n))
+		np.save(file_list[-1],ens.values[n])
+
+	store = Ensemble.compute(file_list,callback_loader=np.load,store="ensemble_store",chunk_size=128)
+	assert store.file_list==file_list
+
+	assert store.shape==ens.shape
+	assert (Ensemble.read("ensemble_store").values==ens.values).all()
+
+	#Streaming statistics
+	assert np.allclose(store.mean(block_size=64).values,ens.mean().values)
+	assert np.allclose(store.covariance(block_size=64).values,ens.cov().values)
+
+	pca_store = store.principalComponents(block_size=64)
+	pca = ens.principalComponents()
+	assert np.allclose(pca_store.eigenvalues.values,pca.eigenvalues.values)
+	assert np.allclose(np.abs(pca_store.transform(ens).values),np.abs(pca.transform(ens).values))
+
+	vectors = (ens.iloc[0],ens.iloc[1])
+	assert np.allclose(store.project(vectors,names=["a","b"],block_size=64).values,ens.project(vectors,names=["a","b"]).values)
+
+def test_pipeline():
+
+	np.random.seed(0)
+	file_list = list()
+	for n in range(50):
+		file_list.append("pipeline_map{0}.npy".format(n))
+		np.save(file_list[-1],np.random.normal(size=(64,64)))
+
+	#Reader threads load the maps, compute threads measure the feature
+	pipeline = ComputePipeline(reader=np.load,read_threads=2,compute_threads=3,prefetch=4)
+	ens = Ensemble.compute(file_list,callback_loader=lambda m,bins:np.histogram(m,bins=bins)[0],pipeline=pipeline,bins=np.linspace(-3,3,11))
+	ens_serial = Ensemble.compute(file_list,callback_loader=lambda f,bins:np.histogram(np.load(f),bins=bins)[0],bins=np.linspace(-3,3,11))
+
+	assert (ens.values==ens_serial.values).all()
+	assert pipeline.metrics["files"]==50
+	assert pipeline.metrics["bytes_read"]==sum(os.path.getsize(f) for f in file_list)
+	assert pipeline.metrics["maps_per_second"]>0
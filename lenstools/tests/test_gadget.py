@@ -1,6 +1,6 @@
 import os
 
-from ..simulations import Gadget2SnapshotDE
+from ..simulations import Gadget2SnapshotDE,Gadget2SnapshotSet
 from ..pipeline.settings import Gadget2Settings
 
 from .. import dataExtern
@@ -53,6 +53,66 @@ def test_write():
 	snap.write("gadget_ic")
 
 
+def test_read_set():
+
+	#Create an empty gadget snapshot
+	snap = Gadget2SnapshotDE()
+
+	#Generate random positions and velocities
+	NumPart = 32**3
+	x = np.random.uniform(0.0,15.0,size=(NumPart,3)) * Mpc
+	v = np.random.uniform(-1,1,size=(NumPart,3)) * m / s
+
+	snap.setPositions(x)
+	snap.setVelocities(v)
+	snap.setHeaderInfo()
+
+	#Split the particles between three files
+	snap.write("gadget_set",files=3)
+
+	#Read them back all at once
+	with Gadget2SnapshotSet.open("gadget_set",snapshot_class=Gadget2SnapshotDE) as snapset:
+		
+		assert len(snapset.snapshots)==3
+		pos = snapset.getPositions()
+		vel = snapset.getVelocities()
+		ids = snapset.getID()
+
+		assert np.allclose(pos.to(Mpc).value,x.to(Mpc).value,rtol=1.0e-5)
+		assert np.allclose(vel.to(m/s).value,v.to(m/s).value,rtol=1.0e-5,atol=1.0e-6)
+		assert np.all(ids==np.arange(1,NumPart+1))
+
+		#Balanced partition among tasks, regardless of the file boundaries
+		partition = snapset.partition(4)
+		assert [ sum([ last-first for n,first,last in chunks ]) for chunks in partition ]==[NumPart//4]*4
+
+
+def test_write_stream():
+
+	#Create an empty gadget snapshot and set the header in advance
+	NumPart = 32**3
+	snap = Gadget2SnapshotDE()
+	snap.setHeaderInfo(num_particles_file_of_type=np.array([0,NumPart,0,0,0,0]))
+
+	#Generate the particles chunk by chunk
+	np.random.seed(1)
+	x = np.random.uniform(0.0,15.0,size=(NumPart,3)) * Mpc
+	v = np.random.uniform(-1,1,size=(NumPart,3)) * m / s
+
+	def chunks(size=5000):
+		for n in range(0,NumPart,size):
+			yield x[n:n+size],v[n:n+size]
+
+	#Stream to three files
+	snap.writeStream("gadget_stream",chunks(),files=3)
+
+	#Read back and compare
+	with Gadget2SnapshotSet.open("gadget_stream",snapshot_class=Gadget2SnapshotDE) as snapset:
+		assert np.allclose(snapset.getPositions().to(Mpc).value,x.to(Mpc).value,rtol=1.0e-5)
+		assert np.allclose(snapset.getVelocities().to(m/s).value,v.to(m/s).value,rtol=1.0e-5,atol=1.0e-6)
+		assert np.all(snapset.getID()==np.arange(1,NumPart+1))
+
+
 def test_paramfile():
 
 	#Create an empty gadget snapshot
@@ -30,4 +30,27 @@ def test_convergence_power():
 	try:
 		plt.savefig("limber_power.png")
 	except:
-		pass
\ No newline at end of file
+		pass
+
+
+def test_tomographic_power():
+
+	l = np.logspace(1.0,4.0,50)
+
+	integrator = LimberIntegrator(cosmoModel=WMAP9)
+	integrator.load3DPowerSpectrum(load_power_default,os.path.join(dataExtern(),"camb_output"),"fiducial_matterpower_")
+
+	#Single source at the last redshift gives back the convergence power spectrum
+	zs = integrator.z[-1]
+	C = integrator.tomographicPowerSpectrum(l,[zs,(np.array([0.5,0.8,1.0,1.2]),np.array([0.0,1.0,1.0,0.0]))])
+	assert C.shape==(2,2,len(l))
+	assert np.allclose(C[0,0],integrator.convergencePowerSpectrum(l))
+
+	#Cross spectra are symmetric and bounded by the auto spectra
+	assert np.allclose(C[0,1],C[1,0])
+	assert (C[0,1]**2<=C[0,0]*C[1,1]*(1+1.0e-10)).all()
+
+	#Distributions tabulated on different grids have different kernels
+	narrow = integrator.lensingKernel((np.array([0.8,1.0,1.2]),np.array([0.0,1.0,0.0])))
+	wide = integrator.lensingKernel((np.array([0.5,0.8,1.0,1.2]),np.array([0.0,1.0,1.0,0.0])))
+	assert not np.allclose(narrow,wide)
@@ -244,3 +244,23 @@ def test_moments():
 	np.savetxt("masked_moments.txt",np.array([mom_original,mom_masked,rel_difference]),fmt="%.2e")
 
 
+
+#Check that the compacted masked derivatives agree with the full map derivatives on the valid pixels
+def test_masked_derivatives():
+
+	conv_map = ConvergenceMap.load(os.path.join(dataExtern(),"unmasked.fit"))
+	mask_profile = Mask.load(os.path.join(dataExtern(),"mask.fit"))
+
+	masked_map = conv_map.mask(mask_profile)
+	masked_map.maskBoundaries()
+	stencils = masked_map._maskedDerivatives()
+
+	gradient_x,gradient_y = masked_map.gradient()
+	hessian_xx,hessian_yy,hessian_xy = masked_map.hessian()
+	valid = ~(np.isnan(gradient_x) | np.isnan(gradient_y) | np.isnan(hessian_xx) | np.isnan(hessian_yy) | np.isnan(hessian_xy)) & masked_map._mask
+
+	assert (masked_map._full_mask==valid).all()
+	assert (stencils["pixels"]==np.flatnonzero(valid)).all()
+	assert np.allclose(stencils["values"],masked_map.data[valid])
+	assert np.allclose(stencils["gradient_x"],gradient_x[valid])
+	assert np.allclose(stencils["hessian_xy"],hessian_xy[valid])
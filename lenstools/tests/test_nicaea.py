@@ -61,4 +61,20 @@ def test_2pt_correlation():
 	ax.legend()
 
 	#Save figure
-	fig.savefig("2pt_nicaea.png")
\ No newline at end of file
+	fig.savefig("2pt_nicaea.png")
+
+def test_batch_power_spectrum():
+
+	#A small grid of cosmological models
+	cosmologies = [ Nicaea(Om0=Om0,Ode0=1.0-Om0,sigma8=0.8) for Om0 in (0.24,0.26,0.28) ]
+	ell = np.arange(300.0,1.0e4,500.0)
+
+	try:
+		power = Nicaea.batchPowerSpectrum(cosmologies,ell,z=2.0,settings=settings,threads=2)
+	except ImportError:
+		return
+
+	#The batch must agree with the one-at-a-time computation
+	assert power.shape==(len(cosmologies),len(ell),1)
+	for n,c in enumerate(cosmologies):
+		assert np.allclose(power[n,:,0],c.convergencePowerSpectrum(ell,z=2.0,settings=settings))
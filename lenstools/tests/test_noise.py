@@ -35,6 +35,17 @@ def test_smooth():
 	fig.tight_layout()
 	fig.savefig("smooth.png")
 
+def test_smooth_scales():
+
+	#Threaded real space smoothing and multi scale FFT smoothing must match single scale smoothing
+	scales = [0.5,1.0,2.0]*arcmin
+	assert np.allclose(test_map_conv.smooth(1.0*arcmin,threads=4).data,test_map_conv.smooth(1.0*arcmin).data)
+
+	smoothed = test_map_conv.smooth(scales,kind="gaussianFFT",threads=2)
+	assert len(smoothed)==len(scales)
+	for n,scale in enumerate(scales):
+		assert np.allclose(smoothed[n].data,test_map_conv.smooth(scale,kind="gaussianFFT").data)
+
 def test_shape_noise():
 
 	fig,ax = plt.subplots(1,3,figsize=(24,8))
@@ -90,6 +101,28 @@ def test_correlated_convergence_maps():
 	fig.tight_layout()
 	fig.savefig("correlated_maps.png")
 
+def test_batch_convergence_maps():
+
+	#Each realization depends only on its index, not on the batch or on the number of threads
+	batch = corr_noise_gen.fromConvPowerBatch(sample_power_shape,4,seed=3,threads=2,scale=scale)
+	assert batch.shape==(4,)+test_map_conv.data.shape
+	assert np.allclose(batch[2:],corr_noise_gen.fromConvPowerBatch(sample_power_shape,[2,3],seed=3,scale=scale))
+	assert not np.allclose(batch[0],batch[1])
+
+	#Seeds and realization indices must fit in the 64 bit halves of the random stream key
+	for seed,realizations in [(2**64,1),(-1,1),(0,[2**64])]:
+		try:
+			corr_noise_gen.fromConvPowerBatch(sample_power_shape,realizations,seed=seed,scale=scale)
+		except AssertionError:
+			pass
+		else:
+			raise AssertionError("seed={0}, realizations={1} should be refused".format(seed,realizations))
+
+	#The realizations have the input power spectrum
+	ell,Pl = ConvergenceMap(batch[0],test_map_conv.side_angle).powerSpectrum(l)
+	Pl_batch = np.array([ ConvergenceMap(m,test_map_conv.side_angle).powerSpectrum(l)[1] for m in batch ]).mean(0)
+	assert np.allclose(Pl_batch[:20],sample_power_shape(ell[:20],scale=scale),rtol=0.3)
+
 def test_interpolated_convergence_power():
 
 	fig,ax = plt.subplots()
@@ -7,6 +7,7 @@ from .. import dataExtern
 
 import numpy as np
 import astropy.units as u
+from astropy.cosmology import w0waCDM
 
 
 def test_nfw():
@@ -29,4 +30,34 @@ def test_nfw():
 	#Build a PotentialPlane
 	pln = PotentialPlane(p/p.max(),snap.header["box_size"],comoving_distance=snap.header["comoving_distance"],unit=None,num_particles=n)
 	pln.visualize(colorbar=True)
-	pln.savefig("nfw.png")
\ No newline at end of file
+	pln.savefig("nfw.png")
+
+
+def test_tiles():
+
+	#Random potential plane
+	np.random.seed(1)
+	pln = PotentialPlane(np.random.normal(size=(500,500)),angle=3.0*u.deg,redshift=1.0,cosmology=w0waCDM(H0=70.0,Om0=0.3,Ode0=0.7),num_particles=1)
+
+	#Lossless round trip
+	pln.save("plane.tiles",tile_size=128,double_precision=True)
+	pln_read = PotentialPlane.load("plane.tiles")
+	assert np.all(pln_read.data==pln.data)
+	assert pln_read.redshift==pln.redshift
+	np.testing.assert_approx_equal(pln_read.comoving_distance.value,pln.comoving_distance.to(u.Mpc).value)
+
+	#Lossy round trip, the error is bounded by the tolerance
+	pln.save("plane_lossy.tiles",tile_size=128,tolerance=1.0e-3,double_precision=True)
+	assert np.abs(PotentialPlane.load("plane_lossy.tiles").data - pln.data).max()<=1.0e-3*(1+1.0e-5)
+
+	#Read only some of the tiles, already rolled
+	tiles = np.zeros((4,4),dtype=np.bool_)
+	tiles[1,2] = True
+	pln_part = PotentialPlane.load("plane.tiles",tiles=tiles,shift=(100,450))
+	rolled = np.roll(np.roll(pln.data,100,axis=0),450,axis=1)
+	selected = np.zeros((500,500),dtype=np.bool_)
+	selected[128:256,256:384] = True
+	selected = np.roll(np.roll(selected,100,axis=0),450,axis=1)
+	assert np.all(pln_part.data[selected]==rolled[selected])
+	assert np.all(pln_part.data[~selected]==0)
+
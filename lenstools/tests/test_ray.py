@@ -2,6 +2,7 @@ import os
 
 from ..simulations.raytracing import RayTracer,PotentialPlane,DeflectionPlane
 from .. import ConvergenceMap,OmegaMap,ShearMap
+from ..catalog import Catalog
 
 from .. import dataExtern
 
@@ -147,6 +148,32 @@ def test_callback():
 
 
 
+def test_shoot_catalog():
+
+	#Two position catalogs (e.g. redshift slices) traced in a single pass
+	catalogs = list()
+	for zmin,zmax in [(0.5,1.0),(1.0,1.8)]:
+		x,y = np.random.uniform(0.0,tracer.lens[0].side_angle.to(deg).value,size=(2,1000))
+		catalogs.append(Catalog([x,y,np.random.uniform(zmin,zmax,size=1000)],names=["x","y","z"]))
+
+	shear_catalogs = tracer.shootCatalog(catalogs,interpolation="nearest",tile_angle=0.5*deg)
+	assert [ len(c) for c in shear_catalogs ]==[1000,1000]
+
+	#Sorting the galaxies in tiles does not change the result of the traversal
+	for n,c in enumerate(catalogs):
+		shear = tracer.shoot(np.array([c["x"],c["y"]])*deg,z=np.array(c["z"]),kind="shear")
+		assert np.allclose(shear_catalogs[n]["shear1"],shear[0])
+		assert np.allclose(shear_catalogs[n]["shear2"],shear[1])
+
+	#Interpolating the lens derivatives between pixels gives consistent shears
+	interpolated = tracer.shootCatalog(catalogs,interpolation="bilinear")
+	assert np.corrcoef(interpolated[1]["shear1"],shear_catalogs[1]["shear1"])[0,1]>0.9
+
+	#The redshift column can have any name
+	renamed = [ Catalog([c["x"],c["y"],c["z"]],names=["x","y","zs"]) for c in catalogs ]
+	shear_renamed = tracer.shootCatalog(renamed,z_field="zs",interpolation="nearest",tile_angle=0.5*deg)
+	assert np.allclose(shear_renamed[0]["shear1"],shear_catalogs[0]["shear1"])
+
 def test_convergence_born():
 
 	z_final = 2.0
@@ -2,6 +2,7 @@ import os
 
 from .. import ConvergenceMap,ShearMap
 from ..image.shear import Spin2
+from ..extern import _topology
 
 from .. import dataExtern
 
@@ -89,6 +90,20 @@ def test_EB_decompose():
 	plt.savefig("EB_corr.png")
 	plt.clf()
 
+def test_EB_stack():
+
+	#Batched E/B spectra must match the explicit E and B mode spectra of each map
+	stack = np.array([test_map.data,test_map.data[::-1]])
+	l,EE,BB,EB = ShearMap.ebPowerSpectra(stack,test_map.side_angle,l_edges,threads=2)
+	assert EE.shape==BB.shape==EB.shape==(2,len(l_edges)-1)
+
+	ft_E,ft_B = test_map.fourierEB()
+	angle = test_map.side_angle.to(deg).value
+	assert np.allclose(EE[0],_topology.rfft2_azimuthal(ft_E,ft_E,angle,l_edges,None))
+	assert np.allclose(BB[0],_topology.rfft2_azimuthal(ft_B,ft_B,angle,l_edges,None))
+	assert np.allclose(EB[0],_topology.rfft2_azimuthal(ft_E,ft_B,angle,l_edges,None))
+	assert np.allclose(EE[1],ShearMap(stack[1],test_map.side_angle).eb_power_spectrum(l_edges)[1])
+
 def test_visualize2():
 
 	fig,ax = plt.subplots()
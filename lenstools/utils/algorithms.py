@@ -59,12 +59,13 @@ class pcaHandler(object):
 			self._pca_std = data.std(0)
 
 		#Whiten the data
+		self._nobs = data.shape[0]
 		self._data_scaled = data.copy()
 		self._data_scaled -= self._pca_mean[None]
 		self._data_scaled /= self._pca_std[None]
 
 		#Scale by sqrt(N-1)
-		self._data_scaled /= np.sqrt(self._data_scaled.shape[0] - 1)
+		self._data_scaled /= np.sqrt(self._nobs - 1)
 
 		#Perform singular value decomposition
 		left,eigenvalues,right = np.linalg.svd(self._data_scaled,full_matrices=False)
@@ -73,13 +74,35 @@ class pcaHandler(object):
 		self.components_ = right
 		self.explained_variance_ = eigenvalues**2 
 
+	def fit_scatter(self,scatter,nobs):
+
+		"""
+		Same as fit, but starting from the scatter matrix of the data with respect to the location, sum_i (x_i-location)(x_i-location)^T, instead of the data itself (location and scale must be set)
+
+		"""
+
+		self._pca_mean = self._location
+		self._pca_std = self._scale
+		self._nobs = nobs
+
+		#Whitened scatter matrix, scaled by N-1
+		scatter_scaled = scatter/(self._pca_std[None]*self._pca_std[:,None])/(nobs - 1)
+
+		#Its eigenvectors are the right singular vectors of the whitened data, sorted by decreasing eigenvalue
+		eigenvalues,eigenvectors = np.linalg.eigh(scatter_scaled)
+		order = np.argsort(eigenvalues)[::-1]
+
+		#Assign eigenvalues and eigenvectors as attributes
+		self.components_ = eigenvectors[:,order].T
+		self.explained_variance_ = np.clip(eigenvalues[order],0,None)
+
 	@property
 	def eigenvalues(self):
 		return self._constructor_series(self.explained_variance_)
 
 	@property
 	def eigenvectors(self):
-		e = self._constructor_ensemble(self.components_*np.sqrt(self._data_scaled.shape[0] - 1)*self._pca_std[None] + self._pca_mean[None],columns=self._columns)
+		e = self._constructor_ensemble(self.components_*np.sqrt(self._nobs - 1)*self._pca_std[None] + self._pca_mean[None],columns=self._columns)
 		e.index.name = "eigenvector"
 		e.columns.name = "component"
 		return e
@@ -104,7 +127,7 @@ class pcaHandler(object):
 
 		#Subtract mean and scale by variance
 		X_copy -= self._pca_mean[None]
-		X_copy /= (self._pca_std[None]*np.sqrt(self._data_scaled.shape[0] - 1))
+		X_copy /= (self._pca_std[None]*np.sqrt(self._nobs - 1))
 
 		#Compute the projection via dot product
 		components = X_copy.dot(self.components_.transpose())
@@ -137,7 +160,7 @@ class pcaHandler(object):
 		original_components = X_copy.dot(basis_vectors)
 
 		#De-whitening
-		original_components *= (self._pca_std[None]*np.sqrt(self._data_scaled.shape[0] - 1))
+		original_components *= (self._pca_std[None]*np.sqrt(self._nobs - 1))
 		original_components += self._pca_mean[None]  
 
 		if original_components.shape[0]==1:
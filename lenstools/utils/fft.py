@@ -34,7 +34,7 @@ class FFTEngine(object):
 		pass
 
 	@abstractmethod
-	def irfft2(self,x):
+	def irfft2(self,x,out=None):
 		pass
 
 	@abstractmethod
@@ -83,8 +83,18 @@ class NUMPYFFTPack(FFTEngine):
 	def rfft2(self,x):
 		return np.fft.rfft2(x)
 
-	def irfft2(self,x):
-		return np.fft.irfft2(x)
+	def irfft2(self,x,out=None):
+
+		if out is None:
+			return np.fft.irfft2(x)
+
+		#Transform along the first axis, then write the real transform along the second one directly in the output buffer (numpy>=2.0)
+		try:
+			np.fft.irfft(np.fft.ifft(x,axis=0),n=out.shape[1],axis=1,out=out)
+		except TypeError:
+			out[:] = np.fft.irfft2(x,s=out.shape)
+
+		return out
 
 	def rfftn(self,x):
 		return np.fft.rfftn(x)